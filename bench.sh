@@ -0,0 +1,90 @@
+# Runs the in-kernel benchmarks (src/bench.rs) under QEMU, once per CPU count, and appends
+# their "bench ..." lines to bench/results/qemu/<benchmarks>.txt.
+#
+#   ./bench.sh <bench>[,<bench>...] [CPU counts, default "1 2 4 8"]
+#
+# BENCH_ARGS adds knobs to the kernel command line (e.g. "bench.ms=1000"), QEMU_EXTRA adds
+# QEMU flags, BLK_QUEUES overrides virtio-blk's num-queues (default: the CPU count),
+# BENCH_RUNS boots that many times per CPU count (default 1; e.g. for the boot benchmark),
+# and bench/speedup.py turns the boots into per-stage speedups over the CPU counts.
+# virtio-net is a UDP socket link from NET_LOCAL_PORT to NET_PEER_PORT, a loopback by
+# default. NET_PAIR=1 boots a second, receive-only instance (PEER_ARGS on its command
+# line) with the ports swapped, for benchmarks that need a separate receiver.
+
+# Uncomment this to print out exactly what this script is running
+# set -x
+
+BENCH=$1
+if [ -z "${BENCH}" ]; then
+  echo "Usage: $0 <bench>[,<bench>...] [CPU counts]"
+  exit 1
+fi
+shift
+CPU_COUNTS=${*:-1 2 4 8}
+
+if ! JERRY_RELEASE=1 JERRY_FEATURES=bench ./build.sh; then
+  echo "Build failed!"
+  exit 1
+fi
+KERNEL=target/aarch64-unknown-jerryOS-elf/release/jerryOS
+
+MEMORY_N=${MEMORY_N:-512}
+MEMORY_UNIT=M
+DISK_N=1
+DISK_UNIT=G
+DISK_DIR=.disks
+DISK_PATH=${DISK_DIR}/disk_${DISK_N}${DISK_UNIT}.img
+NET_LOCAL_PORT=${NET_LOCAL_PORT:-5555}
+NET_PEER_PORT=${NET_PEER_PORT:-${NET_LOCAL_PORT}}
+if [ -n "${NET_PAIR}" ] && [ "${NET_PEER_PORT}" = "${NET_LOCAL_PORT}" ]; then
+  NET_PEER_PORT=$((NET_LOCAL_PORT + 1))
+fi
+RESULTS_DIR=bench/results/qemu
+RESULTS=${RESULTS_DIR}/$(echo "${BENCH}" | tr ',' '+').txt
+mkdir -p ${DISK_DIR} ${RESULTS_DIR}
+if [ ! -f "${DISK_PATH}" ]; then
+  qemu-img create -f raw "${DISK_PATH}" "${DISK_N}${DISK_UNIT}"
+fi
+
+# run_qemu <CPUs> <local port> <peer port> <kernel command line>
+run_qemu() {
+  # bench.rs powers the machine off when it's done; the timeout is for when it hangs.
+  timeout ${BENCH_TIMEOUT:-600} qemu-system-aarch64 \
+    -machine virt,gic-version=3 \
+    -cpu cortex-a710 \
+    -smp $1 \
+    -m ${MEMORY_N}${MEMORY_UNIT} \
+    -drive file="${DISK_PATH}",if=none,format=raw,id=vd,snapshot=on -device virtio-blk-device,drive=vd,num-queues=${BLK_QUEUES:-$1} -global virtio-mmio.force-legacy=false \
+    -netdev socket,id=net0,udp=127.0.0.1:$3,localaddr=127.0.0.1:$2 -device virtio-net-device,netdev=net0 \
+    -chardev stdio,id=con0,mux=on,signal=off -serial chardev:con0 -mon chardev=con0 \
+    -device virtio-serial-device -device virtconsole,chardev=con0 \
+    ${QEMU_EXTRA} \
+    -kernel ${KERNEL} \
+    -append "$4" \
+    -nographic \
+  | tr -d '\r'
+}
+
+echo "# $(date -u +%Y-%m-%dT%H:%MZ) $(git rev-parse --short HEAD) bench=${BENCH} ${BENCH_ARGS}" >> ${RESULTS}
+for CPU_N in ${CPU_COUNTS}; do
+  echo "--------------------------------------------------------------------"
+  echo "bench=${BENCH} on ${CPU_N} CPU(s)"
+  for RUN in $(seq ${BENCH_RUNS:-1}); do
+    PEER_PID=
+    if [ -n "${NET_PAIR}" ]; then
+      # The peer has its own console (and stdin), so it runs detached into a log.
+      run_qemu ${CPU_N} ${NET_PEER_PORT} ${NET_LOCAL_PORT} "bench=${BENCH} bench.tx=0 ${PEER_ARGS}" < /dev/null \
+        > ${RESULTS_DIR}/peer.log 2>&1 &
+      PEER_PID=$!
+      sleep ${PEER_BOOT_S:-2}
+    fi
+    run_qemu ${CPU_N} ${NET_LOCAL_PORT} ${NET_PEER_PORT} "bench=${BENCH} ${BENCH_ARGS}" \
+      | tee /dev/stderr | grep '^bench ' | sed "s/^/smp=${CPU_N} /" >> ${RESULTS}
+    if [ -n "${PEER_PID}" ]; then
+      wait ${PEER_PID}
+      grep '^bench ' ${RESULTS_DIR}/peer.log | sed "s/^/smp=${CPU_N} peer /" >> ${RESULTS}
+    fi
+  done
+done
+echo "--------------------------------------------------------------------"
+echo "Results in ${RESULTS}"
@@ -0,0 +1,150 @@
+/*
+ * Host harness for libfdtLite: times a full walk of a DTB (every node's name, every
+ * property's name and value, as dt_index.rs's init_dt_index() reads them) with
+ * libfdt's per-access checks on, and with them skipped the way libfdt_lite_init()
+ * leaves them once fdt_check_full_and_trust() passes. run.sh builds it against
+ * src/libfdtLite with the kernel's includes.
+ *
+ *   fdt_walk <dtb>...
+ *
+ * Only libfdt.h's prototypes are declared here: its headers are jerryOS's, not the
+ * host's.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef unsigned long long size;
+struct fdt_property;
+
+int fdt_check_full_and_trust(const void *fdt, size bufsize);
+void fdt_set_trusted(int trusted);
+int fdt_next_node(const void *fdt, int offset, int *depth);
+const char *fdt_get_name(const void *fdt, int nodeoffset, int *lenp);
+int fdt_first_property_offset(const void *fdt, int nodeoffset);
+int fdt_next_property_offset(const void *fdt, int offset);
+const struct fdt_property *fdt_get_property_by_offset(const void *fdt, int offset, int *lenp);
+const char *fdt_get_string(const void *fdt, int stroffset, int *lenp);
+
+#define WALKS	2000
+#define TRIALS	7
+
+struct walk_totals {
+	long nodes;
+	long props;
+	long bytes;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void walk(const void *fdt, struct walk_totals *totals)
+{
+	int depth = 0;
+	int node = 0;
+	int len, prop;
+
+	/* The root is offset 0; fdt_next_node() goes on from there. */
+	do {
+		if (fdt_get_name(fdt, node, &len))
+			totals->bytes += len;
+		for (prop = fdt_first_property_offset(fdt, node); prop >= 0;
+		     prop = fdt_next_property_offset(fdt, prop)) {
+			const struct fdt_property *p = fdt_get_property_by_offset(fdt, prop, &len);
+
+			if (!p)
+				break;
+			totals->bytes += len;
+			/* nameoff is the second big-endian word */
+			if (fdt_get_string(fdt, __builtin_bswap32(((const unsigned int *)p)[1]), &len))
+				totals->bytes += len;
+			totals->props++;
+		}
+		totals->nodes++;
+		node = fdt_next_node(fdt, node, &depth);
+	} while (node >= 0 && depth > 0);
+}
+
+/* Best of TRIALS runs of WALKS walks, in ns per walk. */
+static unsigned long long time_walks(const void *fdt, struct walk_totals *totals)
+{
+	unsigned long long best = ~0ULL;
+	int trial, i;
+
+	for (trial = 0; trial < TRIALS; trial++) {
+		unsigned long long start = now_ns();
+		unsigned long long elapsed;
+		struct walk_totals run = { 0, 0, 0 };
+
+		for (i = 0; i < WALKS; i++)
+			walk(fdt, &run);
+		elapsed = now_ns() - start;
+		if (elapsed < best)
+			best = elapsed;
+		*totals = run;
+	}
+	return best / WALKS;
+}
+
+static void *read_dtb(const char *path, size *len)
+{
+	FILE *fp = fopen(path, "rb");
+	void *buf;
+	long file_len;
+
+	if (!fp)
+		return NULL;
+	fseek(fp, 0, SEEK_END);
+	file_len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	/* libfdt wants the blob 8-byte aligned, like the kernel gets it */
+	buf = aligned_alloc(8, (file_len + 7) & ~7L);
+	if (buf && fread(buf, 1, file_len, fp) != (size_t)file_len) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(fp);
+	*len = file_len;
+	return buf;
+}
+
+int main(int argc, char **argv)
+{
+	int arg;
+
+	for (arg = 1; arg < argc; arg++) {
+		struct walk_totals totals;
+		unsigned long long checked_ns, trusted_ns;
+		size len;
+		void *fdt = read_dtb(argv[arg], &len);
+		const char *name = strrchr(argv[arg], '/') ? strrchr(argv[arg], '/') + 1 : argv[arg];
+		int ret;
+
+		if (!fdt) {
+			fprintf(stderr, "%s: can't read\n", argv[arg]);
+			return 1;
+		}
+		ret = fdt_check_full_and_trust(fdt, len);
+		if (ret) {
+			fprintf(stderr, "%s: fdt_check_full_and_trust() = %d\n", argv[arg], ret);
+			return 1;
+		}
+		fdt_set_trusted(0);
+		checked_ns = time_walks(fdt, &totals);
+		fdt_set_trusted(1);
+		trusted_ns = time_walks(fdt, &totals);
+		printf("host fdt-walk dtb=%s bytes=%llu nodes=%ld props=%ld checks_on_ns=%llu checks_off_ns=%llu "
+		       "ns_per_node_on=%llu ns_per_node_off=%llu speedup_x100=%llu\n",
+		       name, len, totals.nodes / WALKS, totals.props / WALKS, checked_ns, trusted_ns,
+		       checked_ns * WALKS / totals.nodes, trusted_ns * WALKS / totals.nodes,
+		       checked_ns * 100 / (trusted_ns ? trusted_ns : 1));
+		free(fdt);
+	}
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Host check for fdt.c's word-at-a-time fdt_name_len_(): compares it against a
+ * byte-at-a-time reference over random buffers, name alignments and bounds, then
+ * times both on node-name-sized strings. fdt.c is included whole to get at the
+ * static function, so this builds with libfdtLite's (freestanding) flags; run.sh
+ * does that.
+ */
+#include "fdt.c"
+
+int printf(const char *fmt, ...);
+
+struct timespec_ {
+	long tv_sec;
+	long tv_nsec;
+};
+int clock_gettime(int clock, struct timespec_ *ts);
+#define CLOCK_MONOTONIC_ 1
+
+#define CASES	1000000
+#define SCANS	2000000
+
+static u64 rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* xorshift64* */
+static u64 rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec_ ts;
+
+	clock_gettime(CLOCK_MONOTONIC_, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* What fdt_next_tag() did before, minus fdt_offset_ptr()'s per-byte bounds checks */
+static int name_len_bytewise(const char *name, int avail)
+{
+	int len;
+
+	for (len = 0; len < avail; len++)
+		if (!name[len])
+			return len;
+	return -1;
+}
+
+static _Alignas(8) char buf[512];
+
+int main(void)
+{
+	volatile int sink = 0;
+	u64 start, swar_ns, bytewise_ns;
+	int bad = 0;
+	int i, k;
+
+	for (i = 0; i < CASES; i++) {
+		int start_idx = rng() % 64;
+		int avail = rng() % 96;
+
+		for (k = 0; k < (int)sizeof(buf); k++)
+			buf[k] = (rng() % 8 == 0) ? 0 : 'a' + rng() % 26;
+		if (fdt_name_len_(buf + start_idx, avail) != name_len_bytewise(buf + start_idx, avail)) {
+			if (bad++ < 5)
+				printf("mismatch: start %d avail %d: %d, want %d\n", start_idx, avail,
+				       fdt_name_len_(buf + start_idx, avail),
+				       name_len_bytewise(buf + start_idx, avail));
+		}
+	}
+
+	/* Names like QEMU virt's: "virtio_mmio@a003e00" and friends, 4-24 characters */
+	for (k = 0; k < (int)sizeof(buf); k++)
+		buf[k] = (k % 29 == 28) ? 0 : 'a' + k % 26;
+	start = now_ns();
+	for (i = 0; i < SCANS; i++)
+		sink += fdt_name_len_(buf + 4 * (i % 64), 256);
+	swar_ns = now_ns() - start;
+	start = now_ns();
+	for (i = 0; i < SCANS; i++)
+		sink += name_len_bytewise(buf + 4 * (i % 64), 256);
+	bytewise_ns = now_ns() - start;
+
+	printf("host fdt-name-len cases=%d mismatches=%d scans=%d swar_ps=%llu bytewise_ps=%llu speedup_x100=%llu\n",
+	       CASES, bad, SCANS, swar_ns * 1000 / SCANS, bytewise_ns * 1000 / SCANS,
+	       bytewise_ns * 100 / (swar_ns ? swar_ns : 1));
+	return bad != 0;
+}
@@ -0,0 +1,65 @@
+# Builds the libfdtLite host harnesses and appends their results to
+# bench/results/host/fdt-walk.txt and fdt-name-len.txt.
+#
+#   bench/host/fdt/run.sh [DTB...]
+#
+# Without DTBs it runs on virt_dtb.py's stand-ins for QEMU's virt blob at 1, 4 and 8
+# CPUs. Real blobs come from scripts_lldb/dtb_to_dts.py (dt-blob-to-source -b).
+# FDT_BASE=<git rev> also times the walk with that revision's libfdtLite, for a
+# before/after.
+
+cd "$(dirname "$0")/../../.." || exit 1
+HOST_DIR=bench/host/fdt
+BUILD_DIR=${BUILD_DIR:-/tmp/jerryOS-fdt-host}
+RESULTS_DIR=bench/results/host
+CC=${CC:-cc}
+# The kernel's include path, so libfdtLite builds exactly as it does for the kernel.
+FDT_FLAGS="-O2 -nostdinc -ffreestanding -fno-builtin"
+FDT_INCLUDES="-Isrc/include -Isrc/jerryLibc/include -Isrc/libfdtLite/include"
+rm -rf ${BUILD_DIR}
+mkdir -p ${BUILD_DIR} ${RESULTS_DIR}
+
+# build_fdt_walk <tree> <out>: fdt_walk against <tree>'s src/libfdtLite, objects in <out>.o
+build_fdt_walk() {
+  mkdir -p "$2.o"
+  for SRC in $1/src/libfdtLite/*.c; do
+    if ! ${CC} ${FDT_FLAGS} -I$1/src/include -I$1/src/jerryLibc/include -I$1/src/libfdtLite/include \
+      -c "${SRC}" -o "$2.o/$(basename "${SRC}" .c).o"; then
+      return 1
+    fi
+  done
+  ${CC} -O2 ${HOST_DIR}/fdt_walk.c "$2.o"/*.o -o "$2"
+}
+
+# name_len.c includes fdt.c itself, so it takes the rest of libfdtLite without fdt.o.
+if ! build_fdt_walk . ${BUILD_DIR}/fdt_walk \
+  || ! ${CC} ${FDT_FLAGS} ${FDT_INCLUDES} -Isrc/libfdtLite ${HOST_DIR}/name_len.c \
+    $(ls ${BUILD_DIR}/fdt_walk.o/*.o | grep -v '/fdt\.o$') -o ${BUILD_DIR}/name_len; then
+  echo "Build failed!"
+  exit 1
+fi
+if [ -n "${FDT_BASE}" ]; then
+  mkdir -p ${BUILD_DIR}/base
+  git archive "${FDT_BASE}" src/include src/jerryLibc src/libfdtLite | tar -x -C ${BUILD_DIR}/base
+  if ! build_fdt_walk ${BUILD_DIR}/base ${BUILD_DIR}/fdt_walk_base; then
+    echo "Build of ${FDT_BASE} failed!"
+    exit 1
+  fi
+fi
+
+DTBS=$*
+if [ -z "${DTBS}" ]; then
+  for CPU_N in 1 4 8; do
+    python3 ${HOST_DIR}/virt_dtb.py ${BUILD_DIR}/virt-smp${CPU_N}.dtb ${CPU_N}
+    DTBS="${DTBS} ${BUILD_DIR}/virt-smp${CPU_N}.dtb"
+  done
+fi
+
+STAMP="# $(date -u +%Y-%m-%dT%H:%MZ) $(git rev-parse --short HEAD) $(${CC} --version | head -n 1) $(uname -m)"
+echo "${STAMP}" >> ${RESULTS_DIR}/fdt-name-len.txt
+${BUILD_DIR}/name_len | tee -a ${RESULTS_DIR}/fdt-name-len.txt
+echo "${STAMP}${FDT_BASE:+ base=${FDT_BASE}}" >> ${RESULTS_DIR}/fdt-walk.txt
+${BUILD_DIR}/fdt_walk ${DTBS} | sed "s/^host fdt-walk /host fdt-walk libfdt=HEAD /" | tee -a ${RESULTS_DIR}/fdt-walk.txt
+if [ -n "${FDT_BASE}" ]; then
+  ${BUILD_DIR}/fdt_walk_base ${DTBS} | sed "s/^host fdt-walk /host fdt-walk libfdt=base /" | tee -a ${RESULTS_DIR}/fdt-walk.txt
+fi
@@ -0,0 +1,250 @@
+# Writes a DTB shaped like the one QEMU hands jerryOS (-machine virt,gic-version=3
+# -cpu cortex-a710): the same nodes, properties and sizes, so the host harness has
+# something realistic to chew on without QEMU. A real blob is better; capture one with
+# scripts_lldb/dtb_to_dts.py (dt-blob-to-source -p <dtb pointer> -b <file>).
+#
+#   python3 virt_dtb.py <out.dtb> [CPUs, default 4]
+
+import struct
+import sys
+
+strings = bytearray()
+string_offsets = {}
+structure = bytearray()
+
+FDT_BEGIN_NODE = 1
+FDT_END_NODE = 2
+FDT_PROP = 3
+FDT_END = 9
+
+def string_offset(name):
+  if name not in string_offsets:
+    string_offsets[name] = len(strings)
+    strings.extend(name.encode() + b'\0')
+  return string_offsets[name]
+
+def tag(value):
+  structure.extend(struct.pack('>I', value))
+
+def pad():
+  while len(structure) % 4:
+    structure.append(0)
+
+def begin(name):
+  tag(FDT_BEGIN_NODE)
+  structure.extend(name.encode() + b'\0')
+  pad()
+
+def end():
+  tag(FDT_END_NODE)
+
+def prop(name, value=b''):
+  tag(FDT_PROP)
+  structure.extend(struct.pack('>II', len(value), string_offset(name)))
+  structure.extend(value)
+  pad()
+
+def cells(*values):
+  return b''.join(struct.pack('>I', value) for value in values)
+
+def strs(*values):
+  return b''.join(value.encode() + b'\0' for value in values)
+
+num_cpus = int(sys.argv[2]) if len(sys.argv) > 2 else 4
+PH_INTC, PH_ITS, PH_CLK, PH_GPIO = 0x8005, 0x8006, 0x8000, 0x8004
+SPI, PPI = 0, 1
+
+begin('')
+prop('interrupt-parent', cells(PH_INTC))
+prop('dma-coherent')
+prop('model', strs('linux,dummy-virt'))
+prop('#size-cells', cells(2))
+prop('#address-cells', cells(2))
+prop('compatible', strs('linux,dummy-virt'))
+
+begin('psci')
+prop('migrate', cells(0xc4000005))
+prop('cpu_on', cells(0xc4000003))
+prop('cpu_off', cells(0x84000002))
+prop('cpu_suspend', cells(0xc4000001))
+prop('method', strs('hvc'))
+prop('compatible', strs('arm,psci-1.0', 'arm,psci-0.2', 'arm,psci'))
+end()
+
+begin('memory@40000000')
+prop('reg', cells(0, 0x40000000, 0, 0x20000000))
+prop('device_type', strs('memory'))
+end()
+
+begin('platform-bus@c000000')
+prop('interrupt-parent', cells(PH_INTC))
+prop('ranges', cells(0, 0, 0x0c000000, 0x02000000))
+prop('#address-cells', cells(1))
+prop('#size-cells', cells(1))
+prop('compatible', strs('qemu,platform', 'simple-bus'))
+end()
+
+begin('fw-cfg@9020000')
+prop('dma-coherent')
+prop('reg', cells(0, 0x09020000, 0, 0x18))
+prop('compatible', strs('qemu,fw-cfg-mmio'))
+end()
+
+# QEMU adds them last-first, so the DTB lists the highest address first.
+for i in reversed(range(32)):
+  base = 0x0a000000 + i * 0x200
+  begin('virtio_mmio@%x' % base)
+  prop('dma-coherent')
+  prop('interrupts', cells(SPI, 0x10 + i, 1))
+  prop('reg', cells(0, base, 0, 0x200))
+  prop('compatible', strs('virtio,mmio'))
+  end()
+
+begin('gpio-keys')
+prop('compatible', strs('gpio-keys'))
+begin('poweroff')
+prop('gpios', cells(PH_GPIO, 3, 0))
+prop('linux,code', cells(0x74))
+prop('label', strs('GPIO Key Poweroff'))
+end()
+end()
+
+begin('pl061@9030000')
+prop('phandle', cells(PH_GPIO))
+prop('clock-names', strs('apb_pclk'))
+prop('clocks', cells(PH_CLK))
+prop('interrupts', cells(SPI, 7, 4))
+prop('gpio-controller')
+prop('#gpio-cells', cells(2))
+prop('compatible', strs('arm,pl061', 'arm,primecell'))
+prop('reg', cells(0, 0x09030000, 0, 0x1000))
+end()
+
+begin('pcie@10000000')
+prop('interrupt-map-mask', cells(0x1800, 0, 0, 7))
+interrupt_map = []
+for slot in range(4):
+  for pin in range(4):
+    interrupt_map += [slot << 11, 0, 0, pin + 1, PH_INTC, 0, 0, SPI, 3 + (slot + pin) % 4, 4]
+prop('interrupt-map', cells(*interrupt_map))
+prop('#interrupt-cells', cells(1))
+prop('ranges', cells(
+  0x01000000, 0, 0, 0, 0x3eff0000, 0, 0x10000,
+  0x02000000, 0, 0x10000000, 0, 0x10000000, 0, 0x2eff0000,
+  0x03000000, 0x80, 0, 0x80, 0, 0x80, 0))
+prop('reg', cells(0x40, 0x10000000, 0, 0x10000000))
+prop('msi-map', cells(0, PH_ITS, 0, 0x10000))
+prop('dma-coherent')
+prop('bus-range', cells(0, 0xff))
+prop('linux,pci-domain', cells(0))
+prop('#size-cells', cells(2))
+prop('#address-cells', cells(3))
+prop('device_type', strs('pci'))
+prop('compatible', strs('pci-host-ecam-generic'))
+end()
+
+begin('pl031@9010000')
+prop('clock-names', strs('apb_pclk'))
+prop('clocks', cells(PH_CLK))
+prop('interrupts', cells(SPI, 2, 4))
+prop('reg', cells(0, 0x09010000, 0, 0x1000))
+prop('compatible', strs('arm,pl031', 'arm,primecell'))
+end()
+
+begin('pl011@9000000')
+prop('clock-names', strs('uartclk', 'apb_pclk'))
+prop('clocks', cells(PH_CLK, PH_CLK))
+prop('interrupts', cells(SPI, 1, 4))
+prop('reg', cells(0, 0x09000000, 0, 0x1000))
+prop('compatible', strs('arm,pl011', 'arm,primecell'))
+end()
+
+begin('pmu')
+prop('interrupts', cells(PPI, 7, 0x104))
+prop('compatible', strs('arm,armv8-pmuv3'))
+end()
+
+begin('intc@8000000')
+prop('phandle', cells(PH_INTC))
+prop('reg', cells(0, 0x08000000, 0, 0x10000, 0, 0x080a0000, 0, 0x20000 * num_cpus))
+prop('#redistributor-regions', cells(1))
+prop('compatible', strs('arm,gic-v3'))
+prop('ranges')
+prop('#size-cells', cells(2))
+prop('#address-cells', cells(2))
+prop('interrupt-controller')
+prop('#interrupt-cells', cells(3))
+begin('its@8080000')
+prop('phandle', cells(PH_ITS))
+prop('reg', cells(0, 0x08080000, 0, 0x20000))
+prop('#msi-cells', cells(1))
+prop('msi-controller')
+prop('compatible', strs('arm,gic-v3-its'))
+end()
+end()
+
+begin('flash@0')
+prop('bank-width', cells(4))
+prop('reg', cells(0, 0, 0, 0x04000000, 0, 0x04000000, 0, 0x04000000))
+prop('compatible', strs('cfi-flash'))
+end()
+
+begin('cpus')
+prop('#size-cells', cells(0))
+prop('#address-cells', cells(1))
+begin('cpu-map')
+begin('socket0')
+begin('cluster0')
+for cpu in range(num_cpus):
+  begin('core%d' % cpu)
+  prop('cpu', cells(0x8007 + cpu))
+  end()
+end()
+end()
+end()
+for cpu in range(num_cpus):
+  begin('cpu@%d' % cpu)
+  prop('phandle', cells(0x8007 + cpu))
+  prop('reg', cells(cpu))
+  prop('enable-method', strs('psci'))
+  prop('compatible', strs('arm,cortex-a710'))
+  prop('device_type', strs('cpu'))
+  end()
+end()
+
+begin('timer')
+prop('interrupts', cells(PPI, 13, 0x104, PPI, 14, 0x104, PPI, 11, 0x104, PPI, 10, 0x104))
+prop('always-on')
+prop('compatible', strs('arm,armv8-timer', 'arm,armv7-timer'))
+end()
+
+begin('apb-pclk')
+prop('phandle', cells(PH_CLK))
+prop('clock-output-names', strs('clk24mhz'))
+prop('clock-frequency', cells(24000000))
+prop('#clock-cells', cells(0))
+prop('compatible', strs('fixed-clock'))
+end()
+
+begin('chosen')
+prop('stdout-path', strs('/pl011@9000000'))
+prop('rng-seed', bytes(range(32)))
+prop('kaslr-seed', cells(0x12345678, 0x9abcdef0))
+prop('bootargs', strs(''))
+end()
+
+end()
+tag(FDT_END)
+
+HEADER_LEN = 40
+reserve_map = struct.pack('>QQ', 0, 0)
+off_mem_rsvmap = HEADER_LEN
+off_dt_struct = off_mem_rsvmap + len(reserve_map)
+off_dt_strings = off_dt_struct + len(structure)
+total_size = off_dt_strings + len(strings)
+header = struct.pack(
+  '>10I', 0xd00dfeed, total_size, off_dt_struct, off_dt_strings, off_mem_rsvmap,
+  17, 16, 0, len(strings), len(structure)
+)
+with open(sys.argv[1], 'wb') as dtb_file:
+  dtb_file.write(header + reserve_map + bytes(structure) + bytes(strings))
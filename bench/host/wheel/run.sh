@@ -0,0 +1,29 @@
+# Builds the timer wheel's host simulation against src/devices/timer.rs and appends its
+# results to bench/results/host/timer-wheel.txt.
+#
+#   bench/host/wheel/run.sh
+#
+# The wheel is cut out of timer.rs as is (its constants, then Timer and TimerWheel up to
+# program(), which is the first thing that touches the hardware).
+
+cd "$(dirname "$0")/../../.." || exit 1
+HOST_DIR=bench/host/wheel
+BUILD_DIR=${BUILD_DIR:-/tmp/jerryOS-wheel-host}
+RESULTS_DIR=bench/results/host
+RUSTC=${RUSTC:-rustc}
+TIMER_RS=src/devices/timer.rs
+rm -rf ${BUILD_DIR}
+mkdir -p ${BUILD_DIR} ${RESULTS_DIR}
+
+{
+  sed -n '/^const WHEEL_LEVELS/,/^const EXPIRE_BATCH/p' ${TIMER_RS}
+  sed -n '/^struct TimerLinks/,/^    \/\/ Point CNTV_CVAL_EL0/p' ${TIMER_RS} | sed '$d'
+  echo '}'
+} > ${BUILD_DIR}/wheel.rs
+if ! WHEEL_RS=${BUILD_DIR}/wheel.rs ${RUSTC} --edition 2024 -O ${HOST_DIR}/wheel_sim.rs -o ${BUILD_DIR}/wheel_sim; then
+  echo "Build failed!"
+  exit 1
+fi
+
+echo "# $(date -u +%Y-%m-%dT%H:%MZ) $(git rev-parse --short HEAD) $(${RUSTC} --version) $(uname -m)" >> ${RESULTS_DIR}/timer-wheel.txt
+${BUILD_DIR}/wheel_sim | tee -a ${RESULTS_DIR}/timer-wheel.txt
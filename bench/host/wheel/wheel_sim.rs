@@ -0,0 +1,228 @@
+/*
+ * Host simulation of the timer wheel in src/devices/timer.rs. run.sh cuts the wheel
+ * (its constants, Timer and TimerWheel up to program()) out of timer.rs and this
+ * include!()s it, so what's tested is the kernel's own code, minus the hardware and the
+ * locks around it.
+ *
+ *   exact:  timers stepped to with next_event(), as the IRQ does, must each expire in
+ *           exactly their unit.
+ *   late:   with random cancels and the clock jumping past events (a late IRQ), no
+ *           cancelled timer may expire, none early, none lost.
+ *   cost:   insert+unlink (arm+cancel) with 0..1M others pending, in ps, and advance()
+ *           per timer expired, in ns (with an Instant::now() per event in it).
+ */
+#![allow(dead_code)]
+
+use std::cell::UnsafeCell;
+use std::hint::black_box;
+use std::ptr;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::time::Instant;
+
+pub type TimerFn = fn(ctx: usize);
+
+static TIMER_CASCADES: AtomicU64 = AtomicU64::new(0);
+
+include!(env!("WHEEL_RS"));
+
+fn noop(_ctx: usize) { }
+
+// xorshift64*, as bench.rs's BenchRng.
+struct Rng {
+    state: u64
+} impl Rng {
+    fn next(&mut self) -> u64 {
+        self.state ^= self.state >> 12;
+        self.state ^= self.state << 25;
+        self.state ^= self.state >> 27;
+        return self.state.wrapping_mul(0x2545_f491_4f6c_dd1d);
+    }
+}
+
+fn new_timers(num_timers: usize) -> Vec<&'static Timer> {
+    return (0..num_timers).map(|i| &*Box::leak(Box::new(Timer::new(noop, i)))).collect();
+}
+
+unsafe fn file(wheel: &mut TimerWheel, timer: &Timer, expires: u64) {
+    unsafe {
+        (*timer.links.get()).expires = expires;
+        wheel.insert(timer);
+    }
+}
+
+// Every timer on the expired list, taken off it.
+fn take_expired(wheel: &mut TimerWheel) -> Vec<usize> {
+    let mut expired: Vec<usize> = Vec::new();
+    let mut timer: *const Timer = wheel.lists[EXPIRED_LIST];
+    while !timer.is_null() {
+        unsafe {
+            let next_timer: *const Timer = (*(*timer).links.get()).next;
+            expired.push((*timer).ctx);
+            wheel.unlink(&*timer);
+            timer = next_timer;
+        }
+    }
+    return expired;
+}
+
+// A delta from the wheel's clock: mostly near, some out past the top level's reach.
+fn random_delta(rng: &mut Rng) -> u64 {
+    let r: u64 = rng.next();
+    return match r % 5 {
+        0 => r % 64,
+        1 => r % 5_000,
+        2 => r % 1_000_000,
+        3 => r % (1 << 33),
+        _ => r % (1 << 40)
+    };
+}
+
+fn check_exact(rng: &mut Rng, rounds: usize, num_timers: usize) -> (u64, u64) {
+    let mut fired: u64 = 0;
+    let mut wrong_unit: u64 = 0;
+    for _ in 0..rounds {
+        let mut wheel: TimerWheel = TimerWheel::new();
+        wheel.clock = rng.next() % (1 << 40);
+        let timers: Vec<&'static Timer> = new_timers(num_timers);
+        let mut expires: Vec<u64> = vec![0; num_timers];
+        for i in 0..num_timers {
+            expires[i] = wheel.clock + random_delta(rng);
+            unsafe { file(&mut wheel, timers[i], expires[i]); }
+        }
+        while let Some(next) = wheel.next_event() {
+            unsafe { wheel.advance(next); }
+            for i in take_expired(&mut wheel) {
+                fired += 1;
+                if expires[i] != next {
+                    wrong_unit += 1;
+                }
+            }
+        }
+    }
+    return (fired, wrong_unit);
+}
+
+fn check_late(rng: &mut Rng, rounds: usize, num_timers: usize) -> (u64, u64, u64, u64) {
+    let mut fired: u64 = 0;
+    let mut early: u64 = 0;
+    let mut cancelled_fired: u64 = 0;
+    let mut lost: u64 = 0;
+    for _ in 0..rounds {
+        let mut wheel: TimerWheel = TimerWheel::new();
+        wheel.clock = rng.next() % (1 << 40);
+        let timers: Vec<&'static Timer> = new_timers(num_timers);
+        let mut expires: Vec<u64> = vec![0; num_timers];
+        let mut armed: Vec<bool> = vec![true; num_timers];
+        let mut done: Vec<bool> = vec![false; num_timers];
+        for i in 0..num_timers {
+            expires[i] = wheel.clock + random_delta(rng);
+            unsafe { file(&mut wheel, timers[i], expires[i]); }
+        }
+        for i in 0..num_timers {
+            if rng.next() % 7 == 0 {
+                unsafe { wheel.unlink(timers[i]); }
+                armed[i] = false;
+            }
+        }
+        let mut now: u64 = wheel.clock;
+        while let Some(next) = wheel.next_event() {
+            // A third of the time the IRQ is late, and the wheel catches up past the event.
+            now = if rng.next() % 3 == 0 { core::cmp::max(now, next) + rng.next() % 100 } else { next };
+            unsafe { wheel.advance(now); }
+            for i in take_expired(&mut wheel) {
+                fired += 1;
+                if !armed[i] || done[i] {
+                    cancelled_fired += 1;
+                }
+                if expires[i] > now {
+                    early += 1;
+                }
+                done[i] = true;
+            }
+        }
+        lost += (0..num_timers).filter(|&i| armed[i] && !done[i]).count() as u64;
+    }
+    return (fired, early, cancelled_fired, lost);
+}
+
+// Best of 5 runs of `ops` arm+cancel pairs, with `pending` other timers on the wheel.
+fn time_arm_cancel(rng: &mut Rng, pending: usize, ops: usize) -> (u64, u64) {
+    let mut wheel: TimerWheel = TimerWheel::new();
+    wheel.clock = 1 << 20;
+    for timer in new_timers(pending) {
+        let expires: u64 = wheel.clock + random_delta(rng);
+        unsafe { file(&mut wheel, timer, expires); }
+    }
+    let batch: Vec<&'static Timer> = new_timers(64);
+    let deltas: Vec<u64> = (0..ops).map(|_| random_delta(rng)).collect();
+    let mut best_arm_ns: u64 = u64::MAX;
+    let mut best_cancel_ns: u64 = u64::MAX;
+    for _ in 0..5 {
+        let mut arm_ns: u64 = 0;
+        let mut cancel_ns: u64 = 0;
+        for ops_start in (0..ops).step_by(batch.len()) {
+            let start: Instant = Instant::now();
+            for (timer, &delta) in batch.iter().zip(&deltas[ops_start..]) {
+                let expires: u64 = wheel.clock + delta;
+                unsafe { file(&mut wheel, black_box(timer), expires); }
+            }
+            let armed: Instant = Instant::now();
+            for timer in &batch {
+                unsafe { wheel.unlink(black_box(timer)); }
+            }
+            cancel_ns += armed.elapsed().as_nanos() as u64;
+            arm_ns += (armed - start).as_nanos() as u64;
+        }
+        best_arm_ns = core::cmp::min(best_arm_ns, arm_ns);
+        best_cancel_ns = core::cmp::min(best_cancel_ns, cancel_ns);
+    }
+    return (best_arm_ns * 1000 / ops as u64, best_cancel_ns * 1000 / ops as u64);
+}
+
+// Everything expired by stepping event to event: ns of advance() and cascades, per timer.
+fn time_expiry(rng: &mut Rng, num_timers: usize) -> (u64, u64) {
+    let mut wheel: TimerWheel = TimerWheel::new();
+    wheel.clock = 1 << 20;
+    for timer in new_timers(num_timers) {
+        let expires: u64 = wheel.clock + random_delta(rng);
+        unsafe { file(&mut wheel, timer, expires); }
+    }
+    let cascades_before: u64 = TIMER_CASCADES.load(Ordering::Relaxed);
+    let mut advance_ns: u64 = 0;
+    let mut fired: u64 = 0;
+    while let Some(next) = wheel.next_event() {
+        let start: Instant = Instant::now();
+        unsafe { wheel.advance(next); }
+        advance_ns += start.elapsed().as_nanos() as u64;
+        fired += take_expired(&mut wheel).len() as u64;
+    }
+    let cascades: u64 = TIMER_CASCADES.load(Ordering::Relaxed) - cascades_before;
+    return (advance_ns / fired.max(1), cascades * 100 / fired.max(1));
+}
+
+fn main() {
+    let mut rng: Rng = Rng { state: 0x9e37_79b9_7f4a_7c15 };
+
+    let (fired, wrong_unit): (u64, u64) = check_exact(&mut rng, 100, 200);
+    println!("host timer-wheel check=exact rounds=100 timers=200 fired={} wrong_unit={}", fired, wrong_unit);
+    let (fired, early, cancelled_fired, lost): (u64, u64, u64, u64) = check_late(&mut rng, 200, 300);
+    println!(
+        "host timer-wheel check=late rounds=200 timers=300 fired={} early={} cancelled_fired={} lost={}",
+        fired, early, cancelled_fired, lost
+    );
+
+    for pending in [0, 100, 10_000, 1_000_000] {
+        let (arm_ps, cancel_ps): (u64, u64) = time_arm_cancel(&mut rng, pending, 64 * 4096);
+        println!("host timer-wheel cost=arm-cancel pending={} arm_ps={} cancel_ps={}", pending, arm_ps, cancel_ps);
+    }
+    for num_timers in [1_000, 100_000] {
+        let (advance_ns, cascades_x100): (u64, u64) = time_expiry(&mut rng, num_timers);
+        println!(
+            "host timer-wheel cost=expiry timers={} advance_ns_per_timer={} cascades_per_timer_x100={}",
+            num_timers, advance_ns, cascades_x100
+        );
+    }
+    if wrong_unit != 0 || early != 0 || cancelled_fired != 0 || lost != 0 {
+        std::process::exit(1);
+    }
+}
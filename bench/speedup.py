@@ -0,0 +1,59 @@
+# Speedup curves from bench.sh's results: for each CPU count in the last run appended to
+# a results file, the median of every *_us field over that count's boots, and how much
+# faster than on the fewest CPUs it is.
+#
+#   MEMORY_N=4096 BENCH_RUNS=5 ./bench.sh boot "1 2 3 4 5 6 7 8"
+#   python3 bench/speedup.py [bench/results/qemu/boot.txt] [bench name, default boot]
+#
+# A stage the boot doesn't parallelize should come out near 1.00x at every count; the
+# linear map and registry scale with -m, so the default 512MB hides most of theirs.
+
+import statistics
+import sys
+
+path = sys.argv[1] if len(sys.argv) > 1 else 'bench/results/qemu/boot.txt'
+bench = sys.argv[2] if len(sys.argv) > 2 else 'boot'
+
+with open(path) as results_file:
+  lines = results_file.read().splitlines()
+# Only the last run: earlier ones may be another revision.
+headers = [i for i, line in enumerate(lines) if line.startswith('#')]
+if headers:
+  print(lines[headers[-1]])
+  lines = lines[headers[-1] + 1:]
+
+samples = {}
+fields = []
+for line in lines:
+  words = line.split()
+  if len(words) < 3 or not words[0].startswith('smp=') or words[1:3] != ['bench', bench]:
+    continue
+  smp = int(words[0][len('smp='):])
+  for word in words[3:]:
+    key, _, value = word.partition('=')
+    if not key.endswith('_us'):
+      continue
+    if key not in fields:
+      fields.append(key)
+    samples.setdefault(smp, {}).setdefault(key, []).append(int(value))
+
+if not samples:
+  print('no "bench %s" lines in %s' % (bench, path))
+  sys.exit(1)
+
+counts = sorted(samples)
+medians = {smp: {key: statistics.median(values) for key, values in samples[smp].items()} for smp in counts}
+base = medians[counts[0]]
+print('%-16s' % 'stage' + ''.join('%14s' % ('smp=%d' % smp) for smp in counts))
+print('%-16s' % 'boots' + ''.join('%14d' % len(samples[smp][fields[0]]) for smp in counts))
+for key in fields:
+  row = '%-16s' % key
+  for smp in counts:
+    median = medians[smp].get(key)
+    if median is None:
+      row += '%14s' % '-'
+    elif not median or not base.get(key):
+      row += '%14s' % ('%dus' % median)
+    else:
+      row += '%14s' % ('%dus %.2fx' % (median, base[key] / median))
+  print(row)
@@ -2,4 +2,4 @@ RUSTC_BOOTSTRAP=1
 
 rustup override set nightly
 rustup component add rust-src
-cargo +nightly build -Z build-std=core --target=aarch64-unknown-jerryOS-elf.json # --verbose
+cargo +nightly build ${JERRY_RELEASE:+--release} ${JERRY_FEATURES:+--features ${JERRY_FEATURES}} -Z build-std=core,alloc --target=aarch64-unknown-jerryOS-elf.json # --verbose
@@ -8,12 +8,19 @@ fi
 BUILD_DIR="target/aarch64-unknown-jerryOS-elf"
 echo "--------------------------------------------------------------------"
 
+CPU_N=${CPU_N:-4}
 MEMORY_N=512
 MEMORY_UNIT=M
 DISK_N=1
 DISK_UNIT=G
 DISK_DIR=.disks
 DISK_PATH=${DISK_DIR}/disk_${DISK_N}${DISK_UNIT}.img
+# virtio-net sits on a UDP socket netdev: it receives on NET_LOCAL_PORT and sends to
+# NET_PEER_PORT. By default both are the same, so every frame jerryOS transmits comes
+# straight back in on RX (a loopback link, no host networking needed). Two instances
+# with the ports swapped are a point-to-point link between them.
+NET_LOCAL_PORT=${NET_LOCAL_PORT:-5555}
+NET_PEER_PORT=${NET_PEER_PORT:-${NET_LOCAL_PORT}}
 mkdir -p ${DISK_DIR}
 if [ ! -f "${DISK_PATH}" ]; then 
   echo ""
@@ -30,16 +37,19 @@ fi
 
 # Note: use "-machine virt,virtualization=on" to enable EL2
 # https://qemu-project.gitlab.io/qemu/system/arm/virt.html
-echo "Starting QEMU on localhost:${LLDB_PORT} with ${MEMORY_N} ${MEMORY_UNIT}B of RAM & a ${DISK_N} ${DISK_UNIT}B disk." \
+echo "Starting QEMU on localhost:${LLDB_PORT} with ${CPU_N} CPUs, ${MEMORY_N} ${MEMORY_UNIT}B of RAM & a ${DISK_N} ${DISK_UNIT}B disk." \
 && \
 echo "--------------------------------------------------------------------" \
 && \
 qemu-system-aarch64 \
-  -machine virt \
+  -machine virt,gic-version=3 \
   -cpu cortex-a710 \
+  -smp ${CPU_N} \
   -m ${MEMORY_N}${MEMORY_UNIT} \
-  -drive file="${DISK_PATH}",if=none,format=raw,id=vd -device virtio-blk-device,drive=vd -global virtio-mmio.force-legacy=false \
-  -serial mon:stdio \
+  -drive file="${DISK_PATH}",if=none,format=raw,id=vd -device virtio-blk-device,drive=vd,num-queues=${CPU_N} -global virtio-mmio.force-legacy=false \
+  -netdev socket,id=net0,udp=127.0.0.1:${NET_PEER_PORT},localaddr=127.0.0.1:${NET_LOCAL_PORT} -device virtio-net-device,netdev=net0 \
+  -chardev stdio,id=con0,mux=on,signal=off -serial chardev:con0 -mon chardev=con0 \
+  -device virtio-serial-device -device virtconsole,chardev=con0 \
   -kernel ${BUILD_DIR}/debug/jerryOS -S \
   -gdb tcp::${LLDB_PORT} \
   -nographic
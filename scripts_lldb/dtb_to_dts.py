@@ -63,6 +63,18 @@ class DTBlobToSource(ParsedCommand):
       default='./parsedDeviceTree.dts'
     )
     
+    parser.add_option(
+      'b',
+      'blob-file',
+      help=(
+        'Path to file where the raw device tree blob should also be written to, '
+        'e.g. for bench/host/fdt/run.sh. Defaults to \'_\' (don\'t).'
+      ),
+      value_type=eArgTypeFilename,
+      dest='blob_file',
+      default='_'
+    )
+    
     parser.add_option(
       't',
       'print-dts',
@@ -123,6 +135,10 @@ class DTBlobToSource(ParsedCommand):
         with open('.dtb_to_dts/.dtb', 'wb') as dtb_file:
             dtb_file.write(device_tree_blob)
 
+        if parser.blob_file != '_':
+          with open(parser.blob_file, 'wb') as blob_file:
+            blob_file.write(device_tree_blob)
+
         dtc_out = popen('dtc -I dtb -O dts -o .dtb_to_dts/.dts .dtb_to_dts/.dtb').read()
         if dtc_out != '':
           print(dtc_out)
@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+# Decoder for jerryOS binary tracepoints (src/trace.rs). Events only hold the address of
+# a static TracePoint plus raw u64 arguments, so the format strings are looked up in the
+# kernel ELF. Events can come from:
+#   - a console capture containing a trace_dump() ("@@T ..." lines):
+#       trace_decode.py --elf <jerryOS> --console qemu.log [--chrome out.json]
+#   - a raw dump of 64-byte TraceEvents (e.g. written by the lldb command below):
+#       trace_decode.py --elf <jerryOS> --raw trace.bin --freq <CNTFRQ> [--chrome out.json]
+#   - the live rings from lldb: `command script import ./scripts_lldb/trace_decode.py`,
+#       then `trace_dump [out.json]` (text to the console, Chrome trace JSON to out.json)
+import argparse
+import json
+import re
+import struct
+import sys
+
+TRACE_MAX_ARGS = 4
+TRACE_RING_PAGES = 8
+TRACE_EVENT_LEN = 64
+TRACE_CPU_LEN = 128
+MAX_CPUS = 8
+PAGE_LEN = 0x4000
+TRACE_EVENTS_PER_PAGE = PAGE_LEN // TRACE_EVENT_LEN
+# ticks, tp, args[4], seq, cpu
+TRACE_EVENT_FMT = "<QQ4QQQ"
+# fmt_ptr, fmt_len, file_ptr, file_len, line, nargs
+TRACE_POINT_FMT = "<QQQQQQ"
+
+class KernelElf:
+    """Just enough ELF64 to read initialized kernel memory by virtual address."""
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        if self.data[:4] != b"\x7fELF" or self.data[4] != 2:
+            raise ValueError(f"{path} isn't an ELF64 file")
+        e_phoff, = struct.unpack_from("<Q", self.data, 0x20)
+        e_phentsize, e_phnum = struct.unpack_from("<HH", self.data, 0x36)
+        self.segments = []
+        for i in range(e_phnum):
+            p_type, _flags, p_offset, p_vaddr, _paddr, p_filesz = struct.unpack_from(
+                "<IIQQQQ", self.data, e_phoff + i * e_phentsize
+            )
+            if p_type == 1:  # PT_LOAD
+                self.segments.append((p_vaddr, p_offset, p_filesz))
+
+    def read(self, va, length):
+        for vaddr, offset, filesz in self.segments:
+            if vaddr <= va and va + length <= vaddr + filesz:
+                start = offset + (va - vaddr)
+                return self.data[start:start + length]
+        raise KeyError(f"{va:#x} isn't in any loaded segment")
+
+class TracePoints:
+    def __init__(self, elf):
+        self.elf = elf
+        self.cache = {}
+
+    def lookup(self, tp_va):
+        if tp_va not in self.cache:
+            try:
+                fmt_ptr, fmt_len, file_ptr, file_len, line, nargs = struct.unpack(
+                    TRACE_POINT_FMT, self.elf.read(tp_va, struct.calcsize(TRACE_POINT_FMT))
+                )
+                fmt = self.elf.read(fmt_ptr, fmt_len).decode("utf-8", "replace")
+                file = self.elf.read(file_ptr, file_len).decode("utf-8", "replace")
+                self.cache[tp_va] = (fmt, file, line, nargs)
+            except (KeyError, struct.error):
+                self.cache[tp_va] = (f"<unknown tracepoint {tp_va:#x}>", "?", 0, TRACE_MAX_ARGS)
+        return self.cache[tp_va]
+
+# Rust's {} / {:x} / {:#x} / {:>5} specs are also valid Python format specs for ints.
+PLACEHOLDER = re.compile(r"\{(:[^}]*)?\}")
+
+def format_event(fmt, args):
+    it = iter(args)
+    def sub(m):
+        try:
+            return ("{" + (m.group(1) or "") + "}").format(next(it))
+        except (StopIteration, ValueError):
+            return m.group(0)
+    return PLACEHOLDER.sub(sub, fmt.replace("{{", "\x00").replace("}}", "\x01")).replace("\x00", "{").replace("\x01", "}")
+
+def parse_console(path):
+    freq, events = None, []
+    with open(path, "r", errors="replace") as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith("@@TRACE-BEGIN"):
+                freq = int(line.split()[-1])
+            elif line.startswith("@@T "):
+                fields = line.split()[1:]
+                cpu = int(fields[0])
+                seq, ticks, tp, *args = (int(x, 16) for x in fields[1:])
+                events.append((ticks, cpu, seq, tp, args))
+    return freq, events
+
+def parse_raw(data):
+    events = []
+    for off in range(0, len(data) - TRACE_EVENT_LEN + 1, TRACE_EVENT_LEN):
+        ticks, tp, a0, a1, a2, a3, seq, cpu = struct.unpack_from(TRACE_EVENT_FMT, data, off)
+        if seq == 0:
+            continue
+        events.append((ticks, cpu, seq - 1, tp, [a0, a1, a2, a3]))
+    return events
+
+def decode(events, tracepoints, freq, out_text, chrome_path=None):
+    events = sorted(events)
+    if not events:
+        out_text.write("no trace events\n")
+        return
+    t0 = events[0][0]
+    chrome = []
+    for ticks, cpu, seq, tp, args in events:
+        fmt, file, line, nargs = tracepoints.lookup(tp)
+        msg = format_event(fmt, args[:nargs])
+        us = (ticks - t0) * 1e6 / freq
+        out_text.write(f"[{us:14.3f} us] cpu{cpu} #{seq:<8} {msg}\n")
+        chrome.append({
+            "name": fmt, "ph": "i", "s": "t", "ts": us, "pid": 0, "tid": cpu,
+            "args": {"msg": msg, "at": f"{file}:{line}"}
+        })
+    if chrome_path:
+        with open(chrome_path, "w") as f:
+            json.dump({"traceEvents": chrome, "displayTimeUnit": "ns"}, f)
+        out_text.write(f"wrote {len(chrome)} events to {chrome_path}\n")
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode jerryOS binary trace events")
+    parser.add_argument("--elf", required=True, help="kernel ELF the events were recorded by")
+    src = parser.add_mutually_exclusive_group(required=True)
+    src.add_argument("--console", help="console capture containing a trace_dump()")
+    src.add_argument("--raw", help="raw dump of 64-byte TraceEvents")
+    parser.add_argument("--freq", type=int, help="CNTFRQ_EL0 in Hz (taken from the dump header when there is one)")
+    parser.add_argument("--chrome", help="also write Chrome trace JSON (chrome://tracing, Perfetto) here")
+    args = parser.parse_args()
+
+    tracepoints = TracePoints(KernelElf(args.elf))
+    if args.console:
+        freq, events = parse_console(args.console)
+    else:
+        with open(args.raw, "rb") as f:
+            freq, events = None, parse_raw(f.read())
+    freq = args.freq or freq
+    if not freq:
+        parser.error("no @@TRACE-BEGIN header to take the counter frequency from; pass --freq")
+    decode(events, tracepoints, freq, sys.stdout, args.chrome)
+
+# lldb: read the rings straight out of the (stopped) kernel through JERRY_TRACE_CPUS.
+def lldb_trace_dump(debugger, command, result, internal_dict):
+    import lldb
+    target = debugger.GetSelectedTarget()
+    process = target.GetProcess()
+    err = lldb.SBError()
+    symbols = target.FindSymbols("JERRY_TRACE_CPUS")
+    if symbols.GetSize() == 0:
+        print("trace_dump: JERRY_TRACE_CPUS not found")
+        return
+    sym_addr = symbols.GetContextAtIndex(0).GetSymbol().GetStartAddress().GetLoadAddress(target)
+    trace_cpus = process.ReadPointerFromMemory(sym_addr, err)
+    if not err.Success() or trace_cpus == 0:
+        print("trace_dump: tracing isn't initialized")
+        return
+    raw = bytearray()
+    for cpu in range(MAX_CPUS):
+        cpu_base = trace_cpus + cpu * TRACE_CPU_LEN
+        pages = [process.ReadPointerFromMemory(cpu_base + 8 + i * 8, err) for i in range(TRACE_RING_PAGES)]
+        if not err.Success() or pages[0] == 0:
+            continue
+        for page in pages:
+            data = process.ReadMemory(page, PAGE_LEN, err)
+            if err.Success():
+                raw += data
+    frame = process.GetSelectedThread().GetSelectedFrame()
+    cntfrq = frame.FindRegister("cntfrq_el0")
+    # QEMU virt's usual CNTFRQ if lldb can't read the register.
+    freq = cntfrq.GetValueAsUnsigned() if cntfrq.IsValid() else 62_500_000
+    elf_path = target.GetExecutable().fullpath
+    chrome_path = command.strip() or None
+    decode(parse_raw(bytes(raw)), TracePoints(KernelElf(elf_path)), freq, sys.stdout, chrome_path)
+
+def __lldb_init_module(debugger, internal_dict):
+    debugger.HandleCommand("command script add -f trace_decode.lldb_trace_dump trace_dump")
+    print("LLDB trace decoder loaded: trace_dump [chrome.json]")
+
+if __name__ == "__main__":
+    main()
@@ -75,6 +75,18 @@ pub const FDT_ERR_BADFLAGS: u32 = 18;
 pub const FDT_ERR_ALIGNMENT: u32 = 19;
 pub const FDT_ERR_MAX: u32 = 19;
 pub const FDT_MAX_PHANDLE: u32 = 4294967294;
+pub const FDT_PROPNAME_REG: u32 = 0;
+pub const FDT_PROPNAME_INTERRUPTS: u32 = 1;
+pub const FDT_PROPNAME_COMPATIBLE: u32 = 2;
+pub const FDT_PROPNAME_ADDRESS_CELLS: u32 = 3;
+pub const FDT_PROPNAME_SIZE_CELLS: u32 = 4;
+pub const FDT_PROPNAME_PHANDLE: u32 = 5;
+pub const FDT_PROPNAME_STATUS: u32 = 6;
+pub const FDT_PROPNAME_RANGES: u32 = 7;
+pub const FDT_PROPNAME_DEVICE_TYPE: u32 = 8;
+pub const FDT_PROPNAME_INTERRUPT_PARENT: u32 = 9;
+pub const FDT_PROPNAME_INTERRUPT_CELLS: u32 = 10;
+pub const FDT_PROPNAME_COUNT: u32 = 11;
 pub const FDT_MAX_NCELLS: u32 = 4;
 pub const FDT_CREATE_FLAG_NO_NAME_DEDUP: u32 = 1;
 pub const FDT_CREATE_FLAGS_ALL: u32 = 1;
@@ -268,6 +280,18 @@ unsafe extern "C" {
         depth: *mut core::ffi::c_int,
     ) -> core::ffi::c_int;
 }
+unsafe extern "C" {
+    #[doc = " fdt_subtree_index_build - record where every node's subtree ends\n @fdt: pointer to the device tree blob\n\n Walks the structure block once, noting the end of each node, so that\n fdt_next_node_skip_subnodes() (and so fdt_next_subnode()) can jump over\n a subtree without walking it. Like fdt_strindex_build(), there is one\n index, for the blob it was last built for; without it, skipping walks.\n\n returns:\n\t0, on success\n\t-FDT_ERR_NOSPACE, too many nodes, or nested too deep, to index\n\t-FDT_ERR_BADSTRUCTURE,\n\t-FDT_ERR_TRUNCATED, standard meanings"]
+    pub fn fdt_subtree_index_build(fdt: *const core::ffi::c_void) -> core::ffi::c_int;
+}
+unsafe extern "C" {
+    #[doc = " fdt_next_node_skip_subnodes - like fdt_next_node(), minus offset's subtree\n @fdt: pointer to the device tree blob\n @offset: offset of the node whose subnodes to skip\n @depth: depth of the node at offset, updated like fdt_next_node() does\n\n Return: offset of the next node after offset's subtree (with *depth\n below 0 if that means leaving the node depth counts from), or an error\n as for fdt_next_node()"]
+    pub fn fdt_next_node_skip_subnodes(
+        fdt: *const core::ffi::c_void,
+        offset: core::ffi::c_int,
+        depth: *mut core::ffi::c_int,
+    ) -> core::ffi::c_int;
+}
 unsafe extern "C" {
     #[doc = " fdt_first_subnode() - get offset of first direct subnode\n @fdt:\tFDT blob\n @offset:\tOffset of node to check\n\n Return: offset of first subnode, or -FDT_ERR_NOTFOUND if there is none"]
     pub fn fdt_first_subnode(
@@ -303,8 +327,20 @@ unsafe extern "C" {
     ) -> core::ffi::c_int;
 }
 unsafe extern "C" {
+    #[doc = " fdt_check_full - check the whole device tree blob is well formed\n @fdt: pointer to the device tree blob\n @bufsize: size of the buffer the blob was loaded into\n\n fdt_check_full() checks the header, the memory reservation map, and\n every tag, node name and property (including its name's offset into\n the strings block) in the structure block, along with the nesting of\n nodes. It ignores any runtime assumptions made by\n fdt_check_full_and_trust().\n\n returns:\n     0, if the blob is well formed\n     -FDT_ERR_BADSTRUCTURE,\n     -FDT_ERR_TRUNCATED,\n     ... any error fdt_check_header() returns"]
     pub fn fdt_check_full(fdt: *const core::ffi::c_void, bufsize: size) -> core::ffi::c_int;
 }
+unsafe extern "C" {
+    #[doc = " fdt_check_full_and_trust - validate a blob once, then skip per-access checks\n @fdt: pointer to the device tree blob\n @bufsize: size of the buffer the blob was loaded into\n\n Runs fdt_check_full() on the blob and, if it passes, switches libfdt\n over to its ASSUME_VALID_DTB | ASSUME_VALID_INPUT code paths (plus\n ASSUME_LATEST for v17 blobs) for every later call. Callers must then\n only pass offsets libfdt itself handed out.\n\n returns:\n     0, on success\n     the fdt_check_full() error otherwise, with all checks left on"]
+    pub fn fdt_check_full_and_trust(
+        fdt: *const core::ffi::c_void,
+        bufsize: size,
+    ) -> core::ffi::c_int;
+}
+unsafe extern "C" {
+    #[doc = " fdt_set_trusted - turn the runtime assumptions back off (or on again)\n @trusted: 0 to check everything again, nonzero to restore the\n\tassumptions from the last successful fdt_check_full_and_trust()"]
+    pub fn fdt_set_trusted(trusted: core::ffi::c_int);
+}
 unsafe extern "C" {
     #[doc = " fdt_get_string - retrieve a string from the strings block of a device tree\n @fdt: pointer to the device tree blob\n @stroffset: offset of the string within the strings block (native endian)\n @lenp: optional pointer to return the string's length\n\n fdt_get_string() retrieves a pointer to a single string from the\n strings block of the device tree blob at fdt, and optionally also\n returns the string's length in *lenp.\n\n returns:\n     a pointer to the string, on success\n     NULL, if stroffset is out of bounds, or doesn't point to a valid string"]
     pub fn fdt_get_string(
@@ -451,6 +487,40 @@ unsafe extern "C" {
         lenp: *mut core::ffi::c_int,
     ) -> *const core::ffi::c_void;
 }
+unsafe extern "C" {
+    #[doc = " fdt_strindex_build - index the property names of a read-only tree\n @fdt: pointer to the device tree blob\n\n fdt_strindex_build() hashes the name of every property in the blob\n once, recording the strings block offset (nameoff) its properties\n share. While the index is in place, fdt_getprop() and friends find a\n property by comparing nameoffs instead of strings, and fail a name no\n property has without walking the node at all. There is one index, for\n the blob it was last built for; the blob must not change after.\n\n returns:\n\t0, on success\n\t-FDT_ERR_NOSPACE, too many distinct property names to index\n\t-FDT_ERR_BADMAGIC,\n\t-FDT_ERR_BADVERSION,\n\t-FDT_ERR_BADSTATE,\n\t-FDT_ERR_BADSTRUCTURE,\n\t-FDT_ERR_TRUNCATED, standard meanings"]
+    pub fn fdt_strindex_build(fdt: *const core::ffi::c_void) -> core::ffi::c_int;
+}
+unsafe extern "C" {
+    #[doc = " fdt_strindex_num_names - number of distinct property names indexed\n @fdt: pointer to the device tree blob\n\n returns:\n\tthe number of names (>=0), on success\n\t-FDT_ERR_BADSTATE, there is no index for fdt"]
+    pub fn fdt_strindex_num_names(fdt: *const core::ffi::c_void) -> core::ffi::c_int;
+}
+unsafe extern "C" {
+    #[doc = " fdt_propname_stroffset - look up a property name in the index\n @fdt: pointer to the device tree blob\n @name: name of the property\n @namelen: number of characters of name to consider\n\n returns:\n\tthe strings block offset every property named name uses, for\n\tfdt_getprop_by_stroffset()\n\t-FDT_ERR_NOTFOUND, no such property, or properties of that name\n\t\tdon't share one string\n\t-FDT_ERR_BADSTATE, there is no index for fdt"]
+    pub fn fdt_propname_stroffset(
+        fdt: *const core::ffi::c_void,
+        name: *const core::ffi::c_char,
+        namelen: core::ffi::c_int,
+    ) -> core::ffi::c_int;
+}
+unsafe extern "C" {
+    #[doc = " fdt_getprop_by_stroffset - retrieve a property by its name's offset\n @fdt: pointer to the device tree blob\n @nodeoffset: offset of the node whose property to find\n @stroffset: strings block offset of the property's name\n @lenp: pointer to an integer variable (will be overwritten) or NULL\n\n Identical to fdt_getprop(), but matches properties on nameoff alone,\n e.g. with an offset from fdt_propname_stroffset().\n\n Return: pointer to the property's value or NULL on error"]
+    pub fn fdt_getprop_by_stroffset(
+        fdt: *const core::ffi::c_void,
+        nodeoffset: core::ffi::c_int,
+        stroffset: core::ffi::c_int,
+        lenp: *mut core::ffi::c_int,
+    ) -> *const core::ffi::c_void;
+}
+unsafe extern "C" {
+    #[doc = " fdt_getprop_interned - retrieve a commonly used property\n @fdt: pointer to the device tree blob\n @nodeoffset: offset of the node whose property to find\n @propname: one of FDT_PROPNAME_*\n @lenp: pointer to an integer variable (will be overwritten) or NULL\n\n Identical to fdt_getprop() for the property's name, but with the\n name's offset looked up once by fdt_strindex_build() rather than on\n every call. Works (by name) without an index too.\n\n Return: pointer to the property's value or NULL on error"]
+    pub fn fdt_getprop_interned(
+        fdt: *const core::ffi::c_void,
+        nodeoffset: core::ffi::c_int,
+        propname: core::ffi::c_int,
+        lenp: *mut core::ffi::c_int,
+    ) -> *const core::ffi::c_void;
+}
 unsafe extern "C" {
     #[doc = " fdt_get_phandle - retrieve the phandle of a given node\n @fdt: pointer to the device tree blob\n @nodeoffset: structure block offset of the node\n\n fdt_get_phandle() retrieves the phandle of the device tree node at\n structure block offset nodeoffset.\n\n returns:\n\tthe phandle of the node at nodeoffset, on success (!= 0, != -1)\n\t0, if the node has no phandle, or another error occurs"]
     pub fn fdt_get_phandle(fdt: *const core::ffi::c_void, nodeoffset: core::ffi::c_int) -> u32_;
@@ -844,10 +914,17 @@ unsafe extern "C" {
 }
 unsafe extern "C" {
     pub fn fdt_node_end_offset_(
-        fdt: *mut core::ffi::c_void,
+        fdt: *const core::ffi::c_void,
         nodeoffset: core::ffi::c_int,
     ) -> core::ffi::c_int;
 }
+unsafe extern "C" {
+    pub fn fdt_strindex_lookup_(
+        fdt: *const core::ffi::c_void,
+        name: *const core::ffi::c_char,
+        namelen: core::ffi::c_int,
+    ) -> core::ffi::c_int;
+}
 pub const ASSUME_PERFECT: _bindgen_ty_1 = 255;
 pub const ASSUME_VALID_DTB: _bindgen_ty_1 = 1;
 pub const ASSUME_VALID_INPUT: _bindgen_ty_1 = 2;
@@ -856,3 +933,6 @@ pub const ASSUME_NO_ROLLBACK: _bindgen_ty_1 = 8;
 pub const ASSUME_LIBFDT_ORDER: _bindgen_ty_1 = 16;
 pub const ASSUME_LIBFDT_FLAWLESS: _bindgen_ty_1 = 32;
 pub type _bindgen_ty_1 = core::ffi::c_uint;
+unsafe extern "C" {
+    pub static mut fdt_runtime_assume_: u32_;
+}
@@ -0,0 +1,983 @@
+use crate::{block, exceptions, executor::{self, ExecutorStats}, log, println};
+use crate::thread::{self, ThreadStats};
+use crate::devices::{cpu::{self, cpu_id, MAX_CPUS}, dt_index::{self, DTNode}, pl011_uart::{self, PL011Stats}};
+use crate::devices::libfdt_lite::{self, FDTItr, FDTNode, LibfdtStats};
+use crate::devices::drivers::{self, ProbeStats};
+use crate::devices::virtio::console as virtio_console;
+use crate::devices::timer::{self, counter_ticks, ns_to_ticks, ticks_to_ns, Timer};
+use crate::kstats::LatencyHistogram;
+use crate::block::cache::{self, CacheStats, CACHE_FRAMES};
+use crate::block::readahead::RaStream;
+use crate::block::sched::{BlkScheduler, BlkSchedStats};
+use crate::devices::virtio::net::{self, VirtIONet, ETH_ALEN, NET_MAX_FRAME_LEN};
+use crate::devices::virtio::blk::{self, BlkCompletionMode, BlkOp, BlkRequest, BLK_COMPLETION_MODES, VirtIOBlk};
+use crate::devices::memory::{PAGE_LEN, ppm::{self, get_free_page, free_page_ref, page_pa_to_kva}, ptm};
+use alloc::vec::Vec;
+use core::slice;
+use core::sync::atomic::{AtomicU64, Ordering};
+
+/*
+ * In-kernel benchmarks, built in with `--features bench` (bench.sh does that). Once the
+ * kernel is up, main() hands over to run_benchmarks(), which runs whatever the command
+ * line names (bench=<name>[,<name>...]; QEMU's -append lands in /chosen/bootargs),
+ * prints one "bench <name> key=value ..." line per result and powers the machine off.
+ * Knobs are bench.<key>=<n> on the same command line, e.g. bench.ms=1000.
+ */
+struct Benchmark {
+    name : &'static str,
+    run  : fn()
+}
+
+const BENCHMARKS: &[Benchmark] = &[
+    Benchmark { name: "boot", run: bench_boot },
+    Benchmark { name: "blk-iops", run: bench_blk_iops },
+    Benchmark { name: "blk-cpu", run: bench_blk_cpu },
+    Benchmark { name: "blk-seqwrite", run: bench_blk_seqwrite },
+    Benchmark { name: "cache-zipf", run: bench_cache_zipf },
+    Benchmark { name: "ra-scan", run: bench_ra_scan },
+    Benchmark { name: "net-pps", run: bench_net_pps },
+    Benchmark { name: "console", run: bench_console },
+    Benchmark { name: "uart", run: bench_uart },
+    Benchmark { name: "dt-lookup", run: bench_dt_lookup },
+    Benchmark { name: "fdt-walk", run: bench_fdt_walk },
+    Benchmark { name: "timer", run: bench_timer },
+    Benchmark { name: "sched", run: bench_sched }
+];
+
+const DEFAULT_RUN_MS: u64 = 500;
+
+// Whether the command line asks for benchmark `name`.
+fn bench_requested(name: &str) -> bool {
+    return bootargs().split(' ')
+        .filter_map(|arg| arg.strip_prefix("bench="))
+        .any(|names| names.split(',').any(|requested| requested == name));
+}
+
+/*
+ * Called at the end of probe_devices(), for what has to be measured before init_devices()
+ * hands back what only booting needs. The boot path is the same as without benchmarks;
+ * this only runs on top of it.
+ */
+pub fn after_probe() {
+    if bench_requested("dt-lookup") {
+        time_dt_lookup_kinds();
+    }
+}
+
+pub fn run_benchmarks() {
+    for arg in bootargs().split(' ') {
+        let names: &str = match arg.strip_prefix("bench=") {
+            Some(names) => names,
+            None => { continue; }
+        };
+        for name in names.split(',') {
+            match BENCHMARKS.iter().find(|bench| bench.name == name) {
+                Some(bench) => { (bench.run)(); },
+                None => { println!("bench {} unknown", name); }
+            }
+            log::drain_logs();
+        }
+    }
+    println!("bench done");
+    log::drain_logs();
+    cpu::system_off();
+}
+
+fn bootargs() -> &'static str {
+    let chosen: &'static dt_index::DTNode = match dt_index::dt_root().and_then(
+        |root| root.children().find(|node| node.name() == "chosen")
+    ) {
+        Some(chosen) => chosen,
+        None => { return ""; }
+    };
+    match chosen.get_property_bytes(b"bootargs\0") {
+        Ok(bootargs) => {
+            let len: usize = bootargs.iter().position(|&b| b == 0).unwrap_or(bootargs.len());
+            return str::from_utf8(&bootargs[..len]).unwrap_or("");
+        },
+        Err(_e) => { return ""; }
+    }
+}
+
+// bench.<key>=<n> from the command line, or `default`.
+pub fn bench_arg(key: &str, default: u64) -> u64 {
+    for arg in bootargs().split(' ') {
+        if let Some((arg_key, value)) = arg.strip_prefix("bench.").and_then(|arg| arg.split_once('=')) {
+            if arg_key == key {
+                return value.parse::<u64>().unwrap_or(default);
+            }
+        }
+    }
+    return default;
+}
+
+// xorshift64*: plenty for picking sectors and keys.
+pub struct BenchRng {
+    state: u64
+} impl BenchRng {
+    pub fn new(seed: u64) -> Self {
+        return Self { state: seed.wrapping_mul(0x9e37_79b9_7f4a_7c15) | 1 };
+    }
+
+    pub fn next(&mut self) -> u64 {
+        self.state ^= self.state >> 12;
+        self.state ^= self.state << 25;
+        self.state ^= self.state >> 27;
+        return self.state.wrapping_mul(0x2545_f491_4f6c_dd1d);
+    }
+}
+
+/*
+ * Run work(arg) on the first num_cpus online CPUs at once, this one included, and wait
+ * for all of them. Returns how many actually ran it.
+ */
+pub fn run_on_cpus(num_cpus: usize, work: fn(usize), arg: usize) -> usize {
+    let my_cpu_idx: usize = cpu_id();
+    let mut helpers: [bool; MAX_CPUS] = [false; MAX_CPUS];
+    let mut num_workers: usize = 1;
+    for cpu_idx in 0..cpu::num_cpus() {
+        if num_workers >= num_cpus {
+            break;
+        }
+        if cpu_idx != my_cpu_idx && cpu::run_on_cpu(cpu_idx, work, arg).is_ok() {
+            helpers[cpu_idx] = true;
+            num_workers += 1;
+        }
+    }
+    work(arg);
+    for cpu_idx in 0..cpu::num_cpus() {
+        if helpers[cpu_idx] {
+            cpu::wait_for_cpu(cpu_idx);
+        }
+    }
+    return num_workers;
+}
+
+// Per-second rate of `count` events over `ticks`.
+pub fn per_sec(count: u64, ticks: u64) -> u64 {
+    let ns: u64 = ticks_to_ns(ticks);
+    return if ns == 0 { 0 } else { (count as u128 * 1_000_000_000 / ns as u128) as u64 };
+}
+
+/*
+ * boot: how long this boot took, and where it went. The counter starts at machine reset,
+ * so uptime is the whole boot up to here; the stages are what init_devices() times
+ * itself. It's one sample per boot: BENCH_RUNS=n bench.sh boot boots n times per CPU count.
+ */
+fn bench_boot() {
+    let uptime_ns: u64 = ticks_to_ns(counter_ticks());
+    let fdt: LibfdtStats = libfdt_lite::libfdt_stats();
+    let dt: dt_index::DTIndexStats = dt_index::dt_index_stats();
+    let executor: ExecutorStats = executor::executor_stats();
+    let probes: ProbeStats = drivers::probe_stats();
+    println!(
+        "bench boot cpus={} uptime_us={} dtb_validate_us={} dt_index_us={} linear_map_us={} registry_us={} parallel_for_us={} probe_us={} probe_waves={} parallel_probes={} probe_max_cpus={}",
+        cpu::num_cpus_online(), uptime_ns / 1000, ticks_to_ns(fdt.validate_ticks) / 1000, ticks_to_ns(dt.build_ticks) / 1000,
+        ticks_to_ns(ptm::map_rest_of_ram_ticks()) / 1000, ticks_to_ns(ppm::ppm_registry_init_ticks()) / 1000,
+        ticks_to_ns(executor.ticks) / 1000, ticks_to_ns(probes.ticks) / 1000, probes.waves, probes.parallel_probes, probes.max_cpus
+    );
+}
+
+struct IopsRun {
+    blk_dev      : &'static VirtIOBlk,
+    deadline     : u64,
+    io_sectors   : u64,
+    ios          : AtomicU64,
+    errors       : AtomicU64
+}
+
+/*
+ * blk-iops: 1..=N CPUs each doing synchronous random reads of bench.io_kb (4) KB on
+ * their own queue for bench.ms, one point per CPU count. Run with num-queues=N for the
+ * per-CPU queue case, num-queues=1 for everyone sharing one.
+ */
+fn bench_blk_iops() {
+    let blk_dev: &'static VirtIOBlk = match blk::get_blk_device(0) {
+        Some(blk_dev) => blk_dev,
+        None => { println!("bench blk-iops no-device"); return; }
+    };
+    let run_ticks: u64 = ns_to_ticks(bench_arg("ms", DEFAULT_RUN_MS) * 1_000_000);
+    let io_sectors: u64 = bench_arg("io_kb", 4) * 1024 / blk::SECTOR_LEN as u64;
+    for num_cpus in 1..=cpu::num_cpus_online() {
+        let run: IopsRun = IopsRun {
+            blk_dev: blk_dev,
+            deadline: counter_ticks() + run_ticks,
+            io_sectors: io_sectors,
+            ios: AtomicU64::new(0),
+            errors: AtomicU64::new(0)
+        };
+        let start_ticks: u64 = counter_ticks();
+        let num_workers: usize = run_on_cpus(num_cpus, blk_iops_worker, &run as *const IopsRun as usize);
+        let ticks: u64 = counter_ticks() - start_ticks;
+        let ios: u64 = run.ios.load(Ordering::Relaxed);
+        println!(
+            "bench blk-iops cpus={} queues={} mode={:?} io_kb={} ios={} errors={} iops={}",
+            num_workers, blk_dev.num_queues(), blk_dev.completion_mode(), io_sectors * blk::SECTOR_LEN as u64 / 1024,
+            ios, run.errors.load(Ordering::Relaxed), per_sec(ios, ticks)
+        );
+    }
+}
+
+fn blk_iops_worker(run_arg: usize) {
+    let run: &IopsRun = unsafe { &*(run_arg as *const IopsRun) };
+    let io_len: usize = core::cmp::min(run.io_sectors as usize * blk::SECTOR_LEN, PAGE_LEN);
+    let buf_pa: *const u8 = match get_free_page(false) {
+        Ok(buf_pa) => buf_pa,
+        Err(_e) => { return; }
+    };
+    let buf: &mut [u8] = unsafe { slice::from_raw_parts_mut(page_pa_to_kva(buf_pa), io_len) };
+    let io_sectors: u64 = (io_len / blk::SECTOR_LEN) as u64;
+    let num_slots: u64 = core::cmp::max(run.blk_dev.capacity_sectors() / io_sectors, 1);
+    let mut rng: BenchRng = BenchRng::new(cpu_id() as u64 + 1);
+    let mut ios: u64 = 0;
+    let mut errors: u64 = 0;
+    while counter_ticks() < run.deadline {
+        match run.blk_dev.read((rng.next() % num_slots) * io_sectors, buf) {
+            Ok(_) => { ios += 1; },
+            Err(_e) => { errors += 1; }
+        }
+    }
+    run.ios.fetch_add(ios, Ordering::Relaxed);
+    run.errors.fetch_add(errors, Ordering::Relaxed);
+    let _ = free_page_ref(buf_pa);
+}
+
+/*
+ * blk-cpu: the same synchronous random reads on this CPU alone in each completion mode,
+ * for the CPU they cost: busy_pct is the share of the run not spent asleep in WFI, and
+ * cpu_ns_per_io that busy time over the IOs done. Poll mode never sleeps, so the
+ * comparison is what interrupts buy back for the latency they add.
+ */
+fn bench_blk_cpu() {
+    let blk_dev: &'static VirtIOBlk = match blk::get_blk_device(0) {
+        Some(blk_dev) => blk_dev,
+        None => { println!("bench blk-cpu no-device"); return; }
+    };
+    let run_ticks: u64 = ns_to_ticks(bench_arg("ms", DEFAULT_RUN_MS) * 1_000_000);
+    let io_sectors: u64 = bench_arg("io_kb", 4) * 1024 / blk::SECTOR_LEN as u64;
+    let orig_mode: BlkCompletionMode = blk_dev.completion_mode();
+    for mode in BLK_COMPLETION_MODES {
+        if let Err(_e) = blk_dev.set_completion_mode(mode) {
+            println!("bench blk-cpu mode={:?} unsupported", mode);
+            continue;
+        }
+        let run: IopsRun = IopsRun {
+            blk_dev: blk_dev,
+            deadline: counter_ticks() + run_ticks,
+            io_sectors: io_sectors,
+            ios: AtomicU64::new(0),
+            errors: AtomicU64::new(0)
+        };
+        let start_wfi_ticks: u64 = exceptions::wfi_ticks(cpu_id());
+        let start_ticks: u64 = counter_ticks();
+        blk_iops_worker(&run as *const IopsRun as usize);
+        let ticks: u64 = counter_ticks() - start_ticks;
+        let busy_ticks: u64 = ticks.saturating_sub(exceptions::wfi_ticks(cpu_id()) - start_wfi_ticks);
+        let ios: u64 = run.ios.load(Ordering::Relaxed);
+        println!(
+            "bench blk-cpu mode={:?} io_kb={} ios={} iops={} busy_pct={} cpu_ns_per_io={}",
+            mode, io_sectors * blk::SECTOR_LEN as u64 / 1024, ios, per_sec(ios, ticks),
+            if ticks == 0 { 0 } else { busy_ticks * 100 / ticks }, if ios == 0 { 0 } else { ticks_to_ns(busy_ticks) / ios }
+        );
+    }
+    let _ = blk_dev.set_completion_mode(orig_mode);
+}
+
+/*
+ * blk-seqwrite: bench.mb (32) MB of sequential 4KB writes from one CPU, bench.depth
+ * (32) submitted at a time and then waited on, once through the scheduler and once
+ * straight to the device. merge_ratio is callers' requests per device request.
+ */
+fn bench_blk_seqwrite() {
+    let scheduler: &'static BlkScheduler = match block::get_blk_scheduler(0) {
+        Some(scheduler) => scheduler,
+        None => { println!("bench blk-seqwrite no-device"); return; }
+    };
+    let blk_dev: &'static VirtIOBlk = scheduler.device();
+    let io_len: usize = 4096;
+    let num_ios: u64 = core::cmp::min(
+        bench_arg("mb", 32) * 1024 * 1024 / io_len as u64,
+        blk_dev.capacity_sectors() / (io_len / blk::SECTOR_LEN) as u64
+    );
+    let depth: usize = core::cmp::max(bench_arg("depth", 32) as usize, 1);
+    let buf_pa: *const u8 = match get_free_page(false) {
+        Ok(buf_pa) => buf_pa,
+        Err(_e) => { println!("bench blk-seqwrite no-memory"); return; }
+    };
+    let buf: *const u8 = page_pa_to_kva(buf_pa);
+    let mut reqs: Vec<BlkRequest> = (0..depth).map(|_| BlkRequest::new(BlkOp::Write, 0)).collect();
+    for use_scheduler in [true, false] {
+        let start_stats: BlkSchedStats = scheduler.stats();
+        let mut errors: u64 = 0;
+        let start_ticks: u64 = counter_ticks();
+        let mut io_idx: u64 = 0;
+        while io_idx < num_ios {
+            let batch: usize = core::cmp::min(depth as u64, num_ios - io_idx) as usize;
+            let mut submitted: usize = 0;
+            for req in &mut reqs[..batch] {
+                *req = BlkRequest::new(BlkOp::Write, io_idx * (io_len / blk::SECTOR_LEN) as u64);
+                io_idx += 1;
+                let queued: bool = req.add_buffer(buf, io_len).is_ok() && if use_scheduler {
+                    scheduler.submit(req).is_ok()
+                } else {
+                    blk_dev.submit(req).is_ok()
+                };
+                if !queued {
+                    errors += 1;
+                    break;
+                }
+                submitted += 1;
+            }
+            for req in &reqs[..submitted] {
+                let done: bool = if use_scheduler { scheduler.wait(req).is_ok() } else { blk_dev.wait(req).is_ok() };
+                if !done {
+                    errors += 1;
+                }
+            }
+            if submitted < batch {
+                break;
+            }
+        }
+        let ticks: u64 = counter_ticks() - start_ticks;
+        let stats: BlkSchedStats = scheduler.stats();
+        let queued: u64 = stats.queued - start_stats.queued;
+        let dispatched: u64 = stats.dispatched - start_stats.dispatched;
+        println!(
+            "bench blk-seqwrite path={} depth={} ios={} errors={} mb_per_s={} merge_ratio_x100={} unplugs_full={} unplugs_size={} unplugs_time={}",
+            if use_scheduler { "sched" } else { "device" }, depth, io_idx, errors,
+            per_sec(io_idx * io_len as u64, ticks) / (1024 * 1024), if dispatched == 0 { 100 } else { queued * 100 / dispatched },
+            stats.unplugs_full - start_stats.unplugs_full, stats.unplugs_size - start_stats.unplugs_size,
+            stats.unplugs_time - start_stats.unplugs_time
+        );
+    }
+    let _ = free_page_ref(buf_pa);
+}
+
+/*
+ * cache-zipf: bench.ops (50000) get_block()s of Zipf(1)-distributed blocks, over working
+ * sets of 2, 4 and 16 times the cache (or just bench.blocks), after a warm-up of a tenth
+ * as many. ideal_pct is what a cache holding exactly the CACHE_FRAMES most popular
+ * blocks would hit. Weights are 2^20/rank in integers; the table caps the set at 4096.
+ */
+fn bench_cache_zipf() {
+    let blk_dev: &'static VirtIOBlk = match blk::get_blk_device(0) {
+        Some(blk_dev) => blk_dev,
+        None => { println!("bench cache-zipf no-device"); return; }
+    };
+    let max_blocks: u64 = core::cmp::min(4096, blk_dev.capacity_sectors() * blk::SECTOR_LEN as u64 / cache::CACHE_BLOCK_LEN as u64);
+    let ops: u64 = bench_arg("ops", 50_000);
+    let sizes: [u64; 3] = match bench_arg("blocks", 0) {
+        0 => [2 * CACHE_FRAMES as u64, 4 * CACHE_FRAMES as u64, 16 * CACHE_FRAMES as u64],
+        blocks => [blocks, 0, 0]
+    };
+    let mut rng: BenchRng = BenchRng::new(42);
+    for num_blocks in sizes {
+        let num_blocks: usize = core::cmp::min(num_blocks, max_blocks) as usize;
+        if num_blocks == 0 {
+            continue;
+        }
+        let mut cdf: Vec<u32> = Vec::with_capacity(num_blocks);
+        let mut total: u32 = 0;
+        for rank in 1..=num_blocks as u32 {
+            total += (1 << 20) / rank;
+            cdf.push(total);
+        }
+        let ideal_pct: u64 = cdf[core::cmp::min(CACHE_FRAMES, num_blocks) - 1] as u64 * 100 / total as u64;
+        let mut errors: u64 = 0;
+        let mut start_stats: CacheStats = cache::cache_stats();
+        let mut start_ticks: u64 = counter_ticks();
+        for op in 0..ops + ops / 10 {
+            if op == ops / 10 {
+                start_stats = cache::cache_stats();
+                start_ticks = counter_ticks();
+            }
+            let pick: u32 = (rng.next() % total as u64) as u32;
+            let rank: usize = cdf.partition_point(|&cum| cum <= pick);
+            // Scatter the ranks so popularity has nothing to do with LBA.
+            let block: u64 = (rank as u64 * 2_654_435_761) % num_blocks as u64;
+            if let Err(_e) = cache::get_block(0, block) {
+                errors += 1;
+            }
+        }
+        let ticks: u64 = counter_ticks() - start_ticks;
+        let stats: CacheStats = cache::cache_stats();
+        let hits: u64 = stats.hits - start_stats.hits;
+        let misses: u64 = stats.misses - start_stats.misses;
+        println!(
+            "bench cache-zipf blocks={} frames={} ops={} errors={} hit_pct={} ideal_pct={} ghost_b1={} ghost_b2={} arc_p={} ops_per_s={}",
+            num_blocks, CACHE_FRAMES, ops, errors, if hits + misses == 0 { 0 } else { hits * 100 / (hits + misses) }, ideal_pct,
+            stats.ghost_hits_b1 - start_stats.ghost_hits_b1, stats.ghost_hits_b2 - start_stats.ghost_hits_b2, stats.arc_p,
+            per_sec(ops, ticks)
+        );
+    }
+}
+
+/*
+ * ra-scan: a sequential scan of bench.mb (16) MB in cache-block reads through a RaStream,
+ * once per readahead window cap from 0 (off) to 32 blocks. Each scan covers disk nobody
+ * has read yet, so the buffer cache starts cold every time.
+ */
+fn bench_ra_scan() {
+    let blk_dev: &'static VirtIOBlk = match blk::get_blk_device(0) {
+        Some(blk_dev) => blk_dev,
+        None => { println!("bench ra-scan no-device"); return; }
+    };
+    let block_len: u64 = cache::CACHE_BLOCK_LEN as u64;
+    let scan_blocks: u64 = bench_arg("mb", 16) * 1024 * 1024 / block_len;
+    let dev_blocks: u64 = blk_dev.capacity_sectors() * blk::SECTOR_LEN as u64 / block_len;
+    let mut buf: Vec<u8> = alloc::vec![0; block_len as usize];
+    let mut scan_start: u64 = 0;
+    for max_window in [0, 1, 2, 4, 8, 16, 32] {
+        if scan_start + scan_blocks > dev_blocks {
+            scan_start = 0;
+        }
+        let mut stream: RaStream = RaStream::new(0);
+        stream.set_max_window(max_window);
+        let start_stats: CacheStats = cache::cache_stats();
+        let mut errors: u64 = 0;
+        let start_ticks: u64 = counter_ticks();
+        for block in scan_start..scan_start + scan_blocks {
+            if let Err(_e) = stream.read(block * block_len, &mut buf) {
+                errors += 1;
+            }
+        }
+        let ticks: u64 = counter_ticks() - start_ticks;
+        let stats: CacheStats = cache::cache_stats();
+        println!(
+            "bench ra-scan max_window={} mb={} errors={} mb_per_s={} misses={} prefetches={} prefetch_hits={} prefetch_wasted={}",
+            max_window, scan_blocks * block_len / (1024 * 1024), errors, per_sec(scan_blocks * block_len, ticks) / (1024 * 1024),
+            stats.misses - start_stats.misses, stats.prefetches - start_stats.prefetches,
+            stats.prefetch_hits - start_stats.prefetch_hits, stats.prefetch_wasted - start_stats.prefetch_wasted
+        );
+        scan_start += scan_blocks;
+    }
+}
+
+// IEEE 802 "local experimental" EtherType: nothing else on the link will claim it.
+const BENCH_ETHERTYPE: u16 = 0x88b5;
+const NET_BURST: usize = 32;
+// A receiver gives up once it has heard nothing for this long after the first frame.
+const NET_RX_IDLE_MS: u64 = 200;
+
+/*
+ * net-pps: send bench.frame_len (64) byte frames in bursts of NET_BURST for bench.ms
+ * while counting whatever comes in. On the default loopback link that's our own frames;
+ * with bench.sh's NET_PAIR the peer runs with bench.tx=0 and only receives, until it's
+ * been idle for NET_RX_IDLE_MS. rx_pps is over the span from first to last frame in.
+ */
+fn bench_net_pps() {
+    let net_dev: &'static VirtIONet = match net::get_net_device(0) {
+        Some(net_dev) => net_dev,
+        None => { println!("bench net-pps no-device"); return; }
+    };
+    let tx: bool = bench_arg("tx", 1) != 0;
+    let frame_len: usize = core::cmp::min(core::cmp::max(bench_arg("frame_len", 64) as usize, 14), NET_MAX_FRAME_LEN);
+    let run_ticks: u64 = ns_to_ticks(bench_arg("ms", if tx { DEFAULT_RUN_MS } else { 30_000 }) * 1_000_000);
+    let idle_ticks: u64 = ns_to_ticks(NET_RX_IDLE_MS * 1_000_000);
+
+    let mut frame: [u8; NET_MAX_FRAME_LEN] = [0; NET_MAX_FRAME_LEN];
+    frame[..ETH_ALEN].copy_from_slice(&[0xff; ETH_ALEN]);
+    frame[ETH_ALEN..2 * ETH_ALEN].copy_from_slice(&net_dev.mac());
+    frame[2 * ETH_ALEN..2 * ETH_ALEN + 2].copy_from_slice(&BENCH_ETHERTYPE.to_be_bytes());
+    let burst: [&[u8]; NET_BURST] = [&frame[..frame_len]; NET_BURST];
+    let mut rx_buf: [u8; NET_MAX_FRAME_LEN] = [0; NET_MAX_FRAME_LEN];
+
+    let mut tx_frames: u64 = 0;
+    let mut tx_full: u64 = 0;
+    let mut rx_frames: u64 = 0;
+    let mut first_rx_ticks: u64 = 0;
+    let mut last_rx_ticks: u64 = 0;
+    let start_ticks: u64 = counter_ticks();
+    let deadline: u64 = start_ticks + run_ticks;
+    loop {
+        let now: u64 = counter_ticks();
+        if now >= deadline || (!tx && rx_frames > 0 && now - last_rx_ticks >= idle_ticks) {
+            break;
+        }
+        if tx {
+            match net_dev.send_burst(&burst) {
+                Ok(sent) => { tx_frames += sent as u64; },
+                Err(_e) => { tx_full += 1; }
+            }
+        }
+        while let Ok(Some(_frame)) = net_dev.recv(&mut rx_buf) {
+            last_rx_ticks = counter_ticks();
+            if rx_frames == 0 {
+                first_rx_ticks = last_rx_ticks;
+            }
+            rx_frames += 1;
+        }
+    }
+    let ticks: u64 = counter_ticks() - start_ticks;
+    println!(
+        "bench net-pps tx={} frame_len={} tx_frames={} tx_full={} tx_pps={} rx_frames={} rx_pps={}",
+        tx as u8, frame_len, tx_frames, tx_full, if tx { per_sec(tx_frames, ticks) } else { 0 },
+        rx_frames, if rx_frames < 2 { 0 } else { per_sec(rx_frames - 1, last_rx_ticks - first_rx_ticks) }
+    );
+}
+
+// Lines per println!/drain_logs() round, well within what a log ring holds.
+const LOG_BURST: u64 = 32;
+
+/*
+ * console: bench.lines (2000) lines of bench.line_len (80) bytes, straight into each
+ * backend and then through println!. The filler lines start with "bench-" so bench.sh
+ * doesn't pick them up as results. cpu_ns_per_line is the time spent in the write calls,
+ * i.e. what the printing CPU pays; bytes_per_s runs until the text has left (the backend
+ * is flushed, or the log rings drained).
+ */
+fn bench_console() {
+    let num_lines: u64 = bench_arg("lines", 2000);
+    let line_len: usize = core::cmp::min(core::cmp::max(bench_arg("line_len", 80) as usize, 16), 200);
+    let mut line_buf: [u8; 201] = [b'.'; 201];
+    line_buf[..13].copy_from_slice(b"bench-filler ");
+    line_buf[line_len - 1] = b'\n';
+    let line: &str = str::from_utf8(&line_buf[..line_len]).unwrap_or("bench-filler\n");
+    log::drain_logs();
+
+    for backend in ["pl011", "virtio"] {
+        if backend == "virtio" && !virtio_console::console_active() {
+            println!("bench console path=virtio no-device");
+            log::drain_logs();
+            continue;
+        }
+        let start_ticks: u64 = counter_ticks();
+        let mut write_ticks: u64 = 0;
+        for _ in 0..num_lines {
+            let write_start: u64 = counter_ticks();
+            if backend == "virtio" {
+                virtio_console::console_write_str(line);
+            } else {
+                pl011_uart::write_str(line);
+            }
+            write_ticks += counter_ticks() - write_start;
+        }
+        // Flushing: an empty polled write drains the PL011's TX ring first.
+        if backend == "virtio" { virtio_console::console_flush(); } else { pl011_uart::write_str_polled(""); }
+        let ticks: u64 = counter_ticks() - start_ticks;
+        println!(
+            "bench console path={} lines={} line_len={} bytes_per_s={} cpu_ns_per_line={}",
+            backend, num_lines, line_len, per_sec(num_lines * line_len as u64, ticks), ticks_to_ns(write_ticks) / num_lines.max(1)
+        );
+        log::drain_logs();
+    }
+
+    let start_dropped: u64 = log::log_ring_stats(cpu_id()).dropped;
+    let start_ticks: u64 = counter_ticks();
+    let mut print_ticks: u64 = 0;
+    let mut drain_ticks: u64 = 0;
+    let mut printed: u64 = 0;
+    while printed < num_lines {
+        let print_start: u64 = counter_ticks();
+        for _ in 0..core::cmp::min(LOG_BURST, num_lines - printed) {
+            crate::print!("{}", line);
+            printed += 1;
+        }
+        let drain_start: u64 = counter_ticks();
+        print_ticks += drain_start - print_start;
+        log::drain_logs();
+        drain_ticks += counter_ticks() - drain_start;
+    }
+    let ticks: u64 = counter_ticks() - start_ticks;
+    println!(
+        "bench console path=log lines={} line_len={} bytes_per_s={} cpu_ns_per_line={} drain_ns_per_line={} dropped={}",
+        num_lines, line_len, per_sec(num_lines * line_len as u64, ticks), ticks_to_ns(print_ticks) / num_lines.max(1),
+        ticks_to_ns(drain_ticks) / num_lines.max(1), log::log_ring_stats(cpu_id()).dropped - start_dropped
+    );
+}
+
+/*
+ * uart: bench.kb (64) KB of filler lines through the PL011, interrupt-driven (ring +
+ * TX IRQ) and then polled, each timed until the last byte is in the FIFO.
+ * cpu_ns_per_kb is the time spent in the write calls, i.e. what the writer paid; with
+ * the ring, the rest is the TX IRQ's, on whichever CPU takes it. QEMU's PL011 takes
+ * bytes as fast as they come, so this measures the driver's cost more than the UART's.
+ */
+fn bench_uart() {
+    let total_bytes: u64 = bench_arg("kb", 64) * 1024;
+    let line: &str = "bench-filler ..................................................\n";
+    log::drain_logs();
+    for use_irq in [true, false] {
+        if use_irq && !pl011_uart::pl011_stats().irq_mode {
+            println!("bench uart mode=irq unsupported");
+            log::drain_logs();
+            continue;
+        }
+        let start_stats: PL011Stats = pl011_uart::pl011_stats();
+        let start_ticks: u64 = counter_ticks();
+        let mut write_ticks: u64 = 0;
+        let mut written: u64 = 0;
+        while written < total_bytes {
+            let write_start: u64 = counter_ticks();
+            if use_irq { pl011_uart::write_str(line); } else { pl011_uart::write_str_polled(line); }
+            write_ticks += counter_ticks() - write_start;
+            written += line.len() as u64;
+        }
+        while pl011_uart::tx_pending() != 0 {
+            core::hint::spin_loop();
+        }
+        let ticks: u64 = counter_ticks() - start_ticks;
+        let stats: PL011Stats = pl011_uart::pl011_stats();
+        println!(
+            "bench uart mode={} bytes={} bytes_per_s={} cpu_ns_per_kb={} tx_irqs={} ring_waits={}",
+            if use_irq { "irq" } else { "polled" }, written, per_sec(written, ticks), ticks_to_ns(write_ticks) * 1024 / written.max(1),
+            stats.tx_irqs - start_stats.tx_irqs, stats.tx_ring_waits - start_stats.tx_ring_waits
+        );
+        log::drain_logs();
+    }
+}
+
+// The first (most specific) "compatible" entry, or nothing.
+fn first_compatible(node: &DTNode) -> &'static [u8] {
+    return node.compatible().split(|&b| b == 0).next().unwrap_or(&[]);
+}
+
+fn fdt_find_phandle(phandle: u32) -> bool {
+    let fdt: FDTItr = match FDTItr::new() {
+        Ok(fdt) => fdt,
+        Err(_e) => { return false; }
+    };
+    for fdt_node in fdt {
+        if let Ok(value) = fdt_node.get_property_bytes(b"phandle\0") {
+            if value.len() == 4 && u32::from_be_bytes(value.try_into().unwrap()) == phandle {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+fn fdt_find_compatible(compatible: &[u8]) -> bool {
+    match FDTItr::new() {
+        Ok(fdt) => { return fdt.with_compatible(compatible).next().is_some(); },
+        Err(_e) => { return false; }
+    }
+}
+
+// Every node `wanted` picks, `iters` times over; returns (lookups, ticks, misses).
+fn time_dt_lookups(iters: u64, wanted: fn(&DTNode) -> bool, lookup: fn(&'static DTNode) -> bool) -> (u64, u64, u64) {
+    let mut lookups: u64 = 0;
+    let mut misses: u64 = 0;
+    let start_ticks: u64 = counter_ticks();
+    for _ in 0..iters {
+        for node in dt_index::dt_nodes().iter().filter(|node| wanted(node)) {
+            if !lookup(node) {
+                misses += 1;
+            }
+            lookups += 1;
+        }
+    }
+    return (lookups, counter_ticks() - start_ticks, misses);
+}
+
+#[derive(Copy, Clone)]
+struct DTLookupResult {
+    kind          : &'static str,
+    lookups       : u64,
+    index_ns      : u64,
+    fdt_ns        : u64,
+    index_misses  : u64,
+    fdt_misses    : u64
+}
+
+const DT_LOOKUP_KINDS: usize = 4;
+// Filled in by after_probe(), on the boot CPU, before anything reads them.
+static mut DT_LOOKUP_RESULTS: [DTLookupResult; DT_LOOKUP_KINDS] = [DTLookupResult {
+    kind: "", lookups: 0, index_ns: 0, fdt_ns: 0, index_misses: 0, fdt_misses: 0
+}; DT_LOOKUP_KINDS];
+
+/*
+ * dt-lookup: what drivers ask the device tree, through the DT index and through libfdt:
+ * a node by compatible, a node by phandle, its first "reg", and its first "interrupts"
+ * specifier (for libfdt, just fetching the raw property). Each is done for every node
+ * that has one, bench.iters (200) times over. The index's phandle and compatible hashes
+ * go with the boot arena, so the lookups run from after_probe(), before init_devices()
+ * drops them, and this only reports them.
+ */
+fn bench_dt_lookup() {
+    let results: [DTLookupResult; DT_LOOKUP_KINDS] = unsafe { DT_LOOKUP_RESULTS };
+    for result in results {
+        if result.kind.is_empty() {
+            println!("bench dt-lookup not-run");
+            return;
+        }
+        println!(
+            "bench dt-lookup kind={} lookups={} index_ns={} libfdt_ns={} speedup_x100={} index_misses={} libfdt_misses={}",
+            result.kind, result.lookups, result.index_ns, result.fdt_ns, result.fdt_ns * 100 / result.index_ns.max(1),
+            result.index_misses, result.fdt_misses
+        );
+        log::drain_logs();
+    }
+}
+
+fn time_dt_lookup_kinds() {
+    let iters: u64 = bench_arg("iters", 200);
+    let has_compatible: fn(&DTNode) -> bool = |node| !first_compatible(node).is_empty();
+    let has_phandle: fn(&DTNode) -> bool = |node| node.phandle() != 0;
+    let has_reg: fn(&DTNode) -> bool = |node| node.num_regs() != 0;
+    let has_irqs: fn(&DTNode) -> bool = |node| node.num_irqs() != 0;
+    let kinds: [(&'static str, fn(&DTNode) -> bool, fn(&'static DTNode) -> bool, fn(&'static DTNode) -> bool); DT_LOOKUP_KINDS] = [
+        ("compatible", has_compatible,
+            |node| dt_index::dt_find_compatible(first_compatible(node)).is_some(),
+            |node| fdt_find_compatible(first_compatible(node))),
+        ("phandle", has_phandle,
+            |node| dt_index::dt_node_by_phandle(node.phandle()).is_some(),
+            |node| fdt_find_phandle(node.phandle())),
+        ("reg", has_reg,
+            |node| node.get_reg().is_ok(),
+            |node| node.fdt_node().get_reg().is_ok()),
+        ("interrupts", has_irqs,
+            |node| node.get_irq_cells(0).is_some(),
+            |node| node.fdt_node().get_property_bytes(b"interrupts\0").is_ok())
+    ];
+    for (kind_idx, (kind, wanted, index_lookup, fdt_lookup)) in kinds.into_iter().enumerate() {
+        let (lookups, index_ticks, index_misses): (u64, u64, u64) = time_dt_lookups(iters, wanted, index_lookup);
+        let (_, fdt_ticks, fdt_misses): (u64, u64, u64) = time_dt_lookups(iters, wanted, fdt_lookup);
+        unsafe {
+            DT_LOOKUP_RESULTS[kind_idx] = DTLookupResult {
+                kind: kind,
+                lookups: lookups,
+                index_ns: ticks_to_ns(index_ticks) / lookups.max(1),
+                fdt_ns: ticks_to_ns(fdt_ticks) / lookups.max(1),
+                index_misses: index_misses,
+                fdt_misses: fdt_misses
+            };
+        }
+    }
+}
+
+/*
+ * fdt-walk: bench.iters (200) full walks of the DTB through FDTItr, reading every node's
+ * name and every property, first with libfdt's per-access checks on and then with them
+ * skipped, as libfdt_lite_init() leaves libfdt once the DTB validates.
+ */
+fn bench_fdt_walk() {
+    let iters: u64 = bench_arg("iters", 200);
+    let was_trusted: bool = libfdt_lite::libfdt_stats().trusted;
+    for trusted in [false, true] {
+        if trusted && !was_trusted {
+            println!("bench fdt-walk checks=off unsupported");
+            continue;
+        }
+        libfdt_lite::libfdt_set_trusted(trusted);
+        let mut nodes: u64 = 0;
+        let mut props: u64 = 0;
+        let mut bytes: u64 = 0;
+        let mut errors: u64 = 0;
+        let start_ticks: u64 = counter_ticks();
+        for _ in 0..iters {
+            let fdt: FDTItr = match FDTItr::new() {
+                Ok(fdt) => fdt,
+                Err(_e) => { errors += 1; continue; }
+            };
+            for fdt_node in core::iter::once(FDTNode::root()).chain(fdt) {
+                match fdt_node.get_name() {
+                    Ok(name) => { bytes += name.len() as u64; },
+                    Err(_e) => { errors += 1; }
+                }
+                for (_prop_name, value) in fdt_node.properties() {
+                    bytes += value.len() as u64;
+                    props += 1;
+                }
+                nodes += 1;
+            }
+        }
+        let ticks: u64 = counter_ticks() - start_ticks;
+        println!(
+            "bench fdt-walk checks={} walks={} nodes={} props={} bytes={} errors={} walk_us={} ns_per_node={}",
+            if trusted { "off" } else { "on" }, iters, nodes / iters.max(1), props / iters.max(1), bytes / iters.max(1),
+            errors, ticks_to_ns(ticks) / iters.max(1) / 1000, ticks_to_ns(ticks) / nodes.max(1)
+        );
+        log::drain_logs();
+    }
+    libfdt_lite::libfdt_set_trusted(was_trusted);
+}
+
+const TIMER_BATCH: usize = 64;
+// Pending timers are allocated this many at a time: 8KB, where the heap tops out at a page.
+const TIMER_CHUNK: usize = 128;
+
+static TIMER_FIRED_TICKS: AtomicU64 = AtomicU64::new(0);
+
+fn timer_noop(_ctx: usize) { }
+
+fn timer_fired(_ctx: usize) {
+    TIMER_FIRED_TICKS.store(counter_ticks(), Ordering::Release);
+}
+
+// Every timer here is cancelled before it's dropped, so it's as good as 'static while armed.
+fn bench_timer_ref(timer: &Timer) -> &'static Timer {
+    return unsafe { &*(timer as *const Timer) };
+}
+
+/*
+ * timer: what arm_timer() and cancel_timer() cost with 0, 100 and 10000 other timers
+ * pending on this CPU's wheel (bench.batches (1000) batches of 64 each, deadlines 100us
+ * to 1s out), then how late bench.wakeups (1000) one-shot timers 20us..2ms out run past
+ * their deadlines, waiting for each in WFI and spinning.
+ */
+fn bench_timer() {
+    if !timer::timer_irq_ready() {
+        println!("bench timer no-irq");
+        return;
+    }
+    let batches: u64 = bench_arg("batches", 1000);
+    let mut rng: BenchRng = BenchRng::new(counter_ticks());
+    let batch: Vec<Timer> = (0..TIMER_BATCH).map(|i| Timer::new(timer_noop, i)).collect();
+    for pending in [0, 100, 10_000] {
+        let chunks: Vec<Vec<Timer>> = (0..usize::div_ceil(pending, TIMER_CHUNK))
+            .map(|_| (0..TIMER_CHUNK).map(|i| Timer::new(timer_noop, i)).collect())
+            .collect();
+        for timer in chunks.iter().flatten().take(pending) {
+            // Far enough out that none fire mid-run.
+            timer::arm_timer_ns(bench_timer_ref(timer), 10_000_000_000 + rng.next() % 100_000_000_000);
+        }
+        let mut arm_ticks: u64 = 0;
+        let mut cancel_ticks: u64 = 0;
+        for _ in 0..batches {
+            let now: u64 = counter_ticks();
+            let deadlines: [u64; TIMER_BATCH] =
+                core::array::from_fn(|_| now + ns_to_ticks(100_000 + rng.next() % 1_000_000_000));
+            let start_ticks: u64 = counter_ticks();
+            for (timer, &deadline) in batch.iter().zip(deadlines.iter()) {
+                timer::arm_timer(bench_timer_ref(timer), deadline);
+            }
+            let armed_ticks: u64 = counter_ticks();
+            for timer in &batch {
+                timer::cancel_timer(timer);
+            }
+            cancel_ticks += counter_ticks() - armed_ticks;
+            arm_ticks += armed_ticks - start_ticks;
+        }
+        for timer in chunks.iter().flatten() {
+            timer::cancel_timer(timer);
+        }
+        let ops: u64 = core::cmp::max(batches * TIMER_BATCH as u64, 1);
+        println!(
+            "bench timer pending={} ops={} arm_ns={} cancel_ns={}",
+            pending, ops, ticks_to_ns(arm_ticks) / ops, ticks_to_ns(cancel_ticks) / ops
+        );
+        log::drain_logs();
+    }
+
+    let wakeups: u64 = bench_arg("wakeups", 1000);
+    let wakeup: Timer = Timer::new(timer_fired, 0);
+    for wfi in [true, false] {
+        let mut late: LatencyHistogram = LatencyHistogram::new();
+        let mut max_late_ns: u64 = 0;
+        for _ in 0..wakeups {
+            TIMER_FIRED_TICKS.store(0, Ordering::Relaxed);
+            let deadline: u64 = counter_ticks() + ns_to_ticks(20_000 + rng.next() % 1_980_000);
+            timer::arm_timer(bench_timer_ref(&wakeup), deadline);
+            // Checked with IRQs masked, so the wakeup can't land between the check and the WFI.
+            loop {
+                let daif: u64 = exceptions::irq_save();
+                if TIMER_FIRED_TICKS.load(Ordering::Acquire) != 0 {
+                    exceptions::irq_restore(daif);
+                    break;
+                }
+                if wfi {
+                    exceptions::wait_for_interrupt();
+                }
+                exceptions::irq_restore(daif);
+            }
+            let late_ns: u64 = ticks_to_ns(TIMER_FIRED_TICKS.load(Ordering::Relaxed).saturating_sub(deadline));
+            late.record(late_ns);
+            max_late_ns = core::cmp::max(max_late_ns, late_ns);
+        }
+        timer::cancel_timer(&wakeup);
+        println!(
+            "bench timer wait={} wakeups={} late_p50_ns={} late_p99_ns={} late_max_ns={}",
+            if wfi { "wfi" } else { "spin" }, wakeups, late.percentile_ns(50).unwrap_or(0),
+            late.percentile_ns(99).unwrap_or(0), max_late_ns
+        );
+        log::drain_logs();
+    }
+}
+
+struct SchedRun {
+    // 0 until every thread is spawned.
+    deadline : AtomicU64,
+    yields   : AtomicU64
+}
+
+fn sched_wait_start(run: &SchedRun) -> u64 {
+    loop {
+        let deadline: u64 = run.deadline.load(Ordering::Acquire);
+        if deadline != 0 {
+            return deadline;
+        }
+        // Sleeping, so this CPU's idle thread gets back to spawning the rest.
+        thread::sleep_ns(100_000);
+    }
+}
+
+fn sched_yielder(run_arg: usize) {
+    let run: &SchedRun = unsafe { &*(run_arg as *const SchedRun) };
+    let deadline: u64 = sched_wait_start(run);
+    let mut yields: u64 = 0;
+    while counter_ticks() < deadline {
+        thread::yield_now();
+        yields += 1;
+    }
+    run.yields.fetch_add(yields, Ordering::Relaxed);
+}
+
+fn sched_spinner(run_arg: usize) {
+    let run: &SchedRun = unsafe { &*(run_arg as *const SchedRun) };
+    let deadline: u64 = sched_wait_start(run);
+    while counter_ticks() < deadline {
+        core::hint::spin_loop();
+    }
+}
+
+/*
+ * sched: what a thread switch costs, in cycles (PMCCNTR_EL0; counter ticks without a
+ * PMU). mode=yield is two threads per CPU yielding to each other: yield_now() to the
+ * other running. mode=preempt is a spinner and a yielder per CPU: the spinner's
+ * timeslice running out to the yielder running. Both for bench.ms (2000), with
+ * schedule()'s own average. The threads land one per CPU in turn, as spawn_thread()
+ * picks the least loaded.
+ */
+fn bench_sched() {
+    let run_ticks: u64 = ns_to_ticks(bench_arg("ms", 2000) * 1_000_000);
+    let num_cpus: usize = cpu::num_cpus_online();
+    let modes: [(&str, [fn(usize); 2]); 2] = [
+        ("yield", [sched_yielder, sched_yielder]),
+        ("preempt", [sched_spinner, sched_yielder])
+    ];
+    for (mode, entries) in modes {
+        let run: SchedRun = SchedRun { deadline: AtomicU64::new(0), yields: AtomicU64::new(0) };
+        let before: ThreadStats = thread::thread_stats();
+        let switch_before: LatencyHistogram = thread::switch_cycles();
+        let preempt_before: LatencyHistogram = thread::preempt_cycles();
+        let mut num_threads: u64 = 0;
+        for entry in entries {
+            for _ in 0..num_cpus {
+                if thread::spawn_thread("bench-sched", entry, &run as *const SchedRun as usize, thread::DEFAULT_PRIORITY).is_ok() {
+                    num_threads += 1;
+                }
+            }
+        }
+        run.deadline.store(counter_ticks() + run_ticks, Ordering::Release);
+        // The run has to outlive them all.
+        while thread::thread_stats().exited - before.exited < num_threads {
+            thread::sleep_ns(1_000_000);
+        }
+        let after: ThreadStats = thread::thread_stats();
+        let switches: LatencyHistogram = if mode == "yield" {
+            thread::switch_cycles().since(&switch_before)
+        } else {
+            thread::preempt_cycles().since(&preempt_before)
+        };
+        let sched_calls: u64 = core::cmp::max(after.sched_calls - before.sched_calls, 1);
+        println!(
+            "bench sched mode={} cpus={} threads={} unit={} yields={} switches={} preemptions={} timed={} p50<={} p99<={} schedule_avg={}",
+            mode, num_cpus, num_threads, if after.pmu_cycles { "cycles" } else { "ticks" },
+            run.yields.load(Ordering::Relaxed), after.switches - before.switches, after.preemptions - before.preemptions,
+            switches.count(), switches.percentile_ns(50).unwrap_or(0), switches.percentile_ns(99).unwrap_or(0),
+            (after.sched_cycles - before.sched_cycles) / sched_calls
+        );
+        log::drain_logs();
+    }
+}
@@ -0,0 +1,695 @@
+use super::*;
+use core::ptr;
+use crate::sync::SpinLock;
+use crate::devices::cpu::cpu_id;
+use crate::devices::memory::{PAGE_LEN, ppm::{get_free_page, get_free_page_as, page_pa_to_kva}};
+use blk::{BlkOp, BlkRequest, SECTOR_LEN};
+
+/*
+ * Buffer cache: 16KB disk blocks cached in 16KB PPM frames, keyed by (device, block).
+ * Replacement is ARC (Megiddo & Modha, FAST '03): T1 holds blocks seen once recently,
+ * T2 blocks seen at least twice, and the ghost lists B1/B2 remember the keys of blocks
+ * evicted from each so a re-reference can shift the target size p of T1 towards
+ * whichever list is being under-served. Ghosts have no frame, so the directory is
+ * 2 × CACHE_FRAMES entries.
+ *
+ * Dirty blocks are written back asynchronously in LBA-sorted batches through the block
+ * scheduler, which merges adjacent ones. Only clean, unpinned blocks are ever evicted.
+ */
+pub const CACHE_BLOCK_LEN: usize = PAGE_LEN;
+const SECTORS_PER_BLOCK: u64 = (CACHE_BLOCK_LEN / SECTOR_LEN) as u64;
+pub const CACHE_FRAMES: usize = 256;
+const CACHE_ENTRIES: usize = 2 * CACHE_FRAMES;
+const HASH_BUCKETS: usize = 512;
+const NIL: u16 = u16::MAX;
+const WRITEBACK_BATCH: usize = 16;
+// Asynchronous reads that may be in flight for readahead at once.
+const PREFETCH_SLOTS: usize = 32;
+// Start writing back once this many blocks are dirty.
+const DIRTY_HIGH_WATER: usize = CACHE_FRAMES / 4;
+
+// Which list an entry is on.
+const LIST_FREE: usize = 0;
+const LIST_T1:   usize = 1;
+const LIST_T2:   usize = 2;
+const LIST_B1:   usize = 3;
+const LIST_B2:   usize = 4;
+const NUM_LISTS: usize = 5;
+
+const FLAG_VALID:     u8 = 1 << 0;
+const FLAG_DIRTY:     u8 = 1 << 1;
+const FLAG_WRITEBACK: u8 = 1 << 2;
+const FLAG_FILLING:   u8 = 1 << 3;
+// Read in by prefetch_block() and not looked at since.
+const FLAG_PREFETCHED: u8 = 1 << 4;
+
+#[repr(C)]
+struct CacheEntry {
+    block     : u64,
+    frame_pa  : u64,
+    dev       : u8,
+    list      : u8,
+    flags     : u8,
+    // While FILLING: the CPU whose queues the read went into.
+    fill_cpu  : u8,
+    pins      : u16,
+    prev      : u16,
+    next      : u16,
+    hash_next : u16
+}
+
+#[derive(Copy, Clone)]
+struct ListHead {
+    mru : u16,
+    lru : u16,
+    len : usize
+}
+
+#[derive(Copy, Clone, Default)]
+pub struct CacheStats {
+    pub hits          : u64,
+    pub misses        : u64,
+    // Misses on a key ARC still remembered, i.e. ones that moved p.
+    pub ghost_hits_b1 : u64,
+    pub ghost_hits_b2 : u64,
+    pub evictions     : u64,
+    pub writebacks    : u64,
+    pub wb_errors     : u64,
+    pub prefetches    : u64,
+    // Prefetched blocks that were later used vs. evicted untouched.
+    pub prefetch_hits   : u64,
+    pub prefetch_wasted : u64,
+    pub resident      : u64,
+    pub dirty         : u64,
+    pub arc_p         : u64
+}
+
+// An asynchronous cache read or write in flight, and the entry it's for.
+struct IoSlot {
+    req       : BlkRequest,
+    entry_idx : u16,
+    in_use    : bool
+}
+
+struct CacheMeta {
+    entries         : *mut [CacheEntry; CACHE_ENTRIES],
+    wb_slots        : *mut [IoSlot; WRITEBACK_BATCH],
+    ra_slots        : *mut [IoSlot; PREFETCH_SLOTS],
+    lists           : [ListHead; NUM_LISTS],
+    buckets         : [u16; HASH_BUCKETS],
+    free_frames     : [u64; CACHE_FRAMES],
+    num_free_frames : usize,
+    frames_total    : usize,
+    arc_p           : usize,
+    num_dirty       : usize,
+    stats           : CacheStats
+} unsafe impl Send for CacheMeta {}
+
+static mut BUF_CACHE: *const SpinLock<CacheMeta> = ptr::null();
+
+// A pinned, valid cached block. The frame is mapped straight through the TTBR1 window,
+// so reads/writes through it are plain memory accesses. Dropping it unpins the block.
+pub struct CacheRef {
+    entry_idx : u16,
+    va        : *mut u8
+} impl CacheRef {
+    #[inline(always)] pub fn as_slice(&self) -> &[u8] { unsafe { core::slice::from_raw_parts(self.va, CACHE_BLOCK_LEN) } }
+    // Remember to mark_dirty() after writing.
+    #[inline(always)] pub fn as_mut_slice(&mut self) -> &mut [u8] { unsafe { core::slice::from_raw_parts_mut(self.va, CACHE_BLOCK_LEN) } }
+
+    pub fn mark_dirty(&self) {
+        let num_dirty: usize = {
+            let mut meta = buf_cache().lock_irqsave();
+            let entry: &mut CacheEntry = meta.entry(self.entry_idx);
+            if entry.flags & FLAG_DIRTY == 0 {
+                entry.flags |= FLAG_DIRTY;
+                meta.num_dirty += 1;
+            }
+            meta.num_dirty
+        };
+        if num_dirty >= DIRTY_HIGH_WATER {
+            writeback();
+        }
+    }
+} impl Drop for CacheRef {
+    fn drop(&mut self) {
+        let mut meta = buf_cache().lock_irqsave();
+        meta.entry(self.entry_idx).pins -= 1;
+    }
+}
+
+pub fn init_buffer_cache() -> Result<(), BlockError> {
+    let cache: &'static mut SpinLock<CacheMeta> = match get_free_page_as::<SpinLock<CacheMeta>>() {
+        Ok(cache) => cache,
+        Err(e) => { return Err(BlockError::AllocCacheFailed(e)); }
+    };
+    let meta: &mut CacheMeta = cache.get_mut();
+    match get_free_page_as::<[CacheEntry; CACHE_ENTRIES]>() {
+        Ok(entries) => { meta.entries = entries; },
+        Err(e) => { return Err(BlockError::AllocCacheFailed(e)); }
+    }
+    match get_free_page_as::<[IoSlot; WRITEBACK_BATCH]>() {
+        Ok(wb_slots) => { meta.wb_slots = wb_slots; },
+        Err(e) => { return Err(BlockError::AllocCacheFailed(e)); }
+    }
+    match get_free_page_as::<[IoSlot; PREFETCH_SLOTS]>() {
+        Ok(ra_slots) => { meta.ra_slots = ra_slots; },
+        Err(e) => { return Err(BlockError::AllocCacheFailed(e)); }
+    }
+    for list in 0..NUM_LISTS {
+        meta.lists[list] = ListHead { mru: NIL, lru: NIL, len: 0 };
+    }
+    meta.buckets = [NIL; HASH_BUCKETS];
+    for entry_idx in 0..CACHE_ENTRIES as u16 {
+        meta.entry(entry_idx).hash_next = NIL;
+        meta.list_push_mru(LIST_FREE, entry_idx);
+    }
+    unsafe { BUF_CACHE = cache as *const SpinLock<CacheMeta>; }
+    return Ok(());
+}
+
+#[inline(always)]
+fn buf_cache() -> &'static SpinLock<CacheMeta> {
+    unsafe { &*BUF_CACHE }
+}
+
+pub fn cache_stats() -> CacheStats {
+    let meta = buf_cache().lock_irqsave();
+    let mut stats: CacheStats = meta.stats;
+    stats.resident = (meta.lists[LIST_T1].len + meta.lists[LIST_T2].len) as u64;
+    stats.dirty = meta.num_dirty as u64;
+    stats.arc_p = meta.arc_p as u64;
+    return stats;
+}
+
+// Look `block` of block device `dev_idx` up, reading it in on a miss, and pin it.
+pub fn get_block(dev_idx: usize, block: u64) -> Result<CacheRef, BlockError> {
+    let scheduler: &'static BlkScheduler = match get_blk_scheduler(dev_idx) {
+        Some(scheduler) => scheduler,
+        None => { return Err(BlockError::NoSuchDevice); }
+    };
+    if (block + 1) * SECTORS_PER_BLOCK > scheduler.device().capacity_sectors() {
+        return Err(BlockError::OutOfRange);
+    }
+
+    loop {
+        let (entry_idx, frame_pa): (u16, u64) = {
+            let mut meta = buf_cache().lock_irqsave();
+            let found: u16 = meta.hash_find(dev_idx as u8, block);
+            let found_list: usize = if found == NIL { LIST_FREE } else { meta.entry(found).list as usize };
+            if found_list == LIST_T1 || found_list == LIST_T2 {
+                let entry: &mut CacheEntry = meta.entry(found);
+                if entry.flags & FLAG_FILLING != 0 {
+                    // Someone else is reading it in, maybe on another CPU, whose queue nobody
+                    // else reaps in Poll mode: reap it from here. (Its plug drains on a timer.)
+                    let fill_cpu: usize = entry.fill_cpu as usize;
+                    drop(meta);
+                    if scheduler.poll_cpu(fill_cpu) == 0 {
+                        core::hint::spin_loop();
+                    }
+                    continue;
+                }
+                entry.pins += 1;
+                let frame_pa: u64 = entry.frame_pa;
+                // A prefetched block's first use is its first real reference: it stays in T1.
+                let was_prefetched: bool = entry.flags & FLAG_PREFETCHED != 0;
+                entry.flags &= !FLAG_PREFETCHED;
+                meta.list_unlink(found);
+                meta.list_push_mru(if was_prefetched { LIST_T1 } else { LIST_T2 }, found);
+                meta.stats.hits += 1;
+                if was_prefetched {
+                    meta.stats.prefetch_hits += 1;
+                }
+                return Ok(CacheRef { entry_idx: found, va: page_pa_to_kva(frame_pa as *const u8) });
+            }
+
+            match meta.admit(dev_idx as u8, block, found, true) {
+                Some(admitted) => {
+                    meta.stats.misses += 1;
+                    admitted
+                },
+                None => {
+                    // Everything evictable is dirty or pinned: push some dirty blocks out & retry.
+                    drop(meta);
+                    if writeback() == 0 {
+                        scheduler.poll();
+                    }
+                    continue;
+                }
+            }
+        };
+
+        let mut req: BlkRequest = BlkRequest::new(BlkOp::Read, block * SECTORS_PER_BLOCK);
+        let _ = req.add_segment(frame_pa, CACHE_BLOCK_LEN as u32);
+        let result: Result<(), BlockError> = scheduler.submit_and_wait(&mut req);
+
+        let mut meta = buf_cache().lock_irqsave();
+        match result {
+            Ok(_) => {
+                let entry: &mut CacheEntry = meta.entry(entry_idx);
+                entry.flags = FLAG_VALID;
+                return Ok(CacheRef { entry_idx, va: page_pa_to_kva(frame_pa as *const u8) });
+            },
+            Err(e) => {
+                meta.forget(entry_idx);
+                return Err(e);
+            }
+        }
+    }
+}
+
+/*
+ * Start reading `block` into the cache without waiting for it. Returns false if that
+ * wasn't possible (out of range, no free prefetch slot, nothing evictable); true if
+ * the block is already cached or on its way.
+ */
+pub fn prefetch_block(dev_idx: usize, block: u64) -> bool {
+    let scheduler: &'static BlkScheduler = match get_blk_scheduler(dev_idx) {
+        Some(scheduler) => scheduler,
+        None => { return false; }
+    };
+    if (block + 1) * SECTORS_PER_BLOCK > scheduler.device().capacity_sectors() {
+        return false;
+    }
+    let req: &mut BlkRequest = {
+        let mut meta = buf_cache().lock_irqsave();
+        let found: u16 = meta.hash_find(dev_idx as u8, block);
+        if found != NIL && (meta.entry(found).list as usize == LIST_T1 || meta.entry(found).list as usize == LIST_T2) {
+            return true;
+        }
+        let slot_idx: usize = match (0..PREFETCH_SLOTS).find(|&slot_idx| !meta.ra_slot(slot_idx).in_use) {
+            Some(slot_idx) => slot_idx,
+            None => { return false; }
+        };
+        let (entry_idx, frame_pa): (u16, u64) = match meta.admit(dev_idx as u8, block, found, false) {
+            Some(admitted) => admitted,
+            None => { return false; }
+        };
+        meta.stats.prefetches += 1;
+        let slot: &mut IoSlot = meta.ra_slot(slot_idx);
+        slot.in_use = true;
+        slot.entry_idx = entry_idx;
+        slot.req = BlkRequest::new(BlkOp::Read, block * SECTORS_PER_BLOCK);
+        let _ = slot.req.add_segment(frame_pa, CACHE_BLOCK_LEN as u32);
+        slot.req.on_complete = Some(prefetch_complete);
+        slot.req.ctx = slot_idx;
+        unsafe { &mut (*meta.ra_slots)[slot_idx].req }
+    };
+    if let Err(_e) = scheduler.submit(req) {
+        req.finish(Err(VirtIOError::IOError));
+    }
+    return true;
+}
+
+fn prefetch_complete(req: &mut BlkRequest) {
+    let mut meta = buf_cache().lock_irqsave();
+    let slot_idx: usize = req.ctx;
+    let entry_idx: u16 = meta.ra_slot(slot_idx).entry_idx;
+    if req.result().is_ok() {
+        let entry: &mut CacheEntry = meta.entry(entry_idx);
+        entry.flags = FLAG_VALID | FLAG_PREFETCHED;
+        entry.pins -= 1;
+    } else {
+        meta.forget(entry_idx);
+    }
+    meta.ra_slot(slot_idx).in_use = false;
+}
+
+// Copy out of the cache. `offset` is in bytes from the start of the device.
+pub fn cache_read(dev_idx: usize, offset: u64, buf: &mut [u8]) -> Result<(), BlockError> {
+    let mut done: usize = 0;
+    while done < buf.len() {
+        let pos: u64 = offset + done as u64;
+        let block_offset: usize = (pos % CACHE_BLOCK_LEN as u64) as usize;
+        let chunk: usize = core::cmp::min(buf.len() - done, CACHE_BLOCK_LEN - block_offset);
+        match get_block(dev_idx, pos / CACHE_BLOCK_LEN as u64) {
+            Ok(cache_ref) => {
+                buf[done..done + chunk].copy_from_slice(&cache_ref.as_slice()[block_offset..block_offset + chunk]);
+            },
+            Err(e) => { return Err(e); }
+        }
+        done += chunk;
+    }
+    return Ok(());
+}
+
+// Copy into the cache & leave the blocks dirty for writeback.
+pub fn cache_write(dev_idx: usize, offset: u64, buf: &[u8]) -> Result<(), BlockError> {
+    let mut done: usize = 0;
+    while done < buf.len() {
+        let pos: u64 = offset + done as u64;
+        let block_offset: usize = (pos % CACHE_BLOCK_LEN as u64) as usize;
+        let chunk: usize = core::cmp::min(buf.len() - done, CACHE_BLOCK_LEN - block_offset);
+        match get_block(dev_idx, pos / CACHE_BLOCK_LEN as u64) {
+            Ok(mut cache_ref) => {
+                cache_ref.as_mut_slice()[block_offset..block_offset + chunk].copy_from_slice(&buf[done..done + chunk]);
+                cache_ref.mark_dirty();
+            },
+            Err(e) => { return Err(e); }
+        }
+        done += chunk;
+    }
+    return Ok(());
+}
+
+/*
+ * Start writing back up to WRITEBACK_BATCH dirty blocks, LRU end first since those are
+ * the next eviction candidates. Doesn't wait. Returns how many writes were started.
+ */
+pub fn writeback() -> usize {
+    let mut batch: [(u8, u64, usize); WRITEBACK_BATCH] = [(0, 0, 0); WRITEBACK_BATCH];
+    let mut num_batch: usize = 0;
+    {
+        let mut meta = buf_cache().lock_irqsave();
+        let mut free_slots: [usize; WRITEBACK_BATCH] = [0; WRITEBACK_BATCH];
+        let mut num_free_slots: usize = 0;
+        for slot_idx in 0..WRITEBACK_BATCH {
+            if !meta.wb_slot(slot_idx).in_use {
+                free_slots[num_free_slots] = slot_idx;
+                num_free_slots += 1;
+            }
+        }
+        for list in [LIST_T1, LIST_T2] {
+            let mut entry_idx: u16 = meta.lists[list].lru;
+            while entry_idx != NIL && num_batch < num_free_slots {
+                let entry: &mut CacheEntry = meta.entry(entry_idx);
+                let prev: u16 = entry.prev;
+                if entry.flags & (FLAG_DIRTY | FLAG_WRITEBACK) == FLAG_DIRTY {
+                    entry.flags = (entry.flags & !FLAG_DIRTY) | FLAG_WRITEBACK;
+                    entry.pins += 1;
+                    let (dev, block, frame_pa): (u8, u64, u64) = (entry.dev, entry.block, entry.frame_pa);
+                    meta.num_dirty -= 1;
+                    let slot_idx: usize = free_slots[num_batch];
+                    let slot: &mut IoSlot = meta.wb_slot(slot_idx);
+                    slot.in_use = true;
+                    slot.entry_idx = entry_idx;
+                    slot.req = BlkRequest::new(BlkOp::Write, block * SECTORS_PER_BLOCK);
+                    let _ = slot.req.add_segment(frame_pa, CACHE_BLOCK_LEN as u32);
+                    slot.req.on_complete = Some(writeback_complete);
+                    slot.req.ctx = slot_idx;
+                    batch[num_batch] = (dev, block, slot_idx);
+                    num_batch += 1;
+                }
+                entry_idx = prev;
+            }
+        }
+    }
+
+    // Submit in LBA order so the scheduler's plug can merge neighbours.
+    batch[..num_batch].sort_unstable_by_key(|&(dev, block, _)| (dev, block));
+    // The slots are ours until their writes complete, so no need to hold the lock for them.
+    let wb_slots: *mut [IoSlot; WRITEBACK_BATCH] = buf_cache().lock_irqsave().wb_slots;
+    for &(dev, _, slot_idx) in &batch[..num_batch] {
+        let req: &mut BlkRequest = unsafe { &mut (*wb_slots)[slot_idx].req };
+        match get_blk_scheduler(dev as usize) {
+            Some(scheduler) => {
+                if let Err(_e) = scheduler.submit(req) {
+                    req.finish(Err(VirtIOError::IOError));
+                }
+            },
+            None => { req.finish(Err(VirtIOError::IOError)); }
+        }
+    }
+    for dev_idx in 0..MAX_BLK_DEVICES {
+        if let Some(scheduler) = get_blk_scheduler(dev_idx) {
+            scheduler.unplug();
+        }
+    }
+    return num_batch;
+}
+
+// Write back everything dirty, wait for it, then flush the devices' own caches.
+pub fn sync() -> Result<(), BlockError> {
+    loop {
+        let busy: bool = {
+            let meta = buf_cache().lock_irqsave();
+            meta.num_dirty > 0 || (0..WRITEBACK_BATCH).any(|slot_idx| unsafe { (*meta.wb_slots)[slot_idx].in_use })
+        };
+        if !busy {
+            break;
+        }
+        if writeback() == 0 {
+            for dev_idx in 0..MAX_BLK_DEVICES {
+                if let Some(scheduler) = get_blk_scheduler(dev_idx) {
+                    scheduler.poll();
+                }
+            }
+        }
+    }
+    for dev_idx in 0..MAX_BLK_DEVICES {
+        if let Some(scheduler) = get_blk_scheduler(dev_idx) {
+            let mut req: BlkRequest = BlkRequest::new(BlkOp::Flush, 0);
+            match scheduler.submit_and_wait(&mut req) {
+                Ok(_) | Err(BlockError::Device(VirtIOError::Unsupported)) => {},
+                Err(e) => { return Err(e); }
+            }
+        }
+    }
+    return Ok(());
+}
+
+fn writeback_complete(req: &mut BlkRequest) {
+    let mut meta = buf_cache().lock_irqsave();
+    let slot_idx: usize = req.ctx;
+    let entry_idx: u16 = meta.wb_slot(slot_idx).entry_idx;
+    let failed: bool = req.result().is_err();
+    let entry: &mut CacheEntry = meta.entry(entry_idx);
+    entry.flags &= !FLAG_WRITEBACK;
+    entry.pins -= 1;
+    if failed && entry.flags & FLAG_DIRTY == 0 {
+        entry.flags |= FLAG_DIRTY;
+        meta.num_dirty += 1;
+    }
+    if failed {
+        meta.stats.wb_errors += 1;
+    } else {
+        meta.stats.writebacks += 1;
+    }
+    meta.wb_slot(slot_idx).in_use = false;
+}
+
+impl CacheMeta {
+    #[inline(always)]
+    fn entry(&mut self, entry_idx: u16) -> &mut CacheEntry {
+        unsafe { &mut (*self.entries)[entry_idx as usize] }
+    }
+
+    #[inline(always)]
+    fn wb_slot(&mut self, slot_idx: usize) -> &mut IoSlot {
+        unsafe { &mut (*self.wb_slots)[slot_idx] }
+    }
+
+    #[inline(always)]
+    fn ra_slot(&mut self, slot_idx: usize) -> &mut IoSlot {
+        unsafe { &mut (*self.ra_slots)[slot_idx] }
+    }
+
+    /*
+     * ARC's miss path. `ghost` is the B1/B2 entry for this key if ARC remembers it, or
+     * NIL. Returns the T1/T2 entry now holding the key (FILLING, pinned) and its frame,
+     * or None if no frame could be freed up. Only a `demand` miss counts as a re-reference:
+     * a prefetch that lands on a ghost reuses its entry but goes to T1 and leaves p alone.
+     */
+    fn admit(&mut self, dev: u8, block: u64, ghost: u16, demand: bool) -> Option<(u16, u64)> {
+        let c: usize = CACHE_FRAMES;
+        let b1_len: usize = self.lists[LIST_B1].len;
+        let b2_len: usize = self.lists[LIST_B2].len;
+        let ghost_list: usize = if ghost == NIL { LIST_FREE } else { self.entry(ghost).list as usize };
+
+        let frame_pa: u64 = match (ghost_list, demand) {
+            (LIST_B1, true) => {
+                let frame_pa: Option<u64> = self.take_frame(false);
+                if frame_pa.is_some() {
+                    self.arc_p = core::cmp::min(c, self.arc_p + core::cmp::max(b2_len / b1_len.max(1), 1));
+                    self.stats.ghost_hits_b1 += 1;
+                }
+                frame_pa
+            },
+            (LIST_B2, true) => {
+                let frame_pa: Option<u64> = self.take_frame(true);
+                if frame_pa.is_some() {
+                    self.arc_p = self.arc_p.saturating_sub(core::cmp::max(b1_len / b2_len.max(1), 1));
+                    self.stats.ghost_hits_b2 += 1;
+                }
+                frame_pa
+            },
+            (LIST_B1, false) | (LIST_B2, false) => self.take_frame(false),
+            _ => {
+                // Keep the directory within 2c: |T1| + |B1| <= c and the total <= 2c.
+                let t1_len: usize = self.lists[LIST_T1].len;
+                let total: usize = t1_len + self.lists[LIST_T2].len + b1_len + b2_len;
+                if t1_len + b1_len >= c && b1_len > 0 {
+                    self.drop_lru(LIST_B1);
+                } else if total >= 2 * c && b2_len > 0 {
+                    self.drop_lru(LIST_B2);
+                }
+                self.take_frame(false)
+            }
+        }?;
+
+        let entry_idx: u16 = if ghost != NIL {
+            self.list_unlink(ghost);
+            ghost
+        } else {
+            if self.lists[LIST_FREE].len == 0 {
+                // Directory still full (e.g. B1 was empty): make room from the ghosts.
+                self.drop_lru(if self.lists[LIST_B2].len > 0 { LIST_B2 } else { LIST_B1 });
+            }
+            let entry_idx: u16 = self.lists[LIST_FREE].lru;
+            if entry_idx == NIL {
+                self.free_frames[self.num_free_frames] = frame_pa;
+                self.num_free_frames += 1;
+                return None;
+            }
+            self.list_unlink(entry_idx);
+            let entry: &mut CacheEntry = self.entry(entry_idx);
+            entry.dev = dev;
+            entry.block = block;
+            self.hash_insert(entry_idx);
+            entry_idx
+        };
+        let entry: &mut CacheEntry = self.entry(entry_idx);
+        entry.frame_pa = frame_pa;
+        entry.flags = FLAG_FILLING;
+        // Threads stay on their CPU, so the caller submits the read from this one.
+        entry.fill_cpu = cpu_id() as u8;
+        entry.pins = 1;
+        self.list_push_mru(if ghost != NIL && demand { LIST_T2 } else { LIST_T1 }, entry_idx);
+        return Some((entry_idx, frame_pa));
+    }
+
+    // A free frame: a spare one, a new PPM page while under CACHE_FRAMES, or ARC's REPLACE.
+    fn take_frame(&mut self, hit_in_b2: bool) -> Option<u64> {
+        if self.num_free_frames > 0 {
+            self.num_free_frames -= 1;
+            return Some(self.free_frames[self.num_free_frames]);
+        }
+        if self.frames_total < CACHE_FRAMES {
+            if let Ok(frame_pa) = get_free_page(false) {
+                self.frames_total += 1;
+                return Some(frame_pa as u64);
+            }
+        }
+        let t1_len: usize = self.lists[LIST_T1].len;
+        let from_t1: bool = t1_len > 0 && (t1_len > self.arc_p || (hit_in_b2 && t1_len == self.arc_p));
+        let (first, second): (usize, usize) = if from_t1 { (LIST_T1, LIST_T2) } else { (LIST_T2, LIST_T1) };
+        for list in [first, second] {
+            let victim: u16 = self.lru_evictable(list);
+            if victim != NIL {
+                let frame_pa: u64 = self.entry(victim).frame_pa;
+                if self.entry(victim).flags & FLAG_PREFETCHED != 0 {
+                    self.stats.prefetch_wasted += 1;
+                }
+                self.list_unlink(victim);
+                self.entry(victim).flags = 0;
+                self.list_push_mru(if list == LIST_T1 { LIST_B1 } else { LIST_B2 }, victim);
+                self.stats.evictions += 1;
+                return Some(frame_pa);
+            }
+        }
+        return None;
+    }
+
+    fn lru_evictable(&mut self, list: usize) -> u16 {
+        let mut entry_idx: u16 = self.lists[list].lru;
+        while entry_idx != NIL {
+            let entry: &mut CacheEntry = self.entry(entry_idx);
+            if entry.pins == 0 && entry.flags & !FLAG_PREFETCHED == FLAG_VALID {
+                return entry_idx;
+            }
+            entry_idx = entry.prev;
+        }
+        return NIL;
+    }
+
+    fn drop_lru(&mut self, list: usize) {
+        let entry_idx: u16 = self.lists[list].lru;
+        if entry_idx != NIL {
+            self.hash_remove(entry_idx);
+            self.list_unlink(entry_idx);
+            self.list_push_mru(LIST_FREE, entry_idx);
+        }
+    }
+
+    // Throw away a resident entry entirely (e.g. its read failed).
+    fn forget(&mut self, entry_idx: u16) {
+        let frame_pa: u64 = self.entry(entry_idx).frame_pa;
+        self.free_frames[self.num_free_frames] = frame_pa;
+        self.num_free_frames += 1;
+        let entry: &mut CacheEntry = self.entry(entry_idx);
+        entry.flags = 0;
+        entry.pins = 0;
+        self.hash_remove(entry_idx);
+        self.list_unlink(entry_idx);
+        self.list_push_mru(LIST_FREE, entry_idx);
+    }
+
+    fn list_push_mru(&mut self, list: usize, entry_idx: u16) {
+        let old_mru: u16 = self.lists[list].mru;
+        let entry: &mut CacheEntry = self.entry(entry_idx);
+        entry.list = list as u8;
+        entry.prev = NIL;
+        entry.next = old_mru;
+        if old_mru != NIL {
+            self.entry(old_mru).prev = entry_idx;
+        } else {
+            self.lists[list].lru = entry_idx;
+        }
+        self.lists[list].mru = entry_idx;
+        self.lists[list].len += 1;
+    }
+
+    fn list_unlink(&mut self, entry_idx: u16) {
+        let entry: &mut CacheEntry = self.entry(entry_idx);
+        let (list, prev, next): (usize, u16, u16) = (entry.list as usize, entry.prev, entry.next);
+        if prev != NIL { self.entry(prev).next = next; } else { self.lists[list].mru = next; }
+        if next != NIL { self.entry(next).prev = prev; } else { self.lists[list].lru = prev; }
+        self.lists[list].len -= 1;
+    }
+
+    #[inline(always)]
+    fn hash_of(dev: u8, block: u64) -> usize {
+        // Fibonacci hashing: consecutive blocks land in far apart buckets.
+        let key: u64 = block ^ ((dev as u64) << 56);
+        return (key.wrapping_mul(0x9E37_79B9_7F4A_7C15) >> (64 - HASH_BUCKETS.trailing_zeros())) as usize;
+    }
+
+    fn hash_find(&mut self, dev: u8, block: u64) -> u16 {
+        let mut entry_idx: u16 = self.buckets[Self::hash_of(dev, block)];
+        while entry_idx != NIL {
+            let entry: &mut CacheEntry = self.entry(entry_idx);
+            if entry.dev == dev && entry.block == block {
+                return entry_idx;
+            }
+            entry_idx = entry.hash_next;
+        }
+        return NIL;
+    }
+
+    fn hash_insert(&mut self, entry_idx: u16) {
+        let entry: &mut CacheEntry = self.entry(entry_idx);
+        let bucket: usize = Self::hash_of(entry.dev, entry.block);
+        let old_head: u16 = self.buckets[bucket];
+        self.entry(entry_idx).hash_next = old_head;
+        self.buckets[bucket] = entry_idx;
+    }
+
+    fn hash_remove(&mut self, entry_idx: u16) {
+        let entry: &mut CacheEntry = self.entry(entry_idx);
+        let bucket: usize = Self::hash_of(entry.dev, entry.block);
+        let hash_next: u16 = entry.hash_next;
+        if self.buckets[bucket] == entry_idx {
+            self.buckets[bucket] = hash_next;
+            return;
+        }
+        let mut cur: u16 = self.buckets[bucket];
+        while cur != NIL {
+            let cur_next: u16 = self.entry(cur).hash_next;
+            if cur_next == entry_idx {
+                self.entry(cur).hash_next = hash_next;
+                return;
+            }
+            cur = cur_next;
+        }
+    }
+}
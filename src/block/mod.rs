@@ -0,0 +1,45 @@
+use crate::devices::virtio::blk::{self, MAX_BLK_DEVICES};
+use crate::devices::memory::ppm::PPMError;
+use crate::devices::VirtIOError;
+pub mod sched;
+pub mod cache;
+pub mod readahead;
+pub use sched::BlkScheduler;
+
+/*
+ * The block layer: everything that sits between callers and the virtio-blk driver.
+ * Each block device gets a BlkScheduler that plugs, merges & sorts requests before
+ * they take up virtqueue slots. Above those sits one buffer cache shared by all devices,
+ * which per-stream readahead prefetches into.
+ */
+
+pub enum BlockError {
+    AllocSchedulerFailed(PPMError),
+    AllocCacheFailed(PPMError),
+    NoSuchDevice,
+    OutOfRange,
+    Device(VirtIOError)
+}
+
+static mut SCHEDULERS: [*const BlkScheduler; MAX_BLK_DEVICES] = [core::ptr::null(); MAX_BLK_DEVICES];
+
+// Called once the drivers have probed: set up the block layer for every block device found.
+pub fn init_block_layer() -> Result<(), BlockError> {
+    for blk_idx in 0..blk::num_blk_devices() {
+        let blk_dev: &'static blk::VirtIOBlk = match blk::get_blk_device(blk_idx) {
+            Some(blk_dev) => blk_dev,
+            None => { return Err(BlockError::NoSuchDevice); }
+        };
+        match BlkScheduler::new(blk_dev) {
+            Ok(scheduler) => unsafe { SCHEDULERS[blk_idx] = scheduler as *const BlkScheduler; },
+            Err(e) => { return Err(e); }
+        }
+    }
+    return cache::init_buffer_cache();
+}
+
+pub fn get_blk_scheduler(blk_idx: usize) -> Option<&'static BlkScheduler> {
+    unsafe {
+        if blk_idx < MAX_BLK_DEVICES && !SCHEDULERS[blk_idx].is_null() { Some(&*SCHEDULERS[blk_idx]) } else { None }
+    }
+}
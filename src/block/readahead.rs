@@ -0,0 +1,106 @@
+use super::*;
+use cache::{cache_read, prefetch_block, CACHE_BLOCK_LEN};
+
+/*
+ * Per-stream readahead. A stream is one sequential-ish reader (a log replay, an image
+ * load, ...) and owns its RaStream, the way a file handle would. Accesses that keep
+ * moving by the same block stride (1 for a plain sequential scan) grow the prefetch
+ * window exponentially up to max_window; each access then keeps `window` blocks ahead
+ * of it in flight, through the buffer cache, without waiting for them. A break in the
+ * pattern quarters the window so a stream that turns random stops prefetching quickly.
+ */
+const RA_INIT_WINDOW: usize = 2;
+pub const RA_DEFAULT_MAX_WINDOW: usize = 32;
+
+pub struct RaStream {
+    dev_idx    : usize,
+    last_block : Option<u64>,
+    stride     : i64,
+    window     : usize,
+    max_window : usize,
+    // Next block to prefetch, if a prefetch run is going.
+    ra_next    : Option<u64>
+} impl RaStream {
+    pub const fn new(dev_idx: usize) -> Self {
+        return Self {
+            dev_idx,
+            last_block: None,
+            stride: 0,
+            window: 0,
+            max_window: RA_DEFAULT_MAX_WINDOW,
+            ra_next: None
+        };
+    }
+
+    #[inline(always)] pub fn window(&self) -> usize { self.window }
+    #[inline(always)] pub fn stride(&self) -> i64 { self.stride }
+
+    // Cap on blocks kept in flight ahead of the reader. 0 turns readahead off.
+    pub fn set_max_window(&mut self, max_window: usize) {
+        self.max_window = max_window;
+        self.window = core::cmp::min(self.window, max_window);
+    }
+
+    // Like cache_read(), but lets the stream see the access first.
+    pub fn read(&mut self, offset: u64, buf: &mut [u8]) -> Result<(), BlockError> {
+        if buf.is_empty() {
+            return Ok(());
+        }
+        let first_block: u64 = offset / CACHE_BLOCK_LEN as u64;
+        let last_block: u64 = (offset + buf.len() as u64 - 1) / CACHE_BLOCK_LEN as u64;
+        for block in first_block..=last_block {
+            self.access(block);
+        }
+        return cache_read(self.dev_idx, offset, buf);
+    }
+
+    fn access(&mut self, block: u64) {
+        if let Some(last_block) = self.last_block {
+            let delta: i64 = block as i64 - last_block as i64;
+            if delta == 0 {
+                return;
+            }
+            if delta == self.stride {
+                self.window = if self.window == 0 {
+                    core::cmp::min(RA_INIT_WINDOW, self.max_window)
+                } else {
+                    core::cmp::min(self.window * 2, self.max_window)
+                };
+            } else {
+                self.stride = delta;
+                self.window /= 4;
+                self.ra_next = None;
+            }
+        }
+        self.last_block = Some(block);
+        if self.window > 0 {
+            self.prefetch_ahead(block);
+        }
+    }
+
+    // Top the run of in-flight prefetches up to `window` strides past `block`.
+    fn prefetch_ahead(&mut self, block: u64) {
+        let stride: i64 = self.stride;
+        let end: i64 = block as i64 + stride * self.window as i64;
+        let mut next: i64 = match self.ra_next {
+            // Still ahead of the reader: carry on from where the last access left off.
+            Some(ra_next) if (ra_next as i64 - block as i64) * stride.signum() > 0 => ra_next as i64,
+            _ => block as i64 + stride
+        };
+        let mut issued: bool = false;
+        while next >= 0 && (end - next) * stride.signum() >= 0 {
+            if !prefetch_block(self.dev_idx, next as u64) {
+                break;
+            }
+            issued = true;
+            next += stride;
+        }
+        self.ra_next = if next >= 0 { Some(next as u64) } else { None };
+        // Don't leave prefetches sitting in this CPU's plug; anyone may be waiting on them.
+        if issued {
+            if let Some(scheduler) = get_blk_scheduler(self.dev_idx) {
+                scheduler.unplug();
+            }
+        }
+    }
+}
@@ -0,0 +1,485 @@
+use super::*;
+use core::ptr;
+use core::sync::atomic::{AtomicBool, Ordering};
+use crate::sync::SpinLock;
+use crate::devices::cpu::{cpu_id, num_cpus, MAX_CPUS};
+use crate::devices::timer::{self, counter_ticks, ns_to_ticks, Timer};
+use crate::devices::memory::ppm::get_free_page_as;
+use blk::{BlkOp, BlkRequest, VirtIOBlk, BLK_MAX_SEGS, SECTOR_LEN};
+
+/*
+ * Per-CPU plugging in front of virtio-blk. Requests sit in this CPU's plug until it
+ * fills up, holds DEFAULT_UNPLUG_BYTES, gets older than DEFAULT_UNPLUG_NS, or someone
+ * waits on / flushes them. On unplug they're sorted by LBA and runs of sector-adjacent
+ * requests with the same op go to the device as one scatter-gather request.
+ *
+ * Opening a plug arms a timer on this CPU's wheel for the age limit, so a plug nobody
+ * waits on still drains; submit() and poll() check the age too.
+ *
+ * A write that overlaps plugged writes is merged with them right away: whatever part of
+ * the one it partly overlaps it doesn't cover, then it, go out as one request in their
+ * place, and the ones it covers entirely complete when that does. Any other overlap
+ * involving a write has to reach the device in submission order, so it unplugs first.
+ */
+const PLUG_MAX: usize = 32;
+const MERGED_POOL_LEN: usize = 16;
+const DEFAULT_UNPLUG_BYTES: usize = 128 * 1024;
+const DEFAULT_UNPLUG_NS: u64 = 100_000;
+
+#[derive(Copy, Clone, PartialEq)]
+enum UnplugReason {
+    Full,
+    Size,
+    Time,
+    Explicit,
+    // An incoming request overlaps a plugged one in a way that forbids reordering them.
+    Conflict
+}
+
+#[derive(Copy, Clone, Default)]
+pub struct BlkSchedStats {
+    pub queued           : u64,
+    pub dispatched       : u64,
+    // Requests folded into another one's device request.
+    pub merged           : u64,
+    // Plugged writes not sent because a later write covered them entirely.
+    pub absorbed         : u64,
+    // Writes merged with a plugged write they partly overlap.
+    pub overlaps_merged  : u64,
+    pub bytes            : u64,
+    pub unplugs_full     : u64,
+    pub unplugs_size     : u64,
+    pub unplugs_time     : u64,
+    pub unplugs_explicit : u64,
+    pub unplugs_conflict : u64
+} impl BlkSchedStats {
+    fn add(&mut self, other: &BlkSchedStats) {
+        self.queued += other.queued;
+        self.dispatched += other.dispatched;
+        self.merged += other.merged;
+        self.absorbed += other.absorbed;
+        self.overlaps_merged += other.overlaps_merged;
+        self.bytes += other.bytes;
+        self.unplugs_full += other.unplugs_full;
+        self.unplugs_size += other.unplugs_size;
+        self.unplugs_time += other.unplugs_time;
+        self.unplugs_explicit += other.unplugs_explicit;
+        self.unplugs_conflict += other.unplugs_conflict;
+    }
+}
+
+struct Plug {
+    reqs        : [*mut BlkRequest; PLUG_MAX],
+    num_reqs    : usize,
+    bytes       : usize,
+    first_ticks : u64,
+    stats       : BlkSchedStats
+} unsafe impl Send for Plug {}
+
+// A device request built out of several callers' requests. Completing it completes them.
+struct MergedReq {
+    req          : BlkRequest,
+    children     : [*mut BlkRequest; BLK_MAX_SEGS],
+    num_children : usize,
+    in_use       : AtomicBool
+}
+
+// One page per CPU. All-zero is an empty plug and a free pool; new() sets up the timer.
+struct SchedCpu {
+    plug         : SpinLock<Plug>,
+    pool         : [MergedReq; MERGED_POOL_LEN],
+    unplug_timer : Timer
+}
+
+pub struct BlkScheduler {
+    dev          : *const VirtIOBlk,
+    unplug_bytes : usize,
+    unplug_ticks : u64,
+    cpus         : [*mut SchedCpu; MAX_CPUS]
+}
+
+impl BlkScheduler {
+    pub fn new(dev: &'static VirtIOBlk) -> Result<&'static BlkScheduler, BlockError> {
+        let scheduler: &'static mut BlkScheduler = match get_free_page_as::<BlkScheduler>() {
+            Ok(scheduler) => scheduler,
+            Err(e) => { return Err(BlockError::AllocSchedulerFailed(e)); }
+        };
+        scheduler.dev = dev as *const VirtIOBlk;
+        scheduler.unplug_bytes = DEFAULT_UNPLUG_BYTES;
+        scheduler.unplug_ticks = ns_to_ticks(DEFAULT_UNPLUG_NS);
+        let scheduler_arg: usize = scheduler as *const BlkScheduler as usize;
+        for cpu_idx in 0..num_cpus() {
+            match get_free_page_as::<SchedCpu>() {
+                Ok(sched_cpu) => {
+                    unsafe { ptr::write(&raw mut sched_cpu.unplug_timer, Timer::new(plug_expired, scheduler_arg)); }
+                    scheduler.cpus[cpu_idx] = sched_cpu as *mut SchedCpu;
+                },
+                Err(e) => { return Err(BlockError::AllocSchedulerFailed(e)); }
+            }
+        }
+        return Ok(scheduler);
+    }
+
+    #[inline(always)] pub fn device(&self) -> &'static VirtIOBlk { unsafe { &*self.dev } }
+    #[inline(always)] fn my_cpu(&self) -> &SchedCpu { unsafe { &*self.cpus[cpu_id()] } }
+    // SchedCpu pages are never freed.
+    #[inline(always)] fn my_timer(&self) -> &'static Timer { unsafe { &(*self.cpus[cpu_id()]).unplug_timer } }
+
+    pub fn stats(&self) -> BlkSchedStats {
+        let mut stats: BlkSchedStats = BlkSchedStats::default();
+        for cpu_idx in 0..num_cpus() {
+            let sched_cpu: &SchedCpu = unsafe { &*self.cpus[cpu_idx] };
+            stats.add(&sched_cpu.plug.lock_irqsave().stats);
+        }
+        return stats;
+    }
+
+    /*
+     * Plug `req` on this CPU. Same contract as VirtIOBlk::submit(): keep `req` in place
+     * until it's done. Flushes are never plugged; they unplug everything ahead of them.
+     */
+    pub fn submit(&self, req: &mut BlkRequest) -> Result<(), BlockError> {
+        if req.op == BlkOp::Flush {
+            self.unplug_cpu(UnplugReason::Explicit);
+            match self.device().submit(req) {
+                Ok(_) => { return Ok(()); },
+                Err(e) => { return Err(BlockError::Device(e)); }
+            }
+        }
+
+        let sched_cpu: &SchedCpu = self.my_cpu();
+        let (start, end): (u64, u64) = sector_range(req);
+        // Scan and plug under one hold, so nothing can plug an overlapping write in between.
+        let unplug_reason: Option<UnplugReason> = loop {
+            let mut plug = sched_cpu.plug.lock_irqsave();
+            // Plugged writes `req` covers entirely; room is left for `overlapped` and `req`.
+            let mut absorbed: [*mut BlkRequest; BLK_MAX_SEGS] = [ptr::null_mut(); BLK_MAX_SEGS];
+            let mut num_absorbed: usize = 0;
+            // The plugged write `req` partly overlaps, if any.
+            let mut overlapped: *mut BlkRequest = ptr::null_mut();
+            let mut conflict: bool = false;
+            for &plugged in &plug.reqs[..plug.num_reqs] {
+                let plugged: &BlkRequest = unsafe { &*plugged };
+                let (plugged_start, plugged_end): (u64, u64) = sector_range(plugged);
+                if plugged_end <= start || end <= plugged_start {
+                    continue;
+                }
+                if plugged.op == BlkOp::Read && req.op == BlkOp::Read {
+                    continue;
+                }
+                if plugged.op == BlkOp::Write && req.op == BlkOp::Write && start <= plugged_start && plugged_end <= end
+                    && num_absorbed < BLK_MAX_SEGS - 2
+                {
+                    absorbed[num_absorbed] = plugged as *const BlkRequest as *mut BlkRequest;
+                    num_absorbed += 1;
+                    continue;
+                }
+                if plugged.op == BlkOp::Write && req.op == BlkOp::Write && overlapped.is_null() {
+                    overlapped = plugged as *const BlkRequest as *mut BlkRequest;
+                    continue;
+                }
+                conflict = true;
+                break;
+            }
+            let mut to_plug: *mut BlkRequest = req as *mut BlkRequest;
+            if !conflict && (num_absorbed > 0 || !overlapped.is_null()) {
+                match self.merge_writes(self.cpus[cpu_id()], req, overlapped, &absorbed[..num_absorbed]) {
+                    Some(merged) => { to_plug = merged; },
+                    None => { conflict = true; }
+                }
+            }
+            if conflict {
+                // Unplug, then look again: the plug may have refilled meanwhile.
+                drop(plug);
+                self.unplug_cpu(UnplugReason::Conflict);
+                continue;
+            }
+
+            // What the merged write stands in for comes out of the plug; it completes them.
+            let mut kept: usize = 0;
+            for i in 0..plug.num_reqs {
+                let plugged: *mut BlkRequest = plug.reqs[i];
+                if plugged == overlapped || absorbed[..num_absorbed].contains(&plugged) {
+                    plug.bytes -= unsafe { (*plugged).data_len() };
+                } else {
+                    plug.reqs[kept] = plugged;
+                    kept += 1;
+                }
+            }
+            plug.num_reqs = kept;
+            plug.stats.absorbed += num_absorbed as u64;
+            if !overlapped.is_null() {
+                plug.stats.overlaps_merged += 1;
+            }
+
+            let now: u64 = counter_ticks();
+            if plug.num_reqs == 0 {
+                plug.first_ticks = now;
+                timer::arm_timer(self.my_timer(), now + self.unplug_ticks);
+            }
+            let slot: usize = plug.num_reqs;
+            plug.reqs[slot] = to_plug;
+            plug.num_reqs += 1;
+            plug.bytes += unsafe { (*to_plug).data_len() };
+            plug.stats.queued += 1;
+            if plug.num_reqs == PLUG_MAX {
+                break Some(UnplugReason::Full);
+            } else if plug.bytes >= self.unplug_bytes {
+                break Some(UnplugReason::Size);
+            } else if now.wrapping_sub(plug.first_ticks) >= self.unplug_ticks {
+                break Some(UnplugReason::Time);
+            } else {
+                break None;
+            }
+        };
+        if let Some(reason) = unplug_reason {
+            self.unplug_cpu(reason);
+        }
+        return Ok(());
+    }
+
+    // Send everything plugged on this CPU to the device now.
+    pub fn unplug(&self) {
+        self.unplug_cpu(UnplugReason::Explicit);
+    }
+
+    // Unplug if the plug has aged out, then reap this CPU's completions.
+    pub fn poll(&self) -> usize {
+        let aged: bool = {
+            let plug = self.my_cpu().plug.lock_irqsave();
+            plug.num_reqs > 0 && counter_ticks().wrapping_sub(plug.first_ticks) >= self.unplug_ticks
+        };
+        if aged {
+            self.unplug_cpu(UnplugReason::Time);
+        }
+        return self.device().poll();
+    }
+
+    // Reap the device queue `cpu_idx` submits to, e.g. to wait on a request it sent.
+    pub fn poll_cpu(&self, cpu_idx: usize) -> usize {
+        if cpu_idx == cpu_id() {
+            return self.poll();
+        }
+        return self.device().poll_cpu(cpu_idx);
+    }
+
+    pub fn wait(&self, req: &BlkRequest) -> Result<(), BlockError> {
+        self.unplug_cpu(UnplugReason::Explicit);
+        match self.device().wait(req) {
+            Ok(_) => { return Ok(()); },
+            Err(e) => { return Err(BlockError::Device(e)); }
+        }
+    }
+
+    pub fn submit_and_wait(&self, req: &mut BlkRequest) -> Result<(), BlockError> {
+        if let Err(e) = self.submit(req) {
+            return Err(e);
+        }
+        return self.wait(req);
+    }
+
+    fn unplug_cpu(&self, reason: UnplugReason) {
+        let sched_cpu: &SchedCpu = self.my_cpu();
+        let mut reqs: [*mut BlkRequest; PLUG_MAX] = [ptr::null_mut(); PLUG_MAX];
+        let num_reqs: usize;
+        {
+            // Take the requests & drop the lock: completions reaped while dispatching can
+            // run callbacks that submit again.
+            let mut plug = sched_cpu.plug.lock_irqsave();
+            num_reqs = plug.num_reqs;
+            reqs[..num_reqs].copy_from_slice(&plug.reqs[..num_reqs]);
+            plug.num_reqs = 0;
+            plug.bytes = 0;
+        }
+        if num_reqs == 0 {
+            return;
+        }
+        if reason != UnplugReason::Time {
+            timer::cancel_timer(&sched_cpu.unplug_timer);
+        }
+
+        // Insertion sort by (op, LBA): small n, and usually already close to sorted.
+        for i in 1..num_reqs {
+            let mut j: usize = i;
+            while j > 0 && sort_key(reqs[j]) < sort_key(reqs[j - 1]) {
+                reqs.swap(j, j - 1);
+                j -= 1;
+            }
+        }
+
+        let mut unplug_stats: BlkSchedStats = BlkSchedStats::default();
+        let mut i: usize = 0;
+        while i < num_reqs {
+            let first: &BlkRequest = unsafe { &*reqs[i] };
+            let mut num_segs: usize = first.num_segs;
+            let mut end: u64 = sector_range(first).1;
+            let mut j: usize = i + 1;
+            while j < num_reqs {
+                let next: &BlkRequest = unsafe { &*reqs[j] };
+                // A MergedReq has a child slot per segment, and a request can have none.
+                if next.op != first.op || next.sector != end || num_segs + next.num_segs > BLK_MAX_SEGS || j - i >= BLK_MAX_SEGS {
+                    break;
+                }
+                num_segs += next.num_segs;
+                end = sector_range(next).1;
+                j += 1;
+            }
+            for &req in &reqs[i..j] {
+                unplug_stats.bytes += unsafe { (*req).data_len() as u64 };
+            }
+            if j - i > 1 && self.dispatch_merged(self.cpus[cpu_id()], &reqs[i..j]) {
+                unplug_stats.dispatched += 1;
+                unplug_stats.merged += (j - i - 1) as u64;
+            } else {
+                for &req in &reqs[i..j] {
+                    self.dispatch(unsafe { &mut *req });
+                    unplug_stats.dispatched += 1;
+                }
+            }
+            i = j;
+        }
+
+        let mut plug = sched_cpu.plug.lock_irqsave();
+        plug.stats.add(&unplug_stats);
+        match reason {
+            UnplugReason::Full     => { plug.stats.unplugs_full += 1; },
+            UnplugReason::Size     => { plug.stats.unplugs_size += 1; },
+            UnplugReason::Time     => { plug.stats.unplugs_time += 1; },
+            UnplugReason::Explicit => { plug.stats.unplugs_explicit += 1; },
+            UnplugReason::Conflict => { plug.stats.unplugs_conflict += 1; }
+        }
+    }
+
+    // Returns false (and dispatches nothing) if this CPU has no free MergedReq.
+    fn dispatch_merged(&self, sched_cpu: *mut SchedCpu, children: &[*mut BlkRequest]) -> bool {
+        let merged: &mut MergedReq = match alloc_merged(sched_cpu) {
+            Some(merged) => merged,
+            None => { return false; }
+        };
+        let first: &BlkRequest = unsafe { &*children[0] };
+        merged.req = BlkRequest::new(first.op, first.sector);
+        for (child_idx, &child) in children.iter().enumerate() {
+            let child: &BlkRequest = unsafe { &*child };
+            for seg in &child.segs[..child.num_segs] {
+                let _ = merged.req.add_segment(seg.pa, seg.len);
+            }
+            merged.children[child_idx] = child as *const BlkRequest as *mut BlkRequest;
+        }
+        merged.num_children = children.len();
+        merged.req.on_complete = Some(merged_complete);
+        merged.req.ctx = merged as *mut MergedReq as usize;
+        self.dispatch(&mut merged.req);
+        return true;
+    }
+
+    /*
+     * Build the write that stands in for `req` and the plugged writes it overwrites:
+     * `overlapped`'s sectors before `req` (if it partly overlaps one), `req`, then
+     * `overlapped`'s sectors after it, as one request. Completing it completes `req`,
+     * `overlapped` and the `absorbed` writes `req` covers entirely, so none of them is
+     * done before their data is on disk. None if that takes more segments than a
+     * request holds or this CPU has no free MergedReq.
+     */
+    fn merge_writes(
+        &self,
+        sched_cpu: *mut SchedCpu,
+        req: &mut BlkRequest,
+        overlapped: *mut BlkRequest,
+        absorbed: &[*mut BlkRequest]
+    ) -> Option<*mut BlkRequest> {
+        let (start, end): (u64, u64) = sector_range(req);
+        let merged: &mut MergedReq = match alloc_merged(sched_cpu) {
+            Some(merged) => merged,
+            None => { return None; }
+        };
+        let fits: bool = if overlapped.is_null() {
+            merged.req = BlkRequest::new(BlkOp::Write, start);
+            add_segment_range(&mut merged.req, req, 0, req.data_len())
+        } else {
+            let overlapped_ref: &BlkRequest = unsafe { &*overlapped };
+            let (overlapped_start, overlapped_end): (u64, u64) = sector_range(overlapped_ref);
+            merged.req = BlkRequest::new(BlkOp::Write, core::cmp::min(overlapped_start, start));
+            let head_len: usize = (start.saturating_sub(overlapped_start) as usize) * SECTOR_LEN;
+            let tail_offset: usize = ((end - overlapped_start) as usize) * SECTOR_LEN;
+            add_segment_range(&mut merged.req, overlapped_ref, 0, head_len) &&
+            add_segment_range(&mut merged.req, req, 0, req.data_len()) &&
+            (end >= overlapped_end || add_segment_range(&mut merged.req, overlapped_ref, tail_offset, overlapped_ref.data_len()))
+        };
+        if !fits {
+            merged.in_use.store(false, Ordering::Release);
+            return None;
+        }
+        merged.children[..absorbed.len()].copy_from_slice(absorbed);
+        let mut num_children: usize = absorbed.len();
+        if !overlapped.is_null() {
+            merged.children[num_children] = overlapped;
+            num_children += 1;
+        }
+        merged.children[num_children] = req as *mut BlkRequest;
+        merged.num_children = num_children + 1;
+        merged.req.on_complete = Some(merged_complete);
+        merged.req.ctx = merged as *mut MergedReq as usize;
+        return Some(&raw mut merged.req);
+    }
+
+    // Hand `req` to the device (which reaps to make room if its queue is full).
+    fn dispatch(&self, req: &mut BlkRequest) {
+        if let Err(e) = self.device().submit(req) {
+            req.finish(Err(e));
+        }
+    }
+}
+
+// The unplug timer, on the CPU whose plug it was armed for (in IRQ context).
+fn plug_expired(scheduler_arg: usize) {
+    let scheduler: &BlkScheduler = unsafe { &*(scheduler_arg as *const BlkScheduler) };
+    let aged: bool = {
+        let plug = scheduler.my_cpu().plug.lock_irqsave();
+        plug.num_reqs > 0 && counter_ticks().wrapping_sub(plug.first_ticks) >= scheduler.unplug_ticks
+    };
+    if aged {
+        scheduler.unplug_cpu(UnplugReason::Time);
+    }
+}
+
+fn alloc_merged(sched_cpu: *mut SchedCpu) -> Option<&'static mut MergedReq> {
+    for pool_idx in 0..MERGED_POOL_LEN {
+        let candidate: *mut MergedReq = unsafe { &raw mut (*sched_cpu).pool[pool_idx] };
+        if unsafe { (*candidate).in_use.compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed).is_ok() } {
+            return Some(unsafe { &mut *candidate });
+        }
+    }
+    return None;
+}
+
+// Add the segments covering bytes lo..hi of `src`'s data to `dst`. False if they don't fit.
+fn add_segment_range(dst: &mut BlkRequest, src: &BlkRequest, lo: usize, hi: usize) -> bool {
+    let mut offset: usize = 0;
+    for seg in &src.segs[..src.num_segs] {
+        let seg_lo: usize = core::cmp::max(offset, lo);
+        let seg_hi: usize = core::cmp::min(offset + seg.len as usize, hi);
+        if seg_lo < seg_hi && dst.add_segment(seg.pa + (seg_lo - offset) as u64, (seg_hi - seg_lo) as u32).is_err() {
+            return false;
+        }
+        offset += seg.len as usize;
+    }
+    return true;
+}
+
+fn merged_complete(req: &mut BlkRequest) {
+    let merged: &mut MergedReq = unsafe { &mut *(req.ctx as *mut MergedReq) };
+    for &child in &merged.children[..merged.num_children] {
+        unsafe { (*child).finish(merged.req.result()); }
+    }
+    merged.in_use.store(false, Ordering::Release);
+}
+
+#[inline(always)]
+fn sector_range(req: &BlkRequest) -> (u64, u64) {
+    return (req.sector, req.sector + (req.data_len() / SECTOR_LEN) as u64);
+}
+
+#[inline(always)]
+fn sort_key(req: *mut BlkRequest) -> (u32, u64) {
+    unsafe { ((*req).op as u32, (*req).sector) }
+}
@@ -0,0 +1,90 @@
+use core::fmt;
+use core::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use super::pl011_uart;
+use super::virtio::console::{console_write_str, console_try_flush};
+use super::timer::{counter_ticks, ticks_to_ns};
+
+/*
+ * Where kernel output ends up (log.rs decides when). Once a virtio-console has probed,
+ * output is batched through it; before that (early boot) it goes to the PL011's TX
+ * ring, and for good once something panics, byte by byte straight into the PL011's
+ * FIFO, which needs nothing but its MMIO registers.
+ */
+static PANIC_MODE: AtomicBool = AtomicBool::new(false);
+
+#[repr(usize)]
+#[derive(Copy, Clone, PartialEq, Debug)]
+pub enum ConsoleBackend {
+    PL011      = 0,
+    VirtIOCons = 1
+}
+pub const CONSOLE_BACKENDS: [ConsoleBackend; 2] = [ConsoleBackend::PL011, ConsoleBackend::VirtIOCons];
+
+// Cost of the output path per backend, as seen by the CPU doing the printing.
+#[derive(Copy, Clone, Default)]
+pub struct ConsoleBackendStats {
+    pub bytes   : u64,
+    pub lines   : u64,
+    pub busy_ns : u64
+}
+
+struct BackendCounters {
+    bytes       : AtomicU64,
+    lines       : AtomicU64,
+    busy_ticks  : AtomicU64
+} impl BackendCounters {
+    const fn new() -> Self {
+        return Self { bytes: AtomicU64::new(0), lines: AtomicU64::new(0), busy_ticks: AtomicU64::new(0) };
+    }
+}
+
+static BACKEND_COUNTERS: [BackendCounters; CONSOLE_BACKENDS.len()] = [BackendCounters::new(), BackendCounters::new()];
+
+pub fn backend_stats(backend: ConsoleBackend) -> ConsoleBackendStats {
+    let counters: &BackendCounters = &BACKEND_COUNTERS[backend as usize];
+    return ConsoleBackendStats {
+        bytes: counters.bytes.load(Ordering::Relaxed),
+        lines: counters.lines.load(Ordering::Relaxed),
+        busy_ns: ticks_to_ns(counters.busy_ticks.load(Ordering::Relaxed))
+    };
+}
+
+// Route everything to the PL011 from now on, after a last try at getting queued virtio-console text out.
+pub fn enter_panic_mode() {
+    if !PANIC_MODE.swap(true, Ordering::AcqRel) {
+        console_try_flush();
+    }
+}
+
+#[inline(always)]
+pub fn in_panic_mode() -> bool {
+    return PANIC_MODE.load(Ordering::Acquire);
+}
+
+pub fn write_str(s: &str) {
+    let start_ticks: u64 = counter_ticks();
+    let panicking: bool = PANIC_MODE.load(Ordering::Acquire);
+    let backend: ConsoleBackend =
+        if !panicking && console_write_str(s) {
+            ConsoleBackend::VirtIOCons
+        } else {
+            if panicking { pl011_uart::write_str_polled(s); } else { pl011_uart::write_str(s); }
+            ConsoleBackend::PL011
+        };
+    let counters: &BackendCounters = &BACKEND_COUNTERS[backend as usize];
+    counters.busy_ticks.fetch_add(counter_ticks().wrapping_sub(start_ticks), Ordering::Relaxed);
+    counters.bytes.fetch_add(s.len() as u64, Ordering::Relaxed);
+    let lines: usize = s.bytes().filter(|&b| b == b'\n').count();
+    if lines > 0 {
+        counters.lines.fetch_add(lines as u64, Ordering::Relaxed);
+    }
+}
+
+pub struct ConsoleWriter;
+
+impl fmt::Write for ConsoleWriter {
+    fn write_str(&mut self, s: &str) -> fmt::Result {
+        write_str(s);
+        return Ok(());
+    }
+}
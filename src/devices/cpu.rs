@@ -0,0 +1,331 @@
+use super::*;
+use core::sync::atomic::{AtomicUsize, Ordering};
+use memory::{kernel_tcr_el1, ppm::*, ptm::*, PAGE_LEN};
+use crate::exceptions;
+
+pub const MAX_CPUS: usize = 8;
+
+// SMCCC/PSCI 0.2+ function IDs (64-bit calling convention).
+const PSCI_FN64_CPU_ON: u64 = 0xC400_0003;
+const PSCI_FN_SYSTEM_OFF: u64 = 0x8400_0008;
+const PSCI_SUCCESS: i64 = 0;
+const PSCI_ALREADY_ON: i64 = -4;
+
+// MPIDR_EL1.{Aff3, Aff2, Aff1, Aff0}; the DTB cpu@ "reg" uses the same encoding.
+const MPIDR_AFFINITY_MASK: u64 = 0xff_00ff_ffff;
+
+// How long the boot CPU waits on a secondary to check in before giving up on it.
+const CPU_ON_TIMEOUT_SPINS: usize = 1 << 24;
+
+pub enum CPUError {
+    CPUsNodeNotFound,
+    GetRegFailed(FDTError),
+    PSCINodeNotFound,
+    UnsupportedPSCIMethod,
+    BootCPUNotFound,
+    GetStackPageFailed(PPMError),
+    PSCICPUOnFailed(i64),
+    InvalidCPUIdx,
+    CPUOffline,
+    CPUBusy
+}
+
+#[derive(Copy, Clone, PartialEq)]
+enum PSCIConduit {
+    None,
+    HVC,
+    SMC
+}
+
+// Read by _secondary_start in entry.S with the MMU still off, so keep it #[repr(C)]
+// and keep the field order in sync with the ldp/ldr offsets over there.
+#[repr(C)]
+#[derive(Copy, Clone)]
+struct SecondaryBootArgs {
+    ttbr0_el1 : u64,
+    ttbr1_el1 : u64,
+    tcr_el1   : u64,
+    sp        : u64,
+    cpu_idx   : u64
+} impl SecondaryBootArgs {
+    const fn zeroed() -> Self {
+        return Self { ttbr0_el1: 0, ttbr1_el1: 0, tcr_el1: 0, sp: 0, cpu_idx: 0 };
+    }
+}
+
+static mut NUM_CPUS: usize = 0;
+static mut CPU_MPIDRS: [u64; MAX_CPUS] = [0; MAX_CPUS];
+static mut PSCI_CONDUIT: PSCIConduit = PSCIConduit::None;
+static mut SECONDARY_BOOT_ARGS: [SecondaryBootArgs; MAX_CPUS] = [SecondaryBootArgs::zeroed(); MAX_CPUS];
+static BOOT_CPU_IDX: AtomicUsize = AtomicUsize::new(0);
+// Bitmask of logical CPU indices that have made it into Rust.
+static CPUS_ONLINE: AtomicUsize = AtomicUsize::new(0);
+// Single-slot mailbox per CPU: a fn(usize) pointer and its argument. 0 == idle.
+static CPU_WORK_FN: [AtomicUsize; MAX_CPUS] = [const { AtomicUsize::new(0) }; MAX_CPUS];
+static CPU_WORK_ARG: [AtomicUsize; MAX_CPUS] = [const { AtomicUsize::new(0) }; MAX_CPUS];
+
+unsafe extern "C" {
+    fn _secondary_start();
+}
+
+// Logical CPU index, stashed in TPIDR_EL1 by init_cpus()/_secondary_start.
+#[inline(always)]
+pub fn cpu_id() -> usize {
+    let idx: u64;
+    unsafe { asm!("mrs {}, tpidr_el1", out(reg) idx, options(nomem, nostack, preserves_flags)); }
+    return idx as usize;
+}
+
+#[inline(always)]
+pub fn cpu_mpidr(cpu_idx: usize) -> u64 {
+    unsafe { CPU_MPIDRS[cpu_idx] }
+}
+
+#[inline(always)]
+pub fn num_cpus() -> usize {
+    unsafe { if NUM_CPUS == 0 { 1 } else { NUM_CPUS } }
+}
+
+#[inline(always)]
+pub fn cpu_is_online(cpu_idx: usize) -> bool {
+    return CPUS_ONLINE.load(Ordering::Acquire) & (1 << cpu_idx) != 0;
+}
+
+pub fn num_cpus_online() -> usize {
+    return CPUS_ONLINE.load(Ordering::Acquire).count_ones() as usize;
+}
+
+/*
+ * Discover the CPUs in /cpus and the PSCI conduit used to power them on.
+ * Logical CPU indices follow DTB order. The boot CPU gets whichever index 
+ * matches its MPIDR_EL1, which is written to TPIDR_EL1 so cpu_id() works
+ * before any secondary is started.
+ */
+pub fn init_cpus() -> Result<(), CPUError> {
+    let cpus_node: &'static DTNode = match dt_index::dt_root().and_then(
+        |root| root.children().find(|node| node.name() == "cpus")
+    ) {
+        Some(cpus_node) => cpus_node,
+        None => { return Err(CPUError::CPUsNodeNotFound); }
+    };
+
+    let mut num_cpus: usize = 0;
+    for node in cpus_node.children() {
+        let name: &str = node.name();
+        if !name.starts_with("cpu@") {
+            continue;
+        }
+        if num_cpus >= MAX_CPUS {
+            println!("init_cpus(): ignoring {} (MAX_CPUS is {})", name, MAX_CPUS);
+            continue;
+        }
+        // Decoded with /cpus' own cell sizes (#address-cells = <1>, #size-cells = <0>
+        // on QEMU), so the address is the affinity.
+        match node.get_reg() {
+            Ok((mpidr, _)) => unsafe {
+                CPU_MPIDRS[num_cpus] = mpidr & MPIDR_AFFINITY_MASK;
+            },
+            Err(e) => { return Err(CPUError::GetRegFailed(e)); }
+        }
+        num_cpus += 1;
+    }
+
+    // Every PSCI binding lists plain "arm,psci" last.
+    if let Some(psci_node) = dt_index::dt_find_compatible(b"arm,psci") {
+        unsafe {
+            PSCI_CONDUIT = match psci_node.get_property_bytes(b"method\0") {
+                Ok(method) if method.starts_with(b"hvc") => PSCIConduit::HVC,
+                Ok(method) if method.starts_with(b"smc") => PSCIConduit::SMC,
+                _ => PSCIConduit::None
+            };
+        }
+    }
+
+    let my_mpidr: u64 = read_mpidr() & MPIDR_AFFINITY_MASK;
+    unsafe {
+        NUM_CPUS = num_cpus;
+        for cpu_idx in 0..num_cpus {
+            if CPU_MPIDRS[cpu_idx] == my_mpidr {
+                asm!("msr tpidr_el1, {}", in(reg) cpu_idx as u64, options(nomem, nostack, preserves_flags));
+                BOOT_CPU_IDX.store(cpu_idx, Ordering::Relaxed);
+                CPUS_ONLINE.fetch_or(1 << cpu_idx, Ordering::Release);
+                return Ok(());
+            }
+        }
+    }
+    return Err(CPUError::BootCPUNotFound);
+}
+
+/*
+ * Power on every secondary CPU through PSCI CPU_ON. Each one gets a PPM page as its
+ * stack and enters _secondary_start with the MMU off, turns it on with the boot CPU's
+ * translation tables, and then parks in secondary_main() waiting for work.
+ */
+pub fn start_secondary_cpus() -> Result<(), CPUError> {
+    unsafe {
+        if NUM_CPUS <= 1 {
+            return Ok(());
+        }
+        if PSCI_CONDUIT == PSCIConduit::None {
+            return Err(CPUError::PSCINodeNotFound);
+        }
+
+        let my_cpu_idx: usize = cpu_id();
+        for cpu_idx in 0..NUM_CPUS {
+            if cpu_idx == my_cpu_idx {
+                continue;
+            }
+
+            let stack_pa: *const u8 = match get_free_page(false) {
+                Ok(stack_pa) => stack_pa,
+                Err(e) => { return Err(CPUError::GetStackPageFailed(e)); }
+            };
+            let boot_args: *mut SecondaryBootArgs = (&raw mut SECONDARY_BOOT_ARGS[cpu_idx]) as *mut SecondaryBootArgs;
+            *boot_args = SecondaryBootArgs {
+                ttbr0_el1 : get_kernel_root_table_0() as *const _ as u64,
+                ttbr1_el1 : get_kernel_root_table_1() as *const _ as u64,
+                tcr_el1   : u64::from_le_bytes(kernel_tcr_el1().into_bytes()),
+                // Stacks grow down, so start at the end of the page.
+                sp        : (page_pa_to_kva(stack_pa) as u64) + PAGE_LEN as u64,
+                cpu_idx   : cpu_idx as u64
+            };
+            // The secondary reads these with its MMU (and so its data cache) off, straight
+            // from memory: push them out of ours first.
+            clean_dcache_to_poc(boot_args as usize, size_of::<SecondaryBootArgs>());
+
+            // .bss is identity mapped, so the VA of boot_args is also its PA.
+            let psci_ret: i64 = psci_call(
+                PSCI_FN64_CPU_ON,
+                CPU_MPIDRS[cpu_idx],
+                _secondary_start as usize as u64,
+                boot_args as u64
+            );
+            if psci_ret != PSCI_SUCCESS && psci_ret != PSCI_ALREADY_ON {
+                return Err(CPUError::PSCICPUOnFailed(psci_ret));
+            }
+
+            let mut spins: usize = 0;
+            while !cpu_is_online(cpu_idx) && spins < CPU_ON_TIMEOUT_SPINS {
+                core::hint::spin_loop();
+                spins += 1;
+            }
+            if !cpu_is_online(cpu_idx) {
+                println!("start_secondary_cpus(): CPU {} never came online!", cpu_idx);
+            }
+        }
+        return Ok(());
+    }
+}
+
+/*
+ * Hand `work(arg)` to a parked secondary CPU. Fails with CPUBusy if that CPU is still
+ * running the last thing it was given (or is the boot CPU); use wait_for_cpu() to join it.
+ */
+pub fn run_on_cpu(cpu_idx: usize, work: fn(usize), arg: usize) -> Result<(), CPUError> {
+    if cpu_idx >= num_cpus() {
+        return Err(CPUError::InvalidCPUIdx);
+    }
+    if !cpu_is_online(cpu_idx) {
+        return Err(CPUError::CPUOffline);
+    }
+    // It never parks in secondary_main(), so nothing would ever pick the work up.
+    if cpu_idx == BOOT_CPU_IDX.load(Ordering::Relaxed) {
+        return Err(CPUError::CPUBusy);
+    }
+    if CPU_WORK_FN[cpu_idx].load(Ordering::Acquire) != 0 {
+        return Err(CPUError::CPUBusy);
+    }
+    CPU_WORK_ARG[cpu_idx].store(arg, Ordering::Relaxed);
+    CPU_WORK_FN[cpu_idx].store(work as usize, Ordering::Release);
+    unsafe { asm!("sev", options(nomem, nostack, preserves_flags)); }
+    return Ok(());
+}
+
+pub fn wait_for_cpu(cpu_idx: usize) {
+    while CPU_WORK_FN[cpu_idx].load(Ordering::Acquire) != 0 {
+        core::hint::spin_loop();
+    }
+}
+
+// PSCI SYSTEM_OFF: QEMU exits. Spins if there's no PSCI to ask.
+pub fn system_off() -> ! {
+    unsafe { psci_call(PSCI_FN_SYSTEM_OFF, 0, 0, 0); }
+    loop {
+        unsafe { asm!("wfe", options(nomem, nostack, preserves_flags)); }
+    }
+}
+
+#[unsafe(no_mangle)]
+pub extern "C" fn secondary_main(cpu_idx: usize) -> ! {
+    exceptions::init_exceptions();
+    if gic::gic_is_initialized() {
+        if let Err(_e) = gic::init_gic_cpu() {
+            println!("secondary_main(): CPU {} GIC init failed!", cpu_idx);
+        }
+    }
+    exceptions::enable_irqs();
+    CPUS_ONLINE.fetch_or(1 << cpu_idx, Ordering::Release);
+    loop {
+        let work: usize = CPU_WORK_FN[cpu_idx].load(Ordering::Acquire);
+        if work != 0 {
+            let work: fn(usize) = unsafe { core::mem::transmute::<usize, fn(usize)>(work) };
+            work(CPU_WORK_ARG[cpu_idx].load(Ordering::Relaxed));
+            CPU_WORK_FN[cpu_idx].store(0, Ordering::Release);
+            unsafe { asm!("sev", options(nomem, nostack, preserves_flags)); }
+        } else {
+            unsafe { asm!("wfe", options(nomem, nostack, preserves_flags)); }
+        }
+    }
+}
+
+// dc cvac over [va, va + len), then wait for it to land.
+fn clean_dcache_to_poc(va: usize, len: usize) {
+    let ctr: u64;
+    unsafe { asm!("mrs {}, ctr_el0", out(reg) ctr, options(nomem, nostack, preserves_flags)); }
+    // CTR_EL0.DminLine: log2 of the smallest data cache line, in 4-byte words.
+    let line_len: usize = 4 << ((ctr >> 16) & 0xf);
+    let mut line: usize = va & !(line_len - 1);
+    while line < va + len {
+        unsafe { asm!("dc cvac, {}", in(reg) line, options(nostack, preserves_flags)); }
+        line += line_len;
+    }
+    unsafe { dsb(SBType::Sy); }
+}
+
+#[inline(always)]
+fn read_mpidr() -> u64 {
+    let mpidr: u64;
+    unsafe { asm!("mrs {}, mpidr_el1", out(reg) mpidr, options(nomem, nostack, preserves_flags)); }
+    return mpidr;
+}
+
+// SMCCC: x0 = function ID, x1..x3 = args, result in x0, x4..x17 may be clobbered.
+unsafe fn psci_call(fn_id: u64, arg0: u64, arg1: u64, arg2: u64) -> i64 {
+    let ret: i64;
+    unsafe {
+        match PSCI_CONDUIT {
+            PSCIConduit::HVC => asm!(
+                "hvc #0",
+                inlateout("x0") fn_id as i64 => ret,
+                in("x1") arg0, in("x2") arg1, in("x3") arg2,
+                lateout("x4") _, lateout("x5") _, lateout("x6") _, lateout("x7") _,
+                lateout("x8") _, lateout("x9") _, lateout("x10") _, lateout("x11") _,
+                lateout("x12") _, lateout("x13") _, lateout("x14") _, lateout("x15") _,
+                lateout("x16") _, lateout("x17") _,
+                options(nostack)
+            ),
+            PSCIConduit::SMC => asm!(
+                "smc #0",
+                inlateout("x0") fn_id as i64 => ret,
+                in("x1") arg0, in("x2") arg1, in("x3") arg2,
+                lateout("x4") _, lateout("x5") _, lateout("x6") _, lateout("x7") _,
+                lateout("x8") _, lateout("x9") _, lateout("x10") _, lateout("x11") _,
+                lateout("x12") _, lateout("x13") _, lateout("x14") _, lateout("x15") _,
+                lateout("x16") _, lateout("x17") _,
+                options(nostack)
+            ),
+            PSCIConduit::None => { ret = -1; }
+        }
+    }
+    return ret;
+}
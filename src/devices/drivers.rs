@@ -0,0 +1,261 @@
+use super::*;
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use crate::sync::SpinLock;
+use cpu::{cpu_id, num_cpus, run_on_cpu, wait_for_cpu, MAX_CPUS};
+use dt_index::{dt_nodes, DTNode};
+use memory::arena::boot_arena_alloc_slice;
+
+/*
+ * Drivers register themselves with register_driver!, which drops a DriverEntry into
+ * the .jerry_drivers section; link.lds gathers them all between _jerry_drivers_start
+ * and _jerry_drivers_end, so adding a driver doesn't mean touching a central match.
+ * probe_devices() walks the DT index once, binding each node to the driver for the
+ * most specific of its compatible strings, then probes the bindings in priority order
+ * (DTB order within a priority).
+ *
+ * Priorities double as dependencies: every probe of one priority is finished (and
+ * joined) before the next priority starts, so e.g. every virtio device can count on the
+ * GIC being up. Within a priority, Serial drivers are probed first on the boot CPU, then
+ * Parallel ones are pulled off a shared index by every online CPU at once. A Parallel
+ * driver's probe must only touch shared state under a lock (the PPM, the page tables,
+ * the GIC's config registers and the virtio registries all are).
+ */
+
+// Lower probes first.
+pub const DRIVER_PRIORITY_IRQCHIP: u32 = 0;
+pub const DRIVER_PRIORITY_CONSOLE: u32 = 10;
+pub const DRIVER_PRIORITY_TIMER: u32 = 20;
+pub const DRIVER_PRIORITY_DEFAULT: u32 = 100;
+
+#[derive(Copy, Clone, PartialEq, Debug)]
+pub enum ProbeMode {
+    Serial,
+    Parallel
+}
+
+pub type DriverProbeFn = fn(node: &'static DTNode) -> Result<(), DeviceInitError>;
+
+pub struct DriverStats {
+    pub probes      : AtomicU64,
+    pub failures    : AtomicU64,
+    pub probe_ticks : AtomicU64
+} impl DriverStats {
+    pub const fn new() -> Self {
+        return Self { probes: AtomicU64::new(0), failures: AtomicU64::new(0), probe_ticks: AtomicU64::new(0) };
+    }
+}
+
+#[repr(C)]
+pub struct DriverEntry {
+    pub name       : &'static str,
+    // Without the NUL.
+    pub compatible : &'static [u8],
+    pub priority   : u32,
+    pub mode       : ProbeMode,
+    pub probe      : DriverProbeFn,
+    pub stats      : &'static DriverStats
+}
+
+#[derive(Copy, Clone)]
+struct DriverBinding {
+    node   : u16,
+    driver : u16
+}
+
+// One priority's bindings, shared with the CPUs helping probe them. Lives on the boot
+// CPU's stack; everyone is joined before it goes away.
+struct ProbeWave {
+    drivers  : &'static [DriverEntry],
+    nodes    : &'static [DTNode],
+    bindings : *const DriverBinding,
+    len      : usize,
+    next     : AtomicUsize,
+    error    : SpinLock<Option<DeviceInitError>>
+}
+
+#[derive(Copy, Clone, Default)]
+pub struct ProbeStats {
+    pub waves           : u64,
+    pub parallel_probes : u64,
+    // Most CPUs that ever worked on one wave.
+    pub max_cpus        : u64,
+    pub ticks           : u64
+}
+
+static PROBE_WAVES: AtomicU64 = AtomicU64::new(0);
+static PARALLEL_PROBES: AtomicU64 = AtomicU64::new(0);
+static PROBE_MAX_CPUS: AtomicU64 = AtomicU64::new(0);
+static PROBE_TICKS: AtomicU64 = AtomicU64::new(0);
+
+unsafe extern "C" {
+    static _jerry_drivers_start: u8;
+    static _jerry_drivers_end: u8;
+}
+
+pub fn registered_drivers() -> &'static [DriverEntry] {
+    unsafe {
+        let start: *const DriverEntry = &raw const _jerry_drivers_start as *const DriverEntry;
+        let end: *const DriverEntry = &raw const _jerry_drivers_end as *const DriverEntry;
+        return slice::from_raw_parts(start, end.offset_from(start) as usize);
+    }
+}
+
+fn find_driver(drivers: &[DriverEntry], node: &DTNode) -> Option<usize> {
+    for compatible in node.compatible().split(|&b| b == 0).filter(|c| !c.is_empty()) {
+        if let Some(driver_idx) = drivers.iter().position(|driver| driver.compatible == compatible) {
+            return Some(driver_idx);
+        }
+    }
+    return None;
+}
+
+pub fn probe_devices() -> Result<(), DeviceInitError> {
+    let start_ticks: u64 = timer::counter_ticks();
+    let drivers: &'static [DriverEntry] = registered_drivers();
+    let nodes: &'static [DTNode] = dt_nodes();
+
+    // At most one binding a node; only needed until every wave is probed.
+    let bindings: &mut [DriverBinding] = match boot_arena_alloc_slice::<DriverBinding>(nodes.len()) {
+        Ok(bindings) => bindings,
+        Err(e) => { return Err(DeviceInitError::AllocProbeScratchFailed(e)); }
+    };
+    let mut num_bindings: usize = 0;
+    for (node_idx, node) in nodes.iter().enumerate() {
+        if let Some(driver_idx) = find_driver(drivers, node) {
+            bindings[num_bindings] = DriverBinding { node: node_idx as u16, driver: driver_idx as u16 };
+            num_bindings += 1;
+        }
+    }
+    // Insertion sort (stable, no alloc), so devices of one priority keep their DTB order.
+    for i in 1..num_bindings {
+        let mut j: usize = i;
+        while j > 0 && drivers[bindings[j - 1].driver as usize].priority > drivers[bindings[j].driver as usize].priority {
+            bindings.swap(j - 1, j);
+            j -= 1;
+        }
+    }
+
+    let mut wave_start: usize = 0;
+    while wave_start < num_bindings {
+        let priority: u32 = drivers[bindings[wave_start].driver as usize].priority;
+        let mut wave_end: usize = wave_start;
+        while wave_end < num_bindings && drivers[bindings[wave_end].driver as usize].priority == priority {
+            wave_end += 1;
+        }
+        let wave_bindings: &[DriverBinding] = &bindings[wave_start..wave_end];
+        for binding in wave_bindings {
+            if drivers[binding.driver as usize].mode == ProbeMode::Serial {
+                if let Err(e) = probe_binding(drivers, nodes, binding) {
+                    return Err(e);
+                }
+            }
+        }
+        if wave_bindings.iter().any(|binding| drivers[binding.driver as usize].mode == ProbeMode::Parallel) {
+            if let Err(e) = probe_wave_parallel(drivers, nodes, wave_bindings) {
+                return Err(e);
+            }
+        }
+        PROBE_WAVES.fetch_add(1, Ordering::Relaxed);
+        wave_start = wave_end;
+    }
+    PROBE_TICKS.fetch_add(timer::counter_ticks() - start_ticks, Ordering::Relaxed);
+    // Last chance to time the DT index's boot-only lookups (outside probe_us).
+    #[cfg(feature = "bench")]
+    crate::bench::after_probe();
+    return Ok(());
+}
+
+fn probe_binding(drivers: &[DriverEntry], nodes: &'static [DTNode], binding: &DriverBinding) -> Result<(), DeviceInitError> {
+    let driver: &DriverEntry = &drivers[binding.driver as usize];
+    let start_ticks: u64 = timer::counter_ticks();
+    let result: Result<(), DeviceInitError> = (driver.probe)(&nodes[binding.node as usize]);
+    driver.stats.probe_ticks.fetch_add(timer::counter_ticks() - start_ticks, Ordering::Relaxed);
+    driver.stats.probes.fetch_add(1, Ordering::Relaxed);
+    if result.is_err() {
+        driver.stats.failures.fetch_add(1, Ordering::Relaxed);
+    }
+    return result;
+}
+
+fn probe_wave_parallel(drivers: &'static [DriverEntry], nodes: &'static [DTNode], bindings: &[DriverBinding]) -> Result<(), DeviceInitError> {
+    let wave: ProbeWave = ProbeWave {
+        drivers: drivers,
+        nodes: nodes,
+        bindings: bindings.as_ptr(),
+        len: bindings.len(),
+        next: AtomicUsize::new(0),
+        error: SpinLock::new(None)
+    };
+    let wave_arg: usize = &wave as *const ProbeWave as usize;
+    let my_cpu_idx: usize = cpu_id();
+    let mut helpers: [bool; MAX_CPUS] = [false; MAX_CPUS];
+    let mut num_workers: u64 = 1;
+    for cpu_idx in 0..num_cpus() {
+        if cpu_idx != my_cpu_idx && run_on_cpu(cpu_idx, probe_worker, wave_arg).is_ok() {
+            helpers[cpu_idx] = true;
+            num_workers += 1;
+        }
+    }
+    probe_worker(wave_arg);
+    for cpu_idx in 0..num_cpus() {
+        if helpers[cpu_idx] {
+            wait_for_cpu(cpu_idx);
+        }
+    }
+    PROBE_MAX_CPUS.fetch_max(num_workers, Ordering::Relaxed);
+
+    match wave.error.lock().take() {
+        Some(e) => { return Err(e); },
+        None => { return Ok(()); }
+    }
+}
+
+// Runs on every CPU helping with a wave, the boot CPU included.
+fn probe_worker(wave_arg: usize) {
+    let wave: &ProbeWave = unsafe { &*(wave_arg as *const ProbeWave) };
+    loop {
+        let binding_idx: usize = wave.next.fetch_add(1, Ordering::Relaxed);
+        if binding_idx >= wave.len {
+            return;
+        }
+        let binding: &DriverBinding = unsafe { &*wave.bindings.add(binding_idx) };
+        if wave.drivers[binding.driver as usize].mode != ProbeMode::Parallel {
+            continue;
+        }
+        PARALLEL_PROBES.fetch_add(1, Ordering::Relaxed);
+        if let Err(e) = probe_binding(wave.drivers, wave.nodes, binding) {
+            let mut error = wave.error.lock();
+            if error.is_none() {
+                *error = Some(e);
+            }
+        }
+    }
+}
+
+pub fn probe_stats() -> ProbeStats {
+    return ProbeStats {
+        waves: PROBE_WAVES.load(Ordering::Relaxed),
+        parallel_probes: PARALLEL_PROBES.load(Ordering::Relaxed),
+        max_cpus: PROBE_MAX_CPUS.load(Ordering::Relaxed),
+        ticks: PROBE_TICKS.load(Ordering::Relaxed)
+    };
+}
+
+#[macro_export]
+macro_rules! register_driver {
+    ($entry:ident, $name:literal, $compatible:literal, $priority:expr, $mode:ident, $probe:path) => {
+        #[used]
+        #[unsafe(link_section = ".jerry_drivers")]
+        static $entry: $crate::devices::drivers::DriverEntry = $crate::devices::drivers::DriverEntry {
+            name: $name,
+            compatible: $compatible,
+            priority: $priority,
+            mode: $crate::devices::drivers::ProbeMode::$mode,
+            probe: $probe,
+            stats: {
+                static STATS: $crate::devices::drivers::DriverStats = $crate::devices::drivers::DriverStats::new();
+                &STATS
+            }
+        };
+    };
+}
@@ -0,0 +1,799 @@
+use super::*;
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use alloc::alloc::{alloc, Layout};
+use memory::{arena::{boot_arena_alloc_as, boot_arena_alloc_slice, ArenaError}, PAGE_LEN};
+
+/*
+ * The device tree, indexed once at boot. Walking the DTB through libfdt means every
+ * get_name()/get_property()/get_reg() re-scans the node's properties, comparing names
+ * against the strings block, and finding a device means doing that for every node.
+ * Instead, init_dt_index() makes one pass over the DTB (just after the PPM is up),
+ * reading each node's properties once, and builds:
+ *   - a flat DTNode array in DTB order, linked by parent/first-child/next-sibling index,
+ *   - each node's "reg" decoded with its parent's #address-cells/#size-cells and, where
+ *     its bus is mapped, translated through every "ranges" above it into CPU physical
+ *     addresses, and its "interrupts" split into specifiers as host-endian cells, by the
+ *     #interrupt-cells of its interrupt parent (found the way the DT spec says, 2.4.1),
+ *   - each node's "ranges" (child bus -> CPU physical, composed with its ancestors'),
+ *   - a phandle -> node hash, and a compatible string -> nodes hash (chained in DTB
+ *     order, so probing by compatible sees devices in the same order as a DTB walk).
+ * Everything is written once, before the secondary CPUs start, and only read after.
+ * The node table is sized by counting the DTB's nodes first (libfdt's subtree walk,
+ * which reads no properties) and can span pages; the cells go in page-sized tables,
+ * since how many there are isn't known until the walk. Both come out of the boot arena
+ * and are then copied into heap allocations of just the size used, which is what's kept. The two hashes are only for
+ * finding devices while init_devices() runs, so they stay in the boot arena and go away
+ * with it (see drop_dt_lookup_tables()).
+ */
+const DT_NONE: u16 = u16::MAX;
+const DT_MAX_DEPTH: usize = 16;
+const DT_MAX_REGS: usize = 448;
+const DT_MAX_RANGES: usize = 64;
+// Specifiers are as many cells as their controller says, so they're kept as one flat array.
+const DT_MAX_IRQ_CELLS: usize =
+    (PAGE_LEN - DT_MAX_REGS * size_of::<DTReg>() - DT_MAX_RANGES * size_of::<DTRange>())
+    / size_of::<u32>();
+// Open addressing; a power of two, kept at most half full.
+const DT_PHANDLE_SLOTS: usize = 512;
+const DT_COMPAT_BUCKETS: usize = 256;
+const DT_MAX_COMPATS: usize =
+    (PAGE_LEN - DT_PHANDLE_SLOTS * size_of::<DTPhandleSlot>() - DT_COMPAT_BUCKETS * size_of::<u16>())
+    / size_of::<DTCompatEntry>();
+// What a node's children use when it doesn't say (DT spec, 2.3.5).
+const DT_DEFAULT_ADDRESS_CELLS: u8 = 2;
+const DT_DEFAULT_SIZE_CELLS: u8 = 1;
+
+pub enum DTIndexError {
+    FDTItrNewFailed(FDTError),
+    GetNameFailed(FDTError),
+    AllocTableFailed,
+    AllocLookupTablesFailed(ArenaError),
+    AllocScratchFailed(ArenaError),
+    TooManyNodes,
+    TooManyRegs,
+    TooManyRanges,
+    TooManyIrqs,
+    TooManyCompatibles,
+    TooManyPhandles,
+    TooDeep
+}
+
+#[repr(C)]
+pub struct DTNode {
+    name_ptr        : *const u8,
+    compatible_ptr  : *const u8,
+    offset          : i32,
+    phandle         : u32,
+    name_len        : u16,
+    compatible_len  : u16,
+    parent          : u16,
+    first_child     : u16,
+    next_sibling    : u16,
+    reg_start       : u16,
+    // Into the flat irq cell array; irq_count specifiers of irq_parent's #interrupt-cells.
+    irq_start       : u16,
+    irq_parent      : u16,
+    reg_count       : u8,
+    irq_count       : u8,
+    // This node's own #interrupt-cells: 0 unless it's an interrupt controller (or nexus).
+    interrupt_cells : u8,
+    // The cell sizes this node's *children* use in their "reg".
+    address_cells   : u8,
+    size_cells      : u8,
+    // How this node's children's addresses reach the CPU.
+    child_bus       : DTBusMap,
+    // Whether "reg" was translated to CPU physical addresses (else it's as written).
+    reg_translated  : bool
+} unsafe impl Sync for DTNode {} impl DTNode {
+    pub fn name(&self) -> &'static str {
+        return unsafe { str::from_utf8_unchecked(slice::from_raw_parts(self.name_ptr, self.name_len as usize)) };
+    }
+
+    #[inline(always)] pub fn phandle(&self) -> u32 { self.phandle }
+    #[inline(always)] pub fn num_regs(&self) -> usize { self.reg_count as usize }
+    #[inline(always)] pub fn num_irqs(&self) -> usize { self.irq_count as usize }
+    #[inline(always)] pub fn interrupt_cells(&self) -> usize { self.interrupt_cells as usize }
+    #[inline(always)] pub fn address_cells(&self) -> usize { self.address_cells as usize }
+    #[inline(always)] pub fn size_cells(&self) -> usize { self.size_cells as usize }
+    #[inline(always)] pub fn reg_translated(&self) -> bool { self.reg_translated }
+
+    // The raw "compatible" list: NUL-terminated strings, most specific first.
+    pub fn compatible(&self) -> &'static [u8] {
+        if self.compatible_ptr.is_null() {
+            return &[];
+        }
+        return unsafe { slice::from_raw_parts(self.compatible_ptr, self.compatible_len as usize) };
+    }
+
+    pub fn is_compatible(&self, compatible: &[u8]) -> bool {
+        return self.compatible().split(|&b| b == 0).any(|entry| entry == compatible);
+    }
+
+    pub fn parent(&self) -> Option<&'static DTNode> {
+        return dt_node(self.parent);
+    }
+
+    // The controller this node's "interrupts" are for; None if it has none we could find.
+    pub fn interrupt_parent(&self) -> Option<&'static DTNode> {
+        return dt_node(self.irq_parent);
+    }
+
+    pub fn children(&self) -> DTChildItr {
+        return DTChildItr { next: self.first_child };
+    }
+
+    // Every (address, size) pair of "reg"; CPU physical if reg_translated().
+    pub fn regs(&self) -> &'static [DTReg] {
+        if self.reg_count == 0 {
+            return &[];
+        }
+        return &dt_tables().regs[self.reg_start as usize..][..self.reg_count as usize];
+    }
+
+    // A "ranges" this node's children sit behind, already composed with its ancestors'.
+    pub fn ranges(&self) -> &'static [DTRange] {
+        if self.child_bus.range_count == 0 {
+            return &[];
+        }
+        let bus: &DTBusMap = &self.child_bus;
+        return &dt_tables().ranges[bus.range_start as usize..][..bus.range_count as usize];
+    }
+
+    // An address on this node's child bus, as a CPU physical address.
+    pub fn translate_child_address(&self, bus_address: u64) -> Option<u64> {
+        return self.child_bus.translate(dt_tables().ranges, bus_address);
+    }
+
+    // The reg_idx'th (address, size) pair of "reg".
+    pub fn get_reg_idx(&self, reg_idx: usize) -> Result<(u64, u64), FDTError> {
+        if self.reg_count == 0 {
+            return Err(FDTError::NotFound);
+        }
+        if reg_idx >= self.reg_count as usize {
+            return Err(FDTError::UnexpectedRegFormat);
+        }
+        let reg: &DTReg = &dt_tables().regs[self.reg_start as usize + reg_idx];
+        return Ok((reg.address, reg.size));
+    }
+
+    pub fn get_reg(&self) -> Result<(u64, u64), FDTError> {
+        return self.get_reg_idx(0);
+    }
+
+    // The irq_idx'th "interrupts" specifier, interrupt_parent().interrupt_cells() long.
+    pub fn get_irq_cells(&self, irq_idx: usize) -> Option<&'static [u32]> {
+        if irq_idx >= self.irq_count as usize {
+            return None;
+        }
+        let spec_cells: usize = match self.interrupt_parent() {
+            Some(irq_parent) => irq_parent.interrupt_cells as usize,
+            None => { return None; }
+        };
+        return Some(&dt_tables().irqs[self.irq_start as usize + irq_idx * spec_cells..][..spec_cells]);
+    }
+
+    // Anything the index doesn't keep comes from the DTB, through libfdt.
+    pub fn get_property_bytes(&self, property_name: &[u8]) -> Result<&'static [u8], FDTError> {
+        return self.fdt_node().get_property_bytes(property_name);
+    }
+
+    pub fn fdt_node(&self) -> FDTNode {
+        return FDTNode::at_offset(self.offset);
+    }
+}
+
+#[repr(C)]
+pub struct DTReg {
+    pub address : u64,
+    pub size    : u64
+}
+
+#[repr(C)]
+pub struct DTRange {
+    pub child_address : u64,
+    pub cpu_address   : u64,
+    pub size          : u64
+}
+
+#[derive(Copy, Clone)]
+#[repr(C)]
+struct DTBusMap {
+    // Child addresses already are CPU addresses: the root's, or "ranges;" all the way up.
+    identity    : bool,
+    // Otherwise, these DTRanges (none: no "ranges", so the bus isn't mapped at all).
+    range_count : u8,
+    range_start : u16
+} impl DTBusMap {
+    const IDENTITY: Self = Self { identity: true, range_count: 0, range_start: 0 };
+    const UNMAPPED: Self = Self { identity: false, range_count: 0, range_start: 0 };
+
+    fn translate(&self, ranges: &[DTRange], bus_address: u64) -> Option<u64> {
+        if self.identity {
+            return Some(bus_address);
+        }
+        for range in &ranges[self.range_start as usize..][..self.range_count as usize] {
+            if bus_address >= range.child_address && bus_address - range.child_address < range.size {
+                return Some(range.cpu_address + (bus_address - range.child_address));
+            }
+        }
+        return None;
+    }
+}
+
+// What init_dt_index() builds the cells in, out of the boot arena (the nodes are a slice).
+#[repr(C)]
+struct DTCellTable {
+    regs   : [DTReg; DT_MAX_REGS],
+    ranges : [DTRange; DT_MAX_RANGES],
+    irqs   : [u32; DT_MAX_IRQ_CELLS]
+}
+
+// ...and what it keeps of them.
+struct DTTables {
+    nodes  : &'static [DTNode],
+    regs   : &'static [DTReg],
+    ranges : &'static [DTRange],
+    irqs   : &'static [u32]
+}
+
+// phandle 0 is never valid, so a zeroed slot is empty.
+#[repr(C)]
+struct DTPhandleSlot {
+    phandle : u32,
+    node    : u32
+}
+
+// next is an index into compat_entries plus one; 0 ends the chain.
+#[repr(C)]
+struct DTCompatEntry {
+    str_ptr : *const u8,
+    str_len : u16,
+    node    : u16,
+    next    : u16
+}
+
+#[repr(C)]
+struct DTHashTable {
+    phandles       : [DTPhandleSlot; DT_PHANDLE_SLOTS],
+    compat_buckets : [u16; DT_COMPAT_BUCKETS],
+    compat_entries : [DTCompatEntry; DT_MAX_COMPATS]
+}
+
+#[derive(Copy, Clone)]
+#[repr(C)]
+struct DTRawIrqs {
+    value_ptr : *const u8,
+    value_len : usize
+}
+
+/*
+ * What the walk leaves for decoding "interrupts" afterwards: an interrupt parent can be
+ * anywhere in the tree, so it may not have been seen yet. Only needed during
+ * init_dt_index(), so it comes out of the boot arena too.
+ */
+struct DTIrqScratch {
+    // Each node's own "interrupt-parent", 0 if it doesn't have one.
+    parent_phandles : &'static mut [u32],
+    raw_irqs        : &'static mut [DTRawIrqs]
+}
+
+#[derive(Copy, Clone)]
+pub struct DTIndexStats {
+    pub nodes             : usize,
+    pub regs              : usize,
+    // Nodes whose "reg" couldn't be translated to CPU addresses (e.g. /cpus' children).
+    pub untranslated_regs : usize,
+    pub ranges            : usize,
+    pub irqs              : usize,
+    // Nodes whose "interrupts" has no interrupt parent to decode it with, or doesn't fit it.
+    pub unresolved_irqs   : usize,
+    pub compatibles       : usize,
+    pub phandles          : usize,
+    // The heap the index keeps (the walk's page-sized tables were the boot arena's).
+    pub table_bytes       : usize,
+    pub build_ticks       : u64
+}
+
+static mut DT_TABLES: DTTables = DTTables { nodes: &[], regs: &[], ranges: &[], irqs: &[] };
+static mut DT_HASHES: *const DTHashTable = ptr::null();
+static mut DT_STATS: DTIndexStats = DTIndexStats {
+    nodes: 0, regs: 0, untranslated_regs: 0, ranges: 0, irqs: 0, unresolved_irqs: 0, compatibles: 0, phandles: 0,
+    table_bytes: 0, build_ticks: 0
+};
+// Set last; 0 until the index is usable.
+static DT_NUM_NODES: AtomicUsize = AtomicUsize::new(0);
+static DT_LOOKUP_TABLES_LIVE: AtomicBool = AtomicBool::new(false);
+
+#[inline(always)]
+fn be32(bytes: &[u8]) -> u32 {
+    return u32::from_be_bytes(bytes[..4].try_into().unwrap());
+}
+
+// A big-endian number of `cells` cells (at most 2).
+fn read_cells(bytes: &[u8], cells: usize) -> u64 {
+    let mut value: u64 = 0;
+    for cell in 0..cells {
+        value = (value << 32) | be32(&bytes[cell * 4..]) as u64;
+    }
+    return value;
+}
+
+// FNV-1a
+fn hash_bytes(bytes: &[u8]) -> u32 {
+    let mut hash: u32 = 0x811c_9dc5;
+    for &b in bytes {
+        hash = (hash ^ b as u32).wrapping_mul(0x0100_0193);
+    }
+    return hash;
+}
+
+#[inline(always)]
+fn phandle_slot(phandle: u32) -> usize {
+    return (phandle.wrapping_mul(0x9e37_79b1) >> 16) as usize & (DT_PHANDLE_SLOTS - 1);
+}
+
+fn lookup_phandle(phandles: &[DTPhandleSlot; DT_PHANDLE_SLOTS], phandle: u32) -> Option<u16> {
+    if phandle == 0 {
+        return None;
+    }
+    let mut slot: usize = phandle_slot(phandle);
+    while phandles[slot].phandle != 0 {
+        if phandles[slot].phandle == phandle {
+            return Some(phandles[slot].node as u16);
+        }
+        slot = (slot + 1) & (DT_PHANDLE_SLOTS - 1);
+    }
+    return None;
+}
+
+/*
+ * A node's interrupt parent is its "interrupt-parent" if it has one, else its tree parent;
+ * whichever that is, if it isn't an interrupt controller (no #interrupt-cells), carry on
+ * from it the same way. interrupt-map nexuses aren't followed: QEMU's virt doesn't use
+ * them outside PCI, whose children we don't index anyway.
+ */
+fn find_interrupt_parent(
+    nodes: &[DTNode], phandles: &[DTPhandleSlot; DT_PHANDLE_SLOTS],
+    parent_phandles: &[u32], node_idx: u16
+) -> Option<u16> {
+    let mut cur: u16 = node_idx;
+    // Every step lands on a different node unless the tree loops on itself.
+    for _ in 0..nodes.len() {
+        let next: u16 = match parent_phandles[cur as usize] {
+            0 => nodes[cur as usize].parent,
+            phandle => match lookup_phandle(phandles, phandle) {
+                Some(next) => next,
+                None => { return None; }
+            }
+        };
+        if next == DT_NONE {
+            return None;
+        }
+        if nodes[next as usize].interrupt_cells != 0 {
+            return Some(next);
+        }
+        cur = next;
+    }
+    return None;
+}
+
+// A heap copy of the part of a boot arena table the DTB used.
+fn keep_table<T>(used: &[T]) -> Result<&'static [T], DTIndexError> {
+    if used.is_empty() {
+        return Ok(&[]);
+    }
+    let table: *mut T = unsafe { alloc(Layout::for_value(used)) } as *mut T;
+    if table.is_null() {
+        return Err(DTIndexError::AllocTableFailed);
+    }
+    unsafe {
+        ptr::copy_nonoverlapping(used.as_ptr(), table, used.len());
+        return Ok(slice::from_raw_parts(table, used.len()));
+    }
+}
+
+pub fn init_dt_index() -> Result<(), DTIndexError> {
+    let start_ticks: u64 = timer::counter_ticks();
+    // The root plus everything below it. Node indices are u16s, DT_NONE included.
+    let max_nodes: usize = match FDTItr::new() {
+        Ok(fdt) => fdt.count() + 1,
+        Err(e) => { return Err(DTIndexError::FDTItrNewFailed(e)); }
+    };
+    if max_nodes >= DT_NONE as usize {
+        return Err(DTIndexError::TooManyNodes);
+    }
+    let nodes: &'static mut [DTNode] = match boot_arena_alloc_slice::<DTNode>(max_nodes) {
+        Ok(nodes) => nodes,
+        Err(e) => { return Err(DTIndexError::AllocScratchFailed(e)); }
+    };
+    let cells: &'static mut DTCellTable = match boot_arena_alloc_as::<DTCellTable>() {
+        Ok(cells) => cells,
+        Err(e) => { return Err(DTIndexError::AllocScratchFailed(e)); }
+    };
+    let hashes: &'static mut DTHashTable = match boot_arena_alloc_as::<DTHashTable>() {
+        Ok(hashes) => hashes,
+        Err(e) => { return Err(DTIndexError::AllocLookupTablesFailed(e)); }
+    };
+    let scratch: DTIrqScratch = DTIrqScratch {
+        parent_phandles: match boot_arena_alloc_slice::<u32>(max_nodes) {
+            Ok(parent_phandles) => parent_phandles,
+            Err(e) => { return Err(DTIndexError::AllocScratchFailed(e)); }
+        },
+        raw_irqs: match boot_arena_alloc_slice::<DTRawIrqs>(max_nodes) {
+            Ok(raw_irqs) => raw_irqs,
+            Err(e) => { return Err(DTIndexError::AllocScratchFailed(e)); }
+        }
+    };
+    let fdt: FDTItr = match FDTItr::new() {
+        Ok(fdt) => fdt,
+        Err(e) => { return Err(DTIndexError::FDTItrNewFailed(e)); }
+    };
+
+    // The innermost node seen so far at each depth, and the last child seen under it.
+    let mut ancestors: [u16; DT_MAX_DEPTH] = [DT_NONE; DT_MAX_DEPTH];
+    let mut last_child: [u16; DT_MAX_DEPTH] = [DT_NONE; DT_MAX_DEPTH];
+    let mut num_nodes: usize = 0;
+    let mut num_regs: usize = 0;
+    let mut num_untranslated_regs: usize = 0;
+    let mut num_ranges: usize = 0;
+    let mut num_phandles: usize = 0;
+
+    for fdt_node in core::iter::once(FDTNode::root()).chain(fdt) {
+        let depth: usize = fdt_node.depth() as usize;
+        if depth >= DT_MAX_DEPTH {
+            return Err(DTIndexError::TooDeep);
+        }
+        // Only if the DTB changed under us since it was counted.
+        if num_nodes >= nodes.len() {
+            return Err(DTIndexError::TooManyNodes);
+        }
+        let node_idx: u16 = num_nodes as u16;
+        let name: &'static str = match fdt_node.get_name() {
+            Ok(name) => name,
+            Err(e) => { return Err(DTIndexError::GetNameFailed(e)); }
+        };
+        let parent: u16 = if depth == 0 { DT_NONE } else { ancestors[depth - 1] };
+        let (parent_address_cells, parent_size_cells, parent_bus): (usize, usize, DTBusMap) = if parent == DT_NONE {
+            (DT_DEFAULT_ADDRESS_CELLS as usize, DT_DEFAULT_SIZE_CELLS as usize, DTBusMap::IDENTITY)
+        } else {
+            let parent_node: &DTNode = &nodes[parent as usize];
+            (parent_node.address_cells as usize, parent_node.size_cells as usize, parent_node.child_bus)
+        };
+
+        let node: &mut DTNode = &mut nodes[node_idx as usize];
+        *node = DTNode {
+            name_ptr: name.as_ptr(),
+            compatible_ptr: ptr::null(),
+            offset: fdt_node.offset(),
+            phandle: 0,
+            name_len: name.len() as u16,
+            compatible_len: 0,
+            parent: parent,
+            first_child: DT_NONE,
+            next_sibling: DT_NONE,
+            reg_start: num_regs as u16,
+            irq_start: 0,
+            irq_parent: DT_NONE,
+            reg_count: 0,
+            irq_count: 0,
+            interrupt_cells: 0,
+            address_cells: DT_DEFAULT_ADDRESS_CELLS,
+            size_cells: DT_DEFAULT_SIZE_CELLS,
+            child_bus: DTBusMap::UNMAPPED,
+            reg_translated: false
+        };
+
+        // Needs this node's own #address-cells/#size-cells, which may come after it.
+        let mut ranges: Option<&'static [u8]> = None;
+        for (prop_name, value) in fdt_node.properties() {
+            match prop_name {
+                b"compatible" => {
+                    node.compatible_ptr = value.as_ptr();
+                    node.compatible_len = value.len() as u16;
+                },
+                b"phandle" | b"linux,phandle" if value.len() == 4 => {
+                    node.phandle = be32(value);
+                },
+                b"#address-cells" if value.len() == 4 => {
+                    node.address_cells = be32(value) as u8;
+                },
+                b"#size-cells" if value.len() == 4 => {
+                    node.size_cells = be32(value) as u8;
+                },
+                b"#interrupt-cells" if value.len() == 4 => {
+                    node.interrupt_cells = be32(value) as u8;
+                },
+                b"interrupt-parent" if value.len() == 4 => {
+                    scratch.parent_phandles[node_idx as usize] = be32(value);
+                },
+                b"reg" => {
+                    // Wider than u64 (e.g. PCI's 3 address cells) isn't something we decode.
+                    let entry_bytes: usize = (parent_address_cells + parent_size_cells) * 4;
+                    if parent_address_cells > 2 || parent_size_cells > 2 || entry_bytes == 0
+                        || value.len() % entry_bytes != 0 {
+                        continue;
+                    }
+                    let num_entries: usize = core::cmp::min(value.len() / entry_bytes, u8::MAX as usize);
+                    if num_regs + num_entries > DT_MAX_REGS {
+                        return Err(DTIndexError::TooManyRegs);
+                    }
+                    let reg_start: usize = num_regs;
+                    for entry in value.chunks_exact(entry_bytes).take(num_entries) {
+                        cells.regs[num_regs] = DTReg {
+                            address: read_cells(entry, parent_address_cells),
+                            size: read_cells(&entry[parent_address_cells * 4..], parent_size_cells)
+                        };
+                        num_regs += 1;
+                    }
+                    node.reg_count = num_entries as u8;
+                    // All or nothing, so a node's regs are never a mix of bus and CPU addresses.
+                    let translatable: bool = cells.regs[reg_start..num_regs].iter()
+                        .all(|reg| parent_bus.translate(&cells.ranges, reg.address).is_some());
+                    if translatable {
+                        for reg in &mut cells.regs[reg_start..num_regs] {
+                            reg.address = parent_bus.translate(&cells.ranges, reg.address).unwrap();
+                        }
+                        node.reg_translated = true;
+                    } else {
+                        num_untranslated_regs += 1;
+                    }
+                },
+                b"ranges" => {
+                    ranges = Some(value);
+                },
+                b"interrupts" if !value.is_empty() => {
+                    scratch.raw_irqs[node_idx as usize] = DTRawIrqs { value_ptr: value.as_ptr(), value_len: value.len() };
+                },
+                _ => { }
+            }
+        }
+
+        /*
+         * The root's children are in CPU space already. Below it, "ranges;" means the same
+         * mapping as the node's own bus; entries map child-bus windows to the parent's bus,
+         * which are translated up here once so a lookup is a single step. No "ranges" at
+         * all (e.g. /cpus) means the children's addresses aren't CPU addresses.
+         */
+        node.child_bus = match ranges {
+            _ if parent == DT_NONE => DTBusMap::IDENTITY,
+            None => DTBusMap::UNMAPPED,
+            Some(value) if value.is_empty() => parent_bus,
+            Some(value) => {
+                let child_cells: usize = node.address_cells as usize;
+                let size_cells: usize = node.size_cells as usize;
+                let entry_bytes: usize = (child_cells + parent_address_cells + size_cells) * 4;
+                if child_cells > 2 || parent_address_cells > 2 || size_cells > 2 || child_cells == 0
+                    || value.len() % entry_bytes != 0 {
+                    DTBusMap::UNMAPPED
+                } else {
+                    let range_start: usize = num_ranges;
+                    for entry in value.chunks_exact(entry_bytes) {
+                        let parent_address: u64 = read_cells(&entry[child_cells * 4..], parent_address_cells);
+                        // A window onto part of the parent's bus that's unmapped itself goes nowhere.
+                        if let Some(cpu_address) = parent_bus.translate(&cells.ranges, parent_address) {
+                            if num_ranges >= DT_MAX_RANGES || num_ranges - range_start >= u8::MAX as usize {
+                                return Err(DTIndexError::TooManyRanges);
+                            }
+                            cells.ranges[num_ranges] = DTRange {
+                                child_address: read_cells(entry, child_cells),
+                                cpu_address: cpu_address,
+                                size: read_cells(&entry[(child_cells + parent_address_cells) * 4..], size_cells)
+                            };
+                            num_ranges += 1;
+                        }
+                    }
+                    DTBusMap { identity: false, range_count: (num_ranges - range_start) as u8, range_start: range_start as u16 }
+                }
+            }
+        };
+
+        if node.phandle != 0 {
+            if num_phandles >= DT_PHANDLE_SLOTS / 2 {
+                return Err(DTIndexError::TooManyPhandles);
+            }
+            let mut slot: usize = phandle_slot(node.phandle);
+            while hashes.phandles[slot].phandle != 0 {
+                slot = (slot + 1) & (DT_PHANDLE_SLOTS - 1);
+            }
+            hashes.phandles[slot] = DTPhandleSlot { phandle: node.phandle, node: node_idx as u32 };
+            num_phandles += 1;
+        }
+
+        if parent != DT_NONE {
+            match last_child[depth - 1] {
+                DT_NONE => { nodes[parent as usize].first_child = node_idx; },
+                prev_sibling => { nodes[prev_sibling as usize].next_sibling = node_idx; }
+            }
+            last_child[depth - 1] = node_idx;
+        }
+        ancestors[depth] = node_idx;
+        last_child[depth] = DT_NONE;
+        num_nodes += 1;
+    }
+
+    // Every phandle is known now, so every "interrupts" can find its controller.
+    let mut num_irqs: usize = 0;
+    let mut num_irq_cells: usize = 0;
+    let mut num_unresolved_irqs: usize = 0;
+    for node_idx in 0..num_nodes {
+        let raw: &DTRawIrqs = &scratch.raw_irqs[node_idx];
+        if raw.value_len == 0 {
+            continue;
+        }
+        let value: &'static [u8] = unsafe { slice::from_raw_parts(raw.value_ptr, raw.value_len) };
+        let irq_parent: u16 = match find_interrupt_parent(nodes, &hashes.phandles, &scratch.parent_phandles, node_idx as u16) {
+            Some(irq_parent) => irq_parent,
+            None => { num_unresolved_irqs += 1; continue; }
+        };
+        let spec_cells: usize = nodes[irq_parent as usize].interrupt_cells as usize;
+        if value.len() % (spec_cells * 4) != 0 {
+            num_unresolved_irqs += 1;
+            continue;
+        }
+        let num_specs: usize = core::cmp::min(value.len() / (spec_cells * 4), u8::MAX as usize);
+        if num_irq_cells + num_specs * spec_cells > DT_MAX_IRQ_CELLS {
+            return Err(DTIndexError::TooManyIrqs);
+        }
+        for cell in value.chunks_exact(4).take(num_specs * spec_cells) {
+            cells.irqs[num_irq_cells] = be32(cell);
+            num_irq_cells += 1;
+        }
+        let node: &mut DTNode = &mut nodes[node_idx];
+        node.irq_start = (num_irq_cells - num_specs * spec_cells) as u16;
+        node.irq_parent = irq_parent;
+        node.irq_count = num_specs as u8;
+        num_irqs += num_specs;
+    }
+
+    // Prepending while walking the nodes backwards leaves every chain in DTB order.
+    let mut num_compats: usize = 0;
+    for node_idx in (0..num_nodes).rev() {
+        for compatible in nodes[node_idx].compatible().split(|&b| b == 0).filter(|c| !c.is_empty()) {
+            if num_compats >= DT_MAX_COMPATS {
+                return Err(DTIndexError::TooManyCompatibles);
+            }
+            let bucket: usize = hash_bytes(compatible) as usize & (DT_COMPAT_BUCKETS - 1);
+            hashes.compat_entries[num_compats] = DTCompatEntry {
+                str_ptr: compatible.as_ptr(),
+                str_len: compatible.len() as u16,
+                node: node_idx as u16,
+                next: hashes.compat_buckets[bucket]
+            };
+            num_compats += 1;
+            hashes.compat_buckets[bucket] = num_compats as u16;
+        }
+    }
+
+    let tables: DTTables = DTTables {
+        nodes: match keep_table(&nodes[..num_nodes]) { Ok(table) => table, Err(e) => { return Err(e); } },
+        regs: match keep_table(&cells.regs[..num_regs]) { Ok(table) => table, Err(e) => { return Err(e); } },
+        ranges: match keep_table(&cells.ranges[..num_ranges]) { Ok(table) => table, Err(e) => { return Err(e); } },
+        irqs: match keep_table(&cells.irqs[..num_irq_cells]) { Ok(table) => table, Err(e) => { return Err(e); } }
+    };
+    let table_bytes: usize = size_of_val(tables.nodes) + size_of_val(tables.regs)
+        + size_of_val(tables.ranges) + size_of_val(tables.irqs);
+
+    unsafe {
+        DT_TABLES = tables;
+        DT_HASHES = hashes as *const DTHashTable;
+        DT_STATS = DTIndexStats {
+            nodes: num_nodes,
+            regs: num_regs,
+            untranslated_regs: num_untranslated_regs,
+            ranges: num_ranges,
+            irqs: num_irqs,
+            unresolved_irqs: num_unresolved_irqs,
+            compatibles: num_compats,
+            phandles: num_phandles,
+            table_bytes: table_bytes,
+            build_ticks: timer::counter_ticks() - start_ticks
+        };
+    }
+    DT_LOOKUP_TABLES_LIVE.store(true, Ordering::Release);
+    DT_NUM_NODES.store(num_nodes, Ordering::Release);
+    return Ok(());
+}
+
+// Before the boot arena is released: phandle and compatible lookups find nothing after.
+pub fn drop_dt_lookup_tables() {
+    DT_LOOKUP_TABLES_LIVE.store(false, Ordering::Release);
+}
+
+#[inline(always)]
+fn dt_lookup_tables() -> Option<&'static DTHashTable> {
+    if !DT_LOOKUP_TABLES_LIVE.load(Ordering::Acquire) {
+        return None;
+    }
+    return Some(unsafe { &*DT_HASHES });
+}
+
+#[inline(always)]
+fn dt_tables() -> &'static DTTables {
+    return unsafe { &*(&raw const DT_TABLES) };
+}
+
+#[inline(always)]
+fn dt_node(node_idx: u16) -> Option<&'static DTNode> {
+    if node_idx as usize >= DT_NUM_NODES.load(Ordering::Acquire) {
+        return None;
+    }
+    return Some(&dt_tables().nodes[node_idx as usize]);
+}
+
+// Every node, in DTB order. Empty until init_dt_index() has run.
+pub fn dt_nodes() -> &'static [DTNode] {
+    if DT_NUM_NODES.load(Ordering::Acquire) == 0 {
+        return &[];
+    }
+    return dt_tables().nodes;
+}
+
+pub fn dt_root() -> Option<&'static DTNode> {
+    return dt_node(0);
+}
+
+pub fn dt_node_by_phandle(phandle: u32) -> Option<&'static DTNode> {
+    let hashes: &DTHashTable = match dt_lookup_tables() {
+        Some(hashes) if phandle != 0 => hashes,
+        _ => { return None; }
+    };
+    match lookup_phandle(&hashes.phandles, phandle) {
+        Some(node_idx) => { return dt_node(node_idx); },
+        None => { return None; }
+    }
+}
+
+// Every node listing `compatible` (without the NUL), in DTB order.
+pub fn dt_compatible_nodes(compatible: &[u8]) -> DTCompatItr<'_> {
+    let next: u16 = match dt_lookup_tables() {
+        Some(hashes) => hashes.compat_buckets[hash_bytes(compatible) as usize & (DT_COMPAT_BUCKETS - 1)],
+        None => 0
+    };
+    return DTCompatItr { compatible: compatible, next: next };
+}
+
+pub fn dt_find_compatible(compatible: &[u8]) -> Option<&'static DTNode> {
+    return dt_compatible_nodes(compatible).next();
+}
+
+pub fn dt_index_stats() -> DTIndexStats {
+    return unsafe { DT_STATS };
+}
+
+pub struct DTChildItr {
+    next: u16
+} impl Iterator for DTChildItr {
+    type Item = &'static DTNode;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let node: &'static DTNode = match dt_node(self.next) {
+            Some(node) => node,
+            None => { return None; }
+        };
+        self.next = node.next_sibling;
+        return Some(node);
+    }
+}
+
+pub struct DTCompatItr<'a> {
+    compatible : &'a [u8],
+    next       : u16
+} impl<'a> Iterator for DTCompatItr<'a> {
+    type Item = &'static DTNode;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let hashes: &DTHashTable = match dt_lookup_tables() {
+            Some(hashes) => hashes,
+            None => { return None; }
+        };
+        while self.next != 0 {
+            let entry: &DTCompatEntry = &hashes.compat_entries[self.next as usize - 1];
+            self.next = entry.next;
+            let entry_str: &[u8] = unsafe { slice::from_raw_parts(entry.str_ptr, entry.str_len as usize) };
+            if entry_str == self.compatible {
+                return dt_node(entry.node);
+            }
+        }
+        return None;
+    }
+}
@@ -0,0 +1,448 @@
+use super::*;
+use core::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+use cpu::{cpu_id, cpu_mpidr, MAX_CPUS};
+use memory::ppm::*;
+use crate::sync::SpinLock;
+
+/*
+ * GICv3 driver: one distributor (GICD) shared by everyone, one redistributor (GICR)
+ * frame per CPU, and the ICC_* system register CPU interface. All interrupts are
+ * configured as Non-secure Group 1; QEMU's virt board runs the GIC with a single
+ * security state (GICD_CTLR.DS == 1) when EL3 isn't emulated.
+ */
+
+// INTIDs 1020-1023 are special (1023 == spurious), and LPIs (8192+) aren't supported.
+pub const MAX_INTIDS: usize = 1020;
+const SGI_INTIDS: u32 = 16;
+const PRIVATE_INTIDS: u32 = 32;
+
+// SGI INTIDs handed out to subsystems.
+pub const SGI_BLK_COMPLETION: u32 = 1;
+pub const SGI_LOG_DRAIN:      u32 = 2;
+pub const SGI_RESCHED:        u32 = 3;
+
+const DEFAULT_PRIORITY: u32 = 0xa0;
+const DEFAULT_PRIORITY_X4: u32 = DEFAULT_PRIORITY * 0x0101_0101;
+
+// Distributor register offsets
+const GICD_CTLR:       usize = 0x0000;
+const GICD_TYPER:      usize = 0x0004;
+const GICD_IGROUPR:    usize = 0x0080;
+const GICD_ISENABLER:  usize = 0x0100;
+const GICD_ICENABLER:  usize = 0x0180;
+const GICD_ICPENDR:    usize = 0x0280;
+const GICD_IPRIORITYR: usize = 0x0400;
+const GICD_ICFGR:      usize = 0x0C00;
+const GICD_IROUTER:    usize = 0x6000;
+
+const GICD_CTLR_RWP:           u32 = 1 << 31;
+const GICD_CTLR_ARE:           u32 = 1 << 4;
+const GICD_CTLR_ENABLE_GRP1:   u32 = 1 << 1;
+
+// Redistributor register offsets. Each CPU's GICR is an RD_base frame followed by an
+// SGI_base frame (plus two more frames on GICv4 parts with VLPIs).
+const GICR_CTLR:       usize = 0x0000;
+const GICR_TYPER:      usize = 0x0008;
+const GICR_WAKER:      usize = 0x0014;
+const GICR_SGI_OFFSET: usize = 0x1_0000;
+const GICR_FRAME_LEN:  usize = 0x2_0000;
+const GICR_VLPI_FRAME_LEN: usize = 0x4_0000;
+
+const GICR_CTLR_RWP:                u32 = 1 << 3;
+const GICR_TYPER_VLPIS:             u64 = 1 << 1;
+const GICR_TYPER_LAST:              u64 = 1 << 4;
+const GICR_WAKER_PROCESSOR_SLEEP:   u32 = 1 << 1;
+const GICR_WAKER_CHILDREN_ASLEEP:   u32 = 1 << 2;
+
+// SGI_base frame offsets
+const GICR_IGROUPR0:    usize = 0x0080;
+const GICR_ISENABLER0:  usize = 0x0100;
+const GICR_ICENABLER0:  usize = 0x0180;
+const GICR_IPRIORITYR:  usize = 0x0400;
+const GICR_ICFGR0:      usize = 0x0C00;
+
+// "interrupts" specifier cells for arm,gic-v3 (see the kernel's arm,gic-v3.yaml binding),
+// already split by the GIC's #interrupt-cells (3, or 4 with PPI partitions) by the DT index.
+const DT_GIC_MIN_IRQ_CELLS: usize = 3;
+const DT_IRQ_TYPE_SPI: u32 = 0;
+const DT_IRQ_TYPE_PPI: u32 = 1;
+const DT_IRQ_FLAG_EDGE_MASK: u32 = 0b0011;
+
+pub enum GICError {
+    GetNameFailed(FDTError),
+    GetRegsFailed(FDTError),
+    MapMMIORangeFailed(PTMError),
+    AllocHandlerTableFailed(PPMError),
+    RedistributorNotFound,
+    NotInitialized,
+    InvalidIntID,
+    GetInterruptsFailed(FDTError),
+    BadInterruptsProperty,
+    // The node's interrupt parent is some other controller.
+    NotGICInterrupt
+}
+
+#[derive(Copy, Clone, PartialEq, Debug)]
+pub enum IrqTrigger {
+    Level,
+    Edge
+}
+
+pub type IrqHandlerFn = fn(intid: u32, ctx: usize);
+
+#[derive(Copy, Clone)]
+struct IrqHandler {
+    handler : Option<IrqHandlerFn>,
+    ctx     : usize
+}
+
+static mut GICD_BASE: *mut u8 = ptr::null_mut();
+static mut GICR_REGION_BASE: *mut u8 = ptr::null_mut();
+static mut GICR_REGION_LEN: usize = 0;
+static mut GICR_BASES: [*mut u8; MAX_CPUS] = [ptr::null_mut(); MAX_CPUS];
+static mut NUM_INTIDS: usize = 0;
+// Lives in a PPM page: 1020 handlers don't fit in .bss.
+static mut IRQ_HANDLERS: *mut [IrqHandler; MAX_INTIDS] = ptr::null_mut();
+// SGIs/PPIs are banked per CPU; CPUs that come up later enable whatever is set here.
+static BANKED_ENABLE_MASK: AtomicU32 = AtomicU32::new(0);
+// GICD_ICFGR packs 16 INTIDs per register, so configuring one is a read-modify-write.
+static GICD_CONFIG_LOCK: SpinLock<()> = SpinLock::new(());
+static IRQS_HANDLED: [AtomicU64; MAX_CPUS] = [const { AtomicU64::new(0) }; MAX_CPUS];
+// IRQs with no handler, and the INTID of the last one. Counted rather than printed:
+// handle_irq() runs in IRQ context, where println!'s UART lock may already be held.
+static IRQS_UNHANDLED: AtomicU64 = AtomicU64::new(0);
+static LAST_UNHANDLED_INTID: AtomicU32 = AtomicU32::new(0);
+
+#[inline(always)] pub fn gic_is_initialized() -> bool { unsafe { !IRQ_HANDLERS.is_null() } }
+#[inline(always)] pub fn irqs_handled(cpu_idx: usize) -> u64 { IRQS_HANDLED[cpu_idx].load(Ordering::Relaxed) }
+#[inline(always)] pub fn irqs_unhandled() -> u64 { IRQS_UNHANDLED.load(Ordering::Relaxed) }
+#[inline(always)] pub fn last_unhandled_intid() -> u32 { LAST_UNHANDLED_INTID.load(Ordering::Relaxed) }
+
+crate::register_driver!(GIC_V3_DRIVER, "gicv3", b"arm,gic-v3", drivers::DRIVER_PRIORITY_IRQCHIP, Serial, probe_gic);
+
+// Not fatal: drivers fall back to polling if they can't get an IRQ.
+fn probe_gic(intc_node: &'static DTNode) -> Result<(), DeviceInitError> {
+    if gic_is_initialized() {
+        println!("probe_gic(): ignoring {}, already have a GIC", intc_node.name());
+    } else if let Err(_e) = init_gic(intc_node) {
+        println!("probe_gic(): GICv3 init failed, running without interrupts!");
+    } else {
+        // The secondaries are already up (and parked), so bring up their CPU interfaces too.
+        for cpu_idx in 0..cpu::num_cpus() {
+            if cpu_idx != cpu_id() && cpu::run_on_cpu(cpu_idx, init_secondary_gic_cpu, cpu_idx).is_ok() {
+                cpu::wait_for_cpu(cpu_idx);
+            }
+        }
+    }
+    return Ok(());
+}
+
+fn init_secondary_gic_cpu(cpu_idx: usize) {
+    if let Err(_e) = init_gic_cpu() {
+        println!("probe_gic(): CPU {} GIC init failed!", cpu_idx);
+    }
+}
+
+pub fn init_gic(intc_node: &'static DTNode) -> Result<(), GICError> {
+    // reg = <GICD base, size>, <GICR region base, size>, ...
+    unsafe {
+        for (reg_idx, base) in [(0, &raw mut GICD_BASE), (1, &raw mut GICR_REGION_BASE)] {
+            match intc_node.get_reg_idx(reg_idx) {
+                Ok((mmio_address, mmio_len)) => {
+                    if let Err(e) = map_mmio_range(mmio_address as *const u8, mmio_len as usize) {
+                        return Err(GICError::MapMMIORangeFailed(e));
+                    }
+                    *base = mmio_address as *mut u8;
+                    if reg_idx == 1 { GICR_REGION_LEN = mmio_len as usize; }
+                },
+                Err(e) => { return Err(GICError::GetRegsFailed(e)); }
+            }
+        }
+
+        let irq_handlers: &'static mut [IrqHandler; MAX_INTIDS] = match get_free_page_as::<[IrqHandler; MAX_INTIDS]>() {
+            Ok(irq_handlers) => irq_handlers,
+            Err(e) => { return Err(GICError::AllocHandlerTableFailed(e)); }
+        };
+
+        gicd_write32(GICD_CTLR, 0);
+        gicd_wait_for_rwp();
+
+        let it_lines_number: usize = (gicd_read32(GICD_TYPER) & 0x1f) as usize;
+        NUM_INTIDS = core::cmp::min(32 * (it_lines_number + 1), MAX_INTIDS);
+
+        // Every SPI starts out disabled, non-pending, Group 1, default priority & routed to the boot CPU.
+        let boot_cpu_affinity: u64 = mpidr_to_affinity(cpu_mpidr(cpu_id()));
+        for intid in (PRIVATE_INTIDS as usize..NUM_INTIDS).step_by(32) {
+            gicd_write32(GICD_ICENABLER + (intid / 32) * 4, u32::MAX);
+            gicd_write32(GICD_ICPENDR + (intid / 32) * 4, u32::MAX);
+            gicd_write32(GICD_IGROUPR + (intid / 32) * 4, u32::MAX);
+        }
+        for intid in (PRIVATE_INTIDS as usize..NUM_INTIDS).step_by(4) {
+            gicd_write32(GICD_IPRIORITYR + intid, DEFAULT_PRIORITY_X4);
+        }
+        for intid in PRIVATE_INTIDS as usize..NUM_INTIDS {
+            gicd_write64(GICD_IROUTER + intid * 8, boot_cpu_affinity);
+        }
+        gicd_wait_for_rwp();
+
+        gicd_write32(GICD_CTLR, GICD_CTLR_ARE | GICD_CTLR_ENABLE_GRP1);
+        gicd_wait_for_rwp();
+
+        IRQ_HANDLERS = irq_handlers as *mut [IrqHandler; MAX_INTIDS];
+    }
+
+    return init_gic_cpu();
+}
+
+/*
+ * Per-CPU half of GIC bring-up: wake this CPU's redistributor, set up its banked
+ * SGIs/PPIs and turn on the system register CPU interface. Every CPU calls this once.
+ */
+pub fn init_gic_cpu() -> Result<(), GICError> {
+    if !gic_is_initialized() {
+        return Err(GICError::NotInitialized);
+    }
+    unsafe {
+        let my_cpu_idx: usize = cpu_id();
+        let rd_base: *mut u8 = match find_redistributor(cpu_mpidr(my_cpu_idx)) {
+            Some(rd_base) => rd_base,
+            None => { return Err(GICError::RedistributorNotFound); }
+        };
+        GICR_BASES[my_cpu_idx] = rd_base;
+
+        let waker: u32 = read32_ptr(rd_base.add(GICR_WAKER) as *const u32);
+        write32_ptr(rd_base.add(GICR_WAKER) as *mut u32, waker & !GICR_WAKER_PROCESSOR_SLEEP);
+        while read32_ptr(rd_base.add(GICR_WAKER) as *const u32) & GICR_WAKER_CHILDREN_ASLEEP != 0 {}
+
+        let sgi_base: *mut u8 = rd_base.add(GICR_SGI_OFFSET);
+        write32_ptr(sgi_base.add(GICR_ICENABLER0) as *mut u32, u32::MAX);
+        while read32_ptr(rd_base.add(GICR_CTLR) as *const u32) & GICR_CTLR_RWP != 0 {}
+        write32_ptr(sgi_base.add(GICR_IGROUPR0) as *mut u32, u32::MAX);
+        for intid in (0..PRIVATE_INTIDS as usize).step_by(4) {
+            write32_ptr(sgi_base.add(GICR_IPRIORITYR + intid) as *mut u32, DEFAULT_PRIORITY_X4);
+        }
+        // SGIs are always on; PPIs only if someone registered a handler for them.
+        write32_ptr(
+            sgi_base.add(GICR_ISENABLER0) as *mut u32,
+            ((1 << SGI_INTIDS) - 1) | BANKED_ENABLE_MASK.load(Ordering::Acquire)
+        );
+
+        asm!(
+            "mrs {tmp}, S3_0_C12_C12_5",    // ICC_SRE_EL1
+            "orr {tmp}, {tmp}, #1",         // SRE: use the system register interface
+            "msr S3_0_C12_C12_5, {tmp}",
+            "isb",
+            "mov {tmp}, #0xff",
+            "msr S3_0_C4_C6_0, {tmp}",      // ICC_PMR_EL1: let every priority through
+            "msr S3_0_C12_C12_3, xzr",      // ICC_BPR1_EL1: no priority grouping
+            "mov {tmp}, #1",
+            "msr S3_0_C12_C12_7, {tmp}",    // ICC_IGRPEN1_EL1: enable Group 1
+            "isb",
+            tmp = out(reg) _,
+            options(nostack, preserves_flags)
+        );
+    }
+    return Ok(());
+}
+
+/*
+ * Install `handler` for `intid` and enable it. SPIs are enabled for the whole system;
+ * SGIs/PPIs are banked, so they're enabled on the calling CPU immediately and on every
+ * other CPU when it runs init_gic_cpu(). Handlers run in IRQ context with IRQs masked.
+ */
+pub fn register_irq(intid: u32, trigger: IrqTrigger, handler: IrqHandlerFn, ctx: usize) -> Result<(), GICError> {
+    if !gic_is_initialized() {
+        return Err(GICError::NotInitialized);
+    }
+    unsafe {
+        if intid as usize >= NUM_INTIDS.max(PRIVATE_INTIDS as usize) {
+            return Err(GICError::InvalidIntID);
+        }
+        (*IRQ_HANDLERS)[intid as usize] = IrqHandler { handler: Some(handler), ctx };
+    }
+    if intid >= SGI_INTIDS {
+        set_irq_trigger(intid, trigger);
+    }
+    return enable_irq(intid);
+}
+
+pub fn enable_irq(intid: u32) -> Result<(), GICError> {
+    unsafe {
+        if intid < PRIVATE_INTIDS {
+            BANKED_ENABLE_MASK.fetch_or(1 << intid, Ordering::AcqRel);
+            let rd_base: *mut u8 = GICR_BASES[cpu_id()];
+            if rd_base.is_null() {
+                return Err(GICError::NotInitialized);
+            }
+            write32_ptr(rd_base.add(GICR_SGI_OFFSET + GICR_ISENABLER0) as *mut u32, 1 << intid);
+        } else {
+            gicd_write32(GICD_ISENABLER + (intid as usize / 32) * 4, 1 << (intid % 32));
+        }
+    }
+    return Ok(());
+}
+
+pub fn disable_irq(intid: u32) -> Result<(), GICError> {
+    unsafe {
+        if intid < PRIVATE_INTIDS {
+            BANKED_ENABLE_MASK.fetch_and(!(1 << intid), Ordering::AcqRel);
+            let rd_base: *mut u8 = GICR_BASES[cpu_id()];
+            if rd_base.is_null() {
+                return Err(GICError::NotInitialized);
+            }
+            write32_ptr(rd_base.add(GICR_SGI_OFFSET + GICR_ICENABLER0) as *mut u32, 1 << intid);
+            while read32_ptr(rd_base.add(GICR_CTLR) as *const u32) & GICR_CTLR_RWP != 0 {}
+        } else {
+            gicd_write32(GICD_ICENABLER + (intid as usize / 32) * 4, 1 << (intid % 32));
+            gicd_wait_for_rwp();
+        }
+    }
+    return Ok(());
+}
+
+// Route an SPI to a single CPU.
+pub fn set_irq_affinity(intid: u32, cpu_idx: usize) -> Result<(), GICError> {
+    if intid < PRIVATE_INTIDS || !gic_is_initialized() {
+        return Err(GICError::InvalidIntID);
+    }
+    unsafe { gicd_write64(GICD_IROUTER + intid as usize * 8, mpidr_to_affinity(cpu_mpidr(cpu_idx))); }
+    return Ok(());
+}
+
+// Raise SGI `sgi_intid` on `cpu_idx` through ICC_SGI1R_EL1.
+pub fn send_sgi(sgi_intid: u32, cpu_idx: usize) {
+    let mpidr: u64 = cpu_mpidr(cpu_idx);
+    let aff0: u64 = mpidr & 0xff;
+    let sgi1r: u64 =
+        ((mpidr >> 32) & 0xff) << 48 |     // Aff3
+        (aff0 / 16) << 44 |                // RS: which block of 16 Aff0 values TargetList covers
+        ((mpidr >> 16) & 0xff) << 32 |     // Aff2
+        (sgi_intid as u64 & 0xf) << 24 |   // INTID
+        ((mpidr >> 8) & 0xff) << 16 |      // Aff1
+        1 << (aff0 % 16)                   // TargetList
+    ;
+    unsafe {
+        asm!(
+            "msr S3_0_C12_C11_5, {}",       // ICC_SGI1R_EL1
+            "isb",
+            in(reg) sgi1r,
+            options(nostack, preserves_flags)
+        );
+    }
+}
+
+// Called from exceptions.rs for every IRQ exception. Acks, dispatches & EOIs until nothing is pending.
+pub fn handle_irq() {
+    loop {
+        let intid: u64;
+        unsafe { asm!("mrs {}, S3_0_C12_C12_0", out(reg) intid, options(nomem, nostack, preserves_flags)); } // ICC_IAR1_EL1
+        let intid: u32 = (intid & 0xff_ffff) as u32;
+        if intid as usize >= MAX_INTIDS {
+            return; // 1023: spurious, nothing (else) pending
+        }
+
+        IRQS_HANDLED[cpu_id()].fetch_add(1, Ordering::Relaxed);
+        let irq_handler: IrqHandler = unsafe { (*IRQ_HANDLERS)[intid as usize] };
+        match irq_handler.handler {
+            Some(handler) => handler(intid, irq_handler.ctx),
+            None => {
+                LAST_UNHANDLED_INTID.store(intid, Ordering::Relaxed);
+                IRQS_UNHANDLED.fetch_add(1, Ordering::Relaxed);
+            }
+        }
+
+        unsafe { asm!("msr S3_0_C12_C12_1, {}", in(reg) intid as u64, options(nomem, nostack, preserves_flags)); } // ICC_EOIR1_EL1
+    }
+}
+
+/*
+ * Decode the idx'th "interrupts" specifier of a node hanging off the GIC. Each is
+ * <type number flags>: SPIs number from 0 but INTIDs 0-31 are the banked SGIs/PPIs,
+ * so an SPI's INTID is number + 32 (and a PPI's is number + 16).
+ */
+pub fn get_node_irq(node: &DTNode, irq_idx: usize) -> Result<(u32, IrqTrigger), GICError> {
+    if node.num_irqs() == 0 {
+        return Err(GICError::GetInterruptsFailed(FDTError::NotFound));
+    }
+    match node.interrupt_parent() {
+        Some(irq_parent) if irq_parent.is_compatible(b"arm,gic-v3") => { },
+        _ => { return Err(GICError::NotGICInterrupt); }
+    }
+    let spec: &[u32] = match node.get_irq_cells(irq_idx) {
+        Some(spec) if spec.len() >= DT_GIC_MIN_IRQ_CELLS => spec,
+        _ => { return Err(GICError::BadInterruptsProperty); }
+    };
+
+    let intid: u32 = match spec[0] {
+        DT_IRQ_TYPE_SPI => spec[1] + PRIVATE_INTIDS,
+        DT_IRQ_TYPE_PPI => spec[1] + SGI_INTIDS,
+        _ => { return Err(GICError::BadInterruptsProperty); }
+    };
+    let trigger: IrqTrigger = if spec[2] & DT_IRQ_FLAG_EDGE_MASK != 0 { IrqTrigger::Edge } else { IrqTrigger::Level };
+    return Ok((intid, trigger));
+}
+
+fn set_irq_trigger(intid: u32, trigger: IrqTrigger) {
+    unsafe {
+        // Before the offset: past it, an unmapped (null) base no longer looks null.
+        let base: *mut u8 = if intid < PRIVATE_INTIDS { GICR_BASES[cpu_id()] } else { GICD_BASE };
+        if base.is_null() {
+            return;
+        }
+        let icfgr: *mut u32 = if intid < PRIVATE_INTIDS {
+            base.add(GICR_SGI_OFFSET + GICR_ICFGR0 + (intid as usize / 16) * 4) as *mut u32
+        } else {
+            base.add(GICD_ICFGR + (intid as usize / 16) * 4) as *mut u32
+        };
+        // Two bits per INTID; the upper one selects edge-triggered.
+        let edge_bit: u32 = 1 << ((intid % 16) * 2 + 1);
+        let _config_guard = GICD_CONFIG_LOCK.lock_irqsave();
+        let prev: u32 = read32_ptr(icfgr);
+        write32_ptr(icfgr, if trigger == IrqTrigger::Edge { prev | edge_bit } else { prev & !edge_bit });
+    }
+}
+
+fn find_redistributor(mpidr: u64) -> Option<*mut u8> {
+    unsafe {
+        let affinity: u64 = ((mpidr >> 8) & 0xff00_0000) | (mpidr & 0x00ff_ffff);
+        let mut offset: usize = 0;
+        while offset < GICR_REGION_LEN {
+            let rd_base: *mut u8 = GICR_REGION_BASE.add(offset);
+            let typer: u64 = ptr::read_volatile(rd_base.add(GICR_TYPER) as *const u64);
+            if typer >> 32 == affinity {
+                return Some(rd_base);
+            }
+            if typer & GICR_TYPER_LAST != 0 {
+                break;
+            }
+            offset += if typer & GICR_TYPER_VLPIS != 0 { GICR_VLPI_FRAME_LEN } else { GICR_FRAME_LEN };
+        }
+        return None;
+    }
+}
+
+// GICD_IROUTER/ICC_SGI1R_EL1 want Aff3.Aff2.Aff1.Aff0 laid out like MPIDR_EL1 minus the flag bits.
+#[inline(always)]
+fn mpidr_to_affinity(mpidr: u64) -> u64 {
+    return mpidr & 0xff_00ff_ffff;
+}
+
+#[inline(always)]
+unsafe fn gicd_read32(offset: usize) -> u32 {
+    unsafe { read32_ptr(GICD_BASE.add(offset) as *const u32) }
+}
+
+#[inline(always)]
+unsafe fn gicd_write32(offset: usize, val: u32) {
+    unsafe { write32_ptr(GICD_BASE.add(offset) as *mut u32, val); }
+}
+
+#[inline(always)]
+unsafe fn gicd_write64(offset: usize, val: u64) {
+    unsafe { ptr::write_volatile(GICD_BASE.add(offset) as *mut u64, val); }
+}
+
+#[inline(always)]
+unsafe fn gicd_wait_for_rwp() {
+    unsafe { while gicd_read32(GICD_CTLR) & GICD_CTLR_RWP != 0 {} }
+}
@@ -12,6 +12,10 @@ static mut ADDRESS_CELLS: usize = 0;
 static mut SIZE_CELLS: usize = 0;
 static mut KERNEL_DTB_START: *const u8 = ptr::null_mut();
 static mut INITIALIZED: bool = false;
+static mut VALIDATE_TICKS: u64 = 0;
+static mut STRINDEX_TICKS: u64 = 0;
+static mut STRINDEX_RET: i32 = -(FDT_ERR_BADSTATE as i32);
+static mut SUBTREE_INDEX_RET: i32 = -(FDT_ERR_BADSTATE as i32);
 
 #[derive(FromPrimitive, Debug)]
 #[repr(i32)]
@@ -50,6 +54,30 @@ pub fn libfdt_lite_init(kernel_dtb_start: *const u8) -> Result<(), FDTError> {
             return Err(fdt_error);
         }
 
+        /*
+         * Check the whole blob once up front (every tag, name, property and string offset),
+         * then let libfdt take its ASSUME_VALID_DTB/ASSUME_VALID_INPUT fast paths for every
+         * lookup after this instead of re-checking bounds on each access. A corrupt DTB is
+         * rejected here rather than half-way through probing. totalsize is read the same
+         * way init_devices() does, see the comment there.
+         */
+        let start_ticks: u64 = timer::counter_ticks();
+        let dtb_total_size: u32 = u32::from_be(ptr::read(KERNEL_DTB_START.add(4) as *const u32));
+        let check_full_ret: i32 = fdt_check_full_and_trust(KERNEL_DTB_START as *const c_void, dtb_total_size as size);
+        VALIDATE_TICKS = timer::counter_ticks() - start_ticks;
+        if check_full_ret != 0 {
+            INITIALIZED = false;
+            return Err(FDTError::from(check_full_ret));
+        }
+
+        // Lets property lookups compare nameoffs instead of strings. Not fatal without it;
+        // libfdt just falls back to comparing names.
+        let start_ticks: u64 = timer::counter_ticks();
+        STRINDEX_RET = fdt_strindex_build(KERNEL_DTB_START as *const c_void);
+        STRINDEX_TICKS = timer::counter_ticks() - start_ticks;
+        // Same for FDTItr skipping subtrees; without it, skipping one walks it.
+        SUBTREE_INDEX_RET = fdt_subtree_index_build(KERNEL_DTB_START as *const c_void);
+
         let mut lenp: i32 = 0;
         let size_cells_ptr: *const u32 = fdt_getprop(
             KERNEL_DTB_START as *const c_void, 
@@ -72,11 +100,122 @@ pub fn libfdt_lite_init(kernel_dtb_start: *const u8) -> Result<(), FDTError> {
     }
 }
 
+#[derive(Copy, Clone)]
+pub struct LibfdtStats {
+    pub validate_ticks : u64,
+    // Whether libfdt is skipping its per-access checks.
+    pub trusted        : bool,
+    pub strindex_ticks : u64,
+    // Distinct property names in the name index, or why there isn't one.
+    pub prop_names     : Result<u32, i32>,
+    pub subtree_index  : Result<(), i32>
+}
+
+pub fn libfdt_stats() -> LibfdtStats {
+    unsafe {
+        return LibfdtStats {
+            validate_ticks: VALIDATE_TICKS,
+            trusted: fdt_runtime_assume_ != 0,
+            strindex_ticks: STRINDEX_TICKS,
+            prop_names: match fdt_strindex_num_names(KERNEL_DTB_START as *const c_void) {
+                n if n >= 0 => Ok(n as u32),
+                _ => Err(STRINDEX_RET)
+            },
+            subtree_index: if SUBTREE_INDEX_RET == 0 { Ok(()) } else { Err(SUBTREE_INDEX_RET) }
+        };
+    }
+}
+
+/*
+ * Turn libfdt's per-access checks back on (false), or skip them again (true) if the DTB
+ * passed validation in libfdt_lite_init(). Only for measuring what skipping them buys:
+ * nothing else may be using libfdt meanwhile.
+ */
+pub fn libfdt_set_trusted(trusted: bool) {
+    unsafe { fdt_set_trusted(trusted as c_int); }
+}
+
+// Property names libfdtLite looks up by a precomputed nameoff; see fdt_getprop_interned().
+#[derive(Copy, Clone, Debug)]
+#[repr(u32)]
+pub enum FDTPropName {
+    Reg             = FDT_PROPNAME_REG,
+    Interrupts      = FDT_PROPNAME_INTERRUPTS,
+    Compatible      = FDT_PROPNAME_COMPATIBLE,
+    AddressCells    = FDT_PROPNAME_ADDRESS_CELLS,
+    SizeCells       = FDT_PROPNAME_SIZE_CELLS,
+    Phandle         = FDT_PROPNAME_PHANDLE,
+    Status          = FDT_PROPNAME_STATUS,
+    Ranges          = FDT_PROPNAME_RANGES,
+    DeviceType      = FDT_PROPNAME_DEVICE_TYPE,
+    InterruptParent = FDT_PROPNAME_INTERRUPT_PARENT,
+    InterruptCells  = FDT_PROPNAME_INTERRUPT_CELLS
+}
+
+// Any other property name, resolved to its nameoff once for repeated lookups.
+#[derive(Copy, Clone, Debug)]
+pub struct FDTPropKey {
+    stroffset: i32
+} impl FDTPropKey {
+    // Without the NUL. NotFound if no property in the DTB has this name.
+    pub fn new(property_name: &[u8]) -> Result<Self, FDTError> {
+        let stroffset: i32 = unsafe {
+            fdt_propname_stroffset(
+                KERNEL_DTB_START as *const c_void,
+                property_name.as_ptr(),
+                property_name.len() as c_int
+            )
+        };
+        if stroffset < 0 {
+            return Err(FDTError::from(stroffset));
+        }
+        return Ok(Self { stroffset: stroffset });
+    }
+}
+
 #[derive(Clone)]
 pub struct FDTNode {
     offset: i32,
     depth: i32
 } impl FDTNode {
+    // FDTItr starts *after* the root node; this is the root itself.
+    pub fn root() -> Self {
+        return Self { offset: 0, depth: 0 };
+    }
+
+    // For property lookups on a node found some other way; not something to iterate from.
+    pub fn at_offset(offset: i32) -> Self {
+        return Self { offset: offset, depth: 0 };
+    }
+
+    #[inline(always)] pub fn offset(&self) -> i32 { self.offset }
+    #[inline(always)] pub fn depth(&self) -> i32 { self.depth }
+
+    // Every property of the node in DTB order, without any by-name string compares.
+    pub fn properties(&self) -> FDTPropItr {
+        let first_prop: i32 = unsafe { fdt_first_property_offset(KERNEL_DTB_START as *const c_void, self.offset) };
+        return FDTPropItr { offset: first_prop };
+    }
+
+    /*
+     * A direct child by name, without visiting anything below the other children. Without
+     * a unit address (b"memory"), matches any "memory@..." too. Name without the NUL.
+     */
+    pub fn subnode(&self, name: &[u8]) -> Result<FDTNode, FDTError> {
+        let offset: i32 = unsafe {
+            fdt_subnode_offset_namelen(
+                KERNEL_DTB_START as *const c_void,
+                self.offset,
+                name.as_ptr(),
+                name.len() as c_int
+            )
+        };
+        if offset < 0 {
+            return Err(FDTError::from(offset));
+        }
+        return Ok(Self { offset: offset, depth: self.depth + 1 });
+    }
+
     pub fn get_name(&self) -> Result<&'static str, FDTError> {
         unsafe {
             let mut name_len: c_int = 0;
@@ -114,100 +253,248 @@ pub struct FDTNode {
         }
     }
 
-    pub fn get_reg(&self) -> Result<(u64, u64), FDTError>  {
+    pub fn get_property_bytes(&self, property_name: &[u8]) -> Result<&'static [u8], FDTError>  {
         unsafe {
             let mut lenp: i32 = 0;
-            let reg_ptr: *const u8 = fdt_getprop(
+            let prop_ptr: *const u8 = fdt_getprop(
                 KERNEL_DTB_START as *const c_void, 
                 self.offset as c_int, 
-                b"reg\0".as_ptr(), 
+                property_name.as_ptr(), 
                 &mut lenp as *mut i32
             ) as *const u8;
+            if lenp < 0 {
+                Err(FDTError::from(lenp))
+            } else {
+                Ok(slice::from_raw_parts(prop_ptr, lenp as usize))
+            }
+        }
+    }
 
-            let address_bytes: usize = ADDRESS_CELLS * CELL_BYTES;
-            let size_bytes: usize = SIZE_CELLS * CELL_BYTES;
+    pub fn get_property_interned(&self, property_name: FDTPropName) -> Result<&'static [u8], FDTError> {
+        unsafe {
+            let mut lenp: i32 = 0;
+            let prop_ptr: *const u8 = fdt_getprop_interned(
+                KERNEL_DTB_START as *const c_void,
+                self.offset as c_int,
+                property_name as c_int,
+                &mut lenp as *mut i32
+            ) as *const u8;
+            if lenp < 0 {
+                return Err(FDTError::from(lenp));
+            }
+            return Ok(slice::from_raw_parts(prop_ptr, lenp as usize));
+        }
+    }
 
-            if lenp != (address_bytes + size_bytes) as i32 {
-                if lenp < 0 && lenp > FDTError::UnexpectedRegFormat as i32 {
-                    return Err(FDTError::from(lenp));
-                } else {
-                    return Err(FDTError::UnexpectedRegFormat);
-                }
+    pub fn get_property_by_key(&self, key: FDTPropKey) -> Result<&'static [u8], FDTError> {
+        unsafe {
+            let mut lenp: i32 = 0;
+            let prop_ptr: *const u8 = fdt_getprop_by_stroffset(
+                KERNEL_DTB_START as *const c_void,
+                self.offset as c_int,
+                key.stroffset,
+                &mut lenp as *mut i32
+            ) as *const u8;
+            if lenp < 0 {
+                return Err(FDTError::from(lenp));
             }
+            return Ok(slice::from_raw_parts(prop_ptr, lenp as usize));
+        }
+    }
 
-            let address_slice: &[u8] = slice::from_raw_parts(
-                reg_ptr, 
-                address_bytes
-            );
-            let size_slice: &[u8] = slice::from_raw_parts(
-                reg_ptr.add(address_bytes), 
-                size_bytes
-            );
-            const U32_BYTES: usize = size_of::<u32>();
-            const U64_BYTES: usize = size_of::<u64>();
-            let address: u64 = match address_bytes {
-                U32_BYTES => { 
-                    u32::from_be_bytes(
-                        address_slice[0..address_bytes]
-                        .try_into().unwrap()
-                    ) as u64 
-                },
-                U64_BYTES => { 
-                    u64::from_be_bytes(
-                        address_slice[0..address_bytes]
-                        .try_into().unwrap()
-                    )
-                },
-                _ => panic!("Invalid get_regs address bytes!")
-            };
-            let size: u64 = match size_bytes {
-                U32_BYTES => { 
-                    u32::from_be_bytes(
-                        size_slice[0..size_bytes]
-                        .try_into().unwrap()
-                    ) as u64 
-                },
-                U64_BYTES => { 
-                    u64::from_be_bytes(
-                        size_slice[0..size_bytes]
-                        .try_into().unwrap()
-                    )
-                },
-                _ => panic!("Invalid get_regs size bytes!")
+    // "compatible" is a list of NUL-terminated strings, most specific first.
+    pub fn is_compatible(&self, compatible: &[u8]) -> bool {
+        match self.get_property_interned(FDTPropName::Compatible) {
+            Ok(compatible_list) => {
+                return compatible_list
+                    .split(|&b| b == 0)
+                    .any(|entry| entry == compatible);
+            },
+            Err(_) => {
+                return false;
+            }
+        }
+    }
+
+    /*
+     * The reg_idx'th (address, size) pair of a "reg" that may hold several, using the root's
+     * cell sizes: only right for the root's children (e.g. memory@, which is all that's read
+     * before the DT index exists). Anything deeper should go through DTNode::get_reg_idx(),
+     * which uses each node's parent's cells and translates through "ranges".
+     */
+    pub fn get_reg_idx(&self, reg_idx: usize) -> Result<(u64, u64), FDTError> {
+        unsafe {
+            let reg: &[u8] = match self.get_property_interned(FDTPropName::Reg) {
+                Ok(reg) => reg,
+                Err(e) => { return Err(e); }
             };
+            let address_bytes: usize = ADDRESS_CELLS * CELL_BYTES;
+            let size_bytes: usize = SIZE_CELLS * CELL_BYTES;
+            let entry_bytes: usize = address_bytes + size_bytes;
+            if ADDRESS_CELLS > 2 || SIZE_CELLS > 2 || entry_bytes == 0 || reg.len() % entry_bytes != 0 || (reg_idx + 1) * entry_bytes > reg.len() {
+                return Err(FDTError::UnexpectedRegFormat);
+            }
+            let entry: &[u8] = &reg[reg_idx * entry_bytes..(reg_idx + 1) * entry_bytes];
+            let mut address: u64 = 0;
+            for &b in &entry[..address_bytes] { address = (address << 8) | b as u64; }
+            let mut size: u64 = 0;
+            for &b in &entry[address_bytes..] { size = (size << 8) | b as u64; }
             return Ok((address, size));
         }
     }
+
+    // The first (often only) entry of "reg"; see get_reg_idx().
+    pub fn get_reg(&self) -> Result<(u64, u64), FDTError>  {
+        return self.get_reg_idx(0);
+    }
 }
 
+/*
+ * Depth-first over a subtree: the whole tree for new(), everything below a node for
+ * subtree(), or just a node's children for children(). Skipping a node's subnodes (every
+ * child's, for children(); whichever node skip_subnodes() is called after, otherwise)
+ * jumps straight past them using libfdtLite's subtree index instead of walking them.
+ */
 pub struct FDTItr {
-    cur_node: FDTNode
+    cur_node      : FDTNode,
+    // Yields nodes deeper than this, and only as deep as max_depth.
+    root_depth    : i32,
+    max_depth     : i32,
+    skip_subnodes : bool,
+    done          : bool
 } impl FDTItr {
     pub fn new() -> Result<Self, FDTError> {
+        return Self::subtree(&FDTNode::root());
+    }
+
+    // Everything below node, not including node.
+    pub fn subtree(node: &FDTNode) -> Result<Self, FDTError> {
+        return Self::new_below(node, i32::MAX);
+    }
+
+    pub fn children(node: &FDTNode) -> Result<Self, FDTError> {
+        return Self::new_below(node, node.depth + 1);
+    }
+
+    fn new_below(node: &FDTNode, max_depth: i32) -> Result<Self, FDTError> {
         let initialized: bool = unsafe { INITIALIZED };
         if !initialized {
             return Err(FDTError::LibfdtNotInitialized);
         }
 
         return Ok(Self {
-            cur_node: FDTNode { offset: 0, depth: 0 }
+            cur_node: node.clone(),
+            root_depth: node.depth,
+            max_depth: max_depth,
+            skip_subnodes: false,
+            done: false
         });
     }
+
+    // Don't descend into the node next() just returned.
+    pub fn skip_subnodes(&mut self) {
+        self.skip_subnodes = true;
+    }
+
+    // Only nodes listing `compatible` (without the NUL).
+    pub fn with_compatible(self, compatible: &[u8]) -> FDTFilterItr<'_> {
+        return FDTFilterItr { itr: self, property: FDTPropName::Compatible, value: compatible };
+    }
+
+    // Only nodes whose "device_type" is `device_type` (without the NUL), e.g. b"memory".
+    pub fn with_device_type(self, device_type: &[u8]) -> FDTFilterItr<'_> {
+        return FDTFilterItr { itr: self, property: FDTPropName::DeviceType, value: device_type };
+    }
 } impl Iterator for FDTItr {
     type Item = FDTNode;
 
     fn next(&mut self) -> Option<Self::Item> {
+        if self.done {
+            return None;
+        }
+        let skip: bool = self.skip_subnodes || self.cur_node.depth >= self.max_depth;
+        self.skip_subnodes = false;
+        unsafe {
+            self.cur_node.offset = if skip {
+                fdt_next_node_skip_subnodes(
+                    KERNEL_DTB_START as *const c_void,
+                    self.cur_node.offset,
+                    &mut self.cur_node.depth
+                )
+            } else {
+                fdt_next_node(
+                    KERNEL_DTB_START as *const c_void,
+                    self.cur_node.offset,
+                    &mut self.cur_node.depth
+                )
+            };
+        }
+        // Leaving the subtree's root hands back the offset just past it (not a node), at
+        // or above root_depth, rather than an error.
+        if self.cur_node.offset < 0 || self.cur_node.depth <= self.root_depth {
+            self.done = true;
+            return None;
+        }
+        return Some(self.cur_node.clone());
+    }
+}
+
+pub struct FDTFilterItr<'a> {
+    itr      : FDTItr,
+    property : FDTPropName,
+    value    : &'a [u8]
+} impl<'a> Iterator for FDTFilterItr<'a> {
+    type Item = FDTNode;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        while let Some(node) = self.itr.next() {
+            // Both are string lists; a match on any entry counts.
+            if let Ok(list) = node.get_property_interned(self.property) {
+                if list.split(|&b| b == 0).any(|entry| entry == self.value) {
+                    return Some(node);
+                }
+            }
+        }
+        return None;
+    }
+}
+
+pub struct FDTPropItr {
+    offset: i32
+} impl Iterator for FDTPropItr {
+    // (name, value)
+    type Item = (&'static [u8], &'static [u8]);
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.offset < 0 {
+            return None;
+        }
         unsafe {
-            self.cur_node.offset = fdt_next_node(
+            let mut value_len: c_int = 0;
+            let prop: *const fdt_property = fdt_get_property_by_offset(
                 KERNEL_DTB_START as *const c_void,
-                self.cur_node.offset,
-                &mut self.cur_node.depth
+                self.offset,
+                &mut value_len
             );
-        }
-        if self.cur_node.offset < 0 {
-            None
-        } else {
-            Some(self.cur_node.clone())
+            if prop.is_null() {
+                self.offset = value_len;
+                return None;
+            }
+            let mut name_len: c_int = 0;
+            let name_ptr: *const u8 = fdt_get_string(
+                KERNEL_DTB_START as *const c_void,
+                u32::from_be((*prop).nameoff) as c_int,
+                &mut name_len
+            );
+            if name_ptr.is_null() {
+                self.offset = name_len;
+                return None;
+            }
+            self.offset = fdt_next_property_offset(KERNEL_DTB_START as *const c_void, self.offset);
+            return Some((
+                slice::from_raw_parts(name_ptr, name_len as usize),
+                slice::from_raw_parts((*prop).data.as_ptr(), value_len as usize)
+            ));
         }
     }
 }
@@ -0,0 +1,220 @@
+use super::*;
+use super::ppm::*;
+use crate::sync::SpinLock;
+use core::alloc::Layout;
+use core::sync::atomic::{AtomicBool, Ordering};
+
+/*
+ * Bump allocation out of PPM pages ("chunks"), for data that all dies at once: boot-time
+ * tables, a request's scratch space. An allocation is a round-up and an add; nothing is
+ * freed on its own. reset() rewinds to the first chunk in O(1), keeping every chunk for
+ * reuse; release() hands the chunks back to the PPM, one free_page_ref() each.
+ *
+ * Chunks are tracked in the Arena itself rather than in a header inside them, so a whole
+ * page is usable (e.g. a page-sized table). Like the slabs, chunks are addressed through
+ * the linear map once the MMU is on: don't keep an arena across the switch.
+ */
+pub const ARENA_MAX_CHUNKS: usize = 32;
+
+pub enum ArenaError {
+    // Aligned to more than a chunk, or too big to lay out at all.
+    TooBig,
+    OutOfChunks,
+    GetChunkFailed(PPMError),
+    // The boot arena, after release_boot_arena().
+    Released
+}
+
+#[derive(Copy, Clone, Default)]
+pub struct ArenaStats {
+    pub allocs          : u64,
+    pub bytes           : u64,
+    // The only calls into the PPM: one per chunk taken, one per chunk given back.
+    pub chunk_allocs    : u64,
+    pub chunk_frees     : u64,
+    pub resets          : u64,
+    pub releases        : u64
+}
+
+pub struct Arena {
+    chunks     : [*mut u8; ARENA_MAX_CHUNKS],
+    num_chunks : usize,
+    // Chunks before cur_chunk are full (as of the last reset), those after are unused.
+    cur_chunk  : usize,
+    offset     : usize,
+    stats      : ArenaStats
+} unsafe impl Send for Arena {} impl Arena {
+    pub const fn new() -> Self {
+        return Self {
+            chunks: [ptr::null_mut(); ARENA_MAX_CHUNKS],
+            num_chunks: 0,
+            cur_chunk: 0,
+            offset: 0,
+            stats: ArenaStats {
+                allocs: 0, bytes: 0, chunk_allocs: 0, chunk_frees: 0, resets: 0, releases: 0
+            }
+        };
+    }
+
+    pub fn alloc(&mut self, layout: Layout) -> Result<*mut u8, ArenaError> {
+        if layout.align() > PAGE_LEN {
+            return Err(ArenaError::TooBig);
+        }
+        if layout.size() > PAGE_LEN {
+            return self.alloc_run(layout);
+        }
+        if self.cur_chunk < self.num_chunks {
+            let start: usize = (self.offset + layout.align() - 1) & !(layout.align() - 1);
+            if start + layout.size() <= PAGE_LEN {
+                self.offset = start + layout.size();
+                return Ok(self.hand_out(self.chunks[self.cur_chunk], start, layout));
+            }
+            // Chunks are page aligned, so anything fits at the start of the next one.
+            self.cur_chunk += 1;
+            if self.cur_chunk < self.num_chunks {
+                self.offset = layout.size();
+                return Ok(self.hand_out(self.chunks[self.cur_chunk], 0, layout));
+            }
+        }
+
+        if self.num_chunks >= ARENA_MAX_CHUNKS {
+            return Err(ArenaError::OutOfChunks);
+        }
+        let chunk: *mut u8 = match get_free_page(false) {
+            Ok(chunk_pa) => page_pa_to_kva(chunk_pa),
+            Err(e) => { return Err(ArenaError::GetChunkFailed(e)); }
+        };
+        self.stats.chunk_allocs += 1;
+        self.chunks[self.num_chunks] = chunk;
+        self.cur_chunk = self.num_chunks;
+        self.num_chunks += 1;
+        self.offset = layout.size();
+        return Ok(self.hand_out(chunk, 0, layout));
+    }
+
+    /*
+     * Bigger than a chunk: a run of contiguous pages of its own, each tracked as a chunk
+     * so release() frees it like any other. They go in as full chunks, just before the
+     * current one, so everything after cur_chunk is still unused.
+     */
+    fn alloc_run(&mut self, layout: Layout) -> Result<*mut u8, ArenaError> {
+        let num_pages: usize = layout.size().div_ceil(PAGE_LEN);
+        if self.num_chunks + num_pages > ARENA_MAX_CHUNKS {
+            return Err(ArenaError::OutOfChunks);
+        }
+        let run: *mut u8 = match get_free_pages(num_pages, false) {
+            Ok(run_pa) => page_pa_to_kva(run_pa),
+            Err(e) => { return Err(ArenaError::GetChunkFailed(e)); }
+        };
+        self.stats.chunk_allocs += num_pages as u64;
+        let insert_at: usize = core::cmp::min(self.cur_chunk, self.num_chunks);
+        self.chunks.copy_within(insert_at..self.num_chunks, insert_at + num_pages);
+        for page_idx in 0..num_pages {
+            self.chunks[insert_at + page_idx] = unsafe { run.add(page_idx * PAGE_LEN) };
+        }
+        self.num_chunks += num_pages;
+        self.cur_chunk += num_pages;
+        return Ok(self.hand_out(run, 0, layout));
+    }
+
+    #[inline(always)]
+    fn hand_out(&mut self, chunk: *mut u8, start: usize, layout: Layout) -> *mut u8 {
+        self.stats.allocs += 1;
+        self.stats.bytes += layout.size() as u64;
+        return unsafe { chunk.add(start) };
+    }
+
+    // A zeroed T, valid until the arena's next reset() or release().
+    pub fn alloc_zeroed_as<T>(&mut self) -> Result<*mut T, ArenaError> {
+        match self.alloc(Layout::new::<T>()) {
+            Ok(obj) => {
+                unsafe { ptr::write_bytes(obj, 0, size_of::<T>()); }
+                return Ok(obj as *mut T);
+            },
+            Err(e) => {
+                return Err(e);
+            }
+        }
+    }
+
+    // A zeroed [T; len], same lifetime.
+    pub fn alloc_zeroed_slice<T>(&mut self, len: usize) -> Result<*mut T, ArenaError> {
+        let layout: Layout = match Layout::array::<T>(len) {
+            Ok(layout) => layout,
+            Err(_) => { return Err(ArenaError::TooBig); }
+        };
+        match self.alloc(layout) {
+            Ok(objs) => {
+                unsafe { ptr::write_bytes(objs, 0, layout.size()); }
+                return Ok(objs as *mut T);
+            },
+            Err(e) => {
+                return Err(e);
+            }
+        }
+    }
+
+    // Forgets everything allocated, keeping the chunks.
+    pub fn reset(&mut self) {
+        self.cur_chunk = 0;
+        self.offset = 0;
+        self.stats.resets += 1;
+    }
+
+    // Forgets everything allocated and gives the chunks back to the PPM.
+    pub fn release(&mut self) {
+        for chunk_idx in 0..self.num_chunks {
+            let _ = free_page_ref(kva_to_pa(self.chunks[chunk_idx] as usize) as *const u8);
+            self.chunks[chunk_idx] = ptr::null_mut();
+        }
+        self.stats.chunk_frees += self.num_chunks as u64;
+        self.num_chunks = 0;
+        self.cur_chunk = 0;
+        self.offset = 0;
+        self.stats.releases += 1;
+    }
+
+    pub fn stats(&self) -> ArenaStats {
+        return self.stats;
+    }
+}
+
+/*
+ * Whatever only init_devices() needs: the DT index's tables while it's built, its lookup
+ * hashes, probe_devices()' bindings. It's released once init_devices() is done; from
+ * then on, boot_arena_alloc_as() and boot_arena_alloc_slice() fail.
+ */
+static BOOT_ARENA: SpinLock<Arena> = SpinLock::new(Arena::new());
+static BOOT_ARENA_RELEASED: AtomicBool = AtomicBool::new(false);
+
+pub fn boot_arena_alloc_as<T>() -> Result<&'static mut T, ArenaError> {
+    let mut boot_arena = BOOT_ARENA.lock();
+    if BOOT_ARENA_RELEASED.load(Ordering::Relaxed) {
+        return Err(ArenaError::Released);
+    }
+    match boot_arena.alloc_zeroed_as::<T>() {
+        Ok(obj) => { return Ok(unsafe { &mut *obj }); },
+        Err(e) => { return Err(e); }
+    }
+}
+
+pub fn boot_arena_alloc_slice<T>(len: usize) -> Result<&'static mut [T], ArenaError> {
+    let mut boot_arena = BOOT_ARENA.lock();
+    if BOOT_ARENA_RELEASED.load(Ordering::Relaxed) {
+        return Err(ArenaError::Released);
+    }
+    match boot_arena.alloc_zeroed_slice::<T>(len) {
+        Ok(objs) => { return Ok(unsafe { slice::from_raw_parts_mut(objs, len) }); },
+        Err(e) => { return Err(e); }
+    }
+}
+
+pub fn release_boot_arena() {
+    let mut boot_arena = BOOT_ARENA.lock();
+    BOOT_ARENA_RELEASED.store(true, Ordering::Relaxed);
+    boot_arena.release();
+}
+
+pub fn boot_arena_stats() -> ArenaStats {
+    return BOOT_ARENA.lock().stats();
+}
@@ -3,6 +3,8 @@ pub use crate::types::*;
 pub mod ttd;
 pub mod ppm;
 pub mod ptm;
+pub mod slab;
+pub mod arena;
 pub use core::{ptr, arch::asm};
 pub use modular_bitfield::{*, specifiers::*};
 use super::*;
@@ -57,17 +59,31 @@ pub fn init_memory(
     enable_mmu(
         get_kernel_root_table_0() as *const TableDescriptorS1, 
         get_kernel_root_table_1() as *const TableDescriptorS1, 
-        TcrEl1::new()
-            .with_tg0(0b10)
-            .with_tg1(0b01)
-            .with_ds(false)
-            .with_t0sz(T0_T1_SZ as u8)
-            .with_t1sz(T0_T1_SZ as u8)
+        kernel_tcr_el1()
     );
     
     Ok(())
 }
 
+// The rest of init_memory(), for once the secondary CPUs are up to help with it.
+pub fn finish_init_memory() -> Result<(), MemoryError> {
+    if let Err(e) = map_rest_of_ram() {
+        return Err(MemoryError::KernelPTBootStrapFailed(e));
+    }
+    return Ok(());
+}
+
+// Secondary CPUs turn their MMUs on with the exact same configuration as the boot CPU.
+pub fn kernel_tcr_el1() -> TcrEl1 {
+    return TcrEl1::new()
+        .with_tg0(0b10)
+        .with_tg1(0b01)
+        .with_ds(false)
+        .with_t0sz(T0_T1_SZ as u8)
+        .with_t1sz(T0_T1_SZ as u8)
+    ;
+}
+
 #[inline(always)]
 fn enable_mmu(ttbr0_el1: *const TableDescriptorS1, ttbr1_el1: *const TableDescriptorS1, tcr_el1: TcrEl1) {
     unsafe {
@@ -96,8 +112,8 @@ static mut MMU_ENABLED: bool = false;
 #[inline(always)] pub fn mmu_is_enabled() -> bool { unsafe { MMU_ENABLED } }
 
 // 2¹⁴ -> 16KB
-const PAGE_GRANULARITY: usize = 14;
-const PAGE_LEN: usize = 1 << PAGE_GRANULARITY;
+pub const PAGE_GRANULARITY: usize = 14;
+pub const PAGE_LEN: usize = 1 << PAGE_GRANULARITY;
 
 // The size offset of the memory region addressed by $TTBR0_EL1/$TTBR1_EL1. The region size is 2⁽⁶⁴⁻ᵀ⁰-ᵀ¹-ˢz⁾ bytes.
 // i.e. the TTBRs' VA addresses use 64 - T0_T1_SZ = 38 bits. 
@@ -106,6 +122,11 @@ const T0_T1_SZ: usize = 25;
 const TTBR1_MASK: usize = n_bits(T0_T1_SZ) << (usize::BITS as usize - T0_T1_SZ);
 #[inline(always)] pub fn ram_va_to_pa(va: usize) -> usize { unsafe { (!TTBR1_MASK &  va) + RAM_START as usize  } }
 #[inline(always)] pub fn pa_to_ram_va(pa: usize) -> usize { unsafe {   TTBR1_MASK | (pa  - RAM_START as usize) } }
+// Any kernel VA -> PA: the TTBR1 window is a linear map of RAM, and everything else the
+// kernel touches through TTBR0 (its image, boot stack, DTB) is identity mapped.
+#[inline(always)] pub fn kva_to_pa(va: usize) -> usize {
+    if mmu_is_enabled() && va & TTBR1_MASK == TTBR1_MASK { ram_va_to_pa(va) } else { va }
+}
 
 const TABLE_ENTRY_LEN:  usize = 1 <<  3;
 const L1_TABLE_ENTRIES: usize = 1 <<  3;
@@ -1,7 +1,27 @@
 use super::*;
+use crate::sync::SpinLock;
+use crate::executor::parallel_for;
+use core::sync::atomic::{AtomicU64, Ordering};
+
+// Registry entries zeroed per parallel_for() range: 64MB of RAM.
+const REGISTRY_INIT_GRAIN: usize = 4096;
 
 static mut PHYS_PAGE_REGISTRY: *mut u8 = ptr::null_mut();
 static mut PHYS_PAGE_REGISTRY_LEN: usize = 0;
+/*
+ * Entries from here on aren't initialized yet. init_ppm() runs with the MMU off, where
+ * every store is a device-memory write, so it only does what the PPM can hand out before
+ * the rest of RAM is mapped; set_free_page_limit() does more as the limit goes up, and
+ * init_ppm_registry_rest() the rest, on every CPU.
+ */
+static mut PHYS_PAGE_REGISTRY_INIT_LEN: usize = 0;
+// get_free_page() only hands out pages below this one: while only part of RAM is in the
+// kernel's linear map, only pages from that part (see bootstrap_kernel_page_tables()).
+static mut PHYS_PAGE_ALLOC_LIMIT: usize = 0;
+// Serializes registry updates once secondary CPUs are online. Taken with IRQs masked:
+// virtio-blk's completion IRQ unpins its DMA pages (BlkRequest::finish()).
+static PPM_LOCK: SpinLock<()> = SpinLock::new(());
+static REGISTRY_INIT_TICKS: AtomicU64 = AtomicU64::new(0);
 
 pub enum PPMError {
     PageIdxOutOfRange,
@@ -20,18 +40,46 @@ pub fn init_ppm(static_kernel_mem_end: *const u8, ram_start: *const u8, ram_len:
         PHYS_PAGE_REGISTRY = page_idx_to_pa_mut(static_kernel_mem_pages);
         // ram_start for #(physical addresses from 0x0 to start of RAM).
         PHYS_PAGE_REGISTRY_LEN = (ram_start.add(ram_len) as usize) / PAGE_LEN;
-        ptr::write_bytes(PHYS_PAGE_REGISTRY, 0x00, PHYS_PAGE_REGISTRY_LEN);
         let phys_page_registry_pages: usize = (PHYS_PAGE_REGISTRY_LEN / PAGE_LEN) + 1;
         let already_used_pages: usize = static_kernel_mem_pages + phys_page_registry_pages;
-        match increment_ref_count_range(already_used_pages - 1, 0) {
-            Ok(_) => { 
-                return Ok(page_idx_to_pa(already_used_pages));
-            },
-            Err(e) => {
-                return Err(e);
-            }
+        if already_used_pages >= PHYS_PAGE_REGISTRY_LEN {
+            return Err(PPMError::InvalidPageIdxRange);
         }
+        // In use from the start (everything below RAM included): one reference each, in one pass.
+        ptr::write_bytes(PHYS_PAGE_REGISTRY, 0x01, already_used_pages);
+        PHYS_PAGE_REGISTRY_INIT_LEN = already_used_pages;
+        // Until bootstrap_kernel_page_tables() sets the boot window: one L3 table's span past the kernel.
+        set_free_page_limit_locked(core::cmp::min(already_used_pages + PAGE_LEN / size_of::<u64>(), PHYS_PAGE_REGISTRY_LEN));
+        return Ok(page_idx_to_pa(already_used_pages));
+    }
+}
+
+/*
+ * Zero the registry past the boot window, on every CPU, before set_free_page_limit()
+ * lets the PPM at it. Nothing reads those entries until then, so no lock.
+ */
+pub fn init_ppm_registry_rest() {
+    let start_ticks: u64 = timer::counter_ticks();
+    let init_len: usize = unsafe { PHYS_PAGE_REGISTRY_INIT_LEN };
+    let registry_len: usize = get_num_phys_pages();
+    if init_len >= registry_len {
+        return;
     }
+    parallel_for(registry_len - init_len, REGISTRY_INIT_GRAIN, zero_registry_range, init_len);
+    {
+        let _ppm_guard = PPM_LOCK.lock_irqsave();
+        unsafe { PHYS_PAGE_REGISTRY_INIT_LEN = registry_len; }
+    }
+    REGISTRY_INIT_TICKS.fetch_add(timer::counter_ticks() - start_ticks, Ordering::Relaxed);
+}
+
+fn zero_registry_range(start: usize, lo: usize, hi: usize) {
+    unsafe { ptr::write_bytes(PHYS_PAGE_REGISTRY.add(start + lo), 0x00, hi - lo); }
+}
+
+// How long init_ppm_registry_rest() took.
+pub fn ppm_registry_init_ticks() -> u64 {
+    return REGISTRY_INIT_TICKS.load(Ordering::Relaxed);
 }
 
 pub fn get_num_phys_pages() -> usize {
@@ -41,8 +89,9 @@ pub fn get_num_phys_pages() -> usize {
 }
 
 pub fn get_free_page(zero_out: bool) -> Result<*const u8, PPMError> {
+    let ppm_guard = PPM_LOCK.lock_irqsave();
     unsafe {
-        for i in 0..PHYS_PAGE_REGISTRY_LEN {
+        for i in 0..PHYS_PAGE_ALLOC_LIMIT {
             if *PHYS_PAGE_REGISTRY.add(i) == 0 {
                 match increment_ref_count(i) {
                     Ok(ref_count) => {
@@ -54,7 +103,10 @@ pub fn get_free_page(zero_out: bool) -> Result<*const u8, PPMError> {
                         return Err(e);
                     }
                 };
+                // The page is ours now: zero it with IRQs back on.
+                drop(ppm_guard);
                 let page_pa: *const u8 = page_idx_to_pa_mut(i);
+                crate::trace!("ppm: alloc page {:#x} zero {}", page_pa, zero_out);
                 if zero_out {
                     let page_writable_addy: *mut u8 = 
                         if MMU_ENABLED { pa_to_ram_va(page_pa as usize) as *mut u8 }
@@ -73,7 +125,56 @@ pub fn get_free_page(zero_out: bool) -> Result<*const u8, PPMError> {
     }
 }
 
+/*
+ * num_pages free pages in a row, so one range in the linear map too: for the few boot
+ * tables bigger than a page. Each page still has its own reference; free them one by one.
+ */
+pub fn get_free_pages(num_pages: usize, zero_out: bool) -> Result<*const u8, PPMError> {
+    if num_pages == 0 {
+        return Err(PPMError::InvalidPageIdxRange);
+    }
+    let ppm_guard = PPM_LOCK.lock_irqsave();
+    unsafe {
+        let mut run_start: usize = 0;
+        for i in 0..PHYS_PAGE_ALLOC_LIMIT {
+            if *PHYS_PAGE_REGISTRY.add(i) != 0 {
+                run_start = i + 1;
+                continue;
+            }
+            if i + 1 - run_start == num_pages {
+                ptr::write_bytes(PHYS_PAGE_REGISTRY.add(run_start), 0x01, num_pages);
+                drop(ppm_guard);
+                let run_pa: *const u8 = page_idx_to_pa(run_start);
+                crate::trace!("ppm: alloc {} pages at {:#x} zero {}", num_pages, run_pa, zero_out);
+                if zero_out {
+                    ptr::write_bytes(page_pa_to_kva(run_pa), 0x00, num_pages * PAGE_LEN);
+                }
+                return Ok(run_pa);
+            }
+        }
+        return Err(PPMError::NoFreePages);
+    }
+}
+
+// Free pages at or past limit_pa stay free until the limit is raised again.
+pub fn set_free_page_limit(limit_pa: *const u8) {
+    let _ppm_guard = PPM_LOCK.lock_irqsave();
+    set_free_page_limit_locked(core::cmp::min(pa_to_page_idx(limit_pa), get_num_phys_pages()));
+}
+
+// Whatever of the registry the new limit uncovers gets initialized first.
+fn set_free_page_limit_locked(limit_idx: usize) {
+    unsafe {
+        if limit_idx > PHYS_PAGE_REGISTRY_INIT_LEN {
+            ptr::write_bytes(PHYS_PAGE_REGISTRY.add(PHYS_PAGE_REGISTRY_INIT_LEN), 0x00, limit_idx - PHYS_PAGE_REGISTRY_INIT_LEN);
+            PHYS_PAGE_REGISTRY_INIT_LEN = limit_idx;
+        }
+        PHYS_PAGE_ALLOC_LIMIT = limit_idx;
+    }
+}
+
 pub fn get_page(page_idx: usize) -> Result<*const u8, PPMError> {
+    let _ppm_guard = PPM_LOCK.lock_irqsave();
     unsafe {
         if *PHYS_PAGE_REGISTRY.add(page_idx) >= u8::MAX {
             return Err(PPMError::PageHasMaxReferences);
@@ -83,10 +184,57 @@ pub fn get_page(page_idx: usize) -> Result<*const u8, PPMError> {
     }
 }
 
-fn free_page_ref(page_ref: *const u8) -> Result<u8, PPMError> {
+pub fn free_page_ref(page_ref: *const u8) -> Result<u8, PPMError> {
+    let _ppm_guard = PPM_LOCK.lock_irqsave();
+    crate::trace!("ppm: drop ref on page {:#x}", page_ref);
     return decrement_ref_count(pa_to_page_idx(page_ref));
 }
 
+/*
+ * Pin an already allocated page (e.g. one a device is about to DMA to/from) by taking
+ * an extra reference on it: if its owner frees it meanwhile, it can't be handed out
+ * again until the matching unpin_page().
+ */
+pub fn pin_page(page_pa: *const u8) -> Result<u8, PPMError> {
+    let _ppm_guard = PPM_LOCK.lock_irqsave();
+    let page_idx: usize = pa_to_page_idx(page_pa);
+    unsafe {
+        if page_idx >= PHYS_PAGE_REGISTRY_LEN {
+            return Err(PPMError::PageIdxOutOfRange);
+        }
+        // Past the initialized part of the registry, nothing's been handed out.
+        if page_idx >= PHYS_PAGE_REGISTRY_INIT_LEN || *PHYS_PAGE_REGISTRY.add(page_idx) == 0 {
+            return Err(PPMError::PageHasNoReferences);
+        }
+    }
+    crate::trace!("ppm: pin page {:#x}", page_pa);
+    return increment_ref_count(page_idx);
+}
+
+pub fn unpin_page(page_pa: *const u8) -> Result<u8, PPMError> {
+    return free_page_ref(page_pa);
+}
+
+// Hands out a zeroed page as a T in kernel VA space. Used for driver state that is
+// too big for the kernel's .bss; T must be valid as all-zero and fit in one page.
+pub fn get_free_page_as<T>() -> Result<&'static mut T, PPMError> {
+    const { assert!(size_of::<T>() <= PAGE_LEN) };
+    match get_free_page(true) {
+        Ok(page_pa) => {
+            return Ok(unsafe { &mut *(page_pa_to_kva(page_pa) as *mut T) });
+        },
+        Err(e) => {
+            return Err(e);
+        }
+    }
+}
+
+#[inline(always)]
+pub fn page_pa_to_kva(page_pa: *const u8) -> *mut u8 {
+    if mmu_is_enabled() { pa_to_ram_va(page_pa as usize) as *mut u8 }
+    else                {              page_pa           as *mut u8 }
+}
+
 fn increment_ref_count(page_idx: usize) -> Result<u8, PPMError> {
     unsafe {
         if page_idx >= PHYS_PAGE_REGISTRY_LEN {
@@ -1,4 +1,7 @@
 use super::*;
+use crate::sync::SpinLock;
+use crate::executor::parallel_for;
+use core::sync::atomic::{AtomicU64, Ordering};
 
 pub enum PTMError {
     GetFreePageFailed(PPMError),
@@ -6,6 +9,19 @@ pub enum PTMError {
     VAAlreadyMapped
 }
 
+// Serializes changes to the live kernel tables once more than one CPU can be making them.
+static PTM_LOCK: SpinLock<()> = SpinLock::new(());
+
+// RAM one L3 table maps, and one L2 table.
+const L3_TABLE_SPAN: usize = L3_TABLE_ENTRIES * PAGE_LEN;
+const L2_TABLE_SPAN: usize = L2_TABLE_ENTRIES * L3_TABLE_SPAN;
+// The least of RAM past the kernel's static memory that's in the linear map before the
+// secondaries are up. Booting allocates a few dozen pages by then.
+const BOOT_LINEAR_MAP_MIN_LEN: usize = L3_TABLE_SPAN;
+// How much of RAM (from its start) the TTBR1 linear map covers so far.
+static mut LINEAR_MAP_LEN: usize = 0;
+static MAP_REST_TICKS: AtomicU64 = AtomicU64::new(0);
+
 #[unsafe(link_section = ".kernel_root_tables")] #[unsafe(no_mangle)]
 static mut KERNEL_ROOT_TABLE0: L1Table = [TableDescriptorS1::new(); L1_TABLE_ENTRIES];
 #[inline(always)] pub fn get_kernel_root_table_0() -> &'static mut L1Table { unsafe { &mut *(&raw mut KERNEL_ROOT_TABLE0) } }
@@ -136,8 +152,19 @@ pub fn bootstrap_kernel_page_tables(
          * • (One PTE/TTE) ÷ (2048 PTE/TTEs in an L1/L2/L3 node) = 8 ÷ (2048 × 8) = 1 ÷ 2048 ≅ 0.05%
          * 
          * Therefore, there is no practical concern about mapping all of RAM PA space into the kernel's VA space via page tables.
+         *
+         * It is a page table walk per 16KB of RAM though, so only a window at the start of RAM
+         * (ending on an L3 table boundary) is mapped here, on the one CPU there is; the PPM
+         * only hands out pages from that window until map_rest_of_ram() maps the rest of it
+         * on every CPU.
         */
-        for pa in (ram_start as usize..(ram_start.add(ram_len)) as usize).step_by(PAGE_LEN) {
+        let boot_map_len: usize = core::cmp::min(
+            ram_len,
+            (kernel_mem_end as usize - ram_start as usize + BOOT_LINEAR_MAP_MIN_LEN).next_multiple_of(L3_TABLE_SPAN)
+        );
+        set_free_page_limit(ram_start.add(boot_map_len));
+        LINEAR_MAP_LEN = boot_map_len;
+        for pa in (ram_start as usize..(ram_start.add(boot_map_len)) as usize).step_by(PAGE_LEN) {
             let cur_page: *const u8 = pa as *const u8;
             match map_page_to_va(
                 &mut *(&raw mut KERNEL_ROOT_TABLE1), 
@@ -160,12 +187,101 @@ pub fn bootstrap_kernel_page_tables(
     }
 }
 
+struct LinearMapJob {
+    ram_start : *const u8,
+    ram_len   : usize,
+    // Offset into RAM of chunk 0.
+    start     : usize,
+    error     : SpinLock<Option<PTMError>>
+}
+
+/*
+ * Finish the linear map bootstrap_kernel_page_tables() started, once the secondaries
+ * are up to help: one task per L3 table's worth of RAM. No two tasks touch the same
+ * table or table entry (the L2 tables are all made up front), so they don't take
+ * PTM_LOCK; the PPM's own lock covers their L3 table allocations, which come out of the
+ * part of RAM that's already mapped.
+ */
+pub fn map_rest_of_ram() -> Result<(), PTMError> {
+    let start_ticks: u64 = timer::counter_ticks();
+    let ram_start: *const u8 = unsafe { RAM_START };
+    let ram_len: usize = unsafe { RAM_LEN };
+    let start: usize = unsafe { LINEAR_MAP_LEN };
+    if start >= ram_len {
+        return Ok(());
+    }
+
+    let mut l2_start: usize = start.next_multiple_of(L2_TABLE_SPAN);
+    while l2_start < ram_len {
+        let first_page: *const u8 = unsafe { ram_start.add(l2_start) };
+        if let Err(e) = map_page_to_va(get_kernel_root_table_1(), first_page, l2_start as *const u8, false) {
+            return Err(e);
+        }
+        l2_start += L2_TABLE_SPAN;
+    }
+
+    let job: LinearMapJob = LinearMapJob {
+        ram_start: ram_start,
+        ram_len: ram_len,
+        start: start,
+        error: SpinLock::new(None)
+    };
+    parallel_for(
+        (ram_len - start).div_ceil(L3_TABLE_SPAN),
+        1,
+        map_ram_chunks,
+        &job as *const LinearMapJob as usize
+    );
+    if let Some(e) = job.error.lock().take() {
+        return Err(e);
+    }
+    // The new pages' registry entries, before the PPM can hand them out.
+    init_ppm_registry_rest();
+
+    unsafe {
+        LINEAR_MAP_LEN = ram_len;
+        set_free_page_limit(ram_start.add(ram_len));
+    }
+    MAP_REST_TICKS.store(timer::counter_ticks() - start_ticks, Ordering::Relaxed);
+    return Ok(());
+}
+
+// How long map_rest_of_ram() took, registry included.
+pub fn map_rest_of_ram_ticks() -> u64 {
+    return MAP_REST_TICKS.load(Ordering::Relaxed);
+}
+
+fn map_ram_chunks(job_arg: usize, lo: usize, hi: usize) {
+    let job: &LinearMapJob = unsafe { &*(job_arg as *const LinearMapJob) };
+    let chunks_start: usize = job.start + lo * L3_TABLE_SPAN;
+    let chunks_end: usize = core::cmp::min(job.start + hi * L3_TABLE_SPAN, job.ram_len);
+    for offset in (chunks_start..chunks_end).step_by(PAGE_LEN) {
+        let cur_page: *const u8 = unsafe { job.ram_start.add(offset) };
+        let result: Result<*const u8, PTMError> = match map_page_to_va(get_kernel_root_table_1(), cur_page, offset as *const u8, false) {
+            Ok(mapped_pa) if mapped_pa != cur_page => Err(PTMError::VAAlreadyMapped),
+            Ok(mapped_pa) => Ok(mapped_pa),
+            Err(e) => Err(e)
+        };
+        if let Err(e) = result {
+            let mut error = job.error.lock();
+            if error.is_none() {
+                *error = Some(e);
+            }
+            return;
+        }
+    }
+    // Every CPU's table walker sees the new entries before the PPM can hand the pages out.
+    unsafe { dsb(SBType::St); }
+}
+
 // TODO(chungmcl): This currently just identity maps the MMIO physical addy for simplicity.
 // How do I handle if a VA is already taken? Should a caller be able to specify a VA to map to?
 pub fn map_mmio_range(
     mmio_address: *const u8,
     mmio_len: usize
 ) -> Result<(), PTMError> {
+    crate::trace!("ptm: map mmio {:#x} len {:#x}", mmio_address, mmio_len);
+    let _ptm_guard = PTM_LOCK.lock_irqsave();
     unsafe {
         let mmio_pg_range_lo: *const u8 = page_idx_to_pa(pa_to_page_idx(mmio_address));
         let mmio_pg_range_hi: *const u8 = page_idx_to_pa(pa_to_page_idx(mmio_address.add(mmio_len)));
@@ -212,6 +328,7 @@ fn map_page_to_va(
         } else {
             match get_free_page(true) {
                 Ok(l2_table_pa) => {
+                    crate::trace!("ptm: new L2 table {:#x} for va {:#x}", l2_table_pa, va);
                     root_table[l1_idx] = TableDescriptorS1::new()
                         .with_valid_bit(true)
                         .with_table_descriptor(true)
@@ -234,6 +351,7 @@ fn map_page_to_va(
         } else {
             match get_free_page(true) {
                 Ok(l3_table_pa) => {
+                    crate::trace!("ptm: new L3 table {:#x} for va {:#x}", l3_table_pa, va);
                     l2_table[l2_idx] = TableDescriptorS1::new()
                         .with_valid_bit(true)
                         .with_table_descriptor(true)
@@ -252,6 +370,7 @@ fn map_page_to_va(
         if l3_table[l3_idx].valid_bit() && l3_table[l3_idx].descriptor_type() && !overwrite {
             return Ok(oab_to_pa(l3_table[l3_idx].oab() as u64));
         } else {
+            crate::trace!("ptm: map va {:#x} -> pa {:#x}", va, page_pa);
             l3_table[l3_idx] = PageDescriptorS1::new()
                 .with_valid_bit(true)
                 .with_descriptor_type(true)
@@ -0,0 +1,504 @@
+use super::*;
+use super::ppm::*;
+use crate::sync::SpinLock;
+use crate::devices::cpu::{cpu_id, MAX_CPUS};
+use crate::exceptions::{irq_save, irq_restore};
+use core::alloc::{GlobalAlloc, Layout};
+use core::sync::atomic::{AtomicPtr, AtomicU64, Ordering};
+
+/*
+ * The kernel heap (Box, Vec, ...): power-of-two size classes from 16B to 8KB, each
+ * carved out of whole PPM pages ("slabs"). Every object is naturally aligned (64B and up:
+ * cache-line aligned) and no two slabs share a line. Free objects are linked through
+ * their first word.
+ *
+ * Up to 64B, a slab's header takes its page's first cache line and the objects fill the
+ * rest; dealloc finds the header by rounding down to the page. From 128B up, a header on
+ * the page would cost a whole object (half the page at 8KB), so it's allocated from the
+ * 64B class instead and found through a page-indexed table of header pointers: every
+ * page holds PAGE_LEN / obj_len objects, for 64B of header and 8B of table per slab.
+ *
+ * In front of the slabs, every CPU keeps a small stack of free objects per class, touched
+ * with only IRQs masked. Only when it runs dry (or fills up) does a CPU take its class's
+ * lock, to move half a stack's worth from (or back to) the slabs. A slab that empties goes
+ * back to the PPM unless it's its class's only empty one.
+ *
+ * Bigger than 8KB (up to a page) gets a page of its own. The PPM has nothing physically
+ * contiguous past that, so those allocations fail. So does anything before the MMU is
+ * on: slabs are addressed through the TTBR1 linear map.
+ */
+pub const SLAB_MIN_OBJ_LEN: usize = 16;
+pub const SLAB_MAX_OBJ_LEN: usize = 8192;
+// 16B << 0 ..= 16B << 9
+pub const SLAB_NUM_CLASSES: usize = 10;
+const SLAB_HEADER_LEN: usize = 64;
+// Classes at least this big keep their headers off the slab, in SLAB_HEADER_CLASS.
+const SLAB_OFF_SLAB_MIN_LEN: usize = 2 * SLAB_HEADER_LEN;
+const SLAB_HEADER_CLASS: usize = (SLAB_HEADER_LEN.trailing_zeros() - SLAB_MIN_OBJ_LEN.trailing_zeros()) as usize;
+// Off-slab headers by page index: a page of pointers per leaf, leaves made as needed.
+// 512 leaves cover physical addresses up to 16GB.
+const SLAB_HEADER_LEAF_LEN: usize = PAGE_LEN / size_of::<*mut SlabHeader>();
+const SLAB_HEADER_DIR_LEN: usize = 512;
+const SLAB_CPU_CACHE_LEN: usize = 16;
+const SLAB_MAGIC: u32 = 0x51ab_51ab;
+
+#[repr(C, align(64))]
+struct SlabHeader {
+    magic    : u32,
+    class    : u32,
+    in_use   : u32,
+    capacity : u32,
+    free     : *mut FreeObj,
+    prev     : *mut SlabHeader,
+    next     : *mut SlabHeader,
+    // The slab's page: the header's own unless it's off-slab.
+    page     : *mut u8
+}
+const _: () = assert!(size_of::<SlabHeader>() == SLAB_HEADER_LEN);
+
+struct SlabHeaderLeaf {
+    headers: [*mut SlabHeader; SLAB_HEADER_LEAF_LEN]
+}
+
+struct FreeObj {
+    next: *mut FreeObj
+}
+
+// Slabs with at least one free object, doubly linked so a filled or emptied one can be
+// unlinked from anywhere in the list.
+struct SlabClass {
+    partial     : *mut SlabHeader,
+    empty_slabs : usize
+} unsafe impl Send for SlabClass {} impl SlabClass {
+    const fn new() -> Self {
+        return Self { partial: ptr::null_mut(), empty_slabs: 0 };
+    }
+
+    unsafe fn link(&mut self, slab: *mut SlabHeader) {
+        unsafe {
+            (*slab).prev = ptr::null_mut();
+            (*slab).next = self.partial;
+            if !self.partial.is_null() {
+                (*self.partial).prev = slab;
+            }
+            self.partial = slab;
+        }
+    }
+
+    unsafe fn unlink(&mut self, slab: *mut SlabHeader) {
+        unsafe {
+            if (*slab).prev.is_null() {
+                self.partial = (*slab).next;
+            } else {
+                (*(*slab).prev).next = (*slab).next;
+            }
+            if !(*slab).next.is_null() {
+                (*(*slab).next).prev = (*slab).prev;
+            }
+            (*slab).prev = ptr::null_mut();
+            (*slab).next = ptr::null_mut();
+        }
+    }
+}
+
+#[repr(C, align(64))]
+struct SlabCpuCache {
+    objs   : [[*mut u8; SLAB_CPU_CACHE_LEN]; SLAB_NUM_CLASSES],
+    counts : [usize; SLAB_NUM_CLASSES]
+} impl SlabCpuCache {
+    const fn new() -> Self {
+        return Self {
+            objs: [[ptr::null_mut(); SLAB_CPU_CACHE_LEN]; SLAB_NUM_CLASSES],
+            counts: [0; SLAB_NUM_CLASSES]
+        };
+    }
+}
+
+struct SlabStats {
+    allocs          : AtomicU64,
+    frees           : AtomicU64,
+    cache_hits      : AtomicU64,
+    refills         : AtomicU64,
+    flushes         : AtomicU64,
+    slabs           : AtomicU64,
+    // Objects out of the slabs: in use, or sitting in some CPU's cache.
+    taken           : AtomicU64,
+    // What callers actually asked for, of the objects in use.
+    requested_bytes : AtomicU64
+} impl SlabStats {
+    const fn new() -> Self {
+        return Self {
+            allocs: AtomicU64::new(0), frees: AtomicU64::new(0), cache_hits: AtomicU64::new(0),
+            refills: AtomicU64::new(0), flushes: AtomicU64::new(0), slabs: AtomicU64::new(0),
+            taken: AtomicU64::new(0), requested_bytes: AtomicU64::new(0)
+        };
+    }
+}
+
+#[derive(Copy, Clone, Default)]
+pub struct SlabClassStats {
+    pub obj_len         : usize,
+    pub slabs           : u64,
+    // Objects all of this class's slabs hold.
+    pub capacity        : u64,
+    pub in_use          : u64,
+    pub cached          : u64,
+    pub requested_bytes : u64,
+    pub allocs          : u64,
+    pub cache_hits      : u64,
+    pub refills         : u64,
+    pub flushes         : u64
+}
+
+// Only ever taken with IRQs masked.
+static SLAB_CLASSES: [SpinLock<SlabClass>; SLAB_NUM_CLASSES] = [const { SpinLock::new(SlabClass::new()) }; SLAB_NUM_CLASSES];
+static SLAB_STATS: [SlabStats; SLAB_NUM_CLASSES] = [const { SlabStats::new() }; SLAB_NUM_CLASSES];
+// Each CPU only touches its own, with IRQs masked.
+static mut SLAB_CPU_CACHES: [SlabCpuCache; MAX_CPUS] = [const { SlabCpuCache::new() }; MAX_CPUS];
+// Only a class's own slabs' entries are touched, and only under its lock.
+static SLAB_HEADER_DIR: [AtomicPtr<SlabHeaderLeaf>; SLAB_HEADER_DIR_LEN] = [const { AtomicPtr::new(ptr::null_mut()) }; SLAB_HEADER_DIR_LEN];
+static PAGE_ALLOCS: AtomicU64 = AtomicU64::new(0);
+static PAGE_FREES: AtomicU64 = AtomicU64::new(0);
+
+pub struct SlabAllocator;
+
+#[global_allocator]
+static KERNEL_ALLOCATOR: SlabAllocator = SlabAllocator;
+
+unsafe impl GlobalAlloc for SlabAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        return slab_alloc(layout);
+    }
+
+    unsafe fn dealloc(&self, obj: *mut u8, layout: Layout) {
+        slab_free(obj, layout);
+    }
+
+    // Anything that stays in its size class stays where it is.
+    unsafe fn realloc(&self, obj: *mut u8, layout: Layout, new_len: usize) -> *mut u8 {
+        let new_layout: Layout = unsafe { Layout::from_size_align_unchecked(new_len, layout.align()) };
+        if let (Some(class_idx), Some(new_class_idx)) = (class_of(layout), class_of(new_layout)) {
+            if class_idx == new_class_idx {
+                let stats: &SlabStats = &SLAB_STATS[class_idx];
+                stats.requested_bytes.fetch_add(new_len as u64, Ordering::Relaxed);
+                stats.requested_bytes.fetch_sub(layout.size() as u64, Ordering::Relaxed);
+                return obj;
+            }
+        }
+        let new_obj: *mut u8 = slab_alloc(new_layout);
+        if !new_obj.is_null() {
+            unsafe { ptr::copy_nonoverlapping(obj, new_obj, core::cmp::min(layout.size(), new_len)); }
+            slab_free(obj, layout);
+        }
+        return new_obj;
+    }
+}
+
+#[inline(always)]
+fn class_of(layout: Layout) -> Option<usize> {
+    let len: usize = core::cmp::max(core::cmp::max(layout.size(), layout.align()), SLAB_MIN_OBJ_LEN);
+    if len > SLAB_MAX_OBJ_LEN {
+        return None;
+    }
+    return Some((len.next_power_of_two().trailing_zeros() - SLAB_MIN_OBJ_LEN.trailing_zeros()) as usize);
+}
+
+#[inline(always)]
+fn class_obj_len(class_idx: usize) -> usize {
+    return SLAB_MIN_OBJ_LEN << class_idx;
+}
+
+#[inline(always)]
+fn class_off_slab(class_idx: usize) -> bool {
+    return class_obj_len(class_idx) >= SLAB_OFF_SLAB_MIN_LEN;
+}
+
+// Objects start right after an on-slab header (which is as big as they are, or bigger).
+#[inline(always)]
+fn class_first_obj(class_idx: usize) -> usize {
+    return if class_off_slab(class_idx) { 0 } else { SLAB_HEADER_LEN };
+}
+
+#[inline(always)]
+fn class_capacity(class_idx: usize) -> usize {
+    return (PAGE_LEN - class_first_obj(class_idx)) / class_obj_len(class_idx);
+}
+
+pub fn slab_alloc(layout: Layout) -> *mut u8 {
+    if !mmu_is_enabled() {
+        return ptr::null_mut();
+    }
+    let class_idx: usize = match class_of(layout) {
+        Some(class_idx) => class_idx,
+        None => { return page_alloc(layout); }
+    };
+    let stats: &SlabStats = &SLAB_STATS[class_idx];
+
+    let daif: u64 = irq_save();
+    let cache: &mut SlabCpuCache = unsafe { &mut (*(&raw mut SLAB_CPU_CACHES))[cpu_id()] };
+    if cache.counts[class_idx] == 0 {
+        cache.counts[class_idx] = slab_refill(class_idx, &mut cache.objs[class_idx][..SLAB_CPU_CACHE_LEN / 2]);
+        stats.refills.fetch_add(1, Ordering::Relaxed);
+    } else {
+        stats.cache_hits.fetch_add(1, Ordering::Relaxed);
+    }
+    let obj: *mut u8 = if cache.counts[class_idx] == 0 {
+        ptr::null_mut()
+    } else {
+        cache.counts[class_idx] -= 1;
+        cache.objs[class_idx][cache.counts[class_idx]]
+    };
+    irq_restore(daif);
+
+    if !obj.is_null() {
+        stats.allocs.fetch_add(1, Ordering::Relaxed);
+        stats.requested_bytes.fetch_add(layout.size() as u64, Ordering::Relaxed);
+    }
+    return obj;
+}
+
+pub fn slab_free(obj: *mut u8, layout: Layout) {
+    let class_idx: usize = match class_of(layout) {
+        Some(class_idx) => class_idx,
+        None => { return page_free(obj, layout); }
+    };
+    let stats: &SlabStats = &SLAB_STATS[class_idx];
+    stats.frees.fetch_add(1, Ordering::Relaxed);
+    stats.requested_bytes.fetch_sub(layout.size() as u64, Ordering::Relaxed);
+
+    let daif: u64 = irq_save();
+    let cache: &mut SlabCpuCache = unsafe { &mut (*(&raw mut SLAB_CPU_CACHES))[cpu_id()] };
+    if cache.counts[class_idx] == SLAB_CPU_CACHE_LEN {
+        slab_release(class_idx, &cache.objs[class_idx][SLAB_CPU_CACHE_LEN / 2..]);
+        cache.counts[class_idx] = SLAB_CPU_CACHE_LEN / 2;
+        stats.flushes.fetch_add(1, Ordering::Relaxed);
+    }
+    cache.objs[class_idx][cache.counts[class_idx]] = obj;
+    cache.counts[class_idx] += 1;
+    irq_restore(daif);
+}
+
+// Takes up to objs.len() objects out of the class's slabs. IRQs must be masked.
+fn slab_refill(class_idx: usize, objs: &mut [*mut u8]) -> usize {
+    let mut class = SLAB_CLASSES[class_idx].lock();
+    let mut num_objs: usize = 0;
+    while num_objs < objs.len() {
+        if class.partial.is_null() {
+            match slab_new(class_idx) {
+                Some(slab) => unsafe {
+                    class.link(slab);
+                    class.empty_slabs += 1;
+                },
+                None => { break; }
+            }
+        }
+        let slab: *mut SlabHeader = class.partial;
+        unsafe {
+            if (*slab).in_use == 0 {
+                class.empty_slabs -= 1;
+            }
+            while num_objs < objs.len() && !(*slab).free.is_null() {
+                let obj: *mut FreeObj = (*slab).free;
+                (*slab).free = (*obj).next;
+                (*slab).in_use += 1;
+                objs[num_objs] = obj as *mut u8;
+                num_objs += 1;
+            }
+            if (*slab).free.is_null() {
+                class.unlink(slab);
+            }
+        }
+    }
+    SLAB_STATS[class_idx].taken.fetch_add(num_objs as u64, Ordering::Relaxed);
+    return num_objs;
+}
+
+// Where an off-slab header for `page` goes; null if there's no room for one.
+fn off_slab_header_slot(page: *mut u8, create: bool) -> *mut *mut SlabHeader {
+    let page_idx: usize = pa_to_page_idx(kva_to_pa(page as usize) as *const u8);
+    let dir_idx: usize = page_idx / SLAB_HEADER_LEAF_LEN;
+    if dir_idx >= SLAB_HEADER_DIR_LEN {
+        return ptr::null_mut();
+    }
+    let mut leaf: *mut SlabHeaderLeaf = SLAB_HEADER_DIR[dir_idx].load(Ordering::Acquire);
+    if leaf.is_null() {
+        if !create {
+            return ptr::null_mut();
+        }
+        let new_leaf: *mut SlabHeaderLeaf = match get_free_page(true) {
+            Ok(leaf_pa) => page_pa_to_kva(leaf_pa) as *mut SlabHeaderLeaf,
+            Err(_e) => { return ptr::null_mut(); }
+        };
+        // Two classes can race to make the same leaf.
+        match SLAB_HEADER_DIR[dir_idx].compare_exchange(ptr::null_mut(), new_leaf, Ordering::AcqRel, Ordering::Acquire) {
+            Ok(_) => { leaf = new_leaf; },
+            Err(winner) => {
+                let _ = free_page_ref(kva_to_pa(new_leaf as usize) as *const u8);
+                leaf = winner;
+            }
+        }
+    }
+    return unsafe { &raw mut (*leaf).headers[page_idx % SLAB_HEADER_LEAF_LEN] };
+}
+
+// The header of the slab obj is in; null if there isn't one.
+fn slab_of(class_idx: usize, obj: *mut u8) -> *mut SlabHeader {
+    let page: *mut u8 = (obj as usize & !(PAGE_LEN - 1)) as *mut u8;
+    if !class_off_slab(class_idx) {
+        return page as *mut SlabHeader;
+    }
+    let slot: *mut *mut SlabHeader = off_slab_header_slot(page, false);
+    return if slot.is_null() { ptr::null_mut() } else { unsafe { *slot } };
+}
+
+/*
+ * Off-slab headers come straight from SLAB_HEADER_CLASS's slabs, not through a CPU cache:
+ * we're already inside one. That class's headers are on-slab, so this never recurses.
+ */
+fn off_slab_header_alloc() -> *mut SlabHeader {
+    let mut header: [*mut u8; 1] = [ptr::null_mut()];
+    if slab_refill(SLAB_HEADER_CLASS, &mut header) == 0 {
+        return ptr::null_mut();
+    }
+    let stats: &SlabStats = &SLAB_STATS[SLAB_HEADER_CLASS];
+    stats.allocs.fetch_add(1, Ordering::Relaxed);
+    stats.requested_bytes.fetch_add(SLAB_HEADER_LEN as u64, Ordering::Relaxed);
+    return header[0] as *mut SlabHeader;
+}
+
+fn off_slab_header_free(header: *mut SlabHeader) {
+    let stats: &SlabStats = &SLAB_STATS[SLAB_HEADER_CLASS];
+    stats.frees.fetch_add(1, Ordering::Relaxed);
+    stats.requested_bytes.fetch_sub(SLAB_HEADER_LEN as u64, Ordering::Relaxed);
+    slab_release(SLAB_HEADER_CLASS, &[header as *mut u8]);
+}
+
+// Puts objects back in their slabs. IRQs must be masked.
+fn slab_release(class_idx: usize, objs: &[*mut u8]) {
+    let mut class = SLAB_CLASSES[class_idx].lock();
+    for &obj in objs {
+        let slab: *mut SlabHeader = slab_of(class_idx, obj);
+        unsafe {
+            if slab.is_null() || (*slab).magic != SLAB_MAGIC || (*slab).class != class_idx as u32 {
+                panic!("slab_release(): object isn't from a slab of its size class!");
+            }
+            if (*slab).free.is_null() {
+                class.link(slab);
+            }
+            let free_obj: *mut FreeObj = obj as *mut FreeObj;
+            (*free_obj).next = (*slab).free;
+            (*slab).free = free_obj;
+            (*slab).in_use -= 1;
+            if (*slab).in_use == 0 {
+                if class.empty_slabs == 0 {
+                    class.empty_slabs += 1;
+                } else {
+                    class.unlink(slab);
+                    (*slab).magic = 0;
+                    let page: *mut u8 = (*slab).page;
+                    if class_off_slab(class_idx) {
+                        *off_slab_header_slot(page, false) = ptr::null_mut();
+                        off_slab_header_free(slab);
+                    }
+                    let _ = free_page_ref(kva_to_pa(page as usize) as *const u8);
+                    SLAB_STATS[class_idx].slabs.fetch_sub(1, Ordering::Relaxed);
+                }
+            }
+        }
+    }
+    SLAB_STATS[class_idx].taken.fetch_sub(objs.len() as u64, Ordering::Relaxed);
+}
+
+// A fresh page, every object on its free list (in address order).
+fn slab_new(class_idx: usize) -> Option<*mut SlabHeader> {
+    let page_pa: *const u8 = match get_free_page(false) {
+        Ok(page_pa) => page_pa,
+        Err(_e) => { return None; }
+    };
+    let page: *mut u8 = page_pa_to_kva(page_pa);
+    let obj_len: usize = class_obj_len(class_idx);
+    let capacity: usize = class_capacity(class_idx);
+    let first_obj: usize = class_first_obj(class_idx);
+    let slab: *mut SlabHeader = if class_off_slab(class_idx) {
+        let slot: *mut *mut SlabHeader = off_slab_header_slot(page, true);
+        let header: *mut SlabHeader = if slot.is_null() { ptr::null_mut() } else { off_slab_header_alloc() };
+        if header.is_null() {
+            let _ = free_page_ref(page_pa);
+            return None;
+        }
+        unsafe { *slot = header; }
+        header
+    } else {
+        page as *mut SlabHeader
+    };
+    unsafe {
+        let mut free: *mut FreeObj = ptr::null_mut();
+        for obj_idx in (0..capacity).rev() {
+            let obj: *mut FreeObj = page.add(first_obj + obj_idx * obj_len) as *mut FreeObj;
+            (*obj).next = free;
+            free = obj;
+        }
+        *slab = SlabHeader {
+            magic: SLAB_MAGIC,
+            class: class_idx as u32,
+            in_use: 0,
+            capacity: capacity as u32,
+            free: free,
+            prev: ptr::null_mut(),
+            next: ptr::null_mut(),
+            page: page
+        };
+    }
+    SLAB_STATS[class_idx].slabs.fetch_add(1, Ordering::Relaxed);
+    return Some(slab);
+}
+
+// Past a page, a run of them (e.g. the DT index's node table on a big DTB).
+fn page_alloc(layout: Layout) -> *mut u8 {
+    if layout.align() > PAGE_LEN {
+        return ptr::null_mut();
+    }
+    let num_pages: usize = layout.size().div_ceil(PAGE_LEN);
+    match get_free_pages(num_pages, false) {
+        Ok(run_pa) => {
+            PAGE_ALLOCS.fetch_add(num_pages as u64, Ordering::Relaxed);
+            return page_pa_to_kva(run_pa);
+        },
+        Err(_e) => {
+            return ptr::null_mut();
+        }
+    }
+}
+
+fn page_free(run: *mut u8, layout: Layout) {
+    let num_pages: usize = layout.size().div_ceil(PAGE_LEN);
+    PAGE_FREES.fetch_add(num_pages as u64, Ordering::Relaxed);
+    let run_pa: usize = kva_to_pa(run as usize);
+    for page_idx in 0..num_pages {
+        let _ = free_page_ref((run_pa + page_idx * PAGE_LEN) as *const u8);
+    }
+}
+
+pub fn slab_class_stats(class_idx: usize) -> SlabClassStats {
+    let stats: &SlabStats = &SLAB_STATS[class_idx];
+    let slabs: u64 = stats.slabs.load(Ordering::Relaxed);
+    let allocs: u64 = stats.allocs.load(Ordering::Relaxed);
+    let in_use: u64 = allocs.saturating_sub(stats.frees.load(Ordering::Relaxed));
+    return SlabClassStats {
+        obj_len: class_obj_len(class_idx),
+        slabs: slabs,
+        capacity: slabs * class_capacity(class_idx) as u64,
+        in_use: in_use,
+        cached: stats.taken.load(Ordering::Relaxed).saturating_sub(in_use),
+        requested_bytes: stats.requested_bytes.load(Ordering::Relaxed),
+        allocs: allocs,
+        cache_hits: stats.cache_hits.load(Ordering::Relaxed),
+        refills: stats.refills.load(Ordering::Relaxed),
+        flushes: stats.flushes.load(Ordering::Relaxed)
+    };
+}
+
+// Pages handed out whole, for allocations too big for a slab.
+pub fn slab_page_allocs_in_use() -> u64 {
+    return PAGE_ALLOCS.load(Ordering::Relaxed).saturating_sub(PAGE_FREES.load(Ordering::Relaxed));
+}
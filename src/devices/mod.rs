@@ -1,17 +1,25 @@
 pub mod libfdt_lite;
+pub mod dt_index;
+pub mod drivers;
 pub mod pl011_uart;
+pub mod console;
 pub mod memory;
 pub mod virtio;
+pub mod cpu;
+pub mod gic;
+pub mod timer;
 
 pub use core::ffi::{c_void, c_int};
 pub use core::{slice, ptr};
 pub use num_enum::FromPrimitive;
 pub use super::*;
 pub use libfdt_lite::*;
-pub use memory::{ptm::{map_mmio_range, PTMError}, MemoryError};
+pub use dt_index::{DTNode, DTIndexError};
+pub use memory::{ptm::{map_mmio_range, PTMError}, arena::ArenaError, MemoryError};
 pub use virtio::VirtIOError;
 pub use pl011_uart::PL011Error;
-use memory::{init_memory};
+pub use cpu::CPUError;
+use memory::{init_memory, finish_init_memory};
 use crate::{println, JerryMetaData};
 
 pub enum DeviceInitError {
@@ -20,8 +28,11 @@ pub enum DeviceInitError {
     MemoryDeviceNotFound,
     SearchForMemoryDeviceFailed(FDTError),
     MemoryInitFailed(MemoryError),
+    DTIndexFailed(DTIndexError),
+    AllocProbeScratchFailed(ArenaError),
     VirtIOSetup(VirtIOError),
-    PL011Setup(PL011Error)
+    PL011Setup(PL011Error),
+    CPUSetup(CPUError)
 }
  
 pub fn init_devices(kernel_meta_data: JerryMetaData) -> Result<(), DeviceInitError> {
@@ -29,6 +40,7 @@ pub fn init_devices(kernel_meta_data: JerryMetaData) -> Result<(), DeviceInitErr
         return Err(DeviceInitError::LibFDTInitFailed(e));
     }
     let kernel_dtb_start: *const u8 = kernel_meta_data.kernel_dtb_start;
+    timer::init_clock();
 
     /* 
      * Frustratingly, kernel_dtb_start is 0x0 on QEMU sometimes 🫠 So doing:
@@ -47,74 +59,63 @@ pub fn init_devices(kernel_meta_data: JerryMetaData) -> Result<(), DeviceInitErr
     let dtb_total_size: u32 = unsafe { *(kernel_dtb_start.add(4) as *const u32) };
     let kernel_dtb_end: *const u8 = unsafe { kernel_dtb_start.add(dtb_total_size as usize) as *const u8 };
 
-    for device in match FDTItr::new() {
-        Ok(fdt) => fdt,
-        Err(e) => { return Err(DeviceInitError::FDTItrNewFailed(e)); }
-    } {
-        // Memory must be enabled before anything else since we will need all other devices
-        // to be running in virtual address space
-        if match device.get_name() {
-            Ok(device_name) => {device_name},
-            Err(e) => { return Err(DeviceInitError::SearchForMemoryDeviceFailed(e)); }
-        }.starts_with("memory@") {
-            match init_memory(
-                device, 
-                kernel_meta_data.kernel_text_end,
-                kernel_meta_data.kernel_dtb_start,
-                kernel_dtb_end
-            ) {
-                Ok(_) => {
-                    match call_device_inits() {
-                        Ok(_) => {
-                            return Ok(());
-                        },
-                        Err(e) => {
-                            return Err(e);
-                        }
-                    }
-                },
-                Err(e) => {
-                    return Err(DeviceInitError::MemoryInitFailed(e));
-                }
-            }
-        }
+    // Memory must be enabled before anything else since we will need all other devices
+    // to be running in virtual address space
+    let memory_node: FDTNode = match find_memory_node() {
+        Ok(memory_node) => memory_node,
+        Err(e) => { return Err(e); }
+    };
+    if let Err(e) = init_memory(
+        memory_node, 
+        kernel_meta_data.kernel_text_end,
+        kernel_meta_data.kernel_dtb_start,
+        kernel_dtb_end
+    ) {
+        return Err(DeviceInitError::MemoryInitFailed(e));
+    }
+    // Everything past this point finds its devices through the index.
+    if let Err(e) = dt_index::init_dt_index() {
+        return Err(DeviceInitError::DTIndexFailed(e));
+    }
+    // Per-CPU driver state (e.g. virtio-blk queues) is sized off the CPU count,
+    // so find the CPUs before probing anything else.
+    if let Err(e) = cpu::init_cpus() {
+        return Err(DeviceInitError::CPUSetup(e));
+    }
+    // The secondaries come up before any driver so they can help probe.
+    if let Err(e) = cpu::start_secondary_cpus() {
+        return Err(DeviceInitError::CPUSetup(e));
+    }
+    // Only the start of RAM is in the kernel's linear map yet; map the rest on every CPU.
+    if let Err(e) = finish_init_memory() {
+        return Err(DeviceInitError::MemoryInitFailed(e));
     }
-    return Err(DeviceInitError::MemoryDeviceNotFound);
+    if let Err(e) = drivers::probe_devices() {
+        return Err(e);
+    }
+    // Nothing finds devices by phandle or compatible past probing: hand back what only
+    // booting needed.
+    dt_index::drop_dt_lookup_tables();
+    memory::arena::release_boot_arena();
+    return Ok(());
 }
 
-pub fn call_device_inits() -> Result<(), DeviceInitError> {
-    let mut fdt = match FDTItr::new() {
-        Ok(fdt) => fdt,
-        Err(e) => { return Err(DeviceInitError::FDTItrNewFailed(e)); }
-    };
-    for device in &mut fdt {
-        match device.get_name() {
-            Ok(name) => {
-                match name {
-                    name if name.starts_with("virtio_mmio") => {
-                        match virtio::init_virtio_device(device) {
-                            Ok(_virtio_device) => {
-                                // TODO(chungmcl): do... stuff? with the virtio_device
-                            },
-                            Err(VirtIOError::UnsupportedDeviceType) => { /* skip device; do nothing */ },
-                            Err(e) => return Err(DeviceInitError::VirtIOSetup(e))
-                        }
-                    },
-                    name if name.starts_with("pl011") => {
-                        match pl011_uart::init_pl011_uart(device) {
-                            Ok(_pl011_mmio_addy) => {
-
-                            },
-                            Err(e) => return Err(DeviceInitError::PL011Setup(e))
-                        }
-                    },
-                    _ => { }
-                }
-            },
-            Err(e) => {
-                println!("call_device_init() failed on a device with \"FDTError::{:?}]\"!", e);
+// The memory node is one of the root's children: look it up there rather than walking
+// the whole tree for it.
+fn find_memory_node() -> Result<FDTNode, DeviceInitError> {
+    match FDTNode::root().subnode(b"memory") {
+        Ok(memory_node) => { return Ok(memory_node); },
+        Err(FDTError::NotFound) => { },
+        Err(e) => { return Err(DeviceInitError::SearchForMemoryDeviceFailed(e)); }
+    }
+    // Not named memory@..., but still marked as memory.
+    match FDTItr::children(&FDTNode::root()) {
+        Ok(root_children) => {
+            match root_children.with_device_type(b"memory").next() {
+                Some(memory_node) => { return Ok(memory_node); },
+                None => { return Err(DeviceInitError::MemoryDeviceNotFound); }
             }
-        }
+        },
+        Err(e) => { return Err(DeviceInitError::FDTItrNewFailed(e)); }
     }
-    return Ok(()); 
 }
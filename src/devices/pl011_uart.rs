@@ -1,26 +1,119 @@
 use super::*;
 use core::fmt;
+use core::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use crate::sync::SpinLock;
+use gic::{GICError, IrqTrigger};
+use memory::ppm::{get_free_page, page_pa_to_kva, PPMError};
 
 const DATA_REG_OFFSET: usize = 0x0;
 const FLAG_REG_OFFSET: usize = 0x18;
+const LCR_H_REG_OFFSET: usize = 0x2c;
+const CR_REG_OFFSET: usize = 0x30;
+const IMSC_REG_OFFSET: usize = 0x38;
+const MIS_REG_OFFSET: usize = 0x40;
+const ICR_REG_OFFSET: usize = 0x44;
+
 const TX_FIFO_FULL_MASK: u32 = 1 << 5;
+const RX_FIFO_EMPTY_MASK: u32 = 1 << 4;
+const LCR_H_FIFO_ENABLE: u32 = 1 << 4;
+const CR_UART_ENABLE: u32 = 1 << 0;
+const CR_TX_ENABLE: u32 = 1 << 8;
+const CR_RX_ENABLE: u32 = 1 << 9;
+// Interrupt bits, the same in IMSC/RIS/MIS/ICR.
+const INT_RX: u32 = 1 << 4;
+const INT_TX: u32 = 1 << 5;
+const INT_RX_TIMEOUT: u32 = 1 << 6;
+
+// Both rings share one page: TX gets the first half, RX the second.
+const TX_RING_LEN: usize = 8192;
+const RX_RING_LEN: usize = 4096;
 
 static mut ADDRESS: *const u8 = ptr::null();
 static mut DATA_REG: *mut u32 = ptr::null_mut();
 static mut FLAG_REG: *const u32 = ptr::null();
 static mut PL011_INITIALIZED: bool = false;
 
+/*
+ * Once the UART has its IRQ, writers only copy into the TX ring and top up the FIFO;
+ * the TX interrupt (armed only while the ring has something left) refills it as it
+ * drains. Received bytes are moved into the RX ring by the same handler. Until then,
+ * and on the panic path, output is written to the FIFO directly, spinning on TXFF.
+ */
+static IRQ_MODE: AtomicBool = AtomicBool::new(false);
+// Whether TXIM is set in IMSC. Only touched with TX_RING held.
+static TX_IRQ_ARMED: AtomicBool = AtomicBool::new(false);
+static TX_RING: SpinLock<ByteRing> = SpinLock::new(ByteRing::empty());
+static RX_RING: SpinLock<ByteRing> = SpinLock::new(ByteRing::empty());
+
+static TX_BYTES: AtomicU64 = AtomicU64::new(0);
+static TX_IRQS: AtomicU64 = AtomicU64::new(0);
+static TX_RING_WAITS: AtomicU64 = AtomicU64::new(0);
+static RX_BYTES: AtomicU64 = AtomicU64::new(0);
+static RX_OVERRUNS: AtomicU64 = AtomicU64::new(0);
+
 pub enum PL011Error {
     GetRegsFailed(FDTError),
-    MapMMIORangeFailed(PTMError)
+    MapMMIORangeFailed(PTMError),
+    GetInterruptIDFailed(GICError),
+    RegisterIrqFailed(GICError),
+    AllocRingsFailed(PPMError)
+}
+
+// head & tail are running byte counts; the ring is empty when they're equal.
+struct ByteRing {
+    buf  : *mut u8,
+    len  : usize,
+    head : usize,
+    tail : usize
+} unsafe impl Send for ByteRing {} impl ByteRing {
+    const fn empty() -> Self {
+        return Self { buf: ptr::null_mut(), len: 0, head: 0, tail: 0 };
+    }
+    #[inline(always)] fn is_empty(&self) -> bool { self.head == self.tail }
+    #[inline(always)] fn is_full(&self) -> bool { self.head - self.tail == self.len }
+    #[inline(always)] fn count(&self) -> usize { self.head - self.tail }
+
+    fn push(&mut self, b: u8) {
+        unsafe { *self.buf.add(self.head % self.len) = b; }
+        self.head += 1;
+    }
+
+    fn pop(&mut self) -> Option<u8> {
+        if self.is_empty() {
+            return None;
+        }
+        let b: u8 = unsafe { *self.buf.add(self.tail % self.len) };
+        self.tail += 1;
+        return Some(b);
+    }
+}
+
+#[derive(Copy, Clone, Default)]
+pub struct PL011Stats {
+    pub irq_mode      : bool,
+    pub tx_bytes      : u64,
+    pub tx_irqs       : u64,
+    pub tx_ring_waits : u64,
+    pub rx_bytes      : u64,
+    pub rx_overruns   : u64
 }
 
-pub fn init_pl011_uart(pl011_node: FDTNode) -> Result<*const u8, PL011Error> {
+// The UART probes right after the GIC so anything the other drivers print has somewhere to go.
+crate::register_driver!(PL011_DRIVER, "pl011", b"arm,pl011", drivers::DRIVER_PRIORITY_CONSOLE, Serial, probe_pl011);
+
+fn probe_pl011(pl011_node: &'static DTNode) -> Result<(), DeviceInitError> {
+    match init_pl011_uart(pl011_node) {
+        Ok(_pl011_mmio_addy) => { return Ok(()); },
+        Err(e) => { return Err(DeviceInitError::PL011Setup(e)); }
+    }
+}
+
+pub fn init_pl011_uart(pl011_node: &'static DTNode) -> Result<*const u8, PL011Error> {
     unsafe {
         ADDRESS = match pl011_node.get_reg() {
             Ok((pl011_mmio_address, pl011_mmio_size)) => {
                 if let Err(e) = map_mmio_range(
-                    pl011_mmio_address as *const u8, 
+                    pl011_mmio_address as *const u8,
                     pl011_mmio_size as usize
                 ) { return Err(PL011Error::MapMMIORangeFailed(e)); }
                 pl011_mmio_address as *const u8
@@ -32,8 +125,57 @@ pub fn init_pl011_uart(pl011_node: FDTNode) -> Result<*const u8, PL011Error> {
         DATA_REG = ADDRESS.add(DATA_REG_OFFSET) as *mut u32;
         FLAG_REG = ADDRESS.add(FLAG_REG_OFFSET) as *const u32;
         PL011_INITIALIZED = true;
-        return Ok(ADDRESS);
     }
+
+    // Not fatal: the UART works polled too, just slowly.
+    if let Err(_e) = enable_irq_mode(pl011_node) {
+        println!("init_pl011_uart(): couldn't set up the UART's IRQ, staying polled");
+    }
+    return Ok(unsafe { ADDRESS });
+}
+
+fn enable_irq_mode(pl011_node: &DTNode) -> Result<(), PL011Error> {
+    let (intid, trigger): (u32, IrqTrigger) = match gic::get_node_irq(pl011_node, 0) {
+        Ok(interrupt) => interrupt,
+        Err(e) => { return Err(PL011Error::GetInterruptIDFailed(e)); }
+    };
+    match get_free_page(false) {
+        Ok(rings_pa) => {
+            let rings_va: *mut u8 = page_pa_to_kva(rings_pa);
+            let mut tx = TX_RING.lock_irqsave();
+            tx.buf = rings_va;
+            tx.len = TX_RING_LEN;
+            let mut rx = RX_RING.lock_irqsave();
+            rx.buf = unsafe { rings_va.add(TX_RING_LEN) };
+            rx.len = RX_RING_LEN;
+        },
+        Err(e) => { return Err(PL011Error::AllocRingsFailed(e)); }
+    }
+    unsafe {
+        let lcr_h: u32 = read32_ptr(ADDRESS.add(LCR_H_REG_OFFSET) as *const u32);
+        write32_ptr(ADDRESS.add(LCR_H_REG_OFFSET) as *mut u32, lcr_h | LCR_H_FIFO_ENABLE);
+        let cr: u32 = read32_ptr(ADDRESS.add(CR_REG_OFFSET) as *const u32);
+        write32_ptr(ADDRESS.add(CR_REG_OFFSET) as *mut u32, cr | CR_UART_ENABLE | CR_TX_ENABLE | CR_RX_ENABLE);
+        write32_ptr(ADDRESS.add(ICR_REG_OFFSET) as *mut u32, INT_RX | INT_TX | INT_RX_TIMEOUT);
+    }
+    if let Err(e) = gic::register_irq(intid, trigger, pl011_irq_handler, 0) {
+        return Err(PL011Error::RegisterIrqFailed(e));
+    }
+    // RX is interrupt-driven from here on; TX only arms its interrupt when the ring backs up.
+    unsafe { write32_ptr(ADDRESS.add(IMSC_REG_OFFSET) as *mut u32, INT_RX | INT_RX_TIMEOUT); }
+    IRQ_MODE.store(true, Ordering::Release);
+    return Ok(());
+}
+
+pub fn pl011_stats() -> PL011Stats {
+    return PL011Stats {
+        irq_mode: IRQ_MODE.load(Ordering::Relaxed),
+        tx_bytes: TX_BYTES.load(Ordering::Relaxed),
+        tx_irqs: TX_IRQS.load(Ordering::Relaxed),
+        tx_ring_waits: TX_RING_WAITS.load(Ordering::Relaxed),
+        rx_bytes: RX_BYTES.load(Ordering::Relaxed),
+        rx_overruns: RX_OVERRUNS.load(Ordering::Relaxed)
+    };
 }
 
 fn write(b: u8) {
@@ -43,11 +185,123 @@ fn write(b: u8) {
     }
 }
 
-fn write_str(s: &str) {
+#[inline(always)]
+fn tx_fifo_full() -> bool {
+    return unsafe { read32_ptr(FLAG_REG) & TX_FIFO_FULL_MASK != 0 };
+}
+
+// Move as much of the ring into the FIFO as it takes right now.
+fn fill_tx_fifo(tx: &mut ByteRing) {
+    while !tx.is_empty() && !tx_fifo_full() {
+        if let Some(b) = tx.pop() {
+            unsafe { write32_ptr(DATA_REG, b as u32); }
+        }
+    }
+}
+
+fn set_tx_irq(enabled: bool) {
+    if TX_IRQ_ARMED.swap(enabled, Ordering::Relaxed) == enabled {
+        return;
+    }
+    unsafe {
+        let imsc_reg: *mut u32 = ADDRESS.add(IMSC_REG_OFFSET) as *mut u32;
+        let imsc: u32 = read32_ptr(imsc_reg);
+        write32_ptr(imsc_reg, if enabled { imsc | INT_TX } else { imsc & !INT_TX });
+    }
+}
+
+// Queue `s` for the TX interrupt to send. Only waits if the ring is full.
+pub fn write_str(s: &str) {
+    if !IRQ_MODE.load(Ordering::Acquire) {
+        write_str_polled(s);
+        return;
+    }
+    let mut tx = TX_RING.lock_irqsave();
+    for &b in s.as_bytes() {
+        if b == b'\n' { queue_tx_byte(&mut tx, b'\r'); }
+        queue_tx_byte(&mut tx, b);
+    }
+    fill_tx_fifo(&mut tx);
+    // Armed with the FIFO full, so it fires once the FIFO drains past its trigger level.
+    set_tx_irq(!tx.is_empty());
+    TX_BYTES.fetch_add(s.len() as u64, Ordering::Relaxed);
+}
+
+fn queue_tx_byte(tx: &mut ByteRing, b: u8) {
+    if tx.is_full() {
+        // IRQs are masked while we hold the ring, so nobody else will drain it.
+        TX_RING_WAITS.fetch_add(1, Ordering::Relaxed);
+        while tx.is_full() {
+            fill_tx_fifo(tx);
+        }
+    }
+    tx.push(b);
+}
+
+/*
+ * Straight to the FIFO, spinning on TXFF: for early boot & panics. Whatever is still
+ * queued in the TX ring goes out first, unless someone (maybe the panicking CPU
+ * itself) holds it.
+ */
+pub fn write_str_polled(s: &str) {
+    if let Some(mut tx) = TX_RING.try_lock() {
+        if !tx.buf.is_null() {
+            while let Some(b) = tx.pop() {
+                write(b);
+            }
+        }
+    }
     for &b in s.as_bytes() {
         if b == b'\n' { write(b'\r'); }
         write(b);
     }
+    if !IRQ_MODE.load(Ordering::Relaxed) {
+        TX_BYTES.fetch_add(s.len() as u64, Ordering::Relaxed);
+    }
+}
+
+// Next byte received, if any. For a shell or anything else reading the serial console.
+pub fn read_byte() -> Option<u8> {
+    return RX_RING.lock_irqsave().pop();
+}
+
+pub fn rx_available() -> usize {
+    return RX_RING.lock_irqsave().count();
+}
+
+// Bytes queued for the TX interrupt that haven't reached the FIFO yet.
+pub fn tx_pending() -> usize {
+    return TX_RING.lock_irqsave().count();
+}
+
+fn pl011_irq_handler(_intid: u32, _ctx: usize) {
+    let mis: u32 = unsafe { read32_ptr(ADDRESS.add(MIS_REG_OFFSET) as *const u32) };
+    if mis & (INT_RX | INT_RX_TIMEOUT) != 0 {
+        let mut rx = RX_RING.lock_irqsave();
+        let mut received: u64 = 0;
+        unsafe {
+            while read32_ptr(FLAG_REG) & RX_FIFO_EMPTY_MASK == 0 {
+                let b: u8 = (read32_ptr(DATA_REG) & 0xff) as u8;
+                if rx.is_full() {
+                    RX_OVERRUNS.fetch_add(1, Ordering::Relaxed);
+                } else {
+                    rx.push(b);
+                    received += 1;
+                }
+            }
+            write32_ptr(ADDRESS.add(ICR_REG_OFFSET) as *mut u32, INT_RX | INT_RX_TIMEOUT);
+        }
+        RX_BYTES.fetch_add(received, Ordering::Relaxed);
+    }
+    if mis & INT_TX != 0 {
+        TX_IRQS.fetch_add(1, Ordering::Relaxed);
+        let mut tx = TX_RING.lock_irqsave();
+        unsafe { write32_ptr(ADDRESS.add(ICR_REG_OFFSET) as *mut u32, INT_TX); }
+        fill_tx_fifo(&mut tx);
+        if tx.is_empty() {
+            set_tx_irq(false);
+        }
+    }
 }
 
 pub struct PL011Writer;
@@ -58,29 +312,3 @@ impl fmt::Write for PL011Writer {
         return Ok(());
     }
 }
-
-#[macro_export]
-macro_rules! print {
-    ($($arg:tt)*) => ({
-        let _ = core::fmt::write(
-            &mut $crate::PL011Writer, 
-            format_args!($($arg)*)
-        );
-    });
-}
-
-#[macro_export]
-macro_rules! println {
-    () => ($crate::print!("\n"));
-    ($fmt:expr) => (
-        $crate::print!(
-            concat!($fmt, "\n")
-        )
-    );
-    ($fmt:expr, $($arg:tt)*) => (
-        $crate::print!(
-            concat!($fmt, "\n"), 
-            $($arg)*
-        )
-    );
-}
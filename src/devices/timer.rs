@@ -0,0 +1,522 @@
+use super::*;
+use core::cell::UnsafeCell;
+use core::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, AtomicUsize, Ordering};
+use crate::sync::SpinLock;
+use crate::kstats::LatencyHistogram;
+use cpu::{cpu_id, MAX_CPUS};
+use gic::{GICError, IrqTrigger};
+
+/*
+ * The ARM generic timer's virtual counter (CNTVCT_EL0). It ticks at CNTFRQ_EL0 Hz on
+ * every CPU and is synchronized across them, so timestamps taken on one core can be
+ * compared against ones taken on another.
+ */
+
+const NS_PER_SEC: u64 = 1_000_000_000;
+
+// ticks -> ns and back as a multiply and a shift by 32, once init_clock() has run.
+static NS_PER_TICK_X2_32: AtomicU64 = AtomicU64::new(0);
+static TICKS_PER_NS_X2_32: AtomicU64 = AtomicU64::new(0);
+
+// Current counter value. The ISB keeps the read from being hoisted above earlier instructions.
+#[inline(always)]
+pub fn counter_ticks() -> u64 {
+    let ticks: u64;
+    unsafe { asm!("isb", "mrs {}, cntvct_el0", out(reg) ticks, options(nomem, nostack, preserves_flags)); }
+    return ticks;
+}
+
+// Without the ISB: may be read a little early, but doesn't stall the pipeline. For tracing.
+#[inline(always)]
+pub fn counter_ticks_unordered() -> u64 {
+    let ticks: u64;
+    unsafe { asm!("mrs {}, cntvct_el0", out(reg) ticks, options(nomem, nostack, preserves_flags)); }
+    return ticks;
+}
+
+#[inline(always)]
+pub fn counter_freq() -> u64 {
+    let freq: u64;
+    unsafe { asm!("mrs {}, cntfrq_el0", out(reg) freq, options(nomem, nostack, preserves_flags)); }
+    return freq;
+}
+
+// CNTFRQ_EL0 never changes after boot, so do the divisions once.
+pub fn init_clock() {
+    let freq: u64 = counter_freq();
+    if freq == 0 {
+        return;
+    }
+    // A timer wheel unit is the largest power of two of ticks that's at most a microsecond.
+    let ticks_per_us: u64 = core::cmp::max(freq / 1_000_000, 1);
+    UNIT_SHIFT.store(63 - ticks_per_us.leading_zeros(), Ordering::Relaxed);
+    NS_PER_TICK_X2_32.store(((NS_PER_SEC as u128) << 32).div_ceil(freq as u128) as u64, Ordering::Relaxed);
+    TICKS_PER_NS_X2_32.store(((freq as u128) << 32).div_ceil(NS_PER_SEC as u128) as u64, Ordering::Relaxed);
+}
+
+#[inline(always)]
+pub fn ticks_to_ns(ticks: u64) -> u64 {
+    let ns_per_tick: u64 = NS_PER_TICK_X2_32.load(Ordering::Relaxed);
+    if ns_per_tick == 0 {
+        return ((ticks as u128 * NS_PER_SEC as u128) / counter_freq() as u128) as u64;
+    }
+    return ((ticks as u128 * ns_per_tick as u128) >> 32) as u64;
+}
+
+#[inline(always)]
+pub fn ns_to_ticks(ns: u64) -> u64 {
+    let ticks_per_ns: u64 = TICKS_PER_NS_X2_32.load(Ordering::Relaxed);
+    if ticks_per_ns == 0 {
+        return ((ns as u128 * counter_freq() as u128) / NS_PER_SEC as u128) as u64;
+    }
+    return ((ns as u128 * ticks_per_ns as u128) >> 32) as u64;
+}
+
+// Monotonic, and comparable across CPUs.
+pub fn uptime_ns() -> u64 {
+    return ticks_to_ns(counter_ticks());
+}
+
+/*
+ * Timers: every CPU has a hierarchical timing wheel, and a timer lives on the wheel of
+ * the CPU that armed it. A wheel counts in units of 2^UNIT_SHIFT counter ticks (about a
+ * microsecond). Level L has 64 slots of 64^L units each: a timer due within 64 units
+ * goes in level 0, in the slot for its exact unit; one due later goes in the coarsest
+ * level that can still tell its slot apart from the current one, and is cascaded down a
+ * level every time the wheel reaches its slot's start. Arming and cancelling are a list
+ * insert/unlink, whatever the number of timers.
+ *
+ * Nothing ticks: per-level bitmaps of non-empty slots give the next unit anything
+ * happens (a level-0 expiry or a cascade), and CNTV_CVAL_EL0 is programmed for exactly
+ * that. The virtual timer's IRQ then jumps the wheel straight there. Callbacks run in
+ * IRQ context, on the arming CPU, without the wheel's lock held, and may re-arm.
+ */
+const WHEEL_LEVELS: usize = 6;
+const WHEEL_SLOT_BITS: u32 = 6;
+const WHEEL_SLOTS: usize = 1 << WHEEL_SLOT_BITS;
+// Past the top level's reach (a few hours): parked in its last slot, re-filed when reached.
+const WHEEL_MAX_DELTA: u64 = (1 << (WHEEL_SLOT_BITS * WHEEL_LEVELS as u32)) - 1;
+// After the wheel's slots: timers that are due but whose callbacks haven't run yet.
+const EXPIRED_LIST: usize = WHEEL_LEVELS * WHEEL_SLOTS;
+// Callbacks run in batches of this many, dropping the wheel lock in between.
+const EXPIRE_BATCH: usize = 16;
+// The virtual timer is the third of the timer node's four PPIs.
+const DT_VIRT_TIMER_IRQ_IDX: usize = 2;
+
+const CNTV_CTL_ENABLE: u64 = 1 << 0;
+
+pub type TimerFn = fn(ctx: usize);
+
+pub enum TimerError {
+    GetInterruptIDFailed(GICError),
+    RegisterIrqFailed(GICError)
+}
+
+struct TimerLinks {
+    // When it's due, in counter ticks and in wheel units.
+    deadline : u64,
+    expires  : u64,
+    list     : usize,
+    prev     : *const Timer,
+    next     : *const Timer
+}
+
+// Owned by whoever arms it, and must stay put while armed.
+pub struct Timer {
+    callback : TimerFn,
+    ctx      : usize,
+    // Index of the CPU whose wheel it's on, plus one. 0 while not armed.
+    wheel    : AtomicUsize,
+    // Only touched with that wheel's lock held.
+    links    : UnsafeCell<TimerLinks>
+} unsafe impl Sync for Timer {} impl Timer {
+    pub const fn new(callback: TimerFn, ctx: usize) -> Self {
+        return Self {
+            callback: callback,
+            ctx: ctx,
+            wheel: AtomicUsize::new(0),
+            links: UnsafeCell::new(TimerLinks {
+                deadline: 0, expires: 0, list: 0, prev: ptr::null(), next: ptr::null()
+            })
+        };
+    }
+
+    #[inline(always)]
+    pub fn is_armed(&self) -> bool {
+        return self.wheel.load(Ordering::Acquire) != 0;
+    }
+}
+
+struct TimerWheel {
+    // The next unit not yet processed.
+    clock      : u64,
+    lists      : [*const Timer; EXPIRED_LIST + 1],
+    occupied   : [u64; WHEEL_LEVELS],
+    // The unit CNTV_CVAL_EL0 is set for, u64::MAX if the timer is off.
+    programmed : u64
+} unsafe impl Send for TimerWheel {} impl TimerWheel {
+    const fn new() -> Self {
+        return Self {
+            clock: 0,
+            lists: [ptr::null(); EXPIRED_LIST + 1],
+            occupied: [0; WHEEL_LEVELS],
+            programmed: u64::MAX
+        };
+    }
+
+    unsafe fn link(&mut self, timer: &Timer, list: usize) {
+        unsafe {
+            let links: &mut TimerLinks = &mut *timer.links.get();
+            links.list = list;
+            links.prev = ptr::null();
+            links.next = self.lists[list];
+            if !links.next.is_null() {
+                (*(*links.next).links.get()).prev = timer;
+            }
+        }
+        self.lists[list] = timer;
+        if list < EXPIRED_LIST {
+            self.occupied[list / WHEEL_SLOTS] |= 1 << (list % WHEEL_SLOTS);
+        }
+    }
+
+    unsafe fn unlink(&mut self, timer: &Timer) {
+        unsafe {
+            let links: &mut TimerLinks = &mut *timer.links.get();
+            if links.prev.is_null() {
+                self.lists[links.list] = links.next;
+            } else {
+                (*(*links.prev).links.get()).next = links.next;
+            }
+            if !links.next.is_null() {
+                (*(*links.next).links.get()).prev = links.prev;
+            }
+            if links.list < EXPIRED_LIST && self.lists[links.list].is_null() {
+                self.occupied[links.list / WHEEL_SLOTS] &= !(1 << (links.list % WHEEL_SLOTS));
+            }
+        }
+    }
+
+    // File a timer by how far its expiry is from the wheel's clock.
+    unsafe fn insert(&mut self, timer: &Timer) {
+        let expires: u64 = unsafe { (*timer.links.get()).expires };
+        let delta: u64 = expires.saturating_sub(self.clock);
+        let slot_unit: u64 = self.clock + core::cmp::min(delta, WHEEL_MAX_DELTA);
+        let mut level: usize = 0;
+        while level + 1 < WHEEL_LEVELS && delta >> (WHEEL_SLOT_BITS * (level as u32 + 1)) != 0 {
+            level += 1;
+        }
+        let slot: usize = (slot_unit >> (WHEEL_SLOT_BITS * level as u32)) as usize & (WHEEL_SLOTS - 1);
+        unsafe { self.link(timer, level * WHEEL_SLOTS + slot); }
+    }
+
+    // The first unit at or after the clock with an expiry or a cascade to do.
+    fn next_event(&self) -> Option<u64> {
+        let mut next: Option<u64> = None;
+        for level in 0..WHEEL_LEVELS {
+            if self.occupied[level] == 0 {
+                continue;
+            }
+            let shift: u32 = WHEEL_SLOT_BITS * level as u32;
+            let window: u64 = self.clock >> shift;
+            let mut pending: u64 = self.occupied[level].rotate_right((window & (WHEEL_SLOTS as u64 - 1)) as u32);
+            // Mid-window, the current window's slot is for 64 windows from now.
+            if self.clock & ((1 << shift) - 1) != 0 {
+                pending &= !1;
+            }
+            let windows_ahead: u64 = if pending == 0 { WHEEL_SLOTS as u64 } else { pending.trailing_zeros() as u64 };
+            let unit: u64 = (window + windows_ahead) << shift;
+            next = Some(match next { Some(next) => core::cmp::min(next, unit), None => unit });
+        }
+        return next;
+    }
+
+    // Process every unit up to and including `now`: cascades, and moving what's due onto the expired list.
+    unsafe fn advance(&mut self, now: u64) {
+        loop {
+            let next: u64 = match self.next_event() {
+                Some(next) if next <= now => next,
+                _ => {
+                    self.clock = core::cmp::max(self.clock, now + 1);
+                    return;
+                }
+            };
+            self.clock = next;
+            for level in (1..WHEEL_LEVELS).rev() {
+                let shift: u32 = WHEEL_SLOT_BITS * level as u32;
+                if self.clock & ((1 << shift) - 1) == 0 {
+                    unsafe { self.cascade(level * WHEEL_SLOTS + (self.clock >> shift) as usize % WHEEL_SLOTS); }
+                }
+            }
+            let mut timer: *const Timer = self.lists[self.clock as usize % WHEEL_SLOTS];
+            while !timer.is_null() {
+                unsafe {
+                    let next_timer: *const Timer = (*(*timer).links.get()).next;
+                    self.unlink(&*timer);
+                    // Parked at the top level, but not actually due yet.
+                    if (*(*timer).links.get()).expires > self.clock {
+                        self.insert(&*timer);
+                    } else {
+                        self.link(&*timer, EXPIRED_LIST);
+                    }
+                    timer = next_timer;
+                }
+            }
+            self.clock += 1;
+        }
+    }
+
+    unsafe fn cascade(&mut self, list: usize) {
+        let mut timer: *const Timer = self.lists[list];
+        while !timer.is_null() {
+            unsafe {
+                let next_timer: *const Timer = (*(*timer).links.get()).next;
+                self.unlink(&*timer);
+                self.insert(&*timer);
+                timer = next_timer;
+            }
+            TIMER_CASCADES.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    // Point CNTV_CVAL_EL0 at the next event, or turn the timer off. Only on this wheel's CPU.
+    fn program(&mut self) {
+        let next: u64 = if self.lists[EXPIRED_LIST].is_null() {
+            match self.next_event() { Some(next) => next, None => u64::MAX }
+        } else {
+            self.clock
+        };
+        if next == self.programmed {
+            return;
+        }
+        self.programmed = next;
+        TIMER_REPROGRAMS.fetch_add(1, Ordering::Relaxed);
+        unsafe {
+            if next == u64::MAX {
+                asm!("msr cntv_ctl_el0, xzr", "isb", options(nomem, nostack, preserves_flags));
+            } else {
+                asm!(
+                    "msr cntv_cval_el0, {cval}",
+                    "msr cntv_ctl_el0, {ctl}",
+                    "isb",
+                    cval = in(reg) next << UNIT_SHIFT.load(Ordering::Relaxed),
+                    ctl = in(reg) CNTV_CTL_ENABLE,
+                    options(nomem, nostack, preserves_flags)
+                );
+            }
+        }
+    }
+}
+
+#[derive(Copy, Clone, Default)]
+pub struct TimerStats {
+    pub arms         : u64,
+    pub cancels      : u64,
+    pub fired        : u64,
+    pub cascades     : u64,
+    pub reprograms   : u64,
+    pub arm_ticks    : u64,
+    pub cancel_ticks : u64,
+    pub unit_ns      : u64
+}
+
+static TIMER_WHEELS: [SpinLock<TimerWheel>; MAX_CPUS] = [const { SpinLock::new(TimerWheel::new()) }; MAX_CPUS];
+static UNIT_SHIFT: AtomicU32 = AtomicU32::new(0);
+// 0 until the virtual timer's IRQ is registered; wheels don't touch the hardware before.
+static TIMER_INTID: AtomicU32 = AtomicU32::new(0);
+static TIMER_IRQ_READY: AtomicBool = AtomicBool::new(false);
+// How late each CPU's callbacks ran. Only touched by that CPU, in its timer IRQ.
+static mut TIMER_JITTER: [LatencyHistogram; MAX_CPUS] = [const { LatencyHistogram::new() }; MAX_CPUS];
+
+static TIMER_ARMS: AtomicU64 = AtomicU64::new(0);
+static TIMER_CANCELS: AtomicU64 = AtomicU64::new(0);
+static TIMER_FIRED: AtomicU64 = AtomicU64::new(0);
+static TIMER_CASCADES: AtomicU64 = AtomicU64::new(0);
+static TIMER_REPROGRAMS: AtomicU64 = AtomicU64::new(0);
+static TIMER_ARM_TICKS: AtomicU64 = AtomicU64::new(0);
+static TIMER_CANCEL_TICKS: AtomicU64 = AtomicU64::new(0);
+
+// After the GIC, before anything that wants timeouts.
+crate::register_driver!(ARM_TIMER_DRIVER, "armv8-timer", b"arm,armv8-timer", drivers::DRIVER_PRIORITY_TIMER, Serial, probe_arm_timer);
+
+// Not fatal: timers can still be armed, they just won't fire.
+fn probe_arm_timer(timer_node: &'static DTNode) -> Result<(), DeviceInitError> {
+    if let Err(_e) = init_arm_timer(timer_node) {
+        println!("probe_arm_timer(): no virtual timer IRQ, timers won't fire!");
+    }
+    return Ok(());
+}
+
+pub fn init_arm_timer(timer_node: &'static DTNode) -> Result<(), TimerError> {
+    let (intid, trigger): (u32, IrqTrigger) = match gic::get_node_irq(timer_node, DT_VIRT_TIMER_IRQ_IDX) {
+        Ok(irq) => irq,
+        Err(e) => { return Err(TimerError::GetInterruptIDFailed(e)); }
+    };
+    TIMER_INTID.store(intid, Ordering::Relaxed);
+    init_timer_cpu(0);
+    if let Err(e) = gic::register_irq(intid, trigger, timer_irq, 0) {
+        return Err(TimerError::RegisterIrqFailed(e));
+    }
+    // The PPI is banked and the secondaries' GIC CPU interfaces are already up.
+    for cpu_idx in 0..cpu::num_cpus() {
+        if cpu_idx != cpu_id() && cpu::run_on_cpu(cpu_idx, init_timer_cpu, 1).is_ok() {
+            cpu::wait_for_cpu(cpu_idx);
+        }
+    }
+    TIMER_IRQ_READY.store(true, Ordering::Release);
+    // Anything armed before now.
+    for cpu_idx in 0..cpu::num_cpus() {
+        if cpu_idx != cpu_id() && cpu::run_on_cpu(cpu_idx, program_timer_cpu, 0).is_ok() {
+            cpu::wait_for_cpu(cpu_idx);
+        }
+    }
+    program_timer_cpu(0);
+    return Ok(());
+}
+
+// register_irq() already enabled the PPI on the boot CPU.
+fn init_timer_cpu(enable_ppi: usize) {
+    unsafe { asm!("msr cntv_ctl_el0, xzr", "isb", options(nomem, nostack, preserves_flags)); }
+    if enable_ppi != 0 {
+        let _ = gic::enable_irq(TIMER_INTID.load(Ordering::Relaxed));
+    }
+}
+
+fn program_timer_cpu(_arg: usize) {
+    let mut wheel = TIMER_WHEELS[cpu_id()].lock_irqsave();
+    wheel.programmed = u64::MAX - 1;
+    wheel.program();
+}
+
+#[inline(always)]
+fn ticks_to_unit_ceil(ticks: u64) -> u64 {
+    let shift: u32 = UNIT_SHIFT.load(Ordering::Relaxed);
+    return (ticks >> shift) + ((ticks & ((1 << shift) - 1)) != 0) as u64;
+}
+
+/*
+ * (Re-)arm `timer` to call its callback once the counter reaches `deadline_ticks`. Never
+ * early; late by at most a unit plus IRQ latency. Goes on this CPU's wheel, and runs
+ * on this CPU.
+ */
+pub fn arm_timer(timer: &'static Timer, deadline_ticks: u64) {
+    let start_ticks: u64 = counter_ticks_unordered();
+    cancel_timer_locked(timer);
+    let cpu_idx: usize = cpu_id();
+    let mut wheel = TIMER_WHEELS[cpu_idx].lock_irqsave();
+    if wheel.clock == 0 {
+        wheel.clock = counter_ticks() >> UNIT_SHIFT.load(Ordering::Relaxed);
+    }
+    unsafe {
+        let links: &mut TimerLinks = &mut *timer.links.get();
+        links.deadline = deadline_ticks;
+        links.expires = core::cmp::max(ticks_to_unit_ceil(deadline_ticks), wheel.clock);
+        wheel.insert(timer);
+    }
+    timer.wheel.store(cpu_idx + 1, Ordering::Release);
+    if TIMER_IRQ_READY.load(Ordering::Acquire) && unsafe { (*timer.links.get()).expires } < wheel.programmed {
+        wheel.program();
+    }
+    drop(wheel);
+    TIMER_ARMS.fetch_add(1, Ordering::Relaxed);
+    TIMER_ARM_TICKS.fetch_add(counter_ticks_unordered() - start_ticks, Ordering::Relaxed);
+}
+
+pub fn arm_timer_ns(timer: &'static Timer, delay_ns: u64) {
+    arm_timer(timer, counter_ticks() + ns_to_ticks(delay_ns));
+}
+
+// Whether it was armed: false if it never was, or already fired (its callback may be running).
+pub fn cancel_timer(timer: &Timer) -> bool {
+    let start_ticks: u64 = counter_ticks_unordered();
+    let cancelled: bool = cancel_timer_locked(timer);
+    if cancelled {
+        TIMER_CANCELS.fetch_add(1, Ordering::Relaxed);
+        TIMER_CANCEL_TICKS.fetch_add(counter_ticks_unordered() - start_ticks, Ordering::Relaxed);
+    }
+    return cancelled;
+}
+
+/*
+ * The wheel is left programmed for the cancelled timer, if it was the next: that costs
+ * at most one spurious IRQ, where reprogramming would cost a next_event() every cancel.
+ */
+fn cancel_timer_locked(timer: &Timer) -> bool {
+    loop {
+        let wheel_idx: usize = timer.wheel.load(Ordering::Acquire);
+        if wheel_idx == 0 {
+            return false;
+        }
+        let mut wheel = TIMER_WHEELS[wheel_idx - 1].lock_irqsave();
+        // Moved (fired, re-armed elsewhere) before we got the lock.
+        if timer.wheel.load(Ordering::Relaxed) != wheel_idx {
+            continue;
+        }
+        unsafe { wheel.unlink(timer); }
+        timer.wheel.store(0, Ordering::Release);
+        return true;
+    }
+}
+
+// The virtual timer's PPI: runs whatever is due on this CPU's wheel.
+fn timer_irq(_intid: u32, _ctx: usize) {
+    let cpu_idx: usize = cpu_id();
+    let mut batch: [*const Timer; EXPIRE_BATCH] = [ptr::null(); EXPIRE_BATCH];
+    loop {
+        let mut num_due: usize = 0;
+        {
+            let mut wheel = TIMER_WHEELS[cpu_idx].lock();
+            unsafe { wheel.advance(counter_ticks() >> UNIT_SHIFT.load(Ordering::Relaxed)); }
+            while num_due < EXPIRE_BATCH && !wheel.lists[EXPIRED_LIST].is_null() {
+                let timer: *const Timer = wheel.lists[EXPIRED_LIST];
+                unsafe {
+                    wheel.unlink(&*timer);
+                    (*timer).wheel.store(0, Ordering::Release);
+                }
+                batch[num_due] = timer;
+                num_due += 1;
+            }
+            if num_due == 0 {
+                wheel.program();
+                return;
+            }
+        }
+        let now: u64 = counter_ticks();
+        for &timer in &batch[..num_due] {
+            unsafe {
+                // Read before the callback: it may re-arm (and so rewrite) the timer.
+                let late_ticks: u64 = now.saturating_sub((*(*timer).links.get()).deadline);
+                (*(&raw mut TIMER_JITTER))[cpu_idx].record(ticks_to_ns(late_ticks));
+                ((*timer).callback)((*timer).ctx);
+            }
+        }
+        TIMER_FIRED.fetch_add(num_due as u64, Ordering::Relaxed);
+    }
+}
+
+// Whether armed timers actually fire yet.
+pub fn timer_irq_ready() -> bool {
+    return TIMER_IRQ_READY.load(Ordering::Acquire);
+}
+
+pub fn timer_stats() -> TimerStats {
+    return TimerStats {
+        arms: TIMER_ARMS.load(Ordering::Relaxed),
+        cancels: TIMER_CANCELS.load(Ordering::Relaxed),
+        fired: TIMER_FIRED.load(Ordering::Relaxed),
+        cascades: TIMER_CASCADES.load(Ordering::Relaxed),
+        reprograms: TIMER_REPROGRAMS.load(Ordering::Relaxed),
+        arm_ticks: TIMER_ARM_TICKS.load(Ordering::Relaxed),
+        cancel_ticks: TIMER_CANCEL_TICKS.load(Ordering::Relaxed),
+        unit_ns: ticks_to_ns(1 << UNIT_SHIFT.load(Ordering::Relaxed))
+    };
+}
+
+// How late callbacks ran past their deadlines, over every CPU.
+pub fn timer_jitter() -> LatencyHistogram {
+    let mut hist: LatencyHistogram = LatencyHistogram::new();
+    for cpu_idx in 0..cpu::num_cpus() {
+        hist.merge(unsafe { &(*(&raw const TIMER_JITTER))[cpu_idx] });
+    }
+    return hist;
+}
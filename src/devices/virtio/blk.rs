@@ -0,0 +1,893 @@
+use super::*;
+use super::virtqueue::*;
+use core::sync::atomic::{AtomicBool, AtomicU8, AtomicU32, AtomicU64, Ordering};
+use crate::sync::SpinLock;
+use crate::exceptions::{irq_save, irq_restore, irqs_enabled, wait_for_interrupt};
+use cpu::{cpu_id, cpu_is_online, num_cpus, MAX_CPUS};
+use gic::{IrqTrigger, SGI_BLK_COMPLETION};
+use timer::{counter_ticks, ns_to_ticks, ticks_to_ns};
+use crate::kstats::LatencyHistogram;
+use memory::{ppm::*, kva_to_pa, PAGE_LEN};
+
+pub const SECTOR_LEN: usize = 512;
+pub const BLK_MAX_SEGS: usize = 16;
+pub const MAX_BLK_DEVICES: usize = 4;
+
+// Feature bits (virtio 1.x §5.2.3)
+const VIRTIO_BLK_F_FLUSH: u64 = 1 << 9;
+const VIRTIO_BLK_F_MQ:    u64 = 1 << 12;
+
+// Request types & status values (virtio 1.x §5.2.6)
+const VIRTIO_BLK_T_IN:     u32 = 0;
+const VIRTIO_BLK_T_OUT:    u32 = 1;
+const VIRTIO_BLK_T_FLUSH:  u32 = 4;
+const VIRTIO_BLK_S_OK:     u8 = 0;
+const VIRTIO_BLK_S_IOERR:  u8 = 1;
+const VIRTIO_BLK_S_UNSUPP: u8 = 2;
+
+// Completions are drained in batches so callbacks run with the queue unlocked.
+const POLL_BATCH: usize = 16;
+// read()/write() split direct I/O into requests of at most this much.
+const DIRECT_IO_MAX_LEN: usize = 1 << 20;
+
+// Hybrid mode never spins longer than this unless told otherwise (set_hybrid_max_spin_ns()).
+const DEFAULT_HYBRID_MAX_SPIN_NS: u64 = 50_000;
+// Weight of the newest sample in the per-queue completion latency average: 1/2^EWMA_SHIFT.
+const LATENCY_EWMA_SHIFT: u32 = 3;
+
+static mut BLK_DEVICES: [*const VirtIOBlk; MAX_BLK_DEVICES] = [ptr::null(); MAX_BLK_DEVICES];
+static mut NUM_BLK_DEVICES: usize = 0;
+static BLK_REGISTRY_LOCK: SpinLock<()> = SpinLock::new(());
+
+pub fn get_blk_device(blk_idx: usize) -> Option<&'static VirtIOBlk> {
+    unsafe {
+        if blk_idx < NUM_BLK_DEVICES { Some(&*BLK_DEVICES[blk_idx]) } else { None }
+    }
+}
+
+pub fn num_blk_devices() -> usize {
+    unsafe { NUM_BLK_DEVICES }
+}
+
+// How submit_and_wait() finds out a request is done. Poll burns the CPU spinning on the
+// used ring; Interrupt sleeps in WFI until the device (or an SGI from whoever took the
+// device's IRQ) says something completed. Hybrid spins on the used ring index for a
+// window sized off the queue's recent completion latencies, then sleeps like Interrupt.
+#[repr(u8)]
+#[derive(Copy, Clone, PartialEq, Debug)]
+pub enum BlkCompletionMode {
+    Poll      = 0,
+    Interrupt = 1,
+    Hybrid    = 2
+}
+pub const BLK_COMPLETION_MODES: [BlkCompletionMode; 3] = [
+    BlkCompletionMode::Poll, BlkCompletionMode::Interrupt, BlkCompletionMode::Hybrid
+];
+
+#[repr(u32)]
+#[derive(Copy, Clone, PartialEq, Debug)]
+pub enum BlkOp {
+    Read  = VIRTIO_BLK_T_IN,
+    Write = VIRTIO_BLK_T_OUT,
+    Flush = VIRTIO_BLK_T_FLUSH
+}
+
+#[derive(Copy, Clone)]
+pub struct BlkSegment {
+    pub pa  : u64,
+    pub len : u32
+}
+
+/*
+ * An asynchronous block request. The caller owns it and must keep it in place until
+ * is_done(); the queue only holds a pointer to it. Segments are physical addresses,
+ * either given directly (add_segment()) or resolved from kernel VAs (add_buffer()).
+ * on_complete (if any) runs on the CPU that reaps the completion, normally the CPU the
+ * request was submitted from (see poll_cpu()), possibly in IRQ context.
+ */
+pub struct BlkRequest {
+    pub op          : BlkOp,
+    pub sector      : u64,
+    pub segs        : [BlkSegment; BLK_MAX_SEGS],
+    pub num_segs    : usize,
+    pub on_complete : Option<fn(&mut BlkRequest)>,
+    pub ctx         : usize,
+    status          : AtomicU8,
+    done            : AtomicBool,
+    submit_ticks    : u64,
+    // Completion mode when submitted, which is the one its latency is recorded under.
+    submit_mode     : BlkCompletionMode,
+    // Segments whose pages add_buffer() pinned & completion must unpin.
+    pinned_segs     : u16
+} impl BlkRequest {
+    pub const fn new(op: BlkOp, sector: u64) -> Self {
+        return Self {
+            op,
+            sector,
+            segs: [BlkSegment { pa: 0, len: 0 }; BLK_MAX_SEGS],
+            num_segs: 0,
+            on_complete: None,
+            ctx: 0,
+            status: AtomicU8::new(VIRTIO_BLK_S_OK),
+            done: AtomicBool::new(false),
+            submit_ticks: 0,
+            submit_mode: BlkCompletionMode::Poll,
+            pinned_segs: 0
+        };
+    }
+
+    pub fn add_segment(&mut self, pa: u64, len: u32) -> Result<(), VirtIOError> {
+        if self.num_segs >= BLK_MAX_SEGS {
+            return Err(VirtIOError::TooManySegments);
+        }
+        self.segs[self.num_segs] = BlkSegment { pa, len };
+        self.num_segs += 1;
+        return Ok(());
+    }
+
+    /*
+     * Add a segment pointing straight at `len` bytes of kernel memory at `buf_va`, so
+     * the device DMAs to/from it with no bounce copy. Contiguous kernel VAs are
+     * contiguous PAs (see kva_to_pa()), so that's always one segment. Every page it
+     * touches stays pinned in the PPM until the request completes.
+     */
+    pub fn add_buffer(&mut self, buf_va: *const u8, len: usize) -> Result<(), VirtIOError> {
+        if self.num_segs >= BLK_MAX_SEGS {
+            return Err(VirtIOError::TooManySegments);
+        }
+        if len == 0 || len > u32::MAX as usize {
+            return Err(VirtIOError::OutOfRange);
+        }
+        let pa: usize = kva_to_pa(buf_va as usize);
+        if let Err(e) = pin_range(pa, len) {
+            return Err(VirtIOError::PinFailed(e));
+        }
+        self.pinned_segs |= 1 << self.num_segs;
+        self.segs[self.num_segs] = BlkSegment { pa: pa as u64, len: len as u32 };
+        self.num_segs += 1;
+        return Ok(());
+    }
+
+    pub fn data_len(&self) -> usize {
+        return self.segs[..self.num_segs].iter().map(|seg| seg.len as usize).sum();
+    }
+
+    #[inline(always)]
+    pub fn is_done(&self) -> bool {
+        return self.done.load(Ordering::Acquire);
+    }
+
+    /*
+     * Complete the request without the device, for layers that stand in for it (e.g. a
+     * scheduler finishing requests it merged into one). Same effect as being reaped.
+     */
+    pub fn finish(&mut self, result: Result<(), VirtIOError>) {
+        let status: u8 = match result {
+            Ok(_) => VIRTIO_BLK_S_OK,
+            Err(VirtIOError::Unsupported) => VIRTIO_BLK_S_UNSUPP,
+            Err(_) => VIRTIO_BLK_S_IOERR
+        };
+        self.status.store(status, Ordering::Relaxed);
+        self.unpin_segments();
+        let on_complete: Option<fn(&mut BlkRequest)> = self.on_complete;
+        self.done.store(true, Ordering::Release);
+        if let Some(on_complete) = on_complete {
+            on_complete(self);
+        }
+    }
+
+    fn unpin_segments(&mut self) {
+        for seg_idx in 0..self.num_segs {
+            if self.pinned_segs & (1 << seg_idx) != 0 {
+                unpin_range(self.segs[seg_idx].pa as usize, self.segs[seg_idx].len as usize);
+            }
+        }
+        self.pinned_segs = 0;
+    }
+
+    pub fn result(&self) -> Result<(), VirtIOError> {
+        match self.status.load(Ordering::Relaxed) {
+            VIRTIO_BLK_S_OK     => Ok(()),
+            VIRTIO_BLK_S_UNSUPP => Err(VirtIOError::Unsupported),
+            _                   => Err(VirtIOError::IOError)
+        }
+    }
+}
+
+#[repr(C)]
+struct VirtIOBlkReqHdr {
+    req_type : u32,
+    reserved : u32,
+    sector   : u64
+}
+
+// Device-visible header + status byte for one in-flight chain, indexed by head descriptor.
+#[repr(C, align(32))]
+struct BlkReqSlot {
+    hdr    : VirtIOBlkReqHdr,
+    status : u8
+}
+
+#[derive(Copy, Clone, Default)]
+pub struct BlkQueueStats {
+    pub submitted : u64,
+    pub completed : u64,
+    pub errors    : u64,
+    pub bytes     : u64,
+    // Where submit_and_wait() spent its time: polls that found nothing vs. WFI sleeps.
+    pub idle_polls  : u64,
+    pub sleeps      : u64,
+    // Hybrid waits that completed inside the spin window vs. ones that fell back to sleeping.
+    pub spin_hits   : u64,
+    pub spin_misses : u64
+}
+
+pub struct BlkQueue {
+    vq             : VirtQueue,
+    slots          : *mut BlkReqSlot,
+    slots_pa       : u64,
+    stats          : BlkQueueStats,
+    // Moving average of submit-to-reap time, which the hybrid spin window is sized off.
+    lat_ewma_ticks : u64
+} unsafe impl Send for BlkQueue {}
+
+// Staging page for the synchronous read()/write() helpers, for buffers that can't be
+// pinned in the PPM (i.e. aren't allocated RAM) and so can't be handed to the device.
+pub struct BounceBuf {
+    va : *mut u8,
+    pa : u64
+} unsafe impl Send for BounceBuf {}
+
+/*
+ * One virtqueue per CPU (VIRTIO_BLK_F_MQ). CPU n submits to and reaps from queue
+ * n % num_queues, so with num_queues == num_cpus() neither submission nor completion
+ * ever touches another core's queue, and each queue's lock is only ever taken by its owner.
+ * The device has a single IRQ though, so whichever CPU takes it reaps its own queue and
+ * SGIs the owners of any other queue with requests in flight.
+ */
+pub struct VirtIOBlk {
+    regs            : *mut VirtIORegs,
+    size_bytes      : u64,
+    features        : u64,
+    num_queues      : usize,
+    irq_registered  : bool,
+    completion_mode : AtomicU8,
+    irqs_taken      : AtomicU64,
+    bytes_direct    : AtomicU64,
+    bytes_bounced   : AtomicU64,
+    hybrid_max_spin_ticks : AtomicU64,
+    inflight        : [AtomicU32; MAX_CPUS],
+    // Read without the queue lock by hybrid waiters spinning for a completion.
+    used_idxs       : [*const u16; MAX_CPUS],
+    // One histogram per queue per mode, in their own page (they don't fit next to the queues).
+    lat_hists       : *mut [[LatencyHistogram; BLK_COMPLETION_MODES.len()]; MAX_CPUS],
+    queues          : [SpinLock<BlkQueue>; MAX_CPUS],
+    bounces         : [SpinLock<BounceBuf>; MAX_CPUS]
+} impl TrailingConfig for VirtIOBlk {
+    type ConfigStruct = VirtIOBlkConfig;
+}
+
+/*
+ * Devices may be probed in parallel, so the registry is kept in MMIO address order (on
+ * QEMU virt, also DTB order) rather than in whichever order the probes finished, and
+ * blk0 stays the same disk from boot to boot.
+ */
+fn register_blk_device(blk_dev: &'static VirtIOBlk) -> Result<(), VirtIOError> {
+    let _registry_guard = BLK_REGISTRY_LOCK.lock_irqsave();
+    unsafe {
+        if NUM_BLK_DEVICES >= MAX_BLK_DEVICES {
+            return Err(VirtIOError::TooManyDevices);
+        }
+        let mut insert_idx: usize = NUM_BLK_DEVICES;
+        while insert_idx > 0 && (*BLK_DEVICES[insert_idx - 1]).regs > blk_dev.regs {
+            BLK_DEVICES[insert_idx] = BLK_DEVICES[insert_idx - 1];
+            insert_idx -= 1;
+        }
+        BLK_DEVICES[insert_idx] = blk_dev as *const VirtIOBlk;
+        NUM_BLK_DEVICES += 1;
+    }
+    return Ok(());
+}
+
+pub fn setup_block_device(blk_dev_regs: &mut VirtIORegs, interrupt: (u32, IrqTrigger)) -> Result<&'static VirtIOBlk, VirtIOError> {
+    unsafe {
+        if NUM_BLK_DEVICES >= MAX_BLK_DEVICES {
+            return Err(VirtIOError::TooManyDevices);
+        }
+    }
+
+    let features: u64 = match negotiate_features(blk_dev_regs, VIRTIO_BLK_F_MQ | VIRTIO_BLK_F_FLUSH) {
+        Ok(features) => features,
+        Err(e) => { return Err(e); }
+    };
+
+    let mut before: u32;
+    let mut after: u32;
+    let mut capacity: u64;
+    let mut dev_num_queues: u16;
+    let blk_dev_config_ptr: *const VirtIOBlkConfig = blk_dev_regs.get_config::<VirtIOBlk>();
+    loop {
+        unsafe {
+            before = read32(&blk_dev_regs.config_generation);
+            // capacity is always in 512-byte sectors, regardless of blk_size.
+            capacity = read64(&(*blk_dev_config_ptr).capacity) * SECTOR_LEN as u64;
+            dev_num_queues = ptr::read_volatile(&raw const (*blk_dev_config_ptr).num_queues);
+            after = read32(&blk_dev_regs.config_generation);
+        }
+        if after == before { break; }
+    }
+    if features & VIRTIO_BLK_F_MQ == 0 || dev_num_queues == 0 {
+        dev_num_queues = 1;
+    }
+
+    let blk_dev: &'static mut VirtIOBlk = match get_free_page_as::<VirtIOBlk>() {
+        Ok(blk_dev) => blk_dev,
+        Err(e) => { return Err(VirtIOError::AllocDeviceFailed(e)); }
+    };
+    blk_dev.regs = blk_dev_regs as *mut VirtIORegs;
+    blk_dev.size_bytes = capacity;
+    blk_dev.features = features;
+    blk_dev.num_queues = core::cmp::min(num_cpus(), dev_num_queues as usize).max(1);
+    blk_dev.hybrid_max_spin_ticks.store(ns_to_ticks(DEFAULT_HYBRID_MAX_SPIN_NS), Ordering::Relaxed);
+    match get_free_page_as::<[[LatencyHistogram; BLK_COMPLETION_MODES.len()]; MAX_CPUS]>() {
+        Ok(lat_hists) => { blk_dev.lat_hists = lat_hists; },
+        Err(e) => { return Err(VirtIOError::AllocDeviceFailed(e)); }
+    }
+
+    for queue_idx in 0..blk_dev.num_queues {
+        let queue: &mut BlkQueue = blk_dev.queues[queue_idx].get_mut();
+        if let Err(e) = queue.vq.init(blk_dev.regs, queue_idx as u32) {
+            return Err(e);
+        }
+        blk_dev.used_idxs[queue_idx] = queue.vq.used_idx_ptr();
+        match get_free_page(true) {
+            Ok(slots_pa) => {
+                queue.slots_pa = slots_pa as u64;
+                queue.slots = page_pa_to_kva(slots_pa) as *mut BlkReqSlot;
+            },
+            Err(e) => { return Err(VirtIOError::GetQueuePageFailed(e)); }
+        }
+
+        let bounce: &mut BounceBuf = blk_dev.bounces[queue_idx].get_mut();
+        match get_free_page(false) {
+            Ok(bounce_pa) => {
+                bounce.pa = bounce_pa as u64;
+                bounce.va = page_pa_to_kva(bounce_pa);
+            },
+            Err(e) => { return Err(VirtIOError::GetQueuePageFailed(e)); }
+        }
+    }
+
+    // Without a GIC we can still drive the device, just by polling.
+    let (intid, trigger): (u32, IrqTrigger) = interrupt;
+    match gic::register_irq(intid, trigger, blk_irq_handler, blk_dev as *const VirtIOBlk as usize) {
+        Ok(_) => {
+            blk_dev.irq_registered = true;
+            let _ = gic::register_irq(SGI_BLK_COMPLETION, IrqTrigger::Edge, blk_completion_sgi_handler, 0);
+            let _ = blk_dev.set_completion_mode(BlkCompletionMode::Interrupt);
+        },
+        Err(_) => {
+            println!("setup_block_device(): couldn't register INTID {}, falling back to polling", intid);
+        }
+    }
+
+    set_driver_ok(blk_dev_regs);
+
+    if let Err(e) = register_blk_device(blk_dev) {
+        return Err(e);
+    }
+    return Ok(blk_dev);
+}
+
+impl VirtIOBlk {
+    #[inline(always)] pub fn size_bytes(&self) -> u64 { self.size_bytes }
+    #[inline(always)] pub fn capacity_sectors(&self) -> u64 { self.size_bytes / SECTOR_LEN as u64 }
+    #[inline(always)] pub fn num_queues(&self) -> usize { self.num_queues }
+    #[inline(always)] pub fn irqs_taken(&self) -> u64 { self.irqs_taken.load(Ordering::Relaxed) }
+    #[inline(always)] fn my_queue_idx(&self) -> usize { cpu_id() % self.num_queues }
+
+    pub fn queue_stats(&self, queue_idx: usize) -> BlkQueueStats {
+        return self.queues[queue_idx].lock_irqsave().stats;
+    }
+
+    pub fn completion_mode(&self) -> BlkCompletionMode {
+        match self.completion_mode.load(Ordering::Relaxed) {
+            1 => BlkCompletionMode::Interrupt,
+            2 => BlkCompletionMode::Hybrid,
+            _ => BlkCompletionMode::Poll
+        }
+    }
+
+    // Switch every queue between polled, interrupt-driven & hybrid completions (e.g. to compare them).
+    pub fn set_completion_mode(&self, mode: BlkCompletionMode) -> Result<(), VirtIOError> {
+        if mode != BlkCompletionMode::Poll && !self.irq_registered {
+            return Err(VirtIOError::Unsupported);
+        }
+        self.completion_mode.store(mode as u8, Ordering::Relaxed);
+        let mut missed: bool = false;
+        for queue_idx in 0..self.num_queues {
+            let mut queue = self.queues[queue_idx].lock_irqsave();
+            queue.vq.set_interrupts_enabled(mode != BlkCompletionMode::Poll);
+            missed |= mode != BlkCompletionMode::Poll && queue.vq.has_used();
+        }
+        // Completions that landed with interrupts off raised none, and sleepers need one.
+        if missed {
+            self.kick_completions();
+        }
+        return Ok(());
+    }
+
+    pub fn hybrid_max_spin_ns(&self) -> u64 {
+        return ticks_to_ns(self.hybrid_max_spin_ticks.load(Ordering::Relaxed));
+    }
+
+    // Upper bound on how long a hybrid waiter spins before sleeping. 0 makes Hybrid behave like Interrupt.
+    pub fn set_hybrid_max_spin_ns(&self, max_spin_ns: u64) {
+        self.hybrid_max_spin_ticks.store(ns_to_ticks(max_spin_ns), Ordering::Relaxed);
+    }
+
+    pub fn hybrid_spin_window_ns(&self, queue_idx: usize) -> u64 {
+        let queue = self.queues[queue_idx].lock_irqsave();
+        return ticks_to_ns(self.hybrid_spin_window_ticks(&queue));
+    }
+
+    // Submit-to-reap latencies of every queue, for requests reaped while in `mode`.
+    pub fn latency_histogram(&self, mode: BlkCompletionMode) -> LatencyHistogram {
+        let mut hist: LatencyHistogram = LatencyHistogram::new();
+        for queue_idx in 0..self.num_queues {
+            let _queue = self.queues[queue_idx].lock_irqsave();
+            unsafe { hist.merge(&(*self.lat_hists)[queue_idx][mode as usize]); }
+        }
+        return hist;
+    }
+
+    /*
+     * Spin for ~1.5x the queue's average latency: long enough to catch most completions
+     * without an IRQ round trip. If even that is more than the max spin, the device is
+     * slow right now and spinning would only burn the CPU, so go straight to sleeping.
+     */
+    fn hybrid_spin_window_ticks(&self, queue: &BlkQueue) -> u64 {
+        let max_spin_ticks: u64 = self.hybrid_max_spin_ticks.load(Ordering::Relaxed);
+        if queue.lat_ewma_ticks == 0 {
+            return max_spin_ticks;
+        }
+        let window: u64 = queue.lat_ewma_ticks + queue.lat_ewma_ticks / 2;
+        return if window > max_spin_ticks { 0 } else { window };
+    }
+
+    /*
+     * Queue a request on this CPU's virtqueue and kick the device. Doesn't wait for it,
+     * only (reaping completions meanwhile) for room in the ring. On error, whatever
+     * add_buffer() pinned is unpinned again: a failed submit leaves nothing pinned.
+     */
+    pub fn submit(&self, req: &mut BlkRequest) -> Result<(), VirtIOError> {
+        match self.try_submit(req) {
+            Ok(_) => { return Ok(()); },
+            Err(e) => {
+                req.unpin_segments();
+                return Err(e);
+            }
+        }
+    }
+
+    fn try_submit(&self, req: &mut BlkRequest) -> Result<(), VirtIOError> {
+        if req.num_segs > BLK_MAX_SEGS {
+            return Err(VirtIOError::TooManySegments);
+        }
+        let data_len: usize = req.data_len();
+        if data_len % SECTOR_LEN != 0 {
+            return Err(VirtIOError::UnalignedLength);
+        }
+        if req.op != BlkOp::Flush {
+            match req.sector.checked_add((data_len / SECTOR_LEN) as u64) {
+                Some(end_sector) if end_sector <= self.capacity_sectors() => {},
+                _ => { return Err(VirtIOError::OutOfRange); }
+            }
+        }
+        if req.op == BlkOp::Flush && self.features & VIRTIO_BLK_F_FLUSH == 0 {
+            return Err(VirtIOError::Unsupported);
+        }
+        req.done.store(false, Ordering::Relaxed);
+        req.submit_ticks = counter_ticks();
+        req.submit_mode = self.completion_mode();
+
+        let queue_idx: usize = self.my_queue_idx();
+        let num_bufs: usize = req.num_segs + 2;
+        let mut queue = loop {
+            let queue = self.queues[queue_idx].lock_irqsave();
+            if num_bufs > queue.vq.size() as usize {
+                return Err(VirtIOError::QueueFull);
+            }
+            if num_bufs <= queue.vq.num_free() as usize {
+                break queue;
+            }
+            // Full: reap (outside the lock, since completions can submit) until it isn't.
+            drop(queue);
+            if self.poll() == 0 {
+                core::hint::spin_loop();
+            }
+        };
+        // The header and status slots are picked by head descriptor, which we only learn
+        // after pushing, so chain placeholders first and patch their addresses in after.
+        let mut bufs: [VirtqBuf; BLK_MAX_SEGS + 2] = [VirtqBuf { pa: 0, len: 0, device_writable: false }; BLK_MAX_SEGS + 2];
+        bufs[0] = VirtqBuf { pa: 0, len: size_of::<VirtIOBlkReqHdr>() as u32, device_writable: false };
+        for (i, seg) in req.segs[..req.num_segs].iter().enumerate() {
+            bufs[i + 1] = VirtqBuf { pa: seg.pa, len: seg.len, device_writable: req.op == BlkOp::Read };
+        }
+        bufs[num_bufs - 1] = VirtqBuf { pa: 0, len: 1, device_writable: true };
+
+        let head: u16 = queue.vq.next_head();
+        let slot_pa: u64 = queue.slots_pa + (head as usize * size_of::<BlkReqSlot>()) as u64;
+        bufs[0].pa = slot_pa;
+        bufs[num_bufs - 1].pa = slot_pa + core::mem::offset_of!(BlkReqSlot, status) as u64;
+        unsafe {
+            let slot: *mut BlkReqSlot = queue.slots.add(head as usize);
+            (*slot).hdr = VirtIOBlkReqHdr { req_type: req.op as u32, reserved: 0, sector: req.sector };
+            (*slot).status = 0xff;
+        }
+
+        match queue.vq.push(&bufs[..num_bufs], req as *mut BlkRequest as usize) {
+            Ok(_) => {},
+            Err(e) => { return Err(e); }
+        }
+        queue.stats.submitted += 1;
+        crate::trace!("blk: submit op {} sector {} len {} q{}", req.op as u32, req.sector, data_len, queue_idx);
+        self.inflight[queue_idx].fetch_add(1, Ordering::Release);
+        queue.vq.notify();
+        return Ok(());
+    }
+
+    // Reap whatever this CPU's queue has completed. Returns the number of requests finished.
+    pub fn poll(&self) -> usize {
+        return self.poll_queue(self.my_queue_idx());
+    }
+
+    /*
+     * Reap the queue another CPU submits to. Its requests' on_complete callbacks then run
+     * here instead, which is what kick_completions() does for offline CPUs too.
+     */
+    pub fn poll_cpu(&self, cpu_idx: usize) -> usize {
+        return self.poll_queue(cpu_idx % self.num_queues);
+    }
+
+    fn poll_queue(&self, queue_idx: usize) -> usize {
+        let mut total: usize = 0;
+        loop {
+            let mut reaped: [*mut BlkRequest; POLL_BATCH] = [ptr::null_mut(); POLL_BATCH];
+            let mut num_reaped: usize = 0;
+            {
+                let mut queue = self.queues[queue_idx].lock_irqsave();
+                let now: u64 = counter_ticks();
+                while num_reaped < POLL_BATCH {
+                    match queue.vq.pop_used() {
+                        Some(completion) => {
+                            let req: *mut BlkRequest = completion.token as *mut BlkRequest;
+                            unsafe {
+                                let status: u8 = ptr::read_volatile(&raw const (*queue.slots.add(completion.head as usize)).status);
+                                (*req).status.store(status, Ordering::Relaxed);
+                                queue.stats.completed += 1;
+                                if status == VIRTIO_BLK_S_OK {
+                                    queue.stats.bytes += (*req).data_len() as u64;
+                                } else {
+                                    queue.stats.errors += 1;
+                                }
+                                let latency_ticks: u64 = now.saturating_sub((*req).submit_ticks);
+                                (*self.lat_hists)[queue_idx][(*req).submit_mode as usize].record(ticks_to_ns(latency_ticks));
+                                queue.lat_ewma_ticks = if queue.lat_ewma_ticks == 0 {
+                                    latency_ticks
+                                } else {
+                                    queue.lat_ewma_ticks - (queue.lat_ewma_ticks >> LATENCY_EWMA_SHIFT) + (latency_ticks >> LATENCY_EWMA_SHIFT)
+                                };
+                            }
+                            reaped[num_reaped] = req;
+                            num_reaped += 1;
+                        },
+                        None => { break; }
+                    }
+                }
+                self.inflight[queue_idx].fetch_sub(num_reaped as u32, Ordering::Release);
+            }
+
+            for &req in &reaped[..num_reaped] {
+                unsafe {
+                    (*req).unpin_segments();
+                    let on_complete: Option<fn(&mut BlkRequest)> = (*req).on_complete;
+                    (*req).done.store(true, Ordering::Release);
+                    if let Some(on_complete) = on_complete {
+                        on_complete(&mut *req);
+                    }
+                }
+            }
+            total += num_reaped;
+            if num_reaped < POLL_BATCH {
+                return total;
+            }
+        }
+    }
+
+    /*
+     * Submit and wait for `req` to complete: spinning on this CPU's used ring in Poll mode,
+     * sleeping in WFI in Interrupt mode, one then the other in Hybrid mode. Spins regardless
+     * while IRQs are masked (e.g. during boot), since nothing would ever wake us.
+     */
+    pub fn submit_and_wait(&self, req: &mut BlkRequest) -> Result<(), VirtIOError> {
+        if let Err(e) = self.submit(req) {
+            return Err(e);
+        }
+        return self.wait(req);
+    }
+
+    // Wait for an already submitted `req` the way submit_and_wait() does.
+    pub fn wait(&self, req: &BlkRequest) -> Result<(), VirtIOError> {
+        let mode: BlkCompletionMode = self.completion_mode();
+        let can_sleep: bool = mode != BlkCompletionMode::Poll && irqs_enabled();
+        let mut idle_polls: u64 = 0;
+        let mut sleeps: u64 = 0;
+        let mut spin_hit: Option<bool> = None;
+        if mode == BlkCompletionMode::Hybrid && can_sleep {
+            spin_hit = Some(self.hybrid_spin(req));
+        }
+        if can_sleep {
+            loop {
+                // Mask before the final check so the completion IRQ can't slip in between it & WFI.
+                let daif: u64 = irq_save();
+                if req.is_done() {
+                    irq_restore(daif);
+                    break;
+                }
+                wait_for_interrupt();
+                sleeps += 1;
+                irq_restore(daif);
+            }
+        } else {
+            while !req.is_done() {
+                if self.poll() == 0 {
+                    idle_polls += 1;
+                    core::hint::spin_loop();
+                }
+            }
+        }
+        {
+            let mut queue = self.queues[self.my_queue_idx()].lock_irqsave();
+            queue.stats.idle_polls += idle_polls;
+            queue.stats.sleeps += sleeps;
+            match spin_hit {
+                Some(true) => { queue.stats.spin_hits += 1; },
+                Some(false) => { queue.stats.spin_misses += 1; },
+                None => {}
+            }
+        }
+        return req.result();
+    }
+
+    /*
+     * Hybrid mode's spin: watch the used ring index (no lock needed to read it) and only
+     * take the queue lock to reap once it moves. If nobody else submits to this queue,
+     * device interrupts are suppressed while we spin, since we'd only find the IRQ's
+     * work already done. Returns whether `req` completed inside the window.
+     */
+    fn hybrid_spin(&self, req: &BlkRequest) -> bool {
+        let queue_idx: usize = self.my_queue_idx();
+        let exclusive: bool = num_cpus() <= self.num_queues;
+        let window_ticks: u64 = {
+            let mut queue = self.queues[queue_idx].lock_irqsave();
+            if exclusive {
+                queue.vq.set_interrupts_enabled(false);
+            }
+            self.hybrid_spin_window_ticks(&queue)
+        };
+
+        let used_idx: *const u16 = self.used_idxs[queue_idx];
+        let mut last_used_idx: u16 = unsafe { ptr::read_volatile(used_idx) };
+        self.poll();
+        while !req.is_done() && counter_ticks().wrapping_sub(req.submit_ticks) < window_ticks {
+            let cur_used_idx: u16 = unsafe { ptr::read_volatile(used_idx) };
+            if cur_used_idx != last_used_idx {
+                last_used_idx = cur_used_idx;
+                self.poll();
+            } else {
+                core::hint::spin_loop();
+            }
+        }
+
+        if exclusive {
+            self.queues[queue_idx].lock_irqsave().vq.set_interrupts_enabled(true);
+            // Anything that completed while interrupts were off won't raise one now.
+            self.poll();
+        }
+        return req.is_done();
+    }
+
+    // Reap our own queue and poke the CPUs behind every other queue with work in flight.
+    fn kick_completions(&self) {
+        let my_cpu_idx: usize = cpu_id();
+        for queue_idx in 0..self.num_queues {
+            if self.inflight[queue_idx].load(Ordering::Acquire) == 0 {
+                continue;
+            }
+            if queue_idx == self.my_queue_idx() {
+                self.poll_queue(queue_idx);
+                continue;
+            }
+            // Every CPU sharing the queue gets an SGI: any of them may be sleeping on a request in it.
+            let mut sent: bool = false;
+            for cpu_idx in (queue_idx..num_cpus()).step_by(self.num_queues) {
+                if cpu_idx != my_cpu_idx && cpu_is_online(cpu_idx) {
+                    gic::send_sgi(SGI_BLK_COMPLETION, cpu_idx);
+                    sent = true;
+                }
+            }
+            if !sent {
+                self.poll_queue(queue_idx);
+            }
+        }
+    }
+
+    // Zero-copy when `buf` is ordinary kernel memory; staged through the bounce page otherwise.
+    pub fn read(&self, sector: u64, buf: &mut [u8]) -> Result<(), VirtIOError> {
+        match self.direct_io(BlkOp::Read, sector, buf.as_mut_ptr(), buf.len()) {
+            Err(VirtIOError::PinFailed(_)) => {
+                return self.bounce_io(BlkOp::Read, sector, buf.as_mut_ptr(), buf.len());
+            },
+            result => { return result; }
+        }
+    }
+
+    pub fn write(&self, sector: u64, buf: &[u8]) -> Result<(), VirtIOError> {
+        match self.direct_io(BlkOp::Write, sector, buf.as_ptr() as *mut u8, buf.len()) {
+            Err(VirtIOError::PinFailed(_)) => {
+                return self.bounce_io(BlkOp::Write, sector, buf.as_ptr() as *mut u8, buf.len());
+            },
+            result => { return result; }
+        }
+    }
+
+    #[inline(always)] pub fn bytes_direct(&self) -> u64 { self.bytes_direct.load(Ordering::Relaxed) }
+    #[inline(always)] pub fn bytes_bounced(&self) -> u64 { self.bytes_bounced.load(Ordering::Relaxed) }
+
+    // Synchronous I/O with the device DMAing straight to/from `buf`.
+    fn direct_io(&self, op: BlkOp, sector: u64, buf: *mut u8, len: usize) -> Result<(), VirtIOError> {
+        if len % SECTOR_LEN != 0 {
+            return Err(VirtIOError::UnalignedLength);
+        }
+        let mut done: usize = 0;
+        while done < len {
+            let chunk: usize = core::cmp::min(len - done, DIRECT_IO_MAX_LEN);
+            let mut req: BlkRequest = BlkRequest::new(op, sector + (done / SECTOR_LEN) as u64);
+            if let Err(e) = req.add_buffer(unsafe { buf.add(done) }, chunk) {
+                return Err(e);
+            }
+            // A failed submit unpins, and so does completion.
+            if let Err(e) = self.submit_and_wait(&mut req) {
+                return Err(e);
+            }
+            self.bytes_direct.fetch_add(chunk as u64, Ordering::Relaxed);
+            done += chunk;
+        }
+        return Ok(());
+    }
+
+    pub fn flush(&self) -> Result<(), VirtIOError> {
+        let mut req: BlkRequest = BlkRequest::new(BlkOp::Flush, 0);
+        return self.submit_and_wait(&mut req);
+    }
+
+    /*
+     * Synchronous I/O through this CPU's bounce page, one page at a time. The page is taken
+     * out of its slot for the duration rather than locked, since waiting can sleep in WFI;
+     * if it's already out (another thread on the queue is bouncing), this uses a fresh one.
+     */
+    fn bounce_io(&self, op: BlkOp, sector: u64, buf: *mut u8, len: usize) -> Result<(), VirtIOError> {
+        if len % SECTOR_LEN != 0 {
+            return Err(VirtIOError::UnalignedLength);
+        }
+        let queue_idx: usize = self.my_queue_idx();
+        let mut bounce: BounceBuf = core::mem::replace(
+            &mut *self.bounces[queue_idx].lock(),
+            BounceBuf { va: ptr::null_mut(), pa: 0 }
+        );
+        if bounce.va.is_null() {
+            match get_free_page(false) {
+                Ok(bounce_pa) => { bounce = BounceBuf { va: page_pa_to_kva(bounce_pa), pa: bounce_pa as u64 }; },
+                Err(e) => { return Err(VirtIOError::GetQueuePageFailed(e)); }
+            }
+        }
+        let result: Result<(), VirtIOError> = self.bounce_chunks(op, sector, buf, len, &bounce);
+        let spare: BounceBuf = {
+            let mut slot = self.bounces[queue_idx].lock();
+            if slot.va.is_null() { core::mem::replace(&mut *slot, bounce) } else { bounce }
+        };
+        if !spare.va.is_null() {
+            let _ = free_page_ref(spare.pa as *const u8);
+        }
+        return result;
+    }
+
+    fn bounce_chunks(&self, op: BlkOp, sector: u64, buf: *mut u8, len: usize, bounce: &BounceBuf) -> Result<(), VirtIOError> {
+        let mut done: usize = 0;
+        while done < len {
+            let chunk: usize = core::cmp::min(len - done, PAGE_LEN);
+            let mut req: BlkRequest = BlkRequest::new(op, sector + (done / SECTOR_LEN) as u64);
+            let _ = req.add_segment(bounce.pa, chunk as u32);
+            self.bytes_bounced.fetch_add(chunk as u64, Ordering::Relaxed);
+            unsafe {
+                if op == BlkOp::Write {
+                    ptr::copy_nonoverlapping(buf.add(done), bounce.va, chunk);
+                }
+                if let Err(e) = self.submit_and_wait(&mut req) {
+                    return Err(e);
+                }
+                if op == BlkOp::Read {
+                    ptr::copy_nonoverlapping(bounce.va, buf.add(done), chunk);
+                }
+            }
+            done += chunk;
+        }
+        return Ok(());
+    }
+}
+
+fn pin_range(pa: usize, len: usize) -> Result<(), PPMError> {
+    let first_page: usize = pa & !(PAGE_LEN - 1);
+    let mut page: usize = first_page;
+    while page < pa + len {
+        if let Err(e) = pin_page(page as *const u8) {
+            unpin_range(first_page, page - first_page);
+            return Err(e);
+        }
+        page += PAGE_LEN;
+    }
+    return Ok(());
+}
+
+fn unpin_range(pa: usize, len: usize) {
+    let mut page: usize = pa & !(PAGE_LEN - 1);
+    while page < pa + len {
+        let _ = unpin_page(page as *const u8);
+        page += PAGE_LEN;
+    }
+}
+
+fn blk_irq_handler(_intid: u32, ctx: usize) {
+    let blk_dev: &VirtIOBlk = unsafe { &*(ctx as *const VirtIOBlk) };
+    blk_dev.irqs_taken.fetch_add(1, Ordering::Relaxed);
+    unsafe {
+        let regs: &mut VirtIORegs = &mut *blk_dev.regs;
+        let interrupt_status: u32 = read32(&regs.interrupt_status);
+        write32(&mut regs.interrupt_ack, interrupt_status);
+        crate::trace!("blk: irq status {:#x}", interrupt_status);
+    }
+    blk_dev.kick_completions();
+}
+
+// SGI_BLK_COMPLETION: some other CPU took a virtio-blk IRQ on our behalf.
+fn blk_completion_sgi_handler(_intid: u32, _ctx: usize) {
+    for blk_idx in 0..num_blk_devices() {
+        if let Some(blk_dev) = get_blk_device(blk_idx) {
+            blk_dev.poll();
+        }
+    }
+}
+
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct VirtIOBlkConfig {
+    pub capacity: u64,
+    pub size_max: u32,
+    pub seg_max: u32,
+    pub geometry: VirtIOBlkGeometry,
+    pub blk_size: u32,
+    pub topology: VirtIOBlkTopology,
+    pub writeback: u8,
+    pub unused0: u8,
+    pub num_queues: u16
+} #[repr(C)] #[derive(Debug, Copy, Clone)] pub struct VirtIOBlkGeometry {
+    pub cylinders: u16,
+    pub heads: u8,
+    pub sectors: u8,
+} #[repr(C)] #[derive(Debug, Copy, Clone)] pub struct VirtIOBlkTopology {
+    pub physical_block_exp: u8,
+    pub alignment_offset: u8,
+    pub min_io_size: u16,
+    pub opt_io_size: u32,
+}
@@ -0,0 +1,236 @@
+use super::*;
+use super::virtqueue::*;
+use core::sync::atomic::{AtomicBool, AtomicPtr, Ordering};
+use crate::sync::SpinLock;
+use gic::IrqTrigger;
+use memory::{ppm::*, PAGE_LEN};
+
+// Port 0's queues; without VIRTIO_CONSOLE_F_MULTIPORT they're the only ones (virtio 1.x §5.3.2).
+const CONSOLE_RX_QUEUE: u32 = 0;
+const CONSOLE_TX_QUEUE: u32 = 1;
+
+const CONSOLE_RING_LEN: usize = PAGE_LEN;
+// Partial lines are held back until this much text is waiting.
+const CONSOLE_BATCH_LEN: u64 = 4096;
+
+// There's only ever one kernel console; any further virtio-console devices are left alone.
+static CONSOLE: AtomicPtr<VirtIOConsole> = AtomicPtr::new(ptr::null_mut());
+// Claimed up front, so of two consoles probed at once only one is set up.
+static CONSOLE_CLAIMED: AtomicBool = AtomicBool::new(false);
+
+#[derive(Copy, Clone, Default)]
+pub struct ConsoleStats {
+    pub bytes      : u64,
+    // Chains handed to the device; bytes / batches is the average batch size.
+    pub batches    : u64,
+    // Writes that found the ring full and had to wait for the device.
+    pub ring_waits : u64
+}
+
+/*
+ * Log text is copied into a ring page and the device DMAs it straight out of there.
+ * head/sent/done are running byte counts: [done, sent) is the one batch the device
+ * has, [sent, head) is waiting for the next one. While a batch is in flight, writers
+ * just append, so the slower the device the bigger the batches get.
+ */
+struct ConsoleTx {
+    vq       : VirtQueue,
+    ring_va  : *mut u8,
+    ring_pa  : u64,
+    head     : u64,
+    sent     : u64,
+    done     : u64,
+    inflight : bool,
+    stats    : ConsoleStats
+} unsafe impl Send for ConsoleTx {} impl ConsoleTx {
+    #[inline(always)] fn pending(&self) -> u64 { self.head - self.sent }
+    #[inline(always)] fn space(&self) -> usize { CONSOLE_RING_LEN - (self.head - self.done) as usize }
+
+    fn reap(&mut self) {
+        while self.vq.pop_used().is_some() {
+            self.done = self.sent;
+            self.inflight = false;
+        }
+    }
+
+    // Hand [sent, head) to the device as one chain (two descriptors if it wraps).
+    fn submit(&mut self) {
+        if self.inflight || self.pending() == 0 {
+            return;
+        }
+        let start: usize = (self.sent % CONSOLE_RING_LEN as u64) as usize;
+        let len: usize = self.pending() as usize;
+        let first_len: usize = core::cmp::min(len, CONSOLE_RING_LEN - start);
+        let bufs: [VirtqBuf; 2] = [
+            VirtqBuf { pa: self.ring_pa + start as u64, len: first_len as u32, device_writable: false },
+            VirtqBuf { pa: self.ring_pa, len: (len - first_len) as u32, device_writable: false }
+        ];
+        let num_bufs: usize = if first_len == len { 1 } else { 2 };
+        if self.vq.push(&bufs[..num_bufs], 0).is_err() {
+            return;
+        }
+        self.sent = self.head;
+        self.inflight = true;
+        self.stats.batches += 1;
+        self.vq.notify();
+    }
+
+    fn put(&mut self, bytes: &[u8]) {
+        let mut copied: usize = 0;
+        while copied < bytes.len() {
+            if self.space() == 0 {
+                self.stats.ring_waits += 1;
+                self.submit();
+                while self.space() == 0 {
+                    self.reap();
+                    core::hint::spin_loop();
+                }
+            }
+            let start: usize = (self.head % CONSOLE_RING_LEN as u64) as usize;
+            let chunk: usize = core::cmp::min(
+                bytes.len() - copied,
+                core::cmp::min(self.space(), CONSOLE_RING_LEN - start)
+            );
+            unsafe { ptr::copy_nonoverlapping(bytes.as_ptr().add(copied), self.ring_va.add(start), chunk); }
+            self.head += chunk as u64;
+            copied += chunk;
+        }
+        self.stats.bytes += bytes.len() as u64;
+    }
+}
+
+pub struct VirtIOConsole {
+    regs           : *mut VirtIORegs,
+    irq_registered : bool,
+    rx_vq          : VirtQueue,
+    tx             : SpinLock<ConsoleTx>
+}
+
+pub fn setup_console_device(console_regs: &mut VirtIORegs, interrupt: (u32, IrqTrigger)) -> Result<&'static VirtIOConsole, VirtIOError> {
+    if CONSOLE_CLAIMED.swap(true, Ordering::AcqRel) {
+        return Err(VirtIOError::TooManyDevices);
+    }
+    if let Err(e) = negotiate_features(console_regs, 0) {
+        return Err(e);
+    }
+
+    let console: &'static mut VirtIOConsole = match get_free_page_as::<VirtIOConsole>() {
+        Ok(console) => console,
+        Err(e) => { return Err(VirtIOError::AllocDeviceFailed(e)); }
+    };
+    console.regs = console_regs as *mut VirtIORegs;
+    // Nothing reads the console yet, but the device expects port 0's receiveq to exist.
+    if let Err(e) = console.rx_vq.init(console.regs, CONSOLE_RX_QUEUE) {
+        return Err(e);
+    }
+
+    let tx: &mut ConsoleTx = console.tx.get_mut();
+    if let Err(e) = tx.vq.init(console.regs, CONSOLE_TX_QUEUE) {
+        return Err(e);
+    }
+    match get_free_page(false) {
+        Ok(ring_pa) => {
+            tx.ring_pa = ring_pa as u64;
+            tx.ring_va = page_pa_to_kva(ring_pa);
+        },
+        Err(e) => { return Err(VirtIOError::GetQueuePageFailed(e)); }
+    }
+
+    // Without the IRQ, queued text still goes out: writers reap & resubmit as they go.
+    let (intid, trigger): (u32, IrqTrigger) = interrupt;
+    if gic::register_irq(intid, trigger, console_irq_handler, console as *const VirtIOConsole as usize).is_ok() {
+        console.irq_registered = true;
+        console.tx.get_mut().vq.set_interrupts_enabled(true);
+    }
+
+    set_driver_ok(console_regs);
+    CONSOLE.store(console as *mut VirtIOConsole, Ordering::Release);
+    return Ok(console);
+}
+
+#[inline(always)]
+pub fn console_active() -> bool {
+    return !CONSOLE.load(Ordering::Acquire).is_null();
+}
+
+pub fn console_stats() -> Option<ConsoleStats> {
+    let console: *mut VirtIOConsole = CONSOLE.load(Ordering::Acquire);
+    if console.is_null() {
+        return None;
+    }
+    return Some(unsafe { (*console).tx.lock_irqsave().stats });
+}
+
+/*
+ * Append `s` to the console ring, turning "\n" into "\r\n" like the PL011 path does.
+ * Kicks the device only when it's idle and a line was finished (or a batch's worth
+ * of partial line is waiting). Returns false if there's no virtio console to write to.
+ */
+pub fn console_write_str(s: &str) -> bool {
+    let console: *mut VirtIOConsole = CONSOLE.load(Ordering::Acquire);
+    if console.is_null() {
+        return false;
+    }
+    let mut tx = unsafe { (*console).tx.lock_irqsave() };
+    let mut ends_line: bool = false;
+    for line in s.split_inclusive('\n') {
+        match line.strip_suffix('\n') {
+            Some(text) => {
+                tx.put(text.as_bytes());
+                tx.put(b"\r\n");
+                ends_line = true;
+            },
+            None => {
+                tx.put(line.as_bytes());
+                ends_line = false;
+            }
+        }
+    }
+    tx.reap();
+    if ends_line || tx.pending() >= CONSOLE_BATCH_LEN {
+        tx.submit();
+    }
+    return true;
+}
+
+// Push out whatever is queued, partial lines included, & wait for the device to take it.
+pub fn console_flush() {
+    let console: *mut VirtIOConsole = CONSOLE.load(Ordering::Acquire);
+    if console.is_null() {
+        return;
+    }
+    let mut tx = unsafe { (*console).tx.lock_irqsave() };
+    while tx.done != tx.head {
+        tx.reap();
+        tx.submit();
+        core::hint::spin_loop();
+    }
+}
+
+/*
+ * For the panic path: get queued text out without waiting, and without spinning on
+ * a lock the panicking CPU may already hold. Anything that can't go out is lost.
+ */
+pub fn console_try_flush() {
+    let console: *mut VirtIOConsole = CONSOLE.load(Ordering::Acquire);
+    if console.is_null() {
+        return;
+    }
+    if let Some(mut tx) = unsafe { (*console).tx.try_lock() } {
+        tx.reap();
+        tx.submit();
+    }
+}
+
+// The device finished a batch: send whatever piled up meanwhile, partial lines included.
+fn console_irq_handler(_intid: u32, ctx: usize) {
+    let console: &VirtIOConsole = unsafe { &*(ctx as *const VirtIOConsole) };
+    unsafe {
+        let regs: &mut VirtIORegs = &mut *console.regs;
+        let interrupt_status: u32 = read32(&regs.interrupt_status);
+        write32(&mut regs.interrupt_ack, interrupt_status);
+    }
+    let mut tx = console.tx.lock_irqsave();
+    tx.reap();
+    tx.submit();
+}
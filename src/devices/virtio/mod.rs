@@ -0,0 +1,266 @@
+// use crate::{devices::*, read32, write32, read64, dsb, SBType};
+use super::*;
+use memory::ppm::PPMError;
+use gic::{GICError, IrqTrigger};
+pub mod virtqueue;
+pub mod blk;
+pub mod net;
+pub mod console;
+pub use blk::VirtIOBlk;
+pub use net::VirtIONet;
+pub use console::VirtIOConsole;
+
+pub enum VirtIOError {
+    MapMMIORangeFailed(PTMError),
+    WrongMagicValue,
+    UnsupportedVersion,
+    UnsupportedDeviceType,
+    GetRegsFailed(FDTError),
+    GetInterruptIDFailed(GICError),
+    FeaturesNotAccepted,
+    QueueUnavailable,
+    QueueAlreadyInUse,
+    QueueFull,
+    GetQueuePageFailed(PPMError),
+    AllocDeviceFailed(PPMError),
+    TooManyDevices,
+    OutOfRange,
+    UnalignedLength,
+    TooManySegments,
+    IOError,
+    Unsupported,
+    PinFailed(PPMError)
+}
+
+crate::register_driver!(VIRTIO_MMIO_DRIVER, "virtio-mmio", b"virtio,mmio", drivers::DRIVER_PRIORITY_DEFAULT, Parallel, probe_virtio_mmio);
+
+fn probe_virtio_mmio(virtio_node: &'static DTNode) -> Result<(), DeviceInitError> {
+    match init_virtio_device(virtio_node) {
+        Ok(_virtio_device) => {
+            // TODO(chungmcl): do... stuff? with the virtio_device
+            return Ok(());
+        },
+        Err(VirtIOError::UnsupportedDeviceType) => { /* skip device; do nothing */ return Ok(()); },
+        Err(e) => { return Err(DeviceInitError::VirtIOSetup(e)); }
+    }
+}
+
+pub fn init_virtio_device(virtio_node: &'static DTNode) -> Result<VirtIODevice, VirtIOError> { 
+    let virtio_regs: &'static mut VirtIORegs = match virtio_node.get_reg() {   
+        Ok((virtio_regs_ptr, virtio_mmio_len)) => {
+            unsafe {
+                if let Err(e) = map_mmio_range(
+                    virtio_regs_ptr as *const u8, 
+                    virtio_mmio_len as usize
+                ) { return Err(VirtIOError::MapMMIORangeFailed(e)); }
+                &mut *(virtio_regs_ptr as *mut VirtIORegs)
+            }
+        }, 
+        Err(e) => {
+            return Err(VirtIOError::GetRegsFailed(e));
+        }
+    };
+    
+    // The DT numbers SPIs from 0, but GIC INTIDs 0-31 are the per-CPU SGIs/PPIs.
+    let interrupt: (u32, IrqTrigger) = match gic::get_node_irq(virtio_node, 0) {
+        Ok(interrupt) => interrupt,
+        Err(e) => {
+            return Err(VirtIOError::GetInterruptIDFailed(e))
+        }
+    };
+
+    unsafe {
+        let magic_value: u32 = read32(
+            &virtio_regs.magic_value
+        );
+        if magic_value != VIRTIO_MAGIC {
+            return Err(VirtIOError::WrongMagicValue);
+        }
+
+        let version: u32 = read32(
+            &virtio_regs.version
+        );
+        if version != VIRTIO_VERSION {
+            return Err(VirtIOError::UnsupportedVersion);
+        }
+
+        // 1. Reset the device.
+        write32(&mut virtio_regs.status, 0);
+        dsb(SBType::Sy);
+
+        // 2. Set the ACKNOWLEDGE status bit: the guest OS has notice the device.
+        let mut prev_regs_status: u32 = read32(&virtio_regs.status);
+        write32(&mut virtio_regs.status, prev_regs_status | VIRTIO_STATUS_ACKNOWLEDGE);
+        dsb(SBType::Sy);
+
+        // 3. Set the DRIVER status bit: the guest OS knows how to drive the device.
+        prev_regs_status = read32(&virtio_regs.status);
+        write32(&mut virtio_regs.status, prev_regs_status | VIRTIO_STATUS_DRIVER);
+        dsb(SBType::Sy);
+        
+        let device_id: u32 = read32(&virtio_regs.device_id);
+        match device_id {
+            VIRTIO_DEV_BLK => {
+                match blk::setup_block_device(virtio_regs, interrupt) {
+                    Ok(blk_dev) => {
+                        return Ok(VirtIODevice::Block(blk_dev));
+                    },
+                    Err(e) => {
+                        prev_regs_status = read32(&virtio_regs.status);
+                        write32(&mut virtio_regs.status, prev_regs_status | VIRTIO_STATUS_FAILED);
+                        return Err(e);
+                    }
+                }
+            },
+            VIRTIO_DEV_NET => {
+                match net::setup_net_device(virtio_regs) {
+                    Ok(net_dev) => {
+                        return Ok(VirtIODevice::Net(net_dev));
+                    },
+                    Err(e) => {
+                        prev_regs_status = read32(&virtio_regs.status);
+                        write32(&mut virtio_regs.status, prev_regs_status | VIRTIO_STATUS_FAILED);
+                        return Err(e);
+                    }
+                }
+            },
+            VIRTIO_DEV_CONSOLE => {
+                match console::setup_console_device(virtio_regs, interrupt) {
+                    Ok(console_dev) => {
+                        return Ok(VirtIODevice::Console(console_dev));
+                    },
+                    Err(VirtIOError::TooManyDevices) => {
+                        // Only the first console is the kernel's; leave the rest untouched.
+                        return Err(VirtIOError::UnsupportedDeviceType);
+                    },
+                    Err(e) => {
+                        prev_regs_status = read32(&virtio_regs.status);
+                        write32(&mut virtio_regs.status, prev_regs_status | VIRTIO_STATUS_FAILED);
+                        return Err(e);
+                    }
+                }
+            },
+            _ => { 
+                return Err(VirtIOError::UnsupportedDeviceType);
+            }
+        }
+    }
+}
+
+/*
+ * Feature negotiation (virtio 1.x §3.1.1 steps 4-6): offer the subset of `wanted` the device
+ * supports plus VIRTIO_F_VERSION_1, then check FEATURES_OK stuck. Returns the accepted set.
+ */
+fn negotiate_features(regs: &mut VirtIORegs, wanted: u64) -> Result<u64, VirtIOError> {
+    unsafe {
+        write32(&mut regs.device_features_sel, 0);
+        dsb(SBType::Sy);
+        let mut device_features: u64 = read32(&regs.device_features) as u64;
+        write32(&mut regs.device_features_sel, 1);
+        dsb(SBType::Sy);
+        device_features |= (read32(&regs.device_features) as u64) << 32;
+
+        if device_features & VIRTIO_F_VERSION_1 == 0 {
+            return Err(VirtIOError::UnsupportedVersion);
+        }
+        let accepted: u64 = device_features & (wanted | VIRTIO_F_VERSION_1);
+
+        write32(&mut regs.driver_features_sel, 0);
+        write32(&mut regs.driver_features, accepted as u32);
+        write32(&mut regs.driver_features_sel, 1);
+        write32(&mut regs.driver_features, (accepted >> 32) as u32);
+        dsb(SBType::Sy);
+
+        let prev_regs_status: u32 = read32(&regs.status);
+        write32(&mut regs.status, prev_regs_status | VIRTIO_STATUS_FEATURES_OK);
+        dsb(SBType::Sy);
+        if read32(&regs.status) & VIRTIO_STATUS_FEATURES_OK == 0 {
+            return Err(VirtIOError::FeaturesNotAccepted);
+        }
+        return Ok(accepted);
+    }
+}
+
+fn set_driver_ok(regs: &mut VirtIORegs) {
+    unsafe {
+        let prev_regs_status: u32 = read32(&regs.status);
+        write32(&mut regs.status, prev_regs_status | VIRTIO_STATUS_DRIVER_OK);
+        dsb(SBType::Sy);
+    }
+}
+
+pub trait TrailingConfig {
+    type ConfigStruct;
+}
+
+#[repr(C, align(4))]
+pub struct VirtIORegs {
+    magic_value: u32,
+    version: u32,
+    device_id: u32,
+    vendor_id: u32,
+    device_features: u32,
+    device_features_sel: u32,
+    _reserved0: [u32; 2],
+    driver_features: u32,
+    // Affects driver_features.
+    // driver_features_sel=0 -> driver_features[31:0]
+    // driver_features_sel=1 -> driver_features[63:32]
+    driver_features_sel: u32,
+    _reserved1: [u32; 2],
+    queue_sel: u32,
+    queue_num_max: u32,
+    queue_num: u32,
+    _reserved2: [u32; 2],
+    queue_ready: u32,
+    _reserved3: [u32; 2],
+    queue_notify: u32,
+    _reserved4: [u32; 3],
+    interrupt_status: u32,
+    interrupt_ack: u32,
+    _reserved5: [u32; 2],
+    status: u32,
+    _reserved6: [u32; 3],
+    queue_desc_low: u32,
+    queue_desc_high: u32,
+    _reserved7: [u32; 2],
+    queue_avail_low: u32,
+    queue_avail_high: u32,
+    _reserved8: [u32; 2],
+    queue_used_low: u32,
+    queue_used_high: u32,
+    _reserved9: [u32; 21],
+    config_generation: u32,
+    // config: [u32; 0] // Flexible Array Member
+} impl VirtIORegs {
+    pub fn get_config<T: TrailingConfig>(&self) -> *const T::ConfigStruct {
+        let self_raw_ptr: *const u8 = (self as *const Self) as *const u8;
+        let config_ptr: *const u8 = unsafe { self_raw_ptr.add(size_of::<VirtIORegs>()) };
+        return config_ptr as *const T::ConfigStruct;
+    }
+}
+
+pub enum VirtIODevice {
+    Block(&'static VirtIOBlk),
+    Net(&'static VirtIONet),
+    Console(&'static VirtIOConsole),
+}
+
+const VIRTIO_MAGIC:                     u32 = 0x7472_6976;
+const VIRTIO_VERSION:                   u32 = 0x2;
+
+const VIRTIO_DEV_NET:                   u32 = 0x1;
+const VIRTIO_DEV_BLK:                   u32 = 0x2;
+const VIRTIO_DEV_CONSOLE:               u32 = 0x3;
+// ...
+
+// Status bit values
+const VIRTIO_STATUS_ACKNOWLEDGE:        u32 = 1;
+const VIRTIO_STATUS_DRIVER:             u32 = 2;
+const VIRTIO_STATUS_FAILED:             u32 = 128;
+const VIRTIO_STATUS_FEATURES_OK:        u32 = 8;
+const VIRTIO_STATUS_DRIVER_OK:          u32 = 4;
+const VIRTIO_STATUS_DEVICE_NEEDS_RESET: u32 = 64;
+
+// Device-independent feature bits
+const VIRTIO_F_VERSION_1:               u64 = 1 << 32;
@@ -0,0 +1,498 @@
+use super::*;
+use super::virtqueue::*;
+use crate::sync::SpinLock;
+use memory::{ppm::*, PAGE_LEN};
+
+pub const MAX_NET_DEVICES: usize = 4;
+pub const ETH_ALEN: usize = 6;
+// Largest frame we send or expect to receive without GSO: 1500 bytes of MTU + the Ethernet header.
+pub const NET_MAX_FRAME_LEN: usize = 1514;
+
+// Feature bits (virtio 1.x §5.1.3)
+const VIRTIO_NET_F_CSUM:       u64 = 1 << 0;
+const VIRTIO_NET_F_GUEST_CSUM: u64 = 1 << 1;
+const VIRTIO_NET_F_MAC:        u64 = 1 << 5;
+const VIRTIO_NET_F_MRG_RXBUF:  u64 = 1 << 15;
+const VIRTIO_NET_F_STATUS:     u64 = 1 << 16;
+
+// virtio_net_hdr flags & config status bits (virtio 1.x §5.1.4, §5.1.6)
+const VIRTIO_NET_HDR_F_NEEDS_CSUM: u8 = 1;
+const VIRTIO_NET_HDR_F_DATA_VALID: u8 = 2;
+const VIRTIO_NET_HDR_GSO_NONE:     u8 = 0;
+const VIRTIO_NET_S_LINK_UP:        u16 = 1;
+
+// Queue indices of the (single) queue pair.
+const NET_RX_QUEUE: u32 = 0;
+const NET_TX_QUEUE: u32 = 1;
+
+/*
+ * Every RX/TX buffer is a fixed 2KB slice of a pool page, one descriptor each, and the
+ * buffer a chain uses is picked by its head descriptor, the same trick virtio-blk uses
+ * for its request headers. So there's no free list: a descriptor being free means its
+ * buffer is. 2KB holds a header + a full-sized frame, so even without MRG_RXBUF one
+ * buffer is always enough; with it the device may still spread a frame over several.
+ */
+const NET_BUF_LEN: usize = 2048;
+const NET_BUFS_PER_PAGE: usize = PAGE_LEN / NET_BUF_LEN;
+const NET_POOL_PAGES: usize = VIRTQ_MAX_SIZE / NET_BUFS_PER_PAGE;
+
+// RX buffers are handed back to the device this many at a time, with one notify.
+const RX_REFILL_BATCH: u16 = 32;
+// queue_frame() kicks by itself once this many frames are waiting for a flush.
+const TX_BATCH_MAX: u16 = 32;
+
+static mut NET_DEVICES: [*const VirtIONet; MAX_NET_DEVICES] = [ptr::null(); MAX_NET_DEVICES];
+static mut NUM_NET_DEVICES: usize = 0;
+static NET_REGISTRY_LOCK: SpinLock<()> = SpinLock::new(());
+
+pub fn get_net_device(net_idx: usize) -> Option<&'static VirtIONet> {
+    unsafe {
+        if net_idx < NUM_NET_DEVICES { Some(&*NET_DEVICES[net_idx]) } else { None }
+    }
+}
+
+pub fn num_net_devices() -> usize {
+    unsafe { NUM_NET_DEVICES }
+}
+
+// virtio 1.x always has num_buffers, whether or not MRG_RXBUF was negotiated.
+#[repr(C)]
+#[derive(Copy, Clone)]
+struct VirtIONetHdr {
+    flags       : u8,
+    gso_type    : u8,
+    hdr_len     : u16,
+    gso_size    : u16,
+    csum_start  : u16,
+    csum_offset : u16,
+    num_buffers : u16
+}
+const NET_HDR_LEN: usize = size_of::<VirtIONetHdr>();
+
+// Ask for the Internet checksum of frame[start..] to be stored at frame[start + offset..+2]:
+// by the device with VIRTIO_NET_F_CSUM, or in software before sending without it.
+#[derive(Copy, Clone)]
+pub struct NetCsumRequest {
+    pub start  : u16,
+    pub offset : u16
+}
+
+#[derive(Copy, Clone)]
+pub struct NetRxFrame {
+    pub len        : usize,
+    // The device already checked (or didn't need to check) the frame's checksums, or
+    // recv() finished the one it left partial.
+    pub csum_valid : bool
+}
+
+#[derive(Copy, Clone, Default)]
+pub struct NetRxStats {
+    pub packets     : u64,
+    pub bytes       : u64,
+    // Buffers consumed, and frames that needed more than one of them (MRG_RXBUF).
+    pub buffers     : u64,
+    pub merged      : u64,
+    // Refill batches and the buffers they handed back to the device.
+    pub refills     : u64,
+    pub refilled    : u64,
+    pub csum_valid  : u64,
+    // Frames whose checksum the device left partial (NEEDS_CSUM) and recv() completed.
+    pub csum_completed : u64,
+    // Frames too big for the caller's buffer, or missing buffers the header promised.
+    pub drops       : u64
+}
+
+#[derive(Copy, Clone, Default)]
+pub struct NetTxStats {
+    pub packets     : u64,
+    pub bytes       : u64,
+    // Notifies sent; packets / kicks is the average burst size.
+    pub kicks       : u64,
+    pub queue_full  : u64,
+    pub csum_offloaded : u64,
+    pub csum_sw     : u64
+}
+
+struct NetPool {
+    pages_pa : [u64; NET_POOL_PAGES]
+} impl NetPool {
+    fn alloc(&mut self) -> Result<(), VirtIOError> {
+        for page_idx in 0..NET_POOL_PAGES {
+            match get_free_page(false) {
+                Ok(page_pa) => { self.pages_pa[page_idx] = page_pa as u64; },
+                Err(e) => { return Err(VirtIOError::GetQueuePageFailed(e)); }
+            }
+        }
+        return Ok(());
+    }
+
+    #[inline(always)]
+    fn buf_pa(&self, buf_idx: u16) -> u64 {
+        let buf_idx: usize = buf_idx as usize;
+        return self.pages_pa[buf_idx / NET_BUFS_PER_PAGE] + ((buf_idx % NET_BUFS_PER_PAGE) * NET_BUF_LEN) as u64;
+    }
+
+    #[inline(always)]
+    fn buf_va(&self, buf_idx: u16) -> *mut u8 {
+        return page_pa_to_kva(self.buf_pa(buf_idx) as *const u8);
+    }
+}
+
+struct NetRxQueue {
+    vq    : VirtQueue,
+    pool  : NetPool,
+    stats : NetRxStats
+} unsafe impl Send for NetRxQueue {}
+
+struct NetTxQueue {
+    vq      : VirtQueue,
+    pool    : NetPool,
+    // Frames pushed onto the avail ring that the device hasn't been told about yet.
+    pending : u16,
+    stats   : NetTxStats
+} unsafe impl Send for NetTxQueue {}
+
+/*
+ * A single RX/TX queue pair, driven by polling: both queues run with interrupts
+ * suppressed, RX is drained by recv() and TX descriptors are reclaimed lazily by the
+ * next sender. Senders batch frames with queue_frame() and kick the device once per
+ * burst with flush_tx(); send() is the one-frame shorthand.
+ */
+pub struct VirtIONet {
+    regs     : *mut VirtIORegs,
+    features : u64,
+    mac      : [u8; ETH_ALEN],
+    rx       : SpinLock<NetRxQueue>,
+    tx       : SpinLock<NetTxQueue>
+} impl TrailingConfig for VirtIONet {
+    type ConfigStruct = VirtIONetConfig;
+}
+
+// In MMIO address order, like the blk registry, so parallel probing doesn't renumber NICs.
+fn register_net_device(net_dev: &'static VirtIONet) -> Result<(), VirtIOError> {
+    let _registry_guard = NET_REGISTRY_LOCK.lock_irqsave();
+    unsafe {
+        if NUM_NET_DEVICES >= MAX_NET_DEVICES {
+            return Err(VirtIOError::TooManyDevices);
+        }
+        let mut insert_idx: usize = NUM_NET_DEVICES;
+        while insert_idx > 0 && (*NET_DEVICES[insert_idx - 1]).regs > net_dev.regs {
+            NET_DEVICES[insert_idx] = NET_DEVICES[insert_idx - 1];
+            insert_idx -= 1;
+        }
+        NET_DEVICES[insert_idx] = net_dev as *const VirtIONet;
+        NUM_NET_DEVICES += 1;
+    }
+    return Ok(());
+}
+
+pub fn setup_net_device(net_dev_regs: &mut VirtIORegs) -> Result<&'static VirtIONet, VirtIOError> {
+    unsafe {
+        if NUM_NET_DEVICES >= MAX_NET_DEVICES {
+            return Err(VirtIOError::TooManyDevices);
+        }
+    }
+
+    let features: u64 = match negotiate_features(
+        net_dev_regs,
+        VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS
+    ) {
+        Ok(features) => features,
+        Err(e) => { return Err(e); }
+    };
+
+    let net_dev: &'static mut VirtIONet = match get_free_page_as::<VirtIONet>() {
+        Ok(net_dev) => net_dev,
+        Err(e) => { return Err(VirtIOError::AllocDeviceFailed(e)); }
+    };
+    net_dev.regs = net_dev_regs as *mut VirtIORegs;
+    net_dev.features = features;
+    if features & VIRTIO_NET_F_MAC != 0 {
+        let net_dev_config_ptr: *const VirtIONetConfig = net_dev_regs.get_config::<VirtIONet>();
+        loop {
+            unsafe {
+                let before: u32 = read32(&net_dev_regs.config_generation);
+                for i in 0..ETH_ALEN {
+                    net_dev.mac[i] = ptr::read_volatile(&raw const (*net_dev_config_ptr).mac[i]);
+                }
+                if read32(&net_dev_regs.config_generation) == before { break; }
+            }
+        }
+    }
+
+    let rx: &mut NetRxQueue = net_dev.rx.get_mut();
+    if let Err(e) = rx.vq.init(net_dev.regs, NET_RX_QUEUE) {
+        return Err(e);
+    }
+    if let Err(e) = rx.pool.alloc() {
+        return Err(e);
+    }
+    let tx: &mut NetTxQueue = net_dev.tx.get_mut();
+    if let Err(e) = tx.vq.init(net_dev.regs, NET_TX_QUEUE) {
+        return Err(e);
+    }
+    if let Err(e) = tx.pool.alloc() {
+        return Err(e);
+    }
+
+    // Buffers may be posted before DRIVER_OK (virtio 1.x §3.1.1 step 7); the device just won't use them until then.
+    refill_rx(net_dev.rx.get_mut(), 0);
+    set_driver_ok(net_dev_regs);
+
+    if let Err(e) = register_net_device(net_dev) {
+        return Err(e);
+    }
+    return Ok(net_dev);
+}
+
+// Give every free RX descriptor (at least `min_batch` of them) its buffer back, with a single notify.
+fn refill_rx(rx: &mut NetRxQueue, min_batch: u16) -> u16 {
+    let num_free: u16 = rx.vq.num_free();
+    if num_free == 0 || num_free < min_batch {
+        return 0;
+    }
+    let mut refilled: u16 = 0;
+    while rx.vq.num_free() > 0 {
+        let buf_idx: u16 = rx.vq.next_head();
+        let buf: VirtqBuf = VirtqBuf { pa: rx.pool.buf_pa(buf_idx), len: NET_BUF_LEN as u32, device_writable: true };
+        if rx.vq.push(&[buf], buf_idx as usize).is_err() {
+            break;
+        }
+        refilled += 1;
+    }
+    if refilled > 0 {
+        crate::trace!("net: rx refill {} buffers", refilled);
+        rx.vq.notify();
+        rx.stats.refills += 1;
+        rx.stats.refilled += refilled as u64;
+    }
+    return refilled;
+}
+
+// Internet checksum (RFC 1071) over `data`, folded & complemented, in network byte order.
+fn inet_csum(data: &[u8]) -> u16 {
+    let mut sum: u64 = 0;
+    let mut chunks = data.chunks_exact(2);
+    for chunk in &mut chunks {
+        sum += u16::from_be_bytes([chunk[0], chunk[1]]) as u64;
+    }
+    if let [last] = chunks.remainder() {
+        sum += (*last as u64) << 8;
+    }
+    while sum >> 16 != 0 {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return !(sum as u16);
+}
+
+impl VirtIONet {
+    #[inline(always)] pub fn mac(&self) -> [u8; ETH_ALEN] { self.mac }
+    #[inline(always)] pub fn has_csum_offload(&self) -> bool { self.features & VIRTIO_NET_F_CSUM != 0 }
+    #[inline(always)] pub fn has_mrg_rxbuf(&self) -> bool { self.features & VIRTIO_NET_F_MRG_RXBUF != 0 }
+
+    // Without VIRTIO_NET_F_STATUS the link is assumed to always be up.
+    pub fn link_up(&self) -> bool {
+        if self.features & VIRTIO_NET_F_STATUS == 0 {
+            return true;
+        }
+        unsafe {
+            let config_ptr: *const VirtIONetConfig = (*self.regs).get_config::<VirtIONet>();
+            return ptr::read_volatile(&raw const (*config_ptr).status) & VIRTIO_NET_S_LINK_UP != 0;
+        }
+    }
+
+    pub fn rx_stats(&self) -> NetRxStats {
+        return self.rx.lock_irqsave().stats;
+    }
+
+    pub fn tx_stats(&self) -> NetTxStats {
+        return self.tx.lock_irqsave().stats;
+    }
+
+    #[inline(always)]
+    pub fn rx_pending(&self) -> bool {
+        return self.rx.lock_irqsave().vq.has_used();
+    }
+
+    /*
+     * Copy the next received frame (without its virtio header) into `buf`. Ok(None) if
+     * nothing has arrived. A frame that doesn't fit in `buf` is dropped & reported as
+     * OutOfRange. Consumed buffers go back to the device once a whole batch is free.
+     */
+    pub fn recv(&self, buf: &mut [u8]) -> Result<Option<NetRxFrame>, VirtIOError> {
+        let mut rx = self.rx.lock_irqsave();
+        let first: VirtqCompletion = match rx.vq.pop_used() {
+            Some(first) => first,
+            None => { return Ok(None); }
+        };
+        let first_va: *const u8 = rx.pool.buf_va(first.head);
+        let hdr: VirtIONetHdr = unsafe { ptr::read_unaligned(first_va as *const VirtIONetHdr) };
+        let num_buffers: u16 = if self.has_mrg_rxbuf() { core::cmp::max(hdr.num_buffers, 1) } else { 1 };
+
+        let mut len: usize = 0;
+        let mut fits: bool = true;
+        let mut complete: bool = true;
+        for buf_n in 0..num_buffers {
+            let completion: VirtqCompletion = if buf_n == 0 {
+                first
+            } else {
+                match rx.vq.pop_used() {
+                    Some(completion) => completion,
+                    None => { complete = false; break; }
+                }
+            };
+            rx.stats.buffers += 1;
+            let (src_offset, chunk): (usize, usize) = if buf_n == 0 {
+                (NET_HDR_LEN, (completion.len as usize).saturating_sub(NET_HDR_LEN))
+            } else {
+                (0, completion.len as usize)
+            };
+            let chunk: usize = core::cmp::min(chunk, NET_BUF_LEN - src_offset);
+            if len + chunk > buf.len() {
+                fits = false;
+            } else {
+                unsafe {
+                    ptr::copy_nonoverlapping(rx.pool.buf_va(completion.head).add(src_offset), buf.as_mut_ptr().add(len), chunk);
+                }
+                len += chunk;
+            }
+        }
+        refill_rx(&mut rx, RX_REFILL_BATCH);
+
+        if !fits || !complete {
+            rx.stats.drops += 1;
+            return if fits { Err(VirtIOError::IOError) } else { Err(VirtIOError::OutOfRange) };
+        }
+        /*
+         * With GUEST_CSUM the device may hand over a frame the way a sender's stack left
+         * it: the checksum field holds only the pseudo-header sum, and the Internet
+         * checksum of everything from csum_start on still has to be stored over it.
+         */
+        let mut csum_valid: bool = hdr.flags & VIRTIO_NET_HDR_F_DATA_VALID != 0;
+        if hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM != 0 {
+            let csum_start: usize = hdr.csum_start as usize;
+            let csum_at: usize = csum_start + hdr.csum_offset as usize;
+            if csum_at + 2 > len {
+                rx.stats.drops += 1;
+                return Err(VirtIOError::IOError);
+            }
+            let sum: [u8; 2] = inet_csum(&buf[csum_start..len]).to_be_bytes();
+            buf[csum_at..csum_at + 2].copy_from_slice(&sum);
+            rx.stats.csum_completed += 1;
+            csum_valid = true;
+        }
+        crate::trace!("net: rx frame len {} buffers {} csum valid {}", len, num_buffers, csum_valid);
+        rx.stats.packets += 1;
+        rx.stats.bytes += len as u64;
+        if num_buffers > 1 { rx.stats.merged += 1; }
+        if csum_valid { rx.stats.csum_valid += 1; }
+        return Ok(Some(NetRxFrame { len, csum_valid }));
+    }
+
+    /*
+     * Copy `frame` into a TX buffer and put it on the avail ring without kicking the
+     * device; flush_tx() does that once for the whole burst. Kicks early if the burst
+     * reaches TX_BATCH_MAX, and reclaims whatever the device has finished sending.
+     */
+    pub fn queue_frame(&self, frame: &[u8], csum: Option<NetCsumRequest>) -> Result<(), VirtIOError> {
+        if frame.is_empty() || frame.len() > NET_MAX_FRAME_LEN {
+            return Err(VirtIOError::OutOfRange);
+        }
+        if let Some(csum) = csum {
+            if csum.start as usize + csum.offset as usize + 2 > frame.len() {
+                return Err(VirtIOError::OutOfRange);
+            }
+        }
+        let mut tx = self.tx.lock_irqsave();
+        while tx.vq.pop_used().is_some() {}
+        if tx.vq.num_free() == 0 {
+            tx.stats.queue_full += 1;
+            return Err(VirtIOError::QueueFull);
+        }
+
+        let buf_idx: u16 = tx.vq.next_head();
+        let buf_va: *mut u8 = tx.pool.buf_va(buf_idx);
+        let mut hdr: VirtIONetHdr = VirtIONetHdr {
+            flags: 0, gso_type: VIRTIO_NET_HDR_GSO_NONE, hdr_len: 0, gso_size: 0, csum_start: 0, csum_offset: 0, num_buffers: 0
+        };
+        unsafe {
+            ptr::copy_nonoverlapping(frame.as_ptr(), buf_va.add(NET_HDR_LEN), frame.len());
+            if let Some(csum) = csum {
+                if self.has_csum_offload() {
+                    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+                    hdr.csum_start = csum.start;
+                    hdr.csum_offset = csum.offset;
+                    tx.stats.csum_offloaded += 1;
+                } else {
+                    // The checksum field has to be zero while it's being summed over.
+                    let csum_va: *mut u8 = buf_va.add(NET_HDR_LEN + csum.start as usize + csum.offset as usize);
+                    ptr::write_bytes(csum_va, 0, 2);
+                    let covered: &[u8] = slice::from_raw_parts(buf_va.add(NET_HDR_LEN + csum.start as usize), frame.len() - csum.start as usize);
+                    let sum: [u8; 2] = inet_csum(covered).to_be_bytes();
+                    ptr::copy_nonoverlapping(sum.as_ptr(), csum_va, 2);
+                    tx.stats.csum_sw += 1;
+                }
+            }
+            ptr::write_unaligned(buf_va as *mut VirtIONetHdr, hdr);
+        }
+
+        let buf: VirtqBuf = VirtqBuf { pa: tx.pool.buf_pa(buf_idx), len: (NET_HDR_LEN + frame.len()) as u32, device_writable: false };
+        if let Err(e) = tx.vq.push(&[buf], buf_idx as usize) {
+            return Err(e);
+        }
+        tx.stats.packets += 1;
+        tx.stats.bytes += frame.len() as u64;
+        tx.pending += 1;
+        if tx.pending >= TX_BATCH_MAX {
+            Self::kick_tx(&mut tx);
+        }
+        return Ok(());
+    }
+
+    // Tell the device about every frame queued since the last kick.
+    pub fn flush_tx(&self) {
+        let mut tx = self.tx.lock_irqsave();
+        Self::kick_tx(&mut tx);
+    }
+
+    pub fn send(&self, frame: &[u8], csum: Option<NetCsumRequest>) -> Result<(), VirtIOError> {
+        if let Err(e) = self.queue_frame(frame, csum) {
+            return Err(e);
+        }
+        self.flush_tx();
+        return Ok(());
+    }
+
+    // Queue every frame of a burst, then kick once. Returns how many frames went out.
+    pub fn send_burst(&self, frames: &[&[u8]]) -> Result<usize, VirtIOError> {
+        let mut sent: usize = 0;
+        for frame in frames {
+            match self.queue_frame(frame, None) {
+                Ok(_) => { sent += 1; },
+                Err(VirtIOError::QueueFull) if sent > 0 => { break; },
+                Err(e) => { self.flush_tx(); return Err(e); }
+            }
+        }
+        self.flush_tx();
+        return Ok(sent);
+    }
+
+    fn kick_tx(tx: &mut NetTxQueue) {
+        if tx.pending == 0 {
+            return;
+        }
+        crate::trace!("net: tx kick {} frames", tx.pending);
+        tx.vq.notify();
+        tx.pending = 0;
+        tx.stats.kicks += 1;
+    }
+}
+
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct VirtIONetConfig {
+    pub mac: [u8; ETH_ALEN],
+    pub status: u16,
+    pub max_virtqueue_pairs: u16,
+    pub mtu: u16
+}
@@ -0,0 +1,253 @@
+use super::*;
+use memory::ppm::*;
+
+// Split virtqueue (virtio 1.x §2.7). Every queue lives in a single 16KB PPM page:
+// ┌──────────────────────┬──────────────────────┬──────────────────────┐
+// │ desc table @ 0x0000  │ avail ring @ 0x0800  │ used ring @ 0x1000   │
+// │ 128 × 16B            │ 4B + 128 × 2B + 2B   │ 4B + 128 × 8B + 2B   │
+// └──────────────────────┴──────────────────────┴──────────────────────┘
+pub const VIRTQ_MAX_SIZE: usize = 128;
+
+const VIRTQ_DESC_OFFSET:  usize = 0x0000;
+const VIRTQ_AVAIL_OFFSET: usize = 0x0800;
+const VIRTQ_USED_OFFSET:  usize = 0x1000;
+
+const VIRTQ_DESC_F_NEXT:          u16 = 1;
+const VIRTQ_DESC_F_WRITE:         u16 = 2;
+const VIRTQ_AVAIL_F_NO_INTERRUPT: u16 = 1;
+
+#[repr(C)]
+#[derive(Copy, Clone)]
+pub struct VirtqDesc {
+    addr  : u64,
+    len   : u32,
+    flags : u16,
+    next  : u16
+}
+
+#[repr(C)]
+pub struct VirtqAvail {
+    flags      : u16,
+    idx        : u16,
+    ring       : [u16; VIRTQ_MAX_SIZE],
+    used_event : u16
+}
+
+#[repr(C)]
+#[derive(Copy, Clone)]
+pub struct VirtqUsedElem {
+    id  : u32,
+    len : u32
+}
+
+#[repr(C)]
+pub struct VirtqUsed {
+    flags       : u16,
+    idx         : u16,
+    ring        : [VirtqUsedElem; VIRTQ_MAX_SIZE],
+    avail_event : u16
+}
+
+// One buffer of a descriptor chain, as the device sees it.
+#[derive(Copy, Clone)]
+pub struct VirtqBuf {
+    pub pa              : u64,
+    pub len             : u32,
+    pub device_writable : bool
+}
+
+// A chain the device has finished with.
+#[derive(Copy, Clone)]
+pub struct VirtqCompletion {
+    pub token : usize,
+    pub head  : u16,
+    // Bytes the device wrote into the chain's device-writable buffers.
+    pub len   : u32
+}
+
+// All-zero is a valid, not yet initialized VirtQueue, so it can be embedded in
+// driver state allocated with get_free_page_as().
+pub struct VirtQueue {
+    regs          : *mut VirtIORegs,
+    queue_idx     : u32,
+    size          : u16,
+    desc          : *mut VirtqDesc,
+    avail         : *mut VirtqAvail,
+    used          : *mut VirtqUsed,
+    free_head     : u16,
+    num_free      : u16,
+    avail_idx     : u16,
+    last_used_idx : u16,
+    // Opaque per-chain cookie, indexed by the chain's head descriptor.
+    tokens        : [usize; VIRTQ_MAX_SIZE]
+} impl VirtQueue {
+    // virtio 1.x §4.2.3.2: select the queue, size it, hand the device the three ring PAs, mark it ready.
+    pub fn init(&mut self, regs: *mut VirtIORegs, queue_idx: u32) -> Result<(), VirtIOError> {
+        unsafe {
+            let regs_ref: &mut VirtIORegs = &mut *regs;
+            write32(&mut regs_ref.queue_sel, queue_idx);
+            dsb(SBType::Sy);
+            if read32(&regs_ref.queue_ready) != 0 {
+                return Err(VirtIOError::QueueAlreadyInUse);
+            }
+            let queue_num_max: u32 = read32(&regs_ref.queue_num_max);
+            if queue_num_max == 0 {
+                return Err(VirtIOError::QueueUnavailable);
+            }
+
+            let queue_page_pa: *const u8 = match get_free_page(true) {
+                Ok(queue_page_pa) => queue_page_pa,
+                Err(e) => { return Err(VirtIOError::GetQueuePageFailed(e)); }
+            };
+            let queue_page: *mut u8 = page_pa_to_kva(queue_page_pa);
+
+            self.regs = regs;
+            self.queue_idx = queue_idx;
+            self.size = core::cmp::min(queue_num_max as usize, VIRTQ_MAX_SIZE) as u16;
+            self.desc = queue_page.add(VIRTQ_DESC_OFFSET) as *mut VirtqDesc;
+            self.avail = queue_page.add(VIRTQ_AVAIL_OFFSET) as *mut VirtqAvail;
+            self.used = queue_page.add(VIRTQ_USED_OFFSET) as *mut VirtqUsed;
+            for i in 0..self.size {
+                (*self.desc.add(i as usize)).next = i + 1;
+            }
+            self.free_head = 0;
+            self.num_free = self.size;
+            self.avail_idx = 0;
+            self.last_used_idx = 0;
+            // Completions are polled until someone asks for interrupts.
+            ptr::write_volatile(&raw mut (*self.avail).flags, VIRTQ_AVAIL_F_NO_INTERRUPT);
+
+            let desc_pa: u64 = queue_page_pa as u64 + VIRTQ_DESC_OFFSET as u64;
+            let avail_pa: u64 = queue_page_pa as u64 + VIRTQ_AVAIL_OFFSET as u64;
+            let used_pa: u64 = queue_page_pa as u64 + VIRTQ_USED_OFFSET as u64;
+            write32(&mut regs_ref.queue_num, self.size as u32);
+            write32(&mut regs_ref.queue_desc_low, desc_pa as u32);
+            write32(&mut regs_ref.queue_desc_high, (desc_pa >> 32) as u32);
+            write32(&mut regs_ref.queue_avail_low, avail_pa as u32);
+            write32(&mut regs_ref.queue_avail_high, (avail_pa >> 32) as u32);
+            write32(&mut regs_ref.queue_used_low, used_pa as u32);
+            write32(&mut regs_ref.queue_used_high, (used_pa >> 32) as u32);
+            dsb(SBType::Sy);
+            write32(&mut regs_ref.queue_ready, 1);
+            dsb(SBType::Sy);
+            return Ok(());
+        }
+    }
+
+    #[inline(always)] pub fn size(&self) -> u16 { self.size }
+    #[inline(always)] pub fn num_free(&self) -> u16 { self.num_free }
+    #[inline(always)] pub fn queue_idx(&self) -> u32 { self.queue_idx }
+    // Head descriptor the next push() will use; lets drivers key per-chain state off it.
+    #[inline(always)] pub fn next_head(&self) -> u16 { self.free_head }
+
+    /*
+     * Chain `bufs` onto the descriptor table and publish the head on the avail ring.
+     * The device won't look at it until notify(), so callers can push several chains
+     * and kick once.
+     */
+    pub fn push(&mut self, bufs: &[VirtqBuf], token: usize) -> Result<u16, VirtIOError> {
+        if bufs.is_empty() || bufs.len() > self.num_free as usize {
+            return Err(VirtIOError::QueueFull);
+        }
+        unsafe {
+            let head: u16 = self.free_head;
+            let mut cur: u16 = head;
+            for (i, buf) in bufs.iter().enumerate() {
+                let desc: *mut VirtqDesc = self.desc.add(cur as usize);
+                (*desc).addr = buf.pa;
+                (*desc).len = buf.len;
+                (*desc).flags =
+                    if buf.device_writable { VIRTQ_DESC_F_WRITE } else { 0 } |
+                    if i + 1 < bufs.len()  { VIRTQ_DESC_F_NEXT  } else { 0 }
+                ;
+                if i + 1 < bufs.len() {
+                    cur = (*desc).next;
+                } else {
+                    self.free_head = (*desc).next;
+                }
+            }
+            self.num_free -= bufs.len() as u16;
+            self.tokens[head as usize] = token;
+
+            let slot: usize = (self.avail_idx % self.size) as usize;
+            ptr::write_volatile(&raw mut (*self.avail).ring[slot], head);
+            // Descriptors and the ring entry must be visible before the index moves.
+            dsb(SBType::St);
+            self.avail_idx = self.avail_idx.wrapping_add(1);
+            ptr::write_volatile(&raw mut (*self.avail).idx, self.avail_idx);
+            crate::trace!("virtq {:#x}/{}: push head {} bufs {}", self.regs, self.queue_idx, head, bufs.len());
+            return Ok(head);
+        }
+    }
+
+    pub fn notify(&self) {
+        crate::trace!("virtq {:#x}/{}: notify avail idx {}", self.regs, self.queue_idx, self.avail_idx);
+        unsafe {
+            dsb(SBType::Sy);
+            write32(&mut (*self.regs).queue_notify, self.queue_idx);
+        }
+    }
+
+    #[inline(always)]
+    pub fn has_used(&self) -> bool {
+        unsafe { ptr::read_volatile(&raw const (*self.used).idx) != self.last_used_idx }
+    }
+
+    // Index the device will next write a used element at. Cheap to spin on.
+    #[inline(always)]
+    pub fn used_idx(&self) -> u16 {
+        unsafe { ptr::read_volatile(&raw const (*self.used).idx) }
+    }
+
+    // For lock-free spinning on used_idx() from outside whatever lock guards the queue.
+    #[inline(always)]
+    pub fn used_idx_ptr(&self) -> *const u16 {
+        unsafe { &raw const (*self.used).idx }
+    }
+
+    // Reclaim one completed chain.
+    pub fn pop_used(&mut self) -> Option<VirtqCompletion> {
+        if !self.has_used() {
+            return None;
+        }
+        unsafe {
+            // Don't read the element before we've seen the index that publishes it.
+            dsb(SBType::Ld);
+            let slot: usize = (self.last_used_idx % self.size) as usize;
+            let elem: VirtqUsedElem = ptr::read_volatile(&raw const (*self.used).ring[slot]);
+            self.last_used_idx = self.last_used_idx.wrapping_add(1);
+
+            let head: u16 = elem.id as u16;
+            let mut tail: u16 = head;
+            let mut freed: u16 = 1;
+            while (*self.desc.add(tail as usize)).flags & VIRTQ_DESC_F_NEXT != 0 {
+                tail = (*self.desc.add(tail as usize)).next;
+                freed += 1;
+            }
+            (*self.desc.add(tail as usize)).next = self.free_head;
+            self.free_head = head;
+            self.num_free += freed;
+            crate::trace!("virtq {:#x}/{}: used head {} len {}", self.regs, self.queue_idx, head, elem.len);
+
+            return Some(VirtqCompletion { token: self.tokens[head as usize], head, len: elem.len });
+        }
+    }
+
+    /*
+     * A device that adds a used element while it still sees NO_INTERRUPT raises nothing
+     * for it, so after enabling, callers must check has_used() again before waiting on an
+     * IRQ. The dsb keeps that check from being satisfied before the device can see the
+     * flag: otherwise both sides could miss each other and the waiter would sleep forever.
+     */
+    pub fn set_interrupts_enabled(&mut self, enabled: bool) {
+        unsafe {
+            ptr::write_volatile(
+                &raw mut (*self.avail).flags,
+                if enabled { 0 } else { VIRTQ_AVAIL_F_NO_INTERRUPT }
+            );
+            if enabled {
+                dsb(SBType::Sy);
+            }
+        }
+    }
+}
@@ -0,0 +1,123 @@
+use crate::{asm, println};
+use crate::devices::{cpu::{cpu_id, MAX_CPUS}, gic, timer::counter_ticks};
+use crate::thread;
+use core::sync::atomic::{AtomicU64, Ordering};
+
+// Mirrors the layout pushed by SAVE_TRAP_FRAME in exceptions.S.
+#[repr(C)]
+pub struct TrapFrame {
+    pub x        : [u64; 31],
+    pub elr_el1  : u64,
+    pub spsr_el1 : u64,
+    pub fpcr     : u64,
+    pub fpsr     : u64,
+    _pad         : u64,
+    pub q        : [u128; 32]
+}
+const _: () = assert!(size_of::<TrapFrame>() == 800);
+
+const DAIF_I: u64 = 1 << 7;
+
+unsafe extern "C" {
+    static _exception_vectors: u8;
+}
+
+// Point this CPU's VBAR_EL1 at the vector table. Every CPU needs to do this itself.
+pub fn init_exceptions() {
+    unsafe {
+        asm!(
+            "msr vbar_el1, {vectors}",
+            "isb",
+            vectors = in(reg) &raw const _exception_vectors,
+            options(nostack, preserves_flags)
+        );
+    }
+}
+
+#[inline(always)]
+pub fn enable_irqs() {
+    unsafe { asm!("msr daifclr, #0b0010", options(nomem, nostack, preserves_flags)); }
+}
+
+#[inline(always)]
+pub fn disable_irqs() {
+    unsafe { asm!("msr daifset, #0b0010", options(nomem, nostack, preserves_flags)); }
+}
+
+#[inline(always)]
+pub fn irqs_enabled() -> bool {
+    let daif: u64;
+    unsafe { asm!("mrs {}, daif", out(reg) daif, options(nomem, nostack, preserves_flags)); }
+    return daif & DAIF_I == 0;
+}
+
+// Mask IRQs and return the previous DAIF so nested critical sections restore correctly.
+#[inline(always)]
+pub fn irq_save() -> u64 {
+    let daif: u64;
+    unsafe {
+        asm!(
+            "mrs {daif}, daif",
+            "msr daifset, #0b0010",
+            daif = out(reg) daif,
+            options(nomem, nostack, preserves_flags)
+        );
+    }
+    return daif;
+}
+
+#[inline(always)]
+pub fn irq_restore(daif: u64) {
+    unsafe { asm!("msr daif, {}", in(reg) daif, options(nomem, nostack, preserves_flags)); }
+}
+
+/*
+ * Sleep until an interrupt is pending. IRQs must be masked by the caller after its
+ * last check of whatever it's waiting on: WFI still wakes for a pending-but-masked
+ * IRQ, and unmasking afterwards lets the handler run. Checking with IRQs unmasked
+ * and then calling WFI can lose the wakeup.
+ */
+#[inline(always)]
+pub fn wait_for_interrupt() {
+    let start_ticks: u64 = counter_ticks();
+    unsafe { asm!("wfi", options(nomem, nostack, preserves_flags)); }
+    WFI_TICKS[cpu_id()].fetch_add(counter_ticks() - start_ticks, Ordering::Relaxed);
+}
+
+// Time each CPU has spent asleep in WFI, i.e. not using the CPU.
+static WFI_TICKS: [AtomicU64; MAX_CPUS] = [const { AtomicU64::new(0) }; MAX_CPUS];
+
+#[inline(always)] pub fn wfi_ticks(cpu_idx: usize) -> u64 { WFI_TICKS[cpu_idx].load(Ordering::Relaxed) }
+
+#[unsafe(no_mangle)]
+pub extern "C" fn jerry_irq_handler(frame: *mut TrapFrame) -> *mut TrapFrame {
+    gic::handle_irq();
+    return thread::preempt(frame);
+}
+
+#[unsafe(no_mangle)]
+pub extern "C" fn jerry_sync_exception_handler(frame: *mut TrapFrame) -> *mut TrapFrame {
+    let esr: u64;
+    let far: u64;
+    unsafe {
+        asm!("mrs {}, esr_el1", out(reg) esr, options(nomem, nostack, preserves_flags));
+        asm!("mrs {}, far_el1", out(reg) far, options(nomem, nostack, preserves_flags));
+    }
+    // svc #0: a thread giving up the CPU.
+    if let Some(next_frame) = thread::syscall(frame, esr) {
+        return next_frame;
+    }
+    unsafe {
+        println!(
+            "Synchronous exception! ESR_EL1={:#x} (EC={:#x}) ELR_EL1={:#x} FAR_EL1={:#x}",
+            esr, (esr >> 26) & 0x3f, (*frame).elr_el1, far
+        );
+    }
+    panic!("Unhandled synchronous exception!");
+}
+
+#[unsafe(no_mangle)]
+pub extern "C" fn jerry_unexpected_exception_handler(frame: *mut TrapFrame) -> *mut TrapFrame {
+    unsafe { println!("Unexpected exception! ELR_EL1={:#x}", (*frame).elr_el1); }
+    panic!("Unexpected exception!");
+}
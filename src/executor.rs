@@ -0,0 +1,286 @@
+use crate::sync;
+use crate::devices::{cpu::{self, cpu_id, MAX_CPUS}, timer};
+use core::hint::spin_loop;
+use core::sync::atomic::{fence, AtomicIsize, AtomicU64, AtomicUsize, Ordering};
+
+/*
+ * Fork-join over index ranges, for work that splits evenly (mapping RAM, zeroing, ...).
+ * parallel_for(len, grain, func, ctx) calls func(ctx, lo, hi) on disjoint ranges that
+ * cover 0..len, each at most `grain` long, on as many CPUs as will help, and returns
+ * once all of them have.
+ *
+ * Each CPU owns a Chase-Lev deque of ranges. Its owner pushes and pops at the bottom
+ * without a CAS (unless it's racing a thief for the last range); everyone else steals
+ * from the top with one CAS. Whoever takes a range longer than the grain splits it,
+ * pushing the top half and keeping the bottom half, so the biggest pieces sit at the
+ * top for thieves and the work spreads in log2(len / grain) steals.
+ *
+ * The helpers are the secondaries' idle loops, handed executor_worker() through
+ * run_on_cpu() the way probe waves are; a CPU busy with something else just doesn't
+ * help. parallel_for() waits for every CPU it asked, so it's meant for boot-time work
+ * and for CPUs that are idle. Workers run with preemption off: a deque must only ever
+ * have its own CPU's worker as owner.
+ */
+pub type RangeFn = fn(ctx: usize, lo: usize, hi: usize);
+
+// Splitting pushes one range per halving, so this is deep enough for any usize range.
+// A full deque just means the range is run without splitting it any further.
+const DEQUE_LEN: usize = 64;
+
+struct ParallelJob {
+    func      : RangeFn,
+    ctx       : usize,
+    grain     : usize,
+    // Indices not yet run: the job is done at 0.
+    remaining : AtomicUsize
+}
+
+#[derive(Copy, Clone)]
+struct RangeTask {
+    job : usize,
+    lo  : usize,
+    hi  : usize
+}
+
+/*
+ * A thief reads a slot before its CAS on top tells it whether the slot was still its to
+ * take, so the owner may be overwriting it meanwhile: the fields are atomics, and a torn
+ * read is thrown away with the lost CAS.
+ */
+struct TaskSlot {
+    job : AtomicUsize,
+    lo  : AtomicUsize,
+    hi  : AtomicUsize
+} impl TaskSlot {
+    const fn new() -> Self {
+        return Self { job: AtomicUsize::new(0), lo: AtomicUsize::new(0), hi: AtomicUsize::new(0) };
+    }
+
+    #[inline(always)]
+    fn read(&self) -> RangeTask {
+        return RangeTask {
+            job: self.job.load(Ordering::Relaxed),
+            lo: self.lo.load(Ordering::Relaxed),
+            hi: self.hi.load(Ordering::Relaxed)
+        };
+    }
+
+    #[inline(always)]
+    fn write(&self, task: RangeTask) {
+        self.job.store(task.job, Ordering::Relaxed);
+        self.lo.store(task.lo, Ordering::Relaxed);
+        self.hi.store(task.hi, Ordering::Relaxed);
+    }
+}
+
+enum Steal {
+    Empty,
+    // Lost the race for the top range to its owner or another thief.
+    Lost,
+    Took(RangeTask)
+}
+
+#[repr(align(64))]
+struct WorkDeque {
+    // Next slot thieves take. Only ever grows.
+    top    : AtomicIsize,
+    // Next slot the owner pushes to.
+    bottom : AtomicIsize,
+    slots  : [TaskSlot; DEQUE_LEN]
+} impl WorkDeque {
+    const fn new() -> Self {
+        return Self { top: AtomicIsize::new(0), bottom: AtomicIsize::new(0), slots: [const { TaskSlot::new() }; DEQUE_LEN] };
+    }
+
+    #[inline(always)]
+    fn slot(&self, idx: isize) -> &TaskSlot {
+        return &self.slots[idx as usize & (DEQUE_LEN - 1)];
+    }
+
+    // Owner only.
+    fn push(&self, task: RangeTask) -> bool {
+        let bottom: isize = self.bottom.load(Ordering::Relaxed);
+        let top: isize = self.top.load(Ordering::Acquire);
+        if bottom - top >= DEQUE_LEN as isize {
+            return false;
+        }
+        self.slot(bottom).write(task);
+        // Publish the slot before the bottom that makes it visible to thieves.
+        fence(Ordering::Release);
+        self.bottom.store(bottom + 1, Ordering::Relaxed);
+        return true;
+    }
+
+    // Owner only.
+    fn pop(&self) -> Option<RangeTask> {
+        let bottom: isize = self.bottom.load(Ordering::Relaxed) - 1;
+        self.bottom.store(bottom, Ordering::Relaxed);
+        // Claim the bottom slot before looking at top: a thief either sees the claim or
+        // we see its steal.
+        fence(Ordering::SeqCst);
+        let top: isize = self.top.load(Ordering::Relaxed);
+        if top > bottom {
+            self.bottom.store(bottom + 1, Ordering::Relaxed);
+            return None;
+        }
+        let task: RangeTask = self.slot(bottom).read();
+        if top == bottom {
+            // The last range: whoever moves top past it gets it.
+            let won: bool = self.top.compare_exchange(top, top + 1, Ordering::SeqCst, Ordering::Relaxed).is_ok();
+            self.bottom.store(bottom + 1, Ordering::Relaxed);
+            if !won {
+                return None;
+            }
+        }
+        return Some(task);
+    }
+
+    fn steal(&self) -> Steal {
+        let top: isize = self.top.load(Ordering::Acquire);
+        fence(Ordering::SeqCst);
+        let bottom: isize = self.bottom.load(Ordering::Acquire);
+        if top >= bottom {
+            return Steal::Empty;
+        }
+        let task: RangeTask = self.slot(top).read();
+        if self.top.compare_exchange(top, top + 1, Ordering::SeqCst, Ordering::Relaxed).is_err() {
+            return Steal::Lost;
+        }
+        return Steal::Took(task);
+    }
+}
+
+static DEQUES: [WorkDeque; MAX_CPUS] = [const { WorkDeque::new() }; MAX_CPUS];
+
+#[derive(Copy, Clone, Default)]
+pub struct ExecutorStats {
+    pub jobs        : u64,
+    pub tasks       : u64,
+    pub splits      : u64,
+    pub steals      : u64,
+    pub steals_lost : u64,
+    // Most CPUs that ever worked on one job, its caller included.
+    pub max_cpus    : u64,
+    pub ticks       : u64
+}
+
+static JOBS: AtomicU64 = AtomicU64::new(0);
+static TASKS: AtomicU64 = AtomicU64::new(0);
+static SPLITS: AtomicU64 = AtomicU64::new(0);
+static STEALS: AtomicU64 = AtomicU64::new(0);
+static STEALS_LOST: AtomicU64 = AtomicU64::new(0);
+static JOB_MAX_CPUS: AtomicU64 = AtomicU64::new(0);
+static JOB_TICKS: AtomicU64 = AtomicU64::new(0);
+
+pub fn parallel_for(len: usize, grain: usize, func: RangeFn, ctx: usize) {
+    if len == 0 {
+        return;
+    }
+    let start_ticks: u64 = timer::counter_ticks();
+    let job: ParallelJob = ParallelJob {
+        func: func,
+        ctx: ctx,
+        grain: core::cmp::max(grain, 1),
+        remaining: AtomicUsize::new(len)
+    };
+    let job_arg: usize = &job as *const ParallelJob as usize;
+    sync::preempt_disable();
+    let my_cpu_idx: usize = cpu_id();
+    let whole: RangeTask = RangeTask { job: job_arg, lo: 0, hi: len };
+    if !DEQUES[my_cpu_idx].push(whole) {
+        // Only if called from inside another job's range with our deque full.
+        run_range(my_cpu_idx, whole, false);
+    }
+    let mut helpers: [bool; MAX_CPUS] = [false; MAX_CPUS];
+    let mut num_workers: u64 = 1;
+    if len > job.grain {
+        for cpu_idx in 0..cpu::num_cpus() {
+            if cpu_idx != my_cpu_idx && cpu::run_on_cpu(cpu_idx, executor_worker, job_arg).is_ok() {
+                helpers[cpu_idx] = true;
+                num_workers += 1;
+            }
+        }
+    }
+    work_until_done(my_cpu_idx, &job);
+    sync::preempt_enable();
+
+    // Every helper still holds a pointer to the job on our stack.
+    for cpu_idx in 0..cpu::num_cpus() {
+        if helpers[cpu_idx] {
+            cpu::wait_for_cpu(cpu_idx);
+        }
+    }
+    JOBS.fetch_add(1, Ordering::Relaxed);
+    JOB_MAX_CPUS.fetch_max(num_workers, Ordering::Relaxed);
+    JOB_TICKS.fetch_add(timer::counter_ticks() - start_ticks, Ordering::Relaxed);
+}
+
+// Runs on each CPU helping with a job, through run_on_cpu().
+fn executor_worker(job_arg: usize) {
+    let job: &ParallelJob = unsafe { &*(job_arg as *const ParallelJob) };
+    sync::preempt_disable();
+    work_until_done(cpu_id(), job);
+    sync::preempt_enable();
+}
+
+/*
+ * Run ranges until `job` is done: our own first, newest (smallest) first, then the
+ * oldest (biggest) of whoever has any. Ranges of other jobs are fair game too; their
+ * callers are waiting on them.
+ */
+fn work_until_done(my_cpu_idx: usize, job: &ParallelJob) {
+    let num_cpus: usize = cpu::num_cpus();
+    while job.remaining.load(Ordering::Acquire) != 0 {
+        if let Some(task) = DEQUES[my_cpu_idx].pop() {
+            run_range(my_cpu_idx, task, true);
+            continue;
+        }
+        let mut found: bool = false;
+        for offset in 1..num_cpus {
+            let victim: usize = (my_cpu_idx + offset) % num_cpus;
+            match DEQUES[victim].steal() {
+                Steal::Took(task) => {
+                    STEALS.fetch_add(1, Ordering::Relaxed);
+                    run_range(my_cpu_idx, task, true);
+                    found = true;
+                    break;
+                },
+                Steal::Lost => { STEALS_LOST.fetch_add(1, Ordering::Relaxed); },
+                Steal::Empty => { }
+            }
+        }
+        if !found {
+            spin_loop();
+        }
+    }
+}
+
+fn run_range(my_cpu_idx: usize, task: RangeTask, split: bool) {
+    let job: &ParallelJob = unsafe { &*(task.job as *const ParallelJob) };
+    let lo: usize = task.lo;
+    let mut hi: usize = task.hi;
+    while split && hi - lo > job.grain {
+        let mid: usize = lo + (hi - lo) / 2;
+        if !DEQUES[my_cpu_idx].push(RangeTask { job: task.job, lo: mid, hi: hi }) {
+            break;
+        }
+        SPLITS.fetch_add(1, Ordering::Relaxed);
+        hi = mid;
+    }
+    (job.func)(job.ctx, lo, hi);
+    TASKS.fetch_add(1, Ordering::Relaxed);
+    // Last thing we touch: once remaining hits 0 the caller may return and the job is gone.
+    job.remaining.fetch_sub(hi - lo, Ordering::AcqRel);
+}
+
+pub fn executor_stats() -> ExecutorStats {
+    return ExecutorStats {
+        jobs: JOBS.load(Ordering::Relaxed),
+        tasks: TASKS.load(Ordering::Relaxed),
+        splits: SPLITS.load(Ordering::Relaxed),
+        steals: STEALS.load(Ordering::Relaxed),
+        steals_lost: STEALS_LOST.load(Ordering::Relaxed),
+        max_cpus: JOB_MAX_CPUS.load(Ordering::Relaxed),
+        ticks: JOB_TICKS.load(Ordering::Relaxed)
+    };
+}
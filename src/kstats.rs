@@ -0,0 +1,326 @@
+use crate::{exceptions, println};
+use core::sync::atomic::Ordering;
+use crate::devices::virtio::blk::{self, BlkCompletionMode, BLK_COMPLETION_MODES};
+use crate::devices::virtio::net::{self, NetRxStats, NetTxStats};
+use crate::devices::{cpu, gic, timer::{self, TimerStats}};
+use crate::devices::libfdt_lite::{libfdt_stats, FDTError, LibfdtStats};
+use crate::devices::dt_index::{dt_index_stats, DTIndexStats};
+use crate::devices::drivers::{self, registered_drivers, ProbeStats};
+use crate::devices::console::{self, ConsoleBackendStats, CONSOLE_BACKENDS};
+use crate::devices::virtio::console::console_stats;
+use crate::devices::pl011_uart::{pl011_stats, PL011Stats};
+use crate::log::{self, LogRingStats};
+use crate::trace;
+use crate::thread::{self, ThreadStats};
+use crate::executor::{executor_stats, ExecutorStats};
+use crate::block::{self, sched::BlkSchedStats, cache::{self, CacheStats}};
+use crate::devices::memory::slab::{self, SlabClassStats, SLAB_NUM_CLASSES};
+use crate::devices::memory::arena::{boot_arena_stats, ArenaStats};
+
+/*
+ * Log-linear latency histogram: every power of two of nanoseconds is split into
+ * HIST_SUB_BUCKETS equal buckets, so percentiles come out within ~25% of the real
+ * value from a fixed 512 bytes. All-zero is an empty histogram.
+ */
+const HIST_SUB_BITS: u32 = 2;
+const HIST_SUB_BUCKETS: usize = 1 << HIST_SUB_BITS;
+pub const HIST_BUCKETS: usize = 128;
+
+#[derive(Copy, Clone)]
+pub struct LatencyHistogram {
+    counts : [u32; HIST_BUCKETS]
+} impl LatencyHistogram {
+    pub const fn new() -> Self {
+        return Self { counts: [0; HIST_BUCKETS] };
+    }
+
+    pub fn record(&mut self, ns: u64) {
+        let bucket: usize = Self::bucket_of(ns);
+        self.counts[bucket] = self.counts[bucket].saturating_add(1);
+    }
+
+    pub fn count(&self) -> u64 {
+        return self.counts.iter().map(|&count| count as u64).sum();
+    }
+
+    pub fn merge(&mut self, other: &LatencyHistogram) {
+        for (count, other_count) in self.counts.iter_mut().zip(other.counts.iter()) {
+            *count = count.saturating_add(*other_count);
+        }
+    }
+
+    // What was recorded since `earlier`, a copy of this histogram from before.
+    pub fn since(&self, earlier: &LatencyHistogram) -> LatencyHistogram {
+        let mut hist: LatencyHistogram = *self;
+        for (count, earlier_count) in hist.counts.iter_mut().zip(earlier.counts.iter()) {
+            *count = count.saturating_sub(*earlier_count);
+        }
+        return hist;
+    }
+
+    // Upper bound (in ns) of the bucket holding the p'th percentile sample. None if empty.
+    pub fn percentile_ns(&self, p: u32) -> Option<u64> {
+        let total: u64 = self.count();
+        if total == 0 {
+            return None;
+        }
+        // Rank of the sample we want, 1-based & rounded up.
+        let rank: u64 = core::cmp::max(1, (total * p as u64).div_ceil(100));
+        let mut seen: u64 = 0;
+        for (bucket, &count) in self.counts.iter().enumerate() {
+            seen += count as u64;
+            if seen >= rank {
+                return Some(Self::bucket_upper_ns(bucket));
+            }
+        }
+        return Some(Self::bucket_upper_ns(HIST_BUCKETS - 1));
+    }
+
+    fn bucket_of(ns: u64) -> usize {
+        if ns < HIST_SUB_BUCKETS as u64 {
+            return ns as usize;
+        }
+        let msb: u32 = 63 - ns.leading_zeros();
+        let sub: usize = ((ns >> (msb - HIST_SUB_BITS)) as usize) & (HIST_SUB_BUCKETS - 1);
+        let bucket: usize = (msb - HIST_SUB_BITS + 1) as usize * HIST_SUB_BUCKETS + sub;
+        return core::cmp::min(bucket, HIST_BUCKETS - 1);
+    }
+
+    fn bucket_upper_ns(bucket: usize) -> u64 {
+        if bucket < HIST_SUB_BUCKETS {
+            return bucket as u64;
+        }
+        let shift: u32 = (bucket / HIST_SUB_BUCKETS) as u32 - 1;
+        let sub: u64 = (bucket % HIST_SUB_BUCKETS) as u64;
+        return ((HIST_SUB_BUCKETS as u64 + sub + 1) << shift) - 1;
+    }
+}
+
+/*
+ * The "kstats" command: dump whatever counters the kernel keeps to the UART.
+ * Cheap enough to call at any time from any CPU; it only takes driver locks
+ * long enough to copy their counters out.
+ */
+pub fn print_kernel_stats() {
+    println!("---------------------------- kstats ----------------------------");
+    println!("uptime: {} us, {} CPU(s) online", timer::uptime_ns() / 1000, cpu::num_cpus_online());
+    let fdt: LibfdtStats = libfdt_stats();
+    println!(
+        "libfdt: DTB validated in {} us, per-access checks {}",
+        timer::ticks_to_ns(fdt.validate_ticks) / 1000, if fdt.trusted { "skipped" } else { "on" }
+    );
+    match fdt.prop_names {
+        Ok(prop_names) => println!(
+            "libfdt: {} property names indexed in {} us", prop_names, timer::ticks_to_ns(fdt.strindex_ticks) / 1000
+        ),
+        Err(e) => println!("libfdt: no property name index ({:?})", FDTError::from(e))
+    }
+    if let Err(e) = fdt.subtree_index {
+        println!("libfdt: no subtree index ({:?}), skipping subtrees walks them", FDTError::from(e));
+    }
+    let dt: DTIndexStats = dt_index_stats();
+    println!(
+        "dt index: {} nodes, {} regs ({} nodes untranslated), {} ranges, {} irqs ({} nodes unresolved), {} compatibles, {} phandles, {} bytes kept, built in {} us",
+        dt.nodes, dt.regs, dt.untranslated_regs, dt.ranges, dt.irqs, dt.unresolved_irqs, dt.compatibles, dt.phandles,
+        dt.table_bytes, timer::ticks_to_ns(dt.build_ticks) / 1000
+    );
+    let timers: TimerStats = timer::timer_stats();
+    let arm_ns: u64 = if timers.arms == 0 { 0 } else { timer::ticks_to_ns(timers.arm_ticks) / timers.arms };
+    let cancel_ns: u64 = if timers.cancels == 0 { 0 } else { timer::ticks_to_ns(timers.cancel_ticks) / timers.cancels };
+    println!(
+        "timers: armed {} ({} ns avg) cancelled {} ({} ns avg) fired {} | cascades {} reprograms {} | {} ns units",
+        timers.arms, arm_ns, timers.cancels, cancel_ns, timers.fired, timers.cascades, timers.reprograms, timers.unit_ns
+    );
+    let jitter: LatencyHistogram = timer::timer_jitter();
+    if let (Some(p50), Some(p99)) = (jitter.percentile_ns(50), jitter.percentile_ns(99)) {
+        println!("  wakeup jitter: p50 <= {} ns, p99 <= {} ns", p50, p99);
+    }
+    let threads: ThreadStats = thread::thread_stats();
+    let sched_cycles: u64 = if threads.sched_calls == 0 { 0 } else { threads.sched_cycles / threads.sched_calls };
+    println!(
+        "threads: spawned {} exited {} | switches {} preemptions {} (deferred for spinlocks {}) | schedule() {} {} avg",
+        threads.spawned, threads.exited, threads.switches, threads.preemptions, threads.deferred,
+        sched_cycles, if threads.pmu_cycles { "cycles" } else { "counter ticks" }
+    );
+    let switch_cycles: LatencyHistogram = thread::switch_cycles();
+    if let (Some(p50), Some(p99)) = (switch_cycles.percentile_ns(50), switch_cycles.percentile_ns(99)) {
+        println!("  yield-to-resume: p50 <= {} p99 <= {}", p50, p99);
+    }
+    let preempt_cycles: LatencyHistogram = thread::preempt_cycles();
+    if let (Some(p50), Some(p99)) = (preempt_cycles.percentile_ns(50), preempt_cycles.percentile_ns(99)) {
+        println!("  timeslice-to-resume: p50 <= {} p99 <= {}", p50, p99);
+    }
+    let executor: ExecutorStats = executor_stats();
+    println!(
+        "executor: {} parallel_for ({} us) on up to {} CPU(s) | {} ranges run, {} splits, {} steals ({} lost races)",
+        executor.jobs, timer::ticks_to_ns(executor.ticks) / 1000, executor.max_cpus,
+        executor.tasks, executor.splits, executor.steals, executor.steals_lost
+    );
+    let boot_arena: ArenaStats = boot_arena_stats();
+    // Every arena allocation past the first in its chunk would otherwise have been a PPM call.
+    println!(
+        "boot arena: {} allocs ({} bytes) from {} PPM pages, {} pages released",
+        boot_arena.allocs, boot_arena.bytes, boot_arena.chunk_allocs, boot_arena.chunk_frees
+    );
+    let probe: ProbeStats = drivers::probe_stats();
+    println!(
+        "driver probing: {} us, {} priority waves, {} parallel probes on up to {} CPU(s)",
+        timer::ticks_to_ns(probe.ticks) / 1000, probe.waves, probe.parallel_probes, probe.max_cpus
+    );
+    for driver in registered_drivers() {
+        println!(
+            "  driver {} (prio {}): {} probes, {} failed, {} us probing",
+            driver.name, driver.priority,
+            driver.stats.probes.load(Ordering::Relaxed), driver.stats.failures.load(Ordering::Relaxed),
+            timer::ticks_to_ns(driver.stats.probe_ticks.load(Ordering::Relaxed)) / 1000
+        );
+    }
+    for cpu_idx in 0..cpu::num_cpus() {
+        if cpu::cpu_is_online(cpu_idx) {
+            println!(
+                "cpu{}: {} IRQs, {} trace events, {} us in WFI",
+                cpu_idx, gic::irqs_handled(cpu_idx), trace::trace_events_recorded(cpu_idx), timer::ticks_to_ns(exceptions::wfi_ticks(cpu_idx)) / 1000
+            );
+        }
+    }
+    if gic::irqs_unhandled() != 0 {
+        println!("gic: {} IRQs with no handler, last INTID {}", gic::irqs_unhandled(), gic::last_unhandled_intid());
+    }
+    for blk_idx in 0..blk::num_blk_devices() {
+        let blk_dev: &blk::VirtIOBlk = match blk::get_blk_device(blk_idx) {
+            Some(blk_dev) => blk_dev,
+            None => { continue; }
+        };
+        println!(
+            "blk{}: {} queue(s), mode {:?}, {} IRQs, hybrid max spin {} ns, {} bytes direct / {} bounced",
+            blk_idx, blk_dev.num_queues(), blk_dev.completion_mode(), blk_dev.irqs_taken(), blk_dev.hybrid_max_spin_ns(),
+            blk_dev.bytes_direct(), blk_dev.bytes_bounced()
+        );
+        for queue_idx in 0..blk_dev.num_queues() {
+            let stats: blk::BlkQueueStats = blk_dev.queue_stats(queue_idx);
+            println!(
+                "  q{}: submitted {} completed {} errors {} bytes {} | idle polls {} sleeps {} | hybrid spin hits {} misses {} window {} ns",
+                queue_idx, stats.submitted, stats.completed, stats.errors, stats.bytes,
+                stats.idle_polls, stats.sleeps, stats.spin_hits, stats.spin_misses,
+                blk_dev.hybrid_spin_window_ns(queue_idx)
+            );
+        }
+        for mode in BLK_COMPLETION_MODES {
+            let hist: LatencyHistogram = blk_dev.latency_histogram(mode);
+            print_latency(mode, &hist);
+        }
+        if let Some(scheduler) = block::get_blk_scheduler(blk_idx) {
+            let sched_stats: BlkSchedStats = scheduler.stats();
+            // Merge ratio as callers' requests per device request, in hundredths.
+            let merge_ratio_x100: u64 = if sched_stats.dispatched == 0 { 0 } else { sched_stats.queued * 100 / sched_stats.dispatched };
+            println!(
+                "  sched: queued {} dispatched {} (merge ratio {}.{:02}) merged {} absorbed {} overlaps merged {} bytes {} | unplugs full {} size {} time {} explicit {} conflict {}",
+                sched_stats.queued, sched_stats.dispatched, merge_ratio_x100 / 100, merge_ratio_x100 % 100,
+                sched_stats.merged, sched_stats.absorbed, sched_stats.overlaps_merged, sched_stats.bytes,
+                sched_stats.unplugs_full, sched_stats.unplugs_size, sched_stats.unplugs_time,
+                sched_stats.unplugs_explicit, sched_stats.unplugs_conflict
+            );
+        }
+    }
+    for net_idx in 0..net::num_net_devices() {
+        let net_dev: &net::VirtIONet = match net::get_net_device(net_idx) {
+            Some(net_dev) => net_dev,
+            None => { continue; }
+        };
+        let mac: [u8; net::ETH_ALEN] = net_dev.mac();
+        println!(
+            "net{}: {:02x}:{:02x}:{:02x}:{:02x}:{:02x}:{:02x} link {} | csum offload {} mrg rxbuf {}",
+            net_idx, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], if net_dev.link_up() { "up" } else { "down" },
+            net_dev.has_csum_offload(), net_dev.has_mrg_rxbuf()
+        );
+        let rx_stats: NetRxStats = net_dev.rx_stats();
+        println!(
+            "  rx: packets {} bytes {} buffers {} merged {} csum valid {} completed {} drops {} | refills {} ({} buffers)",
+            rx_stats.packets, rx_stats.bytes, rx_stats.buffers, rx_stats.merged, rx_stats.csum_valid, rx_stats.csum_completed, rx_stats.drops,
+            rx_stats.refills, rx_stats.refilled
+        );
+        let tx_stats: NetTxStats = net_dev.tx_stats();
+        // Average burst as frames per kick, in hundredths.
+        let burst_x100: u64 = if tx_stats.kicks == 0 { 0 } else { tx_stats.packets * 100 / tx_stats.kicks };
+        println!(
+            "  tx: packets {} bytes {} kicks {} (burst {}.{:02}) queue full {} | csum offloaded {} software {}",
+            tx_stats.packets, tx_stats.bytes, tx_stats.kicks, burst_x100 / 100, burst_x100 % 100, tx_stats.queue_full,
+            tx_stats.csum_offloaded, tx_stats.csum_sw
+        );
+    }
+    let cache_stats: CacheStats = cache::cache_stats();
+    let lookups: u64 = cache_stats.hits + cache_stats.misses;
+    let hit_rate_x100: u64 = if lookups == 0 { 0 } else { cache_stats.hits * 10000 / lookups };
+    println!(
+        "bcache: hits {} misses {} (hit rate {}.{:02}%) ghost hits B1 {} B2 {} | resident {} dirty {} p {} | evictions {} writebacks {} errors {}",
+        cache_stats.hits, cache_stats.misses, hit_rate_x100 / 100, hit_rate_x100 % 100,
+        cache_stats.ghost_hits_b1, cache_stats.ghost_hits_b2, cache_stats.resident, cache_stats.dirty, cache_stats.arc_p,
+        cache_stats.evictions, cache_stats.writebacks, cache_stats.wb_errors
+    );
+    println!(
+        "readahead: prefetched {} used {} wasted {}",
+        cache_stats.prefetches, cache_stats.prefetch_hits, cache_stats.prefetch_wasted
+    );
+    println!("slab: {} whole pages in use", slab::slab_page_allocs_in_use());
+    for class_idx in 0..SLAB_NUM_CLASSES {
+        let stats: SlabClassStats = slab::slab_class_stats(class_idx);
+        if stats.allocs == 0 {
+            continue;
+        }
+        // Internal: bytes lost to rounding up to the class. External: free objects in the class's slabs.
+        let internal_x100: u64 = if stats.in_use == 0 { 0 } else {
+            (stats.in_use * stats.obj_len as u64 - stats.requested_bytes) * 10000 / (stats.in_use * stats.obj_len as u64)
+        };
+        let external_x100: u64 = if stats.capacity == 0 { 0 } else { (stats.capacity - stats.in_use) * 10000 / stats.capacity };
+        let hit_rate_x100: u64 = stats.cache_hits * 10000 / stats.allocs;
+        println!(
+            "  {}B: slabs {} objs {}/{} ({} in cpu caches) | frag internal {}.{:02}% external {}.{:02}% | allocs {} cpu cache hits {}.{:02}% refills {} flushes {}",
+            stats.obj_len, stats.slabs, stats.in_use, stats.capacity, stats.cached,
+            internal_x100 / 100, internal_x100 % 100, external_x100 / 100, external_x100 % 100,
+            stats.allocs, hit_rate_x100 / 100, hit_rate_x100 % 100, stats.refills, stats.flushes
+        );
+    }
+    for backend in CONSOLE_BACKENDS {
+        let stats: ConsoleBackendStats = console::backend_stats(backend);
+        // Throughput of the print path itself, i.e. how fast a CPU can log, not how fast the host drains it.
+        let bytes_per_sec: u64 = if stats.busy_ns == 0 { 0 } else { (stats.bytes as u128 * 1_000_000_000 / stats.busy_ns as u128) as u64 };
+        let ns_per_line: u64 = if stats.lines == 0 { 0 } else { stats.busy_ns / stats.lines };
+        println!(
+            "console {:?}: bytes {} lines {} busy {} ns | {} bytes/s, {} ns/line",
+            backend, stats.bytes, stats.lines, stats.busy_ns, bytes_per_sec, ns_per_line
+        );
+    }
+    println!("log: {} drains", log::log_drains());
+    for cpu_idx in 0..cpu::num_cpus() {
+        let ring_stats: LogRingStats = log::log_ring_stats(cpu_idx);
+        println!(
+            "  cpu{} ring: records {} bytes {} dropped {}",
+            cpu_idx, ring_stats.records, ring_stats.bytes, ring_stats.dropped
+        );
+    }
+    if let Some(cons_stats) = console_stats() {
+        let batch_len: u64 = if cons_stats.batches == 0 { 0 } else { cons_stats.bytes / cons_stats.batches };
+        println!(
+            "  virtio-console: bytes {} batches {} (avg {} bytes) ring full waits {}",
+            cons_stats.bytes, cons_stats.batches, batch_len, cons_stats.ring_waits
+        );
+    }
+    let uart: PL011Stats = pl011_stats();
+    println!(
+        "  pl011 ({}): tx {} bytes, {} irqs, ring full waits {} | rx {} bytes, {} dropped",
+        if uart.irq_mode { "irq" } else { "polled" },
+        uart.tx_bytes, uart.tx_irqs, uart.tx_ring_waits, uart.rx_bytes, uart.rx_overruns
+    );
+    println!("----------------------------------------------------------------");
+}
+
+fn print_latency(mode: BlkCompletionMode, hist: &LatencyHistogram) {
+    match (hist.percentile_ns(50), hist.percentile_ns(99)) {
+        (Some(p50), Some(p99)) => {
+            println!("  {:?}: {} requests, p50 <= {} ns, p99 <= {} ns", mode, hist.count(), p50, p99);
+        },
+        _ => {
+            println!("  {:?}: no requests", mode);
+        }
+    }
+}
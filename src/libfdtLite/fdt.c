@@ -121,12 +121,73 @@ const void *fdt_offset_ptr(const void *fdt, int offset, unsigned int len)
 	return fdt_offset_ptr_(fdt, offset);
 }
 
+/* Bytes of the structure block from offset on, per fdt_offset_ptr()'s bounds */
+static int fdt_struct_avail_(const void *fdt, int offset)
+{
+	u32 end = fdt_totalsize(fdt) - fdt_off_dt_struct(fdt);
+
+	if (!can_assume(VALID_INPUT)
+	    && fdt_off_dt_struct(fdt) > fdt_totalsize(fdt))
+		return 0;
+	if (can_assume(LATEST) || fdt_version(fdt) >= 0x11) {
+		if (can_assume(VALID_INPUT) || fdt_size_dt_struct(fdt) < end)
+			end = fdt_size_dt_struct(fdt);
+	}
+	if (offset < 0 || (u32)offset > end)
+		return 0;
+	return end - offset;
+}
+
+/*
+ * Length of the NUL-terminated node name at name, or -1 if the NUL isn't
+ * within avail bytes. Scans a word at a time with the usual has-zero-byte
+ * trick, using only aligned 8-byte loads: the first word is masked so bytes
+ * before name can't match, and an aligned word never crosses a page, so
+ * reading the rest of the last one is harmless. The words are loaded
+ * through a may_alias type: they're really chars, and without it the
+ * compiler may assume u64 loads can't see the blob's char stores.
+ */
+typedef u64 __attribute__((may_alias)) u64_alias;
+
+static int fdt_name_len_(const char *name, int avail)
+{
+	const u64 ones = 0x0101010101010101ULL;
+	const u64 highs = 0x8080808080808080ULL;
+	const u64_alias *w = (const u64_alias *)((uintptr)name & ~(uintptr)7);
+	unsigned int lead = ((uintptr)name & 7) * 8;
+	u64 v, zero;
+	int len;
+
+	if (avail <= 0)
+		return -1;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = *w | (((u64)1 << lead) - 1);
+#else
+	v = *w | ~(~(u64)0 >> lead);
+#endif
+	for (;;) {
+		zero = (v - ones) & ~v & highs;
+		if (zero)
+			break;
+		w++;
+		if ((const char *)w - name >= avail)
+			return -1;
+		v = *w;
+	}
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	len = ((const char *)w - name) + (__builtin_ctzll(zero) >> 3);
+#else
+	len = ((const char *)w - name) + (__builtin_clzll(zero) >> 3);
+#endif
+	return len < avail ? len : -1;
+}
+
 u32 fdt_next_tag(const void *fdt, int startoffset, int *nextoffset)
 {
 	const fdt32_t *tagp, *lenp;
 	u32 tag, len, sum;
 	int offset = startoffset;
-	const char *p;
+	int namelen;
 
 	*nextoffset = -FDT_ERR_TRUNCATED;
 	tagp = fdt_offset_ptr(fdt, offset, FDT_TAGSIZE);
@@ -138,12 +199,12 @@ u32 fdt_next_tag(const void *fdt, int startoffset, int *nextoffset)
 	*nextoffset = -FDT_ERR_BADSTRUCTURE;
 	switch (tag) {
 	case FDT_BEGIN_NODE:
-		/* skip name */
-		do {
-			p = fdt_offset_ptr(fdt, offset++, 1);
-		} while (p && (*p != '\0'));
-		if (!can_assume(VALID_DTB) && !p)
+		/* skip name, bounds checked once for the whole thing */
+		namelen = fdt_name_len_(fdt_offset_ptr_(fdt, offset),
+					fdt_struct_avail_(fdt, offset));
+		if (!can_assume(VALID_DTB) && namelen < 0)
 			return FDT_END; /* premature end */
+		offset += namelen + 1;
 		break;
 
 	case FDT_PROP:
@@ -194,15 +255,12 @@ int fdt_check_node_offset_(const void *fdt, int offset)
 	return offset;
 }
 
-int fdt_next_node(const void *fdt, int offset, int *depth)
+/* fdt_next_node() from the tag at nextoffset, already inside the node it left */
+static int fdt_next_node_at_(const void *fdt, int nextoffset, int *depth)
 {
-	int nextoffset = 0;
+	int offset;
 	u32 tag;
 
-	if (offset >= 0)
-		if ((nextoffset = fdt_check_node_offset_(fdt, offset)) < 0)
-			return nextoffset;
-
 	do {
 		offset = nextoffset;
 		tag = fdt_next_tag(fdt, offset, &nextoffset);
@@ -233,3 +291,134 @@ int fdt_next_node(const void *fdt, int offset, int *depth)
 
 	return offset;
 }
+
+int fdt_next_node(const void *fdt, int offset, int *depth)
+{
+	int nextoffset = 0;
+
+	if (offset >= 0)
+		if ((nextoffset = fdt_check_node_offset_(fdt, offset)) < 0)
+			return nextoffset;
+
+	return fdt_next_node_at_(fdt, nextoffset, depth);
+}
+
+/*
+ * Where each node's subtree ends, so skipping one doesn't mean walking it.
+ * Nodes are recorded in DTB order, i.e. sorted by offset.
+ */
+#define FDT_SUBTREE_MAX_NODES	1024
+#define FDT_SUBTREE_MAX_DEPTH	64
+
+static struct {
+	const void *fdt;
+	int num_nodes;
+	struct {
+		i32 offset;
+		i32 end;	/* offset of the tag after its FDT_END_NODE */
+	} nodes[FDT_SUBTREE_MAX_NODES];
+} fdt_subtrees_;
+
+int fdt_subtree_index_build(const void *fdt)
+{
+	int stack[FDT_SUBTREE_MAX_DEPTH];
+	int depth = 0;
+	int offset, nextoffset = 0;
+	u32 tag;
+
+	fdt_subtrees_.fdt = NULL;
+	fdt_subtrees_.num_nodes = 0;
+
+	FDT_RO_PROBE(fdt);
+
+	do {
+		offset = nextoffset;
+		tag = fdt_next_tag(fdt, offset, &nextoffset);
+
+		switch (tag) {
+		case FDT_BEGIN_NODE:
+			if (fdt_subtrees_.num_nodes >= FDT_SUBTREE_MAX_NODES
+			    || depth >= FDT_SUBTREE_MAX_DEPTH)
+				return -FDT_ERR_NOSPACE;
+			stack[depth++] = fdt_subtrees_.num_nodes;
+			fdt_subtrees_.nodes[fdt_subtrees_.num_nodes].offset = offset;
+			fdt_subtrees_.nodes[fdt_subtrees_.num_nodes].end = -1;
+			fdt_subtrees_.num_nodes++;
+			break;
+
+		case FDT_END_NODE:
+			if (depth == 0)
+				return -FDT_ERR_BADSTRUCTURE;
+			fdt_subtrees_.nodes[stack[--depth]].end = nextoffset;
+			break;
+		}
+	} while (tag != FDT_END);
+	if (nextoffset < 0)
+		return nextoffset;
+	if (depth != 0)
+		return -FDT_ERR_BADSTRUCTURE;
+
+	fdt_subtrees_.fdt = fdt;
+	return 0;
+}
+
+int fdt_node_end_offset_(const void *fdt, int offset)
+{
+	int depth = 0;
+
+	if (fdt_subtrees_.fdt == fdt) {
+		int lo = 0, hi = fdt_subtrees_.num_nodes;
+
+		while (lo < hi) {
+			int mid = lo + (hi - lo) / 2;
+
+			if (fdt_subtrees_.nodes[mid].offset < offset)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < fdt_subtrees_.num_nodes
+		    && fdt_subtrees_.nodes[lo].offset == offset)
+			return fdt_subtrees_.nodes[lo].end;
+		return -FDT_ERR_BADOFFSET;
+	}
+
+	while ((offset >= 0) && (depth >= 0))
+		offset = fdt_next_node(fdt, offset, &depth);
+
+	return offset;
+}
+
+int fdt_next_node_skip_subnodes(const void *fdt, int offset, int *depth)
+{
+	int end = fdt_node_end_offset_(fdt, offset);
+
+	if (end < 0)
+		return end;
+	/* Just past the node's FDT_END_NODE, as if fdt_next_node() had got there */
+	if (depth && ((--(*depth)) < 0))
+		return end;
+	return fdt_next_node_at_(fdt, end, depth);
+}
+
+int fdt_first_subnode(const void *fdt, int offset)
+{
+	int depth = 0;
+
+	offset = fdt_next_node(fdt, offset, &depth);
+	if (offset < 0 || depth != 1)
+		return -FDT_ERR_NOTFOUND;
+
+	return offset;
+}
+
+int fdt_next_subnode(const void *fdt, int offset)
+{
+	int depth = 1;
+
+	offset = fdt_next_node_skip_subnodes(fdt, offset, &depth);
+	if (offset < 0 || depth < 1)
+		return -FDT_ERR_NOTFOUND;
+
+	return offset;
+}
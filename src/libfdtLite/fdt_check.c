@@ -0,0 +1,157 @@
+// SPDX-License-Identifier: (GPL-2.0-or-later OR BSD-2-Clause)
+/*
+ * libfdt - Flat Device Tree manipulation
+ * Copyright (C) 2006 David Gibson, IBM Corporation.
+ */
+#include "libfdt_env.h"
+
+#include "fdt.h"
+#include "libfdt.h"
+
+#include "libfdt_internal.h"
+
+u32 fdt_runtime_assume_ = 0;
+static u32 fdt_trusted_assume_ = 0;
+
+static int fdt_check_mem_rsvmap_(const void *fdt)
+{
+	u32 offset = fdt_off_mem_rsvmap(fdt);
+	const struct fdt_reserve_entry *rsv;
+
+	/* The map is terminated by an all-zero entry, which must also fit */
+	for (;;) {
+		if ((offset + sizeof(*rsv)) < offset
+		    || (offset + sizeof(*rsv)) > fdt_totalsize(fdt))
+			return -FDT_ERR_TRUNCATED;
+		rsv = (const struct fdt_reserve_entry *)((const char *)fdt + offset);
+		if (fdt64_ld_(&rsv->size) == 0)
+			return 0;
+		offset += sizeof(*rsv);
+	}
+}
+
+int fdt_check_full(const void *fdt, size bufsize)
+{
+	u32 saved_assume = fdt_runtime_assume_;
+	int err = 0;
+	int offset, nextoffset = 0;
+	u32 tag;
+	unsigned int depth = 0;
+	bool expect_end = false;
+
+	/* Everything below has to run with every check on */
+	fdt_runtime_assume_ = 0;
+
+	if (bufsize < FDT_V1_SIZE || bufsize < fdt_header_size(fdt)) {
+		err = -FDT_ERR_TRUNCATED;
+		goto out;
+	}
+	if ((err = fdt_check_header(fdt)) != 0)
+		goto out;
+	if (bufsize < fdt_totalsize(fdt)) {
+		err = -FDT_ERR_TRUNCATED;
+		goto out;
+	}
+	if ((err = fdt_check_mem_rsvmap_(fdt)) != 0)
+		goto out;
+
+	for (;;) {
+		offset = nextoffset;
+		tag = fdt_next_tag(fdt, offset, &nextoffset);
+		if (nextoffset < 0) {
+			err = nextoffset;
+			goto out;
+		}
+
+		/* Nothing but FDT_END (or NOPs) may follow the root node */
+		if (expect_end && tag != FDT_END && tag != FDT_NOP) {
+			err = -FDT_ERR_BADSTRUCTURE;
+			goto out;
+		}
+
+		switch (tag) {
+		case FDT_NOP:
+			break;
+
+		case FDT_END:
+			err = (depth == 0 && expect_end) ? 0 : -FDT_ERR_BADSTRUCTURE;
+			goto out;
+
+		case FDT_BEGIN_NODE:
+			depth++;
+			if (depth > INT_MAX) {
+				err = -FDT_ERR_BADSTRUCTURE;
+				goto out;
+			}
+			/* The root node must have an empty name */
+			if (depth == 1) {
+				int len;
+				const char *name = fdt_get_name(fdt, offset, &len);
+
+				if (!name) {
+					err = len;
+					goto out;
+				}
+				if (*name || len) {
+					err = -FDT_ERR_BADSTRUCTURE;
+					goto out;
+				}
+			}
+			break;
+
+		case FDT_END_NODE:
+			if (depth == 0) {
+				err = -FDT_ERR_BADSTRUCTURE;
+				goto out;
+			}
+			depth--;
+			if (depth == 0)
+				expect_end = true;
+			break;
+
+		case FDT_PROP: {
+			int len;
+			const struct fdt_property *prop =
+				fdt_get_property_by_offset(fdt, offset, &len);
+
+			if (!prop) {
+				err = len;
+				goto out;
+			}
+			if (!fdt_get_string(fdt, fdt32_ld_(&prop->nameoff), &len)) {
+				err = len < 0 ? len : -FDT_ERR_BADSTRUCTURE;
+				goto out;
+			}
+			break;
+		}
+
+		default:
+			err = -FDT_ERR_INTERNAL;
+			goto out;
+		}
+	}
+
+out:
+	fdt_runtime_assume_ = saved_assume;
+	return err;
+}
+
+int fdt_check_full_and_trust(const void *fdt, size bufsize)
+{
+	int err = fdt_check_full(fdt, bufsize);
+
+	if (err != 0) {
+		fdt_trusted_assume_ = fdt_runtime_assume_ = 0;
+		return err;
+	}
+	fdt_trusted_assume_ = ASSUME_VALID_DTB | ASSUME_VALID_INPUT;
+	if (fdt_version(fdt) >= 17 && fdt_last_comp_version(fdt) <= 16)
+		fdt_trusted_assume_ |= ASSUME_LATEST;
+	fdt_runtime_assume_ = fdt_trusted_assume_;
+	return 0;
+}
+
+void fdt_set_trusted(int trusted)
+{
+	fdt_runtime_assume_ = trusted ? fdt_trusted_assume_ : 0;
+}
@@ -67,6 +67,34 @@ int *lenp)
   return fdt_get_property_by_offset_(fdt, offset, lenp);
 }
 
+static const struct fdt_property *fdt_get_property_stroffset_(const void *fdt,
+							      int offset,
+							      int stroffset,
+							      int *lenp,
+							      int *poffset)
+{
+	for (offset = fdt_first_property_offset(fdt, offset);
+	     (offset >= 0);
+	     (offset = fdt_next_property_offset(fdt, offset))) {
+		const struct fdt_property *prop;
+
+		prop = fdt_get_property_by_offset_(fdt, offset, lenp);
+		if (!can_assume(LIBFDT_FLAWLESS) && !prop) {
+			offset = -FDT_ERR_INTERNAL;
+			break;
+		}
+		if (fdt32_ld_(&prop->nameoff) == (u32)stroffset) {
+			if (poffset)
+				*poffset = offset;
+			return prop;
+		}
+	}
+
+	if (lenp)
+		*lenp = offset;
+	return NULL;
+}
+
 static const struct fdt_property *fdt_get_property_namelen_(const void *fdt,
 						            int offset,
 						            const char *name,
@@ -74,6 +102,23 @@ static const struct fdt_property *fdt_get_property_namelen_(const void *fdt,
 							    int *lenp,
 							    int *poffset)
 {
+	int stroffset = fdt_strindex_lookup_(fdt, name, namelen);
+
+	if (stroffset >= 0)
+		return fdt_get_property_stroffset_(fdt, offset, stroffset,
+						   lenp, poffset);
+	/* No property anywhere has this name */
+	if (stroffset == -FDT_ERR_NOTFOUND) {
+		int err = -FDT_ERR_NOTFOUND;
+
+		if (!can_assume(VALID_INPUT)
+		    && (err = fdt_check_node_offset_(fdt, offset)) >= 0)
+			err = -FDT_ERR_NOTFOUND;
+		if (lenp)
+			*lenp = err;
+		return NULL;
+	}
+
 	for (offset = fdt_first_property_offset(fdt, offset);
 	     (offset >= 0);
 	     (offset = fdt_next_property_offset(fdt, offset))) {
@@ -98,6 +143,16 @@ static const struct fdt_property *fdt_get_property_namelen_(const void *fdt,
 }
 
 
+static const void *fdt_prop_data_(const void *fdt,
+				  const struct fdt_property *prop, int poffset)
+{
+	/* Handle realignment */
+	if (!can_assume(LATEST) && fdt_version(fdt) < 0x10 &&
+	    (poffset + sizeof(*prop)) % 8 && fdt32_ld_(&prop->len) >= 8)
+		return prop->data + 4;
+	return prop->data;
+}
+
 const void *fdt_getprop_namelen(const void *fdt, int nodeoffset,
 				const char *name, int namelen, int *lenp)
 {
@@ -108,12 +163,20 @@ const void *fdt_getprop_namelen(const void *fdt, int nodeoffset,
 					 &poffset);
 	if (!prop)
 		return NULL;
+	return fdt_prop_data_(fdt, prop, poffset);
+}
 
-	/* Handle realignment */
-	if (!can_assume(LATEST) && fdt_version(fdt) < 0x10 &&
-	    (poffset + sizeof(*prop)) % 8 && fdt32_ld_(&prop->len) >= 8)
-		return prop->data + 4;
-	return prop->data;
+const void *fdt_getprop_by_stroffset(const void *fdt, int nodeoffset,
+				     int stroffset, int *lenp)
+{
+	int poffset;
+	const struct fdt_property *prop;
+
+	prop = fdt_get_property_stroffset_(fdt, nodeoffset, stroffset, lenp,
+					   &poffset);
+	if (!prop)
+		return NULL;
+	return fdt_prop_data_(fdt, prop, poffset);
 }
 
 const void *fdt_getprop(const void *fdt, int nodeoffset,
@@ -269,6 +332,45 @@ i32 fdt_ro_probe_(const void *fdt)
 		return -FDT_ERR_TRUNCATED;
 }
 
+static int fdt_nodename_eq_(const void *fdt, int offset,
+			    const char *s, int len)
+{
+	int olen;
+	const char *p = fdt_get_name(fdt, offset, &olen);
+
+	if (!p || olen < len)
+		/* short match */
+		return 0;
+
+	if (memcmp(p, s, len) != 0)
+		return 0;
+
+	if (p[len] == '\0')
+		return 1;
+	else if (!memchr(s, '@', len) && (p[len] == '@'))
+		return 1;
+	else
+		return 0;
+}
+
+int fdt_subnode_offset_namelen(const void *fdt, int offset,
+			       const char *name, int namelen)
+{
+	FDT_RO_PROBE(fdt);
+
+	fdt_for_each_subnode(offset, fdt, offset)
+		if (fdt_nodename_eq_(fdt, offset, name, namelen))
+			return offset;
+
+	return offset;
+}
+
+int fdt_subnode_offset(const void *fdt, int parentoffset,
+		       const char *name)
+{
+	return fdt_subnode_offset_namelen(fdt, parentoffset, name, strlen(name));
+}
+
 const char *fdt_get_name(const void *fdt, int nodeoffset, int *len)
 {
 	const struct fdt_node_header *nh = fdt_offset_ptr_(fdt, nodeoffset);
@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: (GPL-2.0-or-later OR BSD-2-Clause)
+/*
+ * libfdt - Flat Device Tree manipulation
+ * Copyright (C) 2006 David Gibson, IBM Corporation.
+ */
+#include "libfdt_env.h"
+
+#include "fdt.h"
+#include "libfdt.h"
+
+#include "libfdt_internal.h"
+
+/*
+ * Property-name index: every distinct property name in the blob, hashed
+ * once, mapped to the strings-block offset its properties' nameoff holds.
+ * With it, looking a property up by name is one hash of the name plus a
+ * 32-bit compare per property, instead of resolving and memcmp'ing each
+ * property's name. dtc shares one string (or a suffix of one) between all
+ * properties of the same name; a blob that doesn't gets that name marked
+ * shared and looked up the slow way.
+ */
+#define FDT_STRINDEX_SLOTS	512	/* power of two */
+#define FDT_STRINDEX_EMPTY_	(-1)
+
+struct fdt_strindex_slot_ {
+	u32 hash;
+	i32 stroffset;	/* of the first property with this name */
+	bool shared;	/* other properties use another copy of the name */
+};
+
+static struct {
+	const void *fdt;
+	int num_names;
+	struct fdt_strindex_slot_ slots[FDT_STRINDEX_SLOTS];
+	i32 interned[FDT_PROPNAME_COUNT];
+} fdt_strindex_;
+
+/* Indexed by FDT_PROPNAME_* */
+static const char *const fdt_interned_names_[FDT_PROPNAME_COUNT] = {
+	"reg",
+	"interrupts",
+	"compatible",
+	"#address-cells",
+	"#size-cells",
+	"phandle",
+	"status",
+	"ranges",
+	"device_type",
+	"interrupt-parent",
+	"#interrupt-cells",
+};
+
+/* FNV-1a */
+static u32 fdt_strindex_hash_(const char *s, int len)
+{
+	u32 hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (u8)s[i]) * 16777619u;
+	return hash;
+}
+
+static struct fdt_strindex_slot_ *fdt_strindex_find_(const void *fdt,
+						      u32 hash,
+						      const char *name,
+						      int namelen)
+{
+	u32 i = hash & (FDT_STRINDEX_SLOTS - 1);
+
+	for (;;) {
+		struct fdt_strindex_slot_ *slot = &fdt_strindex_.slots[i];
+		const char *s;
+		int slen;
+
+		if (slot->stroffset == FDT_STRINDEX_EMPTY_)
+			return slot;
+		if (slot->hash == hash) {
+			s = fdt_get_string(fdt, slot->stroffset, &slen);
+			if (s && slen == namelen && memcmp(s, name, namelen) == 0)
+				return slot;
+		}
+		i = (i + 1) & (FDT_STRINDEX_SLOTS - 1);
+	}
+}
+
+int fdt_strindex_build(const void *fdt)
+{
+	int offset, nextoffset = 0;
+	u32 tag;
+	int i;
+
+	fdt_strindex_.fdt = NULL;
+	fdt_strindex_.num_names = 0;
+	for (i = 0; i < FDT_STRINDEX_SLOTS; i++)
+		fdt_strindex_.slots[i].stroffset = FDT_STRINDEX_EMPTY_;
+
+	FDT_RO_PROBE(fdt);
+
+	do {
+		offset = nextoffset;
+		tag = fdt_next_tag(fdt, offset, &nextoffset);
+		if (tag == FDT_PROP) {
+			const struct fdt_property *prop;
+			struct fdt_strindex_slot_ *slot;
+			const char *name;
+			int len, stroffset;
+			u32 hash;
+
+			prop = fdt_get_property_by_offset(fdt, offset, &len);
+			if (!prop)
+				return len;
+			stroffset = fdt32_ld_(&prop->nameoff);
+			name = fdt_get_string(fdt, stroffset, &len);
+			if (!name)
+				return len;
+
+			hash = fdt_strindex_hash_(name, len);
+			slot = fdt_strindex_find_(fdt, hash, name, len);
+			if (slot->stroffset == FDT_STRINDEX_EMPTY_) {
+				/* Keep the table at most 3/4 full */
+				if ((fdt_strindex_.num_names + 1) * 4 >
+				    FDT_STRINDEX_SLOTS * 3)
+					return -FDT_ERR_NOSPACE;
+				slot->hash = hash;
+				slot->stroffset = stroffset;
+				slot->shared = false;
+				fdt_strindex_.num_names++;
+			} else if (slot->stroffset != stroffset) {
+				slot->shared = true;
+			}
+		}
+	} while (tag != FDT_END);
+	if (nextoffset < 0)
+		return nextoffset;
+
+	fdt_strindex_.fdt = fdt;
+	for (i = 0; i < FDT_PROPNAME_COUNT; i++) {
+		const char *name = fdt_interned_names_[i];
+
+		fdt_strindex_.interned[i] =
+			fdt_strindex_lookup_(fdt, name, strlen(name));
+	}
+	return 0;
+}
+
+int fdt_strindex_num_names(const void *fdt)
+{
+	if (fdt_strindex_.fdt != fdt)
+		return -FDT_ERR_BADSTATE;
+	return fdt_strindex_.num_names;
+}
+
+int fdt_strindex_lookup_(const void *fdt, const char *name, int namelen)
+{
+	struct fdt_strindex_slot_ *slot;
+
+	if (fdt_strindex_.fdt != fdt)
+		return -FDT_ERR_BADSTATE;
+	slot = fdt_strindex_find_(fdt, fdt_strindex_hash_(name, namelen),
+				  name, namelen);
+	if (slot->stroffset == FDT_STRINDEX_EMPTY_)
+		return -FDT_ERR_NOTFOUND;
+	if (slot->shared)
+		return -FDT_ERR_EXISTS;
+	return slot->stroffset;
+}
+
+int fdt_propname_stroffset(const void *fdt, const char *name, int namelen)
+{
+	int stroffset = fdt_strindex_lookup_(fdt, name, namelen);
+
+	/* Only the index knows; a shared name has no single offset */
+	if (stroffset == -FDT_ERR_EXISTS)
+		return -FDT_ERR_NOTFOUND;
+	return stroffset;
+}
+
+const void *fdt_getprop_interned(const void *fdt, int nodeoffset,
+				 int propname, int *lenp)
+{
+	const char *name;
+	int stroffset;
+
+	if (!can_assume(VALID_INPUT)
+	    && (propname < 0 || propname >= FDT_PROPNAME_COUNT)) {
+		if (lenp)
+			*lenp = -FDT_ERR_BADVALUE;
+		return NULL;
+	}
+	if (fdt_strindex_.fdt == fdt) {
+		stroffset = fdt_strindex_.interned[propname];
+		if (stroffset >= 0)
+			return fdt_getprop_by_stroffset(fdt, nodeoffset,
+							stroffset, lenp);
+	}
+	/* No index, or the name is shared: fdt_getprop() sorts it out */
+	name = fdt_interned_names_[propname];
+	return fdt_getprop_namelen(fdt, nodeoffset, name, strlen(name), lenp);
+}
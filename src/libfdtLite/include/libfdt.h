@@ -192,6 +192,35 @@ static inline void fdt64_st(void *property, u64 value)
 
 int fdt_next_node(const void *fdt, int offset, int *depth);
 
+/**
+ * fdt_subtree_index_build - record where every node's subtree ends
+ * @fdt: pointer to the device tree blob
+ *
+ * Walks the structure block once, noting the end of each node, so that
+ * fdt_next_node_skip_subnodes() (and so fdt_next_subnode()) can jump over
+ * a subtree without walking it. Like fdt_strindex_build(), there is one
+ * index, for the blob it was last built for; without it, skipping walks.
+ *
+ * returns:
+ *	0, on success
+ *	-FDT_ERR_NOSPACE, too many nodes, or nested too deep, to index
+ *	-FDT_ERR_BADSTRUCTURE,
+ *	-FDT_ERR_TRUNCATED, standard meanings
+ */
+int fdt_subtree_index_build(const void *fdt);
+
+/**
+ * fdt_next_node_skip_subnodes - like fdt_next_node(), minus offset's subtree
+ * @fdt: pointer to the device tree blob
+ * @offset: offset of the node whose subnodes to skip
+ * @depth: depth of the node at offset, updated like fdt_next_node() does
+ *
+ * Return: offset of the next node after offset's subtree (with *depth
+ * below 0 if that means leaving the node depth counts from), or an error
+ * as for fdt_next_node()
+ */
+int fdt_next_node_skip_subnodes(const void *fdt, int offset, int *depth);
+
 /**
  * fdt_first_subnode() - get offset of first direct subnode
  * @fdt:	FDT blob
@@ -334,8 +363,48 @@ int fdt_move(const void *fdt, void *buf, int bufsize);
 /* Read-only functions                                                */
 /**********************************************************************/
 
+/**
+ * fdt_check_full - check the whole device tree blob is well formed
+ * @fdt: pointer to the device tree blob
+ * @bufsize: size of the buffer the blob was loaded into
+ *
+ * fdt_check_full() checks the header, the memory reservation map, and
+ * every tag, node name and property (including its name's offset into
+ * the strings block) in the structure block, along with the nesting of
+ * nodes. It ignores any runtime assumptions made by
+ * fdt_check_full_and_trust().
+ *
+ * returns:
+ *     0, if the blob is well formed
+ *     -FDT_ERR_BADSTRUCTURE,
+ *     -FDT_ERR_TRUNCATED,
+ *     ... any error fdt_check_header() returns
+ */
 int fdt_check_full(const void *fdt, size bufsize);
 
+/**
+ * fdt_check_full_and_trust - validate a blob once, then skip per-access checks
+ * @fdt: pointer to the device tree blob
+ * @bufsize: size of the buffer the blob was loaded into
+ *
+ * Runs fdt_check_full() on the blob and, if it passes, switches libfdt
+ * over to its ASSUME_VALID_DTB | ASSUME_VALID_INPUT code paths (plus
+ * ASSUME_LATEST for v17 blobs) for every later call. Callers must then
+ * only pass offsets libfdt itself handed out.
+ *
+ * returns:
+ *     0, on success
+ *     the fdt_check_full() error otherwise, with all checks left on
+ */
+int fdt_check_full_and_trust(const void *fdt, size bufsize);
+
+/**
+ * fdt_set_trusted - turn the runtime assumptions back off (or on again)
+ * @trusted: 0 to check everything again, nonzero to restore the
+ *	assumptions from the last successful fdt_check_full_and_trust()
+ */
+void fdt_set_trusted(int trusted);
+
 /**
  * fdt_get_string - retrieve a string from the strings block of a device tree
  * @fdt: pointer to the device tree blob
@@ -856,6 +925,101 @@ static inline void *fdt_getprop_w(void *fdt, int nodeoffset,
 	return (void *)(uintptr)fdt_getprop(fdt, nodeoffset, name, lenp);
 }
 
+/*
+ * Property names interned by fdt_strindex_build(), for
+ * fdt_getprop_interned().
+ */
+#define FDT_PROPNAME_REG		0
+#define FDT_PROPNAME_INTERRUPTS		1
+#define FDT_PROPNAME_COMPATIBLE		2
+#define FDT_PROPNAME_ADDRESS_CELLS	3
+#define FDT_PROPNAME_SIZE_CELLS		4
+#define FDT_PROPNAME_PHANDLE		5
+#define FDT_PROPNAME_STATUS		6
+#define FDT_PROPNAME_RANGES		7
+#define FDT_PROPNAME_DEVICE_TYPE	8
+#define FDT_PROPNAME_INTERRUPT_PARENT	9
+#define FDT_PROPNAME_INTERRUPT_CELLS	10
+#define FDT_PROPNAME_COUNT		11
+
+/**
+ * fdt_strindex_build - index the property names of a read-only tree
+ * @fdt: pointer to the device tree blob
+ *
+ * fdt_strindex_build() hashes the name of every property in the blob
+ * once, recording the strings block offset (nameoff) its properties
+ * share. While the index is in place, fdt_getprop() and friends find a
+ * property by comparing nameoffs instead of strings, and fail a name no
+ * property has without walking the node at all. There is one index, for
+ * the blob it was last built for; the blob must not change after.
+ *
+ * returns:
+ *	0, on success
+ *	-FDT_ERR_NOSPACE, too many distinct property names to index
+ *	-FDT_ERR_BADMAGIC,
+ *	-FDT_ERR_BADVERSION,
+ *	-FDT_ERR_BADSTATE,
+ *	-FDT_ERR_BADSTRUCTURE,
+ *	-FDT_ERR_TRUNCATED, standard meanings
+ */
+int fdt_strindex_build(const void *fdt);
+
+/**
+ * fdt_strindex_num_names - number of distinct property names indexed
+ * @fdt: pointer to the device tree blob
+ *
+ * returns:
+ *	the number of names (>=0), on success
+ *	-FDT_ERR_BADSTATE, there is no index for fdt
+ */
+int fdt_strindex_num_names(const void *fdt);
+
+/**
+ * fdt_propname_stroffset - look up a property name in the index
+ * @fdt: pointer to the device tree blob
+ * @name: name of the property
+ * @namelen: number of characters of name to consider
+ *
+ * returns:
+ *	the strings block offset every property named name uses, for
+ *	fdt_getprop_by_stroffset()
+ *	-FDT_ERR_NOTFOUND, no such property, or properties of that name
+ *		don't share one string
+ *	-FDT_ERR_BADSTATE, there is no index for fdt
+ */
+int fdt_propname_stroffset(const void *fdt, const char *name, int namelen);
+
+/**
+ * fdt_getprop_by_stroffset - retrieve a property by its name's offset
+ * @fdt: pointer to the device tree blob
+ * @nodeoffset: offset of the node whose property to find
+ * @stroffset: strings block offset of the property's name
+ * @lenp: pointer to an integer variable (will be overwritten) or NULL
+ *
+ * Identical to fdt_getprop(), but matches properties on nameoff alone,
+ * e.g. with an offset from fdt_propname_stroffset().
+ *
+ * Return: pointer to the property's value or NULL on error
+ */
+const void *fdt_getprop_by_stroffset(const void *fdt, int nodeoffset,
+				     int stroffset, int *lenp);
+
+/**
+ * fdt_getprop_interned - retrieve a commonly used property
+ * @fdt: pointer to the device tree blob
+ * @nodeoffset: offset of the node whose property to find
+ * @propname: one of FDT_PROPNAME_*
+ * @lenp: pointer to an integer variable (will be overwritten) or NULL
+ *
+ * Identical to fdt_getprop() for the property's name, but with the
+ * name's offset looked up once by fdt_strindex_build() rather than on
+ * every call. Works (by name) without an index too.
+ *
+ * Return: pointer to the property's value or NULL on error
+ */
+const void *fdt_getprop_interned(const void *fdt, int nodeoffset,
+				 int propname, int *lenp);
+
 /**
  * fdt_get_phandle - retrieve the phandle of a given node
  * @fdt: pointer to the device tree blob
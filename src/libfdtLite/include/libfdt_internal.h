@@ -29,7 +29,15 @@ static inline const char *fdt_find_string_(const char *strtab, int tabsize,
 	return fdt_find_string_len_(strtab, tabsize, s, strlen(s));
 }
 
-int fdt_node_end_offset_(void *fdt, int nodeoffset);
+int fdt_node_end_offset_(const void *fdt, int nodeoffset);
+
+/*
+ * Strings-block offset shared by every property named name, from the
+ * index fdt_strindex_build() made of fdt. -FDT_ERR_NOTFOUND if no property
+ * has that name; -FDT_ERR_EXISTS if properties use different copies of
+ * it; -FDT_ERR_BADSTATE if there's no index for fdt.
+ */
+int fdt_strindex_lookup_(const void *fdt, const char *name, int namelen);
 
 static inline const void *fdt_offset_ptr_(const void *fdt, int offset)
 {
@@ -183,6 +191,13 @@ enum {
 	ASSUME_LIBFDT_FLAWLESS	= 1 << 5,
 };
 
+/*
+ * Assumptions turned on at runtime by fdt_check_full_and_trust(), on top of
+ * FDT_ASSUME_MASK, once the blob has passed a full structural check. jerryOS
+ * only ever looks at the one blob it was booted with, so this is global.
+ */
+extern u32 fdt_runtime_assume_;
+
 /**
  * can_assume_() - check if a particular assumption is enabled
  *
@@ -191,7 +206,7 @@ enum {
  */
 static inline bool can_assume_(int mask)
 {
-	return FDT_ASSUME_MASK & mask;
+	return (FDT_ASSUME_MASK | fdt_runtime_assume_) & mask;
 }
 
 /** helper macros for checking assumptions */
@@ -0,0 +1,344 @@
+use core::fmt;
+use core::sync::atomic::{AtomicBool, AtomicPtr, AtomicU64, Ordering};
+use crate::sync::SpinLock;
+use crate::exceptions::{irq_save, irq_restore};
+use crate::devices::{console, gic, timer};
+use crate::devices::cpu::{cpu_id, MAX_CPUS};
+use crate::devices::memory::{ppm::*, PAGE_LEN};
+use crate::ConsoleWriter;
+
+/*
+ * print!/println! don't touch the console. Each CPU formats into a stack buffer and
+ * appends the text as a record to its own ring page: single producer (the CPU, with
+ * IRQs masked only for the copy), single consumer (whoever holds DRAIN_LOCK), so
+ * no locks on the logging side. The first record after the rings were drained SGIs
+ * LOG_DRAIN_CPU, whose handler (or idle loop) writes the rings out to the console,
+ * oldest record first. A full ring drops the record & counts it instead of waiting.
+ *
+ * Until init_log() (early boot) and from the first panic on, output goes
+ * synchronously to the console, as it always used to.
+ */
+const LOG_RING_LEN: usize = PAGE_LEN;
+// Text is copied into the ring in chunks of at most this much; longer messages span records.
+const LOG_MAX_CHUNK: usize = 240;
+// Records are padded to this, so the gap at the end of the ring always fits a header.
+const LOG_RECORD_ALIGN: usize = 16;
+const LOG_DRAIN_CPU: usize = 0;
+
+const LOG_F_CONT: u8 = 1 << 0;  // Continues a line; don't stamp it.
+const LOG_F_PAD:  u8 = 1 << 1;  // Filler up to the end of the ring.
+
+#[repr(u8)]
+#[derive(Copy, Clone, PartialEq, PartialOrd, Debug)]
+pub enum LogLevel {
+    Error = 0,
+    Warn  = 1,
+    Info  = 2,
+    Debug = 3
+}
+
+#[repr(C)]
+struct LogRecordHdr {
+    // CNTVCT_EL0 at the time of the log call.
+    ticks : u64,
+    len   : u16,
+    level : u8,
+    flags : u8,
+    _pad  : u32
+}
+const LOG_HDR_LEN: usize = size_of::<LogRecordHdr>();
+
+#[derive(Copy, Clone, Default)]
+pub struct LogRingStats {
+    pub records : u64,
+    pub bytes   : u64,
+    pub dropped : u64
+}
+
+// head & tail are running byte counts; head is only written by the owning CPU, tail only by the drainer.
+struct LogRing {
+    head          : AtomicU64,
+    tail          : AtomicU64,
+    records       : AtomicU64,
+    bytes         : AtomicU64,
+    dropped       : AtomicU64,
+    // Drainer-only: drops already reported in the output.
+    dropped_shown : AtomicU64,
+    // Producer-only: whether the last record left a line unfinished.
+    mid_line      : AtomicBool,
+    buf           : *mut u8
+}
+
+struct LogRings {
+    rings : [LogRing; MAX_CPUS]
+}
+
+static LOG_RINGS: AtomicPtr<LogRings> = AtomicPtr::new(core::ptr::null_mut());
+static DRAIN_LOCK: SpinLock<()> = SpinLock::new(());
+// Set by the first record since the last drain started; keeps producers to one SGI per drain.
+static DRAIN_PENDING: AtomicBool = AtomicBool::new(false);
+static DRAINS: AtomicU64 = AtomicU64::new(0);
+
+pub fn init_log() -> Result<(), PPMError> {
+    let log_rings: &'static mut LogRings = match get_free_page_as::<LogRings>() {
+        Ok(log_rings) => log_rings,
+        Err(e) => { return Err(e); }
+    };
+    for ring in log_rings.rings.iter_mut() {
+        match get_free_page(false) {
+            Ok(ring_pa) => { ring.buf = page_pa_to_kva(ring_pa); },
+            Err(e) => { return Err(e); }
+        }
+    }
+    // Without the SGI, the rings still drain from the idle loop.
+    let _ = gic::register_irq(gic::SGI_LOG_DRAIN, gic::IrqTrigger::Edge, log_drain_sgi_handler, 0);
+    LOG_RINGS.store(log_rings as *mut LogRings, Ordering::Release);
+    return Ok(());
+}
+
+pub fn log_ring_stats(cpu_idx: usize) -> LogRingStats {
+    let log_rings: *mut LogRings = LOG_RINGS.load(Ordering::Acquire);
+    if log_rings.is_null() || cpu_idx >= MAX_CPUS {
+        return LogRingStats::default();
+    }
+    let ring: &LogRing = unsafe { &(*log_rings).rings[cpu_idx] };
+    return LogRingStats {
+        records: ring.records.load(Ordering::Relaxed),
+        bytes: ring.bytes.load(Ordering::Relaxed),
+        dropped: ring.dropped.load(Ordering::Relaxed)
+    };
+}
+
+#[inline(always)] pub fn log_drains() -> u64 { DRAINS.load(Ordering::Relaxed) }
+
+// What print!/println!/klog! expand to.
+pub fn log_fmt(level: LogLevel, args: fmt::Arguments) {
+    let log_rings: *mut LogRings = LOG_RINGS.load(Ordering::Acquire);
+    if log_rings.is_null() || console::in_panic_mode() {
+        let _ = fmt::write(&mut ConsoleWriter, args);
+        return;
+    }
+    let ticks: u64 = timer::counter_ticks();
+    let mut writer: LogRecordWriter = LogRecordWriter { log_rings, level, ticks, buf: [0; LOG_MAX_CHUNK], len: 0 };
+    let _ = fmt::write(&mut writer, args);
+    writer.commit();
+    if !DRAIN_PENDING.swap(true, Ordering::AcqRel) && gic::gic_is_initialized() {
+        gic::send_sgi(gic::SGI_LOG_DRAIN, LOG_DRAIN_CPU);
+    }
+}
+
+struct LogRecordWriter {
+    log_rings : *mut LogRings,
+    level     : LogLevel,
+    ticks     : u64,
+    buf       : [u8; LOG_MAX_CHUNK],
+    len       : usize
+} impl LogRecordWriter {
+    fn commit(&mut self) {
+        if self.len == 0 {
+            return;
+        }
+        let daif: u64 = irq_save();
+        let ring: &LogRing = unsafe { &(*self.log_rings).rings[cpu_id()] };
+        push_record(ring, self.level, self.ticks, &self.buf[..self.len]);
+        irq_restore(daif);
+        self.len = 0;
+    }
+}
+
+impl fmt::Write for LogRecordWriter {
+    fn write_str(&mut self, s: &str) -> fmt::Result {
+        let mut rest: &str = s;
+        while !rest.is_empty() {
+            // Only split on char boundaries so every record stays valid UTF-8.
+            let mut take: usize = core::cmp::min(rest.len(), LOG_MAX_CHUNK - self.len);
+            while !rest.is_char_boundary(take) {
+                take -= 1;
+            }
+            if take == 0 {
+                self.commit();
+                continue;
+            }
+            self.buf[self.len..self.len + take].copy_from_slice(&rest.as_bytes()[..take]);
+            self.len += take;
+            rest = &rest[take..];
+            if self.len == LOG_MAX_CHUNK {
+                self.commit();
+            }
+        }
+        return Ok(());
+    }
+}
+
+// Owning CPU only, IRQs masked.
+fn push_record(ring: &LogRing, level: LogLevel, ticks: u64, text: &[u8]) {
+    let record_len: usize = (LOG_HDR_LEN + text.len()).next_multiple_of(LOG_RECORD_ALIGN);
+    let head: u64 = ring.head.load(Ordering::Relaxed);
+    let tail: u64 = ring.tail.load(Ordering::Acquire);
+    let offset: usize = (head % LOG_RING_LEN as u64) as usize;
+    // Records never wrap: pad out the end of the ring if this one won't fit before it.
+    let pad_len: usize = if offset + record_len > LOG_RING_LEN { LOG_RING_LEN - offset } else { 0 };
+    if (head - tail) as usize + pad_len + record_len > LOG_RING_LEN {
+        ring.dropped.fetch_add(1, Ordering::Relaxed);
+        return;
+    }
+    unsafe {
+        let mut at: *mut u8 = ring.buf.add(offset);
+        if pad_len > 0 {
+            core::ptr::write(at as *mut LogRecordHdr, LogRecordHdr { ticks, len: 0, level: level as u8, flags: LOG_F_PAD, _pad: 0 });
+            at = ring.buf;
+        }
+        let flags: u8 = if ring.mid_line.load(Ordering::Relaxed) { LOG_F_CONT } else { 0 };
+        core::ptr::write(at as *mut LogRecordHdr, LogRecordHdr { ticks, len: text.len() as u16, level: level as u8, flags, _pad: 0 });
+        core::ptr::copy_nonoverlapping(text.as_ptr(), at.add(LOG_HDR_LEN), text.len());
+    }
+    ring.mid_line.store(text.last() != Some(&b'\n'), Ordering::Relaxed);
+    ring.records.fetch_add(1, Ordering::Relaxed);
+    ring.bytes.fetch_add(text.len() as u64, Ordering::Relaxed);
+    // The record must be visible before the drainer can see the head move past it.
+    ring.head.store(head + (pad_len + record_len) as u64, Ordering::Release);
+}
+
+/*
+ * Write everything the rings hold to the console, merging them oldest record first.
+ * Returns without doing anything if another CPU (or this one, further up the stack)
+ * is already draining; it'll pick up our records since DRAIN_PENDING stays set.
+ */
+pub fn drain_logs() {
+    let log_rings: *mut LogRings = LOG_RINGS.load(Ordering::Acquire);
+    if log_rings.is_null() {
+        return;
+    }
+    loop {
+        {
+            let _drain_guard = match DRAIN_LOCK.try_lock() {
+                Some(drain_guard) => drain_guard,
+                None => { return; }
+            };
+            DRAIN_PENDING.store(false, Ordering::Release);
+            DRAINS.fetch_add(1, Ordering::Relaxed);
+            let rings: &[LogRing; MAX_CPUS] = unsafe { &(*log_rings).rings };
+            for (cpu_idx, ring) in rings.iter().enumerate() {
+                report_drops(cpu_idx, ring);
+            }
+            loop {
+                let mut oldest: Option<(usize, u64)> = None;
+                for (cpu_idx, ring) in rings.iter().enumerate() {
+                    if let Some(ticks) = peek_record(ring) {
+                        if oldest.is_none_or(|(_, oldest_ticks)| ticks < oldest_ticks) {
+                            oldest = Some((cpu_idx, ticks));
+                        }
+                    }
+                }
+                match oldest {
+                    Some((cpu_idx, _)) => { pop_record(cpu_idx, &rings[cpu_idx]); },
+                    None => { break; }
+                }
+            }
+        }
+        // Records pushed after we looked at their ring, whose SGI found us busy.
+        if !DRAIN_PENDING.load(Ordering::Acquire) {
+            return;
+        }
+    }
+}
+
+// Stamp of the ring's next real record, skipping (& consuming) end-of-ring padding.
+fn peek_record(ring: &LogRing) -> Option<u64> {
+    loop {
+        let tail: u64 = ring.tail.load(Ordering::Relaxed);
+        if tail == ring.head.load(Ordering::Acquire) {
+            return None;
+        }
+        let offset: usize = (tail % LOG_RING_LEN as u64) as usize;
+        let hdr: &LogRecordHdr = unsafe { &*(ring.buf.add(offset) as *const LogRecordHdr) };
+        if hdr.flags & LOG_F_PAD != 0 {
+            ring.tail.store(tail + (LOG_RING_LEN - offset) as u64, Ordering::Release);
+            continue;
+        }
+        return Some(hdr.ticks);
+    }
+}
+
+fn pop_record(cpu_idx: usize, ring: &LogRing) {
+    let tail: u64 = ring.tail.load(Ordering::Relaxed);
+    let offset: usize = (tail % LOG_RING_LEN as u64) as usize;
+    let hdr: &LogRecordHdr = unsafe { &*(ring.buf.add(offset) as *const LogRecordHdr) };
+    let text: &str = unsafe {
+        core::str::from_utf8_unchecked(core::slice::from_raw_parts(ring.buf.add(offset + LOG_HDR_LEN), hdr.len as usize))
+    };
+    if hdr.flags & LOG_F_CONT == 0 {
+        let ns: u64 = timer::ticks_to_ns(hdr.ticks);
+        let _ = fmt::write(&mut ConsoleWriter, format_args!(
+            "[{:>5}.{:06} c{}] {}", ns / 1_000_000_000, (ns / 1000) % 1_000_000, cpu_idx, level_tag(hdr.level)
+        ));
+    }
+    console::write_str(text);
+    let record_len: usize = (LOG_HDR_LEN + hdr.len as usize).next_multiple_of(LOG_RECORD_ALIGN);
+    // Done reading the record; the producer may reuse its space as soon as tail moves.
+    ring.tail.store(tail + record_len as u64, Ordering::Release);
+}
+
+fn report_drops(cpu_idx: usize, ring: &LogRing) {
+    let dropped: u64 = ring.dropped.load(Ordering::Relaxed);
+    let dropped_shown: u64 = ring.dropped_shown.load(Ordering::Relaxed);
+    if dropped != dropped_shown {
+        let _ = fmt::write(&mut ConsoleWriter, format_args!(
+            "[log: cpu{} ring full, dropped {} message(s)]\n", cpu_idx, dropped - dropped_shown
+        ));
+        ring.dropped_shown.store(dropped, Ordering::Relaxed);
+    }
+}
+
+fn level_tag(level: u8) -> &'static str {
+    match level {
+        0 => "ERROR: ",
+        1 => "WARN: ",
+        3 => "DEBUG: ",
+        _ => ""
+    }
+}
+
+/*
+ * The panic path: switch the console to the PL011 first (so nothing below can wait
+ * on the virtio-console), then get whatever is still in the rings out. If the drain
+ * lock is held, quite possibly by the panicking CPU itself, the rings are lost.
+ */
+pub fn emergency_flush() {
+    console::enter_panic_mode();
+    drain_logs();
+}
+
+fn log_drain_sgi_handler(_intid: u32, _ctx: usize) {
+    drain_logs();
+}
+
+#[macro_export]
+macro_rules! klog {
+    ($level:expr, $($arg:tt)*) => ({
+        $crate::log::log_fmt($level, format_args!($($arg)*));
+    });
+}
+
+#[macro_export]
+macro_rules! print {
+    ($($arg:tt)*) => ({
+        $crate::log::log_fmt($crate::log::LogLevel::Info, format_args!($($arg)*));
+    });
+}
+
+#[macro_export]
+macro_rules! println {
+    () => ($crate::print!("\n"));
+    ($fmt:expr) => (
+        $crate::print!(
+            concat!($fmt, "\n")
+        )
+    );
+    ($fmt:expr, $($arg:tt)*) => (
+        $crate::print!(
+            concat!($fmt, "\n"),
+            $($arg)*
+        )
+    );
+}
@@ -2,13 +2,25 @@
 #![no_main]
 #![allow(dead_code)]
 #[link(name = "entry")] unsafe extern "C" {}
+extern crate alloc;
 use core::panic::PanicInfo;
 pub use core::arch::asm;
 pub use core::ptr::*;
 pub use crate::types::*;
 pub use crate::devices::pl011_uart::PL011Writer;
+pub use crate::devices::console::ConsoleWriter;
 mod types;
+mod sync;
+mod log;
+mod trace;
+mod exceptions;
+mod kstats;
 mod devices;
+mod block;
+mod thread;
+mod executor;
+#[cfg(feature = "bench")]
+mod bench;
 
 #[unsafe(no_mangle)]
 pub extern "C" fn main() -> ! {
@@ -52,17 +64,42 @@ pub extern "C" fn main() -> ! {
             kernel_text_end        : kernel_text_end     as *const u8
         };
 
+        exceptions::init_exceptions();
         match devices::init_devices(jerry_meta_data) { 
-            Ok(_) => {},
+            Ok(_) => {
+                exceptions::enable_irqs();
+            },
             Err(_e) => {
                 panic!("devices::init_devices errored!")
             }
         }
+        // Everything printed before this went to the console synchronously.
+        if let Err(_e) = log::init_log() {
+            println!("main(): couldn't allocate log rings, logging stays synchronous!");
+        }
+        if let Err(_e) = trace::init_trace() {
+            println!("main(): couldn't allocate trace rings, tracepoints are off!");
+        }
+        match block::init_block_layer() {
+            Ok(_) => {},
+            Err(_e) => {
+                panic!("block::init_block_layer errored!")
+            }
+        }
+        // Every CPU's current context becomes its idle thread.
+        thread::init_threads();
     }
 
+    #[cfg(feature = "bench")]
+    bench::run_benchmarks();
+
     println!("sup bro i'm jerry, just finished booting. whatchu up to");
-    
-    loop {}
+
+    // Idle: drain the log rings in case nobody SGI'd us, then run threads or sleep until something happens.
+    loop {
+        log::drain_logs();
+        thread::idle();
+    }
 }
 
 #[panic_handler]
@@ -73,6 +110,7 @@ fn jerry_panic(info: &PanicInfo) -> ! {
         .expect("Unknown panic!")
     ;
     /* p/s msg.data_ptr */
+    log::emergency_flush();
     println!("{}", msg);
     loop {}
 }
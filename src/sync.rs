@@ -0,0 +1,141 @@
+use core::cell::UnsafeCell;
+use core::ops::{Deref, DerefMut};
+use core::sync::atomic::{AtomicBool, Ordering};
+use core::hint::spin_loop;
+use crate::exceptions::{irq_save, irq_restore};
+use crate::devices::cpu::{cpu_id, MAX_CPUS};
+
+/*
+ * How many spinlocks each CPU holds right now. The scheduler never preempts a thread
+ * holding one, or another thread on its CPU could spin on it for a whole timeslice.
+ * Only its own CPU touches a count; IRQ handlers leave it as they found it.
+ */
+#[repr(align(64))]
+struct PreemptCount {
+    count: u32
+}
+static mut PREEMPT_COUNTS: [PreemptCount; MAX_CPUS] = [const { PreemptCount { count: 0 } }; MAX_CPUS];
+
+#[inline(always)]
+pub fn preempt_disable() {
+    unsafe { (*(&raw mut PREEMPT_COUNTS))[cpu_id()].count += 1; }
+}
+
+#[inline(always)]
+pub fn preempt_enable() {
+    unsafe { (*(&raw mut PREEMPT_COUNTS))[cpu_id()].count -= 1; }
+}
+
+#[inline(always)]
+pub fn preemptible() -> bool {
+    return unsafe { (*(&raw const PREEMPT_COUNTS))[cpu_id()].count == 0 };
+}
+
+// Test-and-test-and-set spinlock. All-zero is a valid (unlocked) SpinLock,
+// so they can live inside zeroed PPM pages as well as in .bss.
+pub struct SpinLock<T> {
+    locked: AtomicBool,
+    data: UnsafeCell<T>
+}
+
+unsafe impl<T: Send> Sync for SpinLock<T> {}
+unsafe impl<T: Send> Send for SpinLock<T> {}
+
+impl<T> SpinLock<T> {
+    pub const fn new(data: T) -> Self {
+        return Self {
+            locked: AtomicBool::new(false),
+            data: UnsafeCell::new(data)
+        };
+    }
+
+    pub fn lock(&self) -> SpinLockGuard<'_, T> {
+        preempt_disable();
+        loop {
+            if self.locked
+                .compare_exchange_weak(false, true, Ordering::Acquire, Ordering::Relaxed)
+                .is_ok()
+            {
+                return SpinLockGuard { lock: self };
+            }
+            // Spin on a plain load so waiters don't keep stealing the line
+            // from the holder with exclusive stores.
+            while self.locked.load(Ordering::Relaxed) { spin_loop(); }
+        }
+    }
+
+    // For data that is also touched from IRQ handlers on the same CPU: masks IRQs for
+    // as long as the guard lives so a handler can't spin on a lock its own CPU holds.
+    pub fn lock_irqsave(&self) -> SpinLockIrqGuard<'_, T> {
+        let daif: u64 = irq_save();
+        let guard: SpinLockGuard<'_, T> = self.lock();
+        core::mem::forget(guard);
+        return SpinLockIrqGuard { lock: self, daif };
+    }
+
+    pub fn try_lock(&self) -> Option<SpinLockGuard<'_, T>> {
+        preempt_disable();
+        match self.locked.compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed) {
+            Ok(_) => Some(SpinLockGuard { lock: self }),
+            Err(_) => {
+                preempt_enable();
+                None
+            }
+        }
+    }
+
+    // Only for data that is not reachable by any other CPU yet (e.g. during init).
+    pub fn get_mut(&mut self) -> &mut T {
+        return self.data.get_mut();
+    }
+}
+
+pub struct SpinLockGuard<'a, T> {
+    lock: &'a SpinLock<T>
+}
+
+impl<T> Deref for SpinLockGuard<'_, T> {
+    type Target = T;
+    fn deref(&self) -> &T {
+        unsafe { &*self.lock.data.get() }
+    }
+}
+
+impl<T> DerefMut for SpinLockGuard<'_, T> {
+    fn deref_mut(&mut self) -> &mut T {
+        unsafe { &mut *self.lock.data.get() }
+    }
+}
+
+impl<T> Drop for SpinLockGuard<'_, T> {
+    fn drop(&mut self) {
+        self.lock.locked.store(false, Ordering::Release);
+        preempt_enable();
+    }
+}
+
+pub struct SpinLockIrqGuard<'a, T> {
+    lock: &'a SpinLock<T>,
+    daif: u64
+}
+
+impl<T> Deref for SpinLockIrqGuard<'_, T> {
+    type Target = T;
+    fn deref(&self) -> &T {
+        unsafe { &*self.lock.data.get() }
+    }
+}
+
+impl<T> DerefMut for SpinLockIrqGuard<'_, T> {
+    fn deref_mut(&mut self) -> &mut T {
+        unsafe { &mut *self.lock.data.get() }
+    }
+}
+
+impl<T> Drop for SpinLockIrqGuard<'_, T> {
+    fn drop(&mut self) {
+        self.lock.locked.store(false, Ordering::Release);
+        preempt_enable();
+        irq_restore(self.daif);
+    }
+}
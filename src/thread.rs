@@ -0,0 +1,565 @@
+use crate::{asm, println};
+use crate::sync::{self, SpinLock};
+use crate::exceptions::{self, irq_save, irq_restore, TrapFrame};
+use crate::kstats::LatencyHistogram;
+use crate::devices::{cpu::{self, cpu_id, MAX_CPUS}, gic, timer::{self, Timer}};
+use crate::devices::memory::{kva_to_pa, PAGE_LEN, ppm::{get_free_page, free_page_ref, page_pa_to_kva, PPMError}};
+use alloc::boxed::Box;
+use core::ptr;
+use core::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+
+/*
+ * Kernel threads. A thread that isn't running is nothing but the TrapFrame it was
+ * switched out with, on top of its own stack: every switch goes through an exception
+ * (the IRQ path, or svc #0 to give up the CPU), whose entry already saves x0-x30, FPCR,
+ * FPSR and q0-q31, and whose exit restores whichever frame the handler returns. So a
+ * switch is the handler returning another thread's frame, FP/SIMD state included.
+ *
+ * Each CPU has its own run queue: a FIFO per priority plus a bitmap of non-empty ones,
+ * so picking the next thread is a count-trailing-zeros. Threads stay on the CPU they
+ * were spawned on (the least loaded one at the time). A CPU with other threads waiting
+ * arms a timeslice timer; when it fires, the IRQ's exit switches, unless the interrupted
+ * thread holds a spinlock, in which case the switch waits for the next exception out
+ * of it. Whatever a CPU was doing when threads came up (main()'s loop, secondary_main())
+ * becomes its idle thread, which only runs when the run queue is empty.
+ */
+pub const NUM_PRIORITIES: usize = 32;
+pub const DEFAULT_PRIORITY: u8 = 16;
+const TIMESLICE_NS: u64 = 10_000_000;
+// Returning from exception to EL1h with DAIF clear: IRQs on from a thread's first instruction.
+const SPSR_EL1H: u64 = 0b0101;
+const ESR_EC_SVC64: u64 = 0x15;
+// ID_AA64DFR0_EL1.PMUVer: 0 is no PMU, 0xf an IMPLEMENTATION DEFINED one.
+const PMUVER_SHIFT: u64 = 8;
+const PMCR_E: u64 = 1 << 0;
+const PMCNTEN_C: u64 = 1 << 31;
+
+#[derive(Copy, Clone, PartialEq, Debug)]
+pub enum ThreadState {
+    Runnable,
+    Running,
+    Sleeping,
+    Dead
+}
+
+pub enum ThreadError {
+    NotInitialized,
+    BadPriority,
+    AllocStackFailed(PPMError)
+}
+
+pub struct Thread {
+    // Valid while not Running.
+    frame    : *mut TrapFrame,
+    // Run queue link.
+    next     : *mut Thread,
+    // Null for the idle threads, which run on whatever stack their CPU was on.
+    stack    : *mut u8,
+    entry    : fn(usize),
+    arg      : usize,
+    name     : &'static str,
+    id       : u64,
+    priority : u8,
+    cpu      : u8,
+    state    : ThreadState,
+    // Whether it last gave up the CPU through yield_now() (vs. being preempted).
+    yielded  : bool,
+    wakeup   : Timer,
+    switches : u64
+} impl Thread {
+    const fn idle() -> Self {
+        return Self {
+            frame: ptr::null_mut(),
+            next: ptr::null_mut(),
+            stack: ptr::null_mut(),
+            entry: idle_entry,
+            arg: 0,
+            name: "idle",
+            id: 0,
+            priority: NUM_PRIORITIES as u8,
+            cpu: 0,
+            state: ThreadState::Running,
+            yielded: false,
+            wakeup: Timer::new(wakeup_expired, 0),
+            switches: 0
+        };
+    }
+
+    #[inline(always)] pub fn name(&self) -> &'static str { self.name }
+    #[inline(always)] pub fn id(&self) -> u64 { self.id }
+    #[inline(always)] fn is_idle(&self) -> bool { self.stack.is_null() }
+}
+
+struct RunQueue {
+    heads  : [*mut Thread; NUM_PRIORITIES],
+    tails  : [*mut Thread; NUM_PRIORITIES],
+    // Bit p set: heads[p] isn't empty. Lower p runs first.
+    ready  : u32
+} unsafe impl Send for RunQueue {} impl RunQueue {
+    const fn new() -> Self {
+        return Self { heads: [ptr::null_mut(); NUM_PRIORITIES], tails: [ptr::null_mut(); NUM_PRIORITIES], ready: 0 };
+    }
+
+    unsafe fn push(&mut self, thread: *mut Thread) {
+        unsafe {
+            let priority: usize = (*thread).priority as usize;
+            (*thread).next = ptr::null_mut();
+            if self.tails[priority].is_null() {
+                self.heads[priority] = thread;
+            } else {
+                (*self.tails[priority]).next = thread;
+            }
+            self.tails[priority] = thread;
+            self.ready |= 1 << priority;
+        }
+    }
+
+    unsafe fn pop(&mut self) -> *mut Thread {
+        if self.ready == 0 {
+            return ptr::null_mut();
+        }
+        let priority: usize = self.ready.trailing_zeros() as usize;
+        let thread: *mut Thread = self.heads[priority];
+        unsafe {
+            self.heads[priority] = (*thread).next;
+            if self.heads[priority].is_null() {
+                self.tails[priority] = ptr::null_mut();
+                self.ready &= !(1 << priority);
+            }
+            (*thread).next = ptr::null_mut();
+        }
+        return thread;
+    }
+}
+
+#[derive(Copy, Clone, Default)]
+pub struct ThreadStats {
+    pub spawned      : u64,
+    pub exited       : u64,
+    pub switches     : u64,
+    pub preemptions  : u64,
+    // Timeslices that ran out while the thread held a spinlock.
+    pub deferred     : u64,
+    pub sched_calls  : u64,
+    pub sched_cycles : u64,
+    pub pmu_cycles   : bool
+}
+
+static THREADS_UP: AtomicBool = AtomicBool::new(false);
+static RUN_QUEUES: [SpinLock<RunQueue>; MAX_CPUS] = [const { SpinLock::new(RunQueue::new()) }; MAX_CPUS];
+// Runnable or running threads on each CPU, idle not included.
+static NR_THREADS: [AtomicUsize; MAX_CPUS] = [const { AtomicUsize::new(0) }; MAX_CPUS];
+static NEED_RESCHED: [AtomicBool; MAX_CPUS] = [const { AtomicBool::new(false) }; MAX_CPUS];
+static TIMESLICE_TIMERS: [Timer; MAX_CPUS] = {
+    let mut timers: [Timer; MAX_CPUS] = [const { Timer::new(timeslice_expired, 0) }; MAX_CPUS];
+    let mut cpu_idx: usize = 0;
+    while cpu_idx < MAX_CPUS {
+        timers[cpu_idx] = Timer::new(timeslice_expired, cpu_idx);
+        cpu_idx += 1;
+    }
+    timers
+};
+// Everything below is per-CPU and only touched by its CPU with IRQs masked.
+static mut CURRENT: [*mut Thread; MAX_CPUS] = [ptr::null_mut(); MAX_CPUS];
+static mut IDLE_THREADS: [Thread; MAX_CPUS] = [const { Thread::idle() }; MAX_CPUS];
+// A thread that exited on this CPU; its stack can only go once we're off it.
+static mut ZOMBIES: [*mut Thread; MAX_CPUS] = [ptr::null_mut(); MAX_CPUS];
+// When the switch now happening started, 0 if not timing one: the outgoing thread's
+// yield_now(), or its timeslice running out (SWITCH_PREEMPTED).
+static mut SWITCH_START: [u64; MAX_CPUS] = [0; MAX_CPUS];
+static mut SWITCH_PREEMPTED: [bool; MAX_CPUS] = [false; MAX_CPUS];
+// Until the next thread is running again, in cycles (the histograms' "ns" are cycles). Only
+// threads resuming in yield_now() can tell, so it's those that get timed.
+static mut SWITCH_CYCLES: [LatencyHistogram; MAX_CPUS] = [const { LatencyHistogram::new() }; MAX_CPUS];
+static mut PREEMPT_CYCLES: [LatencyHistogram; MAX_CPUS] = [const { LatencyHistogram::new() }; MAX_CPUS];
+// sleep_ns() with no thread to put to sleep: the idle thread's, or before init_threads().
+static SLEEP_TIMERS: [Timer; MAX_CPUS] = [const { Timer::new(sleep_expired, 0) }; MAX_CPUS];
+static SLEEP_EXPIRED: [AtomicBool; MAX_CPUS] = [const { AtomicBool::new(false) }; MAX_CPUS];
+
+static NEXT_THREAD_ID: AtomicU64 = AtomicU64::new(1);
+static PMU_CYCLES: AtomicBool = AtomicBool::new(false);
+static THREADS_SPAWNED: AtomicU64 = AtomicU64::new(0);
+static THREADS_EXITED: AtomicU64 = AtomicU64::new(0);
+static SWITCHES: AtomicU64 = AtomicU64::new(0);
+static PREEMPTIONS: AtomicU64 = AtomicU64::new(0);
+static DEFERRED_PREEMPTIONS: AtomicU64 = AtomicU64::new(0);
+static SCHED_CALLS: AtomicU64 = AtomicU64::new(0);
+static SCHED_CYCLES: AtomicU64 = AtomicU64::new(0);
+
+/*
+ * Every CPU's current context becomes its idle thread. Needs the GIC (for the reschedule
+ * SGI) and the timer (for timeslices); without them threads still run, but only when
+ * something yields.
+ */
+pub fn init_threads() {
+    let pmuver: u64;
+    unsafe { asm!("mrs {}, id_aa64dfr0_el1", out(reg) pmuver, options(nomem, nostack, preserves_flags)); }
+    let pmuver: u64 = (pmuver >> PMUVER_SHIFT) & 0xf;
+    PMU_CYCLES.store(pmuver != 0 && pmuver != 0xf, Ordering::Relaxed);
+
+    for cpu_idx in 0..cpu::num_cpus() {
+        if cpu_idx != cpu_id() && cpu::run_on_cpu(cpu_idx, init_thread_cpu, 0).is_ok() {
+            cpu::wait_for_cpu(cpu_idx);
+        }
+    }
+    init_thread_cpu(0);
+    if gic::register_irq(gic::SGI_RESCHED, gic::IrqTrigger::Edge, resched_ipi, 0).is_err() {
+        println!("init_threads(): no reschedule SGI, threads only switch CPUs' idle loops on yield!");
+    }
+    THREADS_UP.store(true, Ordering::Release);
+}
+
+fn init_thread_cpu(_arg: usize) {
+    let cpu_idx: usize = cpu_id();
+    unsafe {
+        let idle: *mut Thread = &raw mut IDLE_THREADS[cpu_idx];
+        (*idle).cpu = cpu_idx as u8;
+        CURRENT[cpu_idx] = idle;
+        if PMU_CYCLES.load(Ordering::Relaxed) {
+            asm!(
+                "mrs {tmp}, pmcr_el0",
+                "orr {tmp}, {tmp}, {e}",
+                "msr pmcr_el0, {tmp}",
+                "msr pmcntenset_el0, {c}",
+                "isb",
+                tmp = out(reg) _,
+                e = in(reg) PMCR_E,
+                c = in(reg) PMCNTEN_C,
+                options(nomem, nostack, preserves_flags)
+            );
+        }
+    }
+}
+
+// PMCCNTR_EL0 if there's a PMU, the generic timer's counter if not.
+#[inline(always)]
+fn cycles() -> u64 {
+    if !PMU_CYCLES.load(Ordering::Relaxed) {
+        return timer::counter_ticks_unordered();
+    }
+    let cycles: u64;
+    unsafe { asm!("mrs {}, pmccntr_el0", out(reg) cycles, options(nomem, nostack, preserves_flags)); }
+    return cycles;
+}
+
+// Start entry(arg) on the least loaded CPU. Lower priorities run first.
+pub fn spawn_thread(name: &'static str, entry: fn(usize), arg: usize, priority: u8) -> Result<u64, ThreadError> {
+    if !THREADS_UP.load(Ordering::Acquire) {
+        return Err(ThreadError::NotInitialized);
+    }
+    if priority as usize >= NUM_PRIORITIES {
+        return Err(ThreadError::BadPriority);
+    }
+    let stack: *mut u8 = match get_free_page(false) {
+        Ok(stack_pa) => page_pa_to_kva(stack_pa),
+        Err(e) => { return Err(ThreadError::AllocStackFailed(e)); }
+    };
+    let mut target_cpu: usize = cpu_id();
+    for cpu_idx in 0..cpu::num_cpus() {
+        if cpu::cpu_is_online(cpu_idx) && NR_THREADS[cpu_idx].load(Ordering::Relaxed) < NR_THREADS[target_cpu].load(Ordering::Relaxed) {
+            target_cpu = cpu_idx;
+        }
+    }
+
+    let id: u64 = NEXT_THREAD_ID.fetch_add(1, Ordering::Relaxed);
+    let mut thread_box: Box<core::mem::MaybeUninit<Thread>> = Box::new_uninit();
+    let thread: *mut Thread = thread_box.as_mut_ptr();
+    // Its first "return from exception" lands in thread_start(arg, entry) at the top of its stack.
+    let frame: *mut TrapFrame = unsafe { stack.add(PAGE_LEN - size_of::<TrapFrame>()) as *mut TrapFrame };
+    unsafe {
+        ptr::write_bytes(frame as *mut u8, 0, size_of::<TrapFrame>());
+        (*frame).x[0] = arg as u64;
+        (*frame).x[1] = entry as usize as u64;
+        (*frame).elr_el1 = thread_start as usize as u64;
+        (*frame).spsr_el1 = SPSR_EL1H;
+    }
+    let thread_box: Box<Thread> = Box::write(thread_box, Thread {
+        frame: frame,
+        next: ptr::null_mut(),
+        stack: stack,
+        entry: entry,
+        arg: arg,
+        name: name,
+        id: id,
+        priority: priority,
+        cpu: target_cpu as u8,
+        state: ThreadState::Runnable,
+        yielded: false,
+        wakeup: Timer::new(wakeup_expired, thread as usize),
+        switches: 0
+    });
+    let _ = Box::into_raw(thread_box);
+    THREADS_SPAWNED.fetch_add(1, Ordering::Relaxed);
+    NR_THREADS[target_cpu].fetch_add(1, Ordering::Relaxed);
+    make_runnable(thread);
+    // Outranks whoever spawned it: nothing else is going to switch us.
+    if target_cpu == cpu_id() && NEED_RESCHED[target_cpu].load(Ordering::Relaxed) && sync::preemptible() {
+        yield_now();
+    }
+    return Ok(id);
+}
+
+extern "C" fn thread_start(arg: usize, entry: usize) -> ! {
+    let entry: fn(usize) = unsafe { core::mem::transmute::<usize, fn(usize)>(entry) };
+    entry(arg);
+    exit_thread();
+}
+
+fn idle_entry(_arg: usize) {}
+
+// Put a thread on its CPU's run queue and get that CPU to look at it.
+fn make_runnable(thread: *mut Thread) {
+    let cpu_idx: usize = unsafe { (*thread).cpu as usize };
+    {
+        let mut run_queue = RUN_QUEUES[cpu_idx].lock_irqsave();
+        unsafe {
+            (*thread).state = ThreadState::Runnable;
+            run_queue.push(thread);
+        }
+    }
+    if cpu_idx == cpu_id() {
+        let current: *mut Thread = unsafe { (*(&raw const CURRENT))[cpu_idx] };
+        if current.is_null() || unsafe { (*thread).priority < (*current).priority } {
+            NEED_RESCHED[cpu_idx].store(true, Ordering::Relaxed);
+        } else if !TIMESLICE_TIMERS[cpu_idx].is_armed() {
+            // Same priority or lower: its turn comes when the current thread's slice is up.
+            timer::arm_timer_ns(&TIMESLICE_TIMERS[cpu_idx], TIMESLICE_NS);
+        }
+    } else {
+        NEED_RESCHED[cpu_idx].store(true, Ordering::Release);
+        gic::send_sgi(gic::SGI_RESCHED, cpu_idx);
+    }
+}
+
+fn resched_ipi(_intid: u32, _ctx: usize) {
+    NEED_RESCHED[cpu_id()].store(true, Ordering::Relaxed);
+}
+
+fn timeslice_expired(cpu_idx: usize) {
+    unsafe {
+        SWITCH_START[cpu_idx] = cycles();
+        SWITCH_PREEMPTED[cpu_idx] = true;
+    }
+    NEED_RESCHED[cpu_idx].store(true, Ordering::Relaxed);
+}
+
+fn wakeup_expired(thread: usize) {
+    make_runnable(thread as *mut Thread);
+}
+
+// Give up the CPU to anything else runnable here at the same or a higher priority.
+pub fn yield_now() {
+    if !THREADS_UP.load(Ordering::Acquire) {
+        return;
+    }
+    let daif: u64 = irq_save();
+    let cpu_idx: usize = cpu_id();
+    unsafe {
+        SWITCH_START[cpu_idx] = cycles();
+        SWITCH_PREEMPTED[cpu_idx] = false;
+        asm!("svc #0", options(nostack));
+        // Possibly much later. Whoever switched to us left the start of the switch, if timed.
+        let start: u64 = SWITCH_START[cpu_idx];
+        if start != 0 {
+            let switch_cycles: *mut [LatencyHistogram; MAX_CPUS] =
+                if SWITCH_PREEMPTED[cpu_idx] { &raw mut PREEMPT_CYCLES } else { &raw mut SWITCH_CYCLES };
+            (*switch_cycles)[cpu_idx].record(cycles().wrapping_sub(start));
+            SWITCH_START[cpu_idx] = 0;
+        }
+    }
+    irq_restore(daif);
+}
+
+// Not early; late by up to the timer's resolution plus however long it waits to be picked.
+pub fn sleep_ns(ns: u64) {
+    let cpu_idx: usize = cpu_id();
+    let daif: u64 = irq_save();
+    let current: *mut Thread = unsafe { (*(&raw const CURRENT))[cpu_idx] };
+    if current.is_null() || unsafe { (*current).is_idle() } {
+        irq_restore(daif);
+        sleep_wfi(timer::counter_ticks() + timer::ns_to_ticks(ns));
+        return;
+    }
+    unsafe {
+        // With IRQs masked, the wakeup (on this CPU's wheel) can't fire before we're off the CPU.
+        (*current).state = ThreadState::Sleeping;
+        timer::arm_timer_ns(&*(&raw const (*current).wakeup), ns);
+    }
+    yield_now();
+    irq_restore(daif);
+}
+
+/*
+ * Nothing to switch away from, so wait in WFI for a timer on this CPU instead. Threads
+ * that become runnable meanwhile still preempt us from the IRQ. Spins if that timer
+ * can't fire: no timer IRQ yet, or the caller has IRQs masked.
+ */
+fn sleep_wfi(deadline_ticks: u64) {
+    if !timer::timer_irq_ready() || !exceptions::irqs_enabled() {
+        while timer::counter_ticks() < deadline_ticks {
+            core::hint::spin_loop();
+        }
+        return;
+    }
+    let cpu_idx: usize = cpu_id();
+    SLEEP_EXPIRED[cpu_idx].store(false, Ordering::Relaxed);
+    timer::arm_timer(&SLEEP_TIMERS[cpu_idx], deadline_ticks);
+    loop {
+        let daif: u64 = irq_save();
+        if SLEEP_EXPIRED[cpu_idx].load(Ordering::Acquire) {
+            irq_restore(daif);
+            return;
+        }
+        exceptions::wait_for_interrupt();
+        irq_restore(daif);
+    }
+}
+
+// Timers fire on the CPU that armed them.
+fn sleep_expired(_ctx: usize) {
+    SLEEP_EXPIRED[cpu_id()].store(true, Ordering::Release);
+}
+
+pub fn exit_thread() -> ! {
+    exceptions::disable_irqs();
+    let cpu_idx: usize = cpu_id();
+    let current: *mut Thread = unsafe { (*(&raw const CURRENT))[cpu_idx] };
+    unsafe {
+        (*current).state = ThreadState::Dead;
+        // Nobody's resuming to time a switch its timeslice started.
+        SWITCH_START[cpu_idx] = 0;
+    }
+    THREADS_EXITED.fetch_add(1, Ordering::Relaxed);
+    unsafe { asm!("svc #0", options(nostack)); }
+    unreachable!();
+}
+
+// What the current CPU's idle thread does instead of spinning: sleep until there's work.
+pub fn idle() {
+    let cpu_idx: usize = cpu_id();
+    let daif: u64 = irq_save();
+    if RUN_QUEUES[cpu_idx].lock().ready == 0 && !NEED_RESCHED[cpu_idx].load(Ordering::Relaxed) && gic::gic_is_initialized() {
+        exceptions::wait_for_interrupt();
+    }
+    irq_restore(daif);
+    if RUN_QUEUES[cpu_idx].lock_irqsave().ready != 0 {
+        yield_now();
+    }
+}
+
+// On the way out of an IRQ: the frame to resume, switching threads if it's time to.
+pub fn preempt(frame: *mut TrapFrame) -> *mut TrapFrame {
+    let cpu_idx: usize = cpu_id();
+    if !THREADS_UP.load(Ordering::Acquire) || !NEED_RESCHED[cpu_idx].load(Ordering::Relaxed) {
+        return frame;
+    }
+    if !sync::preemptible() {
+        DEFERRED_PREEMPTIONS.fetch_add(1, Ordering::Relaxed);
+        return frame;
+    }
+    PREEMPTIONS.fetch_add(1, Ordering::Relaxed);
+    return schedule(frame, false);
+}
+
+// svc #0, from yield_now()/sleep_ns()/exit_thread().
+pub fn syscall(frame: *mut TrapFrame, esr: u64) -> Option<*mut TrapFrame> {
+    if (esr >> 26) & 0x3f != ESR_EC_SVC64 || esr & 0xffff != 0 {
+        return None;
+    }
+    return Some(schedule(frame, true));
+}
+
+/*
+ * Switch this CPU to the next thread: the current one goes to the back of its priority's
+ * queue if it can still run, and whichever thread is first in the highest non-empty
+ * priority is resumed (possibly the same one). IRQs are masked: we're in an exception.
+ */
+fn schedule(frame: *mut TrapFrame, yielded: bool) -> *mut TrapFrame {
+    let start: u64 = cycles();
+    let cpu_idx: usize = cpu_id();
+    NEED_RESCHED[cpu_idx].store(false, Ordering::Relaxed);
+    unsafe {
+        let zombie: *mut Thread = ZOMBIES[cpu_idx];
+        if !zombie.is_null() {
+            ZOMBIES[cpu_idx] = ptr::null_mut();
+            let _ = free_page_ref(kva_to_pa((*zombie).stack as usize) as *const u8);
+            drop(Box::from_raw(zombie));
+        }
+
+        let prev: *mut Thread = CURRENT[cpu_idx];
+        (*prev).frame = frame;
+        (*prev).yielded = yielded;
+        let mut run_queue = RUN_QUEUES[cpu_idx].lock();
+        match (*prev).state {
+            ThreadState::Running if !(*prev).is_idle() => {
+                (*prev).state = ThreadState::Runnable;
+                run_queue.push(prev);
+            },
+            ThreadState::Dead => {
+                ZOMBIES[cpu_idx] = prev;
+                NR_THREADS[cpu_idx].fetch_sub(1, Ordering::Relaxed);
+            },
+            _ => {}
+        }
+        let mut next: *mut Thread = run_queue.pop();
+        if next.is_null() {
+            // Nothing else to run: keep going if we can, idle if not.
+            next = if (*prev).state == ThreadState::Running { prev } else { &raw mut IDLE_THREADS[cpu_idx] };
+        }
+        let others_waiting: bool = run_queue.ready != 0;
+        drop(run_queue);
+
+        (*next).state = ThreadState::Running;
+        if next != prev {
+            CURRENT[cpu_idx] = next;
+            (*next).switches += 1;
+            SWITCHES.fetch_add(1, Ordering::Relaxed);
+        }
+        // Only time switches out of yield_now() or a timeslice, into a thread that yielded:
+        // anything else resumes somewhere that won't record it.
+        if next == prev || !(*next).yielded || (!yielded && !SWITCH_PREEMPTED[cpu_idx]) {
+            SWITCH_START[cpu_idx] = 0;
+        }
+        if others_waiting && !(*next).is_idle() {
+            if !TIMESLICE_TIMERS[cpu_idx].is_armed() {
+                timer::arm_timer_ns(&TIMESLICE_TIMERS[cpu_idx], TIMESLICE_NS);
+            }
+        } else {
+            timer::cancel_timer(&TIMESLICE_TIMERS[cpu_idx]);
+        }
+        SCHED_CALLS.fetch_add(1, Ordering::Relaxed);
+        SCHED_CYCLES.fetch_add(cycles().wrapping_sub(start), Ordering::Relaxed);
+        return (*next).frame;
+    }
+}
+
+pub fn thread_stats() -> ThreadStats {
+    return ThreadStats {
+        spawned: THREADS_SPAWNED.load(Ordering::Relaxed),
+        exited: THREADS_EXITED.load(Ordering::Relaxed),
+        switches: SWITCHES.load(Ordering::Relaxed),
+        preemptions: PREEMPTIONS.load(Ordering::Relaxed),
+        deferred: DEFERRED_PREEMPTIONS.load(Ordering::Relaxed),
+        sched_calls: SCHED_CALLS.load(Ordering::Relaxed),
+        sched_cycles: SCHED_CYCLES.load(Ordering::Relaxed),
+        pmu_cycles: PMU_CYCLES.load(Ordering::Relaxed)
+    };
+}
+
+// yield_now() to the next thread running, over every CPU. Buckets are cycles, not ns.
+pub fn switch_cycles() -> LatencyHistogram {
+    let mut hist: LatencyHistogram = LatencyHistogram::new();
+    for cpu_idx in 0..cpu::num_cpus() {
+        hist.merge(unsafe { &(*(&raw const SWITCH_CYCLES))[cpu_idx] });
+    }
+    return hist;
+}
+
+// A timeslice running out to the next thread running, likewise.
+pub fn preempt_cycles() -> LatencyHistogram {
+    let mut hist: LatencyHistogram = LatencyHistogram::new();
+    for cpu_idx in 0..cpu::num_cpus() {
+        hist.merge(unsafe { &(*(&raw const PREEMPT_CYCLES))[cpu_idx] });
+    }
+    return hist;
+}
@@ -0,0 +1,226 @@
+use core::fmt;
+use core::ptr;
+use core::sync::atomic::{fence, AtomicBool, AtomicPtr, AtomicU64, Ordering};
+use crate::devices::{console, timer};
+use crate::devices::cpu::{cpu_id, num_cpus, MAX_CPUS};
+use crate::devices::memory::{ppm::*, PAGE_LEN};
+use crate::ConsoleWriter;
+
+/*
+ * Binary tracepoints for hot paths. trace!("fmt", args...) formats nothing: it stores
+ * the address of a static TracePoint (format string, file & line, all in .rodata) and
+ * up to four raw u64 arguments into this CPU's ring, overwriting the oldest events once
+ * it's full. Turning the events back into text is left to the host:
+ * scripts_lldb/trace_decode.py resolves each TracePoint out of the kernel ELF, reading
+ * the events either from the live rings over lldb, or from a trace_dump() captured off
+ * the console.
+ *
+ * Slots are claimed with a fetch_add on the CPU's head, so an IRQ handler tracing in
+ * the middle of someone else's event just takes the next slot. Each slot is its own
+ * seqlock: the writer zeroes seq (never a valid value) before touching the payload and
+ * release-stores the real one after it; a reader copies the payload between two loads
+ * of seq and keeps the copy only if both are the seq it expected. Anything else was
+ * torn, overwritten or never finished.
+ */
+pub const TRACE_MAX_ARGS: usize = 4;
+const TRACE_RING_PAGES: usize = 8;
+const TRACE_EVENTS_PER_PAGE: usize = PAGE_LEN / size_of::<TraceEvent>();
+const TRACE_RING_EVENTS: usize = TRACE_RING_PAGES * TRACE_EVENTS_PER_PAGE;
+const _: () = assert!(TRACE_RING_EVENTS.is_power_of_two());
+
+// Layout is shared with trace_decode.py.
+#[repr(C)]
+pub struct TracePoint {
+    fmt_ptr  : *const u8,
+    fmt_len  : usize,
+    file_ptr : *const u8,
+    file_len : usize,
+    line     : u64,
+    nargs    : u64
+} unsafe impl Sync for TracePoint {} impl TracePoint {
+    pub const fn new(fmt: &'static str, file: &'static str, line: u32, nargs: usize) -> Self {
+        return Self {
+            fmt_ptr: fmt.as_ptr(),
+            fmt_len: fmt.len(),
+            file_ptr: file.as_ptr(),
+            file_len: file.len(),
+            line: line as u64,
+            nargs: nargs as u64
+        };
+    }
+}
+
+// Layout is shared with trace_decode.py.
+#[repr(C, align(64))]
+struct TraceEvent {
+    ticks : u64,
+    tp    : u64,
+    args  : [u64; TRACE_MAX_ARGS],
+    // Index of the event on its CPU, plus one (so a zeroed slot is never valid).
+    seq   : AtomicU64,
+    cpu   : u64
+}
+
+#[repr(C, align(128))]
+struct TraceCpu {
+    head     : AtomicU64,
+    pages    : [*mut TraceEvent; TRACE_RING_PAGES],
+    // record_event()s running on this CPU, so trace_dump() can let them finish.
+    writers  : AtomicU64
+}
+
+#[repr(C)]
+pub struct TraceCpus {
+    cpus : [TraceCpu; MAX_CPUS]
+}
+
+// Unmangled so trace_decode.py can find the rings from lldb.
+#[unsafe(no_mangle)]
+pub static JERRY_TRACE_CPUS: AtomicPtr<TraceCpus> = AtomicPtr::new(core::ptr::null_mut());
+static TRACE_ENABLED: AtomicBool = AtomicBool::new(false);
+
+pub fn init_trace() -> Result<(), PPMError> {
+    let trace_cpus: &'static mut TraceCpus = match get_free_page_as::<TraceCpus>() {
+        Ok(trace_cpus) => trace_cpus,
+        Err(e) => { return Err(e); }
+    };
+    for trace_cpu in trace_cpus.cpus[..num_cpus()].iter_mut() {
+        for page in trace_cpu.pages.iter_mut() {
+            match get_free_page(true) {
+                Ok(page_pa) => { *page = page_pa_to_kva(page_pa) as *mut TraceEvent; },
+                Err(e) => { return Err(e); }
+            }
+        }
+    }
+    JERRY_TRACE_CPUS.store(trace_cpus as *mut TraceCpus, Ordering::Release);
+    TRACE_ENABLED.store(true, Ordering::Release);
+    return Ok(());
+}
+
+pub fn trace_set_enabled(enabled: bool) {
+    if !JERRY_TRACE_CPUS.load(Ordering::Acquire).is_null() {
+        TRACE_ENABLED.store(enabled, Ordering::Release);
+    }
+}
+
+#[inline(always)]
+pub fn trace_event(tp: &'static TracePoint, args: [u64; TRACE_MAX_ARGS]) {
+    // Acquire pairs with init_trace(), so JERRY_TRACE_CPUS is set by the time we see true.
+    if TRACE_ENABLED.load(Ordering::Acquire) {
+        record_event(tp, args);
+    }
+}
+
+fn record_event(tp: &'static TracePoint, args: [u64; TRACE_MAX_ARGS]) {
+    let trace_cpus: *mut TraceCpus = JERRY_TRACE_CPUS.load(Ordering::Relaxed);
+    let cpu_idx: usize = cpu_id();
+    unsafe {
+        let trace_cpu: &TraceCpu = &(*trace_cpus).cpus[cpu_idx];
+        // Either trace_dump() sees us in writers, or we see it turn tracing off.
+        trace_cpu.writers.fetch_add(1, Ordering::SeqCst);
+        if !TRACE_ENABLED.load(Ordering::SeqCst) {
+            trace_cpu.writers.fetch_sub(1, Ordering::Release);
+            return;
+        }
+        let seq: u64 = trace_cpu.head.fetch_add(1, Ordering::Relaxed);
+        let slot: usize = seq as usize & (TRACE_RING_EVENTS - 1);
+        let event: *mut TraceEvent = trace_cpu.pages[slot / TRACE_EVENTS_PER_PAGE].add(slot % TRACE_EVENTS_PER_PAGE);
+        (*event).seq.store(0, Ordering::Relaxed);
+        // Invalidate the slot before any of the payload changes.
+        fence(Ordering::Release);
+        ptr::write_volatile(&raw mut (*event).ticks, timer::counter_ticks_unordered());
+        ptr::write_volatile(&raw mut (*event).tp, tp as *const TracePoint as u64);
+        ptr::write_volatile(&raw mut (*event).args, args);
+        ptr::write_volatile(&raw mut (*event).cpu, cpu_idx as u64);
+        (*event).seq.store(seq + 1, Ordering::Release);
+        trace_cpu.writers.fetch_sub(1, Ordering::Release);
+    }
+}
+
+pub fn trace_events_recorded(cpu_idx: usize) -> u64 {
+    let trace_cpus: *mut TraceCpus = JERRY_TRACE_CPUS.load(Ordering::Acquire);
+    if trace_cpus.is_null() || cpu_idx >= MAX_CPUS {
+        return 0;
+    }
+    return unsafe { (*trace_cpus).cpus[cpu_idx].head.load(Ordering::Relaxed) };
+}
+
+// How long trace_dump() waits for events already being written when it pauses tracing.
+const TRACE_WRITER_WAIT_NS: u64 = 100_000;
+
+/*
+ * Write every CPU's ring to the console as "@@T ..." lines of hex, for trace_decode.py
+ * to pick out of a console capture. Tracing is paused while the rings are read out,
+ * once the events already being written are done. Those are waited for only so long:
+ * a writer may be this very CPU's, interrupted, or a preempted thread's, and whatever
+ * is still torn afterwards is just left out. Goes straight to the console rather than
+ * through the log rings, which it would flood.
+ */
+pub fn trace_dump() {
+    let trace_cpus: *mut TraceCpus = JERRY_TRACE_CPUS.load(Ordering::Acquire);
+    if trace_cpus.is_null() {
+        return;
+    }
+    let was_enabled: bool = TRACE_ENABLED.swap(false, Ordering::SeqCst);
+    let wait_deadline: u64 = timer::counter_ticks() + timer::ns_to_ticks(TRACE_WRITER_WAIT_NS);
+    for cpu_idx in 0..num_cpus() {
+        let trace_cpu: &TraceCpu = unsafe { &(*trace_cpus).cpus[cpu_idx] };
+        while trace_cpu.writers.load(Ordering::Acquire) != 0 && timer::counter_ticks() < wait_deadline {
+            core::hint::spin_loop();
+        }
+    }
+    let _ = fmt::write(&mut ConsoleWriter, format_args!("@@TRACE-BEGIN freq {}\n", timer::counter_freq()));
+    for cpu_idx in 0..num_cpus() {
+        let trace_cpu: &TraceCpu = unsafe { &(*trace_cpus).cpus[cpu_idx] };
+        let head: u64 = trace_cpu.head.load(Ordering::Acquire);
+        for seq in head.saturating_sub(TRACE_RING_EVENTS as u64)..head {
+            let slot: usize = seq as usize & (TRACE_RING_EVENTS - 1);
+            let event: *const TraceEvent = unsafe { trace_cpu.pages[slot / TRACE_EVENTS_PER_PAGE].add(slot % TRACE_EVENTS_PER_PAGE) };
+            let (ticks, tp, args): (u64, u64, [u64; TRACE_MAX_ARGS]) = unsafe {
+                if (*event).seq.load(Ordering::Acquire) != seq + 1 {
+                    continue;
+                }
+                let copy: (u64, u64, [u64; TRACE_MAX_ARGS]) = (
+                    ptr::read_volatile(&raw const (*event).ticks),
+                    ptr::read_volatile(&raw const (*event).tp),
+                    ptr::read_volatile(&raw const (*event).args)
+                );
+                // Finish copying before looking at seq again.
+                fence(Ordering::Acquire);
+                if (*event).seq.load(Ordering::Relaxed) != seq + 1 {
+                    continue;
+                }
+                copy
+            };
+            let _ = fmt::write(&mut ConsoleWriter, format_args!(
+                "@@T {} {:x} {:x} {:x} {:x} {:x} {:x} {:x}\n",
+                cpu_idx, seq, ticks, tp, args[0], args[1], args[2], args[3]
+            ));
+        }
+    }
+    console::write_str("@@TRACE-END\n");
+    TRACE_ENABLED.store(was_enabled, Ordering::Release);
+}
+
+#[macro_export]
+macro_rules! trace {
+    (@emit $fmt:literal, $nargs:expr, $args:expr) => ({
+        static TRACE_POINT: $crate::trace::TracePoint = $crate::trace::TracePoint::new($fmt, file!(), line!(), $nargs);
+        $crate::trace::trace_event(&TRACE_POINT, $args);
+    });
+    ($fmt:literal) => (
+        $crate::trace!(@emit $fmt, 0, [0, 0, 0, 0])
+    );
+    ($fmt:literal, $a0:expr) => (
+        $crate::trace!(@emit $fmt, 1, [$a0 as u64, 0, 0, 0])
+    );
+    ($fmt:literal, $a0:expr, $a1:expr) => (
+        $crate::trace!(@emit $fmt, 2, [$a0 as u64, $a1 as u64, 0, 0])
+    );
+    ($fmt:literal, $a0:expr, $a1:expr, $a2:expr) => (
+        $crate::trace!(@emit $fmt, 3, [$a0 as u64, $a1 as u64, $a2 as u64, 0])
+    );
+    ($fmt:literal, $a0:expr, $a1:expr, $a2:expr, $a3:expr) => (
+        $crate::trace!(@emit $fmt, 4, [$a0 as u64, $a1 as u64, $a2 as u64, $a3 as u64])
+    );
+}